@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -18,6 +19,7 @@
 struct read_cb_data {
     db_data key;
     db_data expected_value;
+    bool deleted; // expect KEY_NOT_FOUND
     unsigned long long time_at_issue;
 };
 
@@ -50,6 +52,14 @@ void read_cb(void *cb_arg, enum read_err error, db_data value) {
     struct read_cb_data *data = cb_arg;
     total_read_latency += get_time_us() - data -> time_at_issue;
 
+    if (data -> deleted) {
+        if (error != KEY_NOT_FOUND) {
+            printf("Deleted key %.16s was still there: %d\n", data -> key.data, error);
+            errors++;
+        }
+        return;
+    }
+
     if (error != READ_SUCCESSFUL) {
         printf("GOT ERROR READING: %d for key %.16s\n", error, data -> key.data);
         errors++;
@@ -132,15 +142,228 @@ void shuffle(struct read_cb_data *array, int n) {
     }
 }
 
+// argv[2] picks the backend: "spdk" (the default), "memory", or "file:<path>". argv[3] is the number of shards,
+// argv[4] MB of value cache, and argv[5] is options: "compact" opens it with compact_index, "fresh" with
+// fresh_sector_flushes, and "compact,fresh" with both. device_size, if not 0, is the memory or file backend's
+// size in place of the usual. in_order turns off the memory backend's jitter, so its completions come back in the
+// order they were issued, the same every run.
+static void *open_db(int argc, char **argv, bool format, unsigned long long device_size, bool in_order) {
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.format = format;
+    opts.num_shards = argc > 3 ? atoi(argv[3]) : 1;
+    opts.value_cache_bytes = argc > 4 ? atoll(argv[4]) << 20 : 0;
+    opts.compact_index = argc > 5 && strstr(argv[5], "compact") != NULL;
+    opts.fresh_sector_flushes = argc > 5 && strstr(argv[5], "fresh") != NULL;
+    if (argc > 2) {
+        if (strcmp(argv[2], "memory") == 0) {
+            opts.backend = DB_BACKEND_MEMORY;
+            opts.device_size = 4ULL<<30;
+            opts.memory_latency_us = 80;
+            opts.memory_latency_jitter_us = in_order ? 0 : 40;
+        } else if (strncmp(argv[2], "file:", 5) == 0) {
+            opts.backend = DB_BACKEND_FILE;
+            opts.path = argv[2] + 5;
+            opts.device_size = 16ULL<<30;
+            opts.checkpoint_interval = 1; // so reopening exercises loading a checkpoint and replaying after it
+        }
+        opts.device_size = device_size ? device_size : opts.device_size;
+    }
+    return create_db_with_options(&opts);
+}
+
+static bool persistent_backend(int argc, char **argv) {
+    return argc <= 2 || strcmp(argv[2], "memory") != 0;
+}
+
+static void read_all(void *db, struct read_cb_data *cbs, int num_keys) {
+    for (int i = 0; i < num_keys; i++) {
+        cbs[i].time_at_issue = get_time_us();
+        read_value_async(db, cbs[i].key, read_cb, cbs+i);
+        for (int i = 0; i < 1000; i++) {
+            poll_db(db);
+        }
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        poll_db(db);
+        usleep(1000);
+    }
+}
+
+#define BIG_VALUES 3
+
+static void too_long_callback(void *cb_arg, enum write_err error) {
+    if (error != VALUE_TOO_LONG_ERROR) {
+        printf("\n\nEXPECTED VALUE_TOO_LONG_ERROR, GOT: %d\n\n", error);
+        errors++;
+    }
+}
+
+static void fill_value(void *cb_arg, unsigned long long offset, void *buf, unsigned long long length) {
+    struct read_cb_data *data = cb_arg;
+    memcpy(buf, data -> expected_value.data + offset, length);
+}
+
+// Values bigger than a region (4MB), which get a run of regions to themselves, the last one streamed. Then the
+// first is overwritten with another, so its first run is freed. Needs 24MB of entropy.
+static void write_big_values(void *db, struct read_cb_data *big, void *entropy) {
+    static char names[BIG_VALUES][16];
+    for (int i = 0; i <= BIG_VALUES; i++) {
+        int which = i % BIG_VALUES;
+        snprintf(names[which], sizeof(names[which]), "big value %d", which);
+        big[which].key = (db_data){.length=strlen(names[which]), .data=names[which]};
+        big[which].expected_value = (db_data){.length=(5 << 20) + i * (3 << 20) + 12345, .data=entropy + i * 1000};
+        struct read_cb_data *data = calloc(sizeof(struct read_cb_data), 1);
+        *data = big[which];
+        data -> time_at_issue = get_time_us();
+        if (i == BIG_VALUES - 1) {
+            write_value_stream_async(db, data -> key, data -> expected_value.length, fill_value, write_callback, data);
+        } else {
+            write_value_async(db, data -> key, data -> expected_value, write_callback, data);
+        }
+        wait_for_zero_writes(db);
+    }
+
+    // More than a db_data can say, which must be turned away rather than cut down to an int.
+    write_value_stream_async(db, big[0].key, 1ULL << 32, fill_value, too_long_callback, NULL);
+}
+
+#define READ_BATCH 64
+
+static void batch_read_cb(void *cb_arg, unsigned int num_keys, const enum read_err *errs, const db_data *values) {
+    int *batches_done = cb_arg;
+    (*batches_done)++;
+}
+
+// read_all again, but READ_BATCH keys at a time through read_values_async.
+static void read_all_batched(void *db, struct read_cb_data *cbs, int num_keys) {
+    db_data keys[READ_BATCH];
+    void *args[READ_BATCH];
+    int batches_done = 0;
+    int batches = 0;
+    for (int i = 0; i < num_keys; i += READ_BATCH, batches++) {
+        int n = num_keys - i < READ_BATCH ? num_keys - i : READ_BATCH;
+        for (int j = 0; j < n; j++) {
+            cbs[i + j].time_at_issue = get_time_us();
+            keys[j] = cbs[i + j].key;
+            args[j] = cbs + i + j;
+        }
+        read_values_async(db, keys, n, read_cb, args, batch_read_cb, &batches_done);
+        while (batches_done < batches + 1) { // args gets reused for the next batch
+            poll_db(db);
+        }
+    }
+}
+
+#define CHURN_KEYS 8000
+#define CHURN_ROUNDS 60
+#define CHURN_DEVICE_SIZE (64ULL<<20)
+
+// Overwrites half of CHURN_KEYS keys over and over on a db small enough that compaction goes round it several
+// times, and deletes the other half along the way, so their tombstones get dropped. Then some of those are
+// written again. Deleted keys have to stay deleted, and the rest read back, reopened too. Formats the backend.
+static void churn_deletes(int argc, char **argv, void *entropy, unsigned long long entropy_bytes) {
+    void *db = open_db(argc, argv, true, CHURN_DEVICE_SIZE, true);
+    if (db == NULL) {
+        printf("got err creating the churn db\n");
+        errors++;
+        return;
+    }
+    char (*names)[16] = malloc(CHURN_KEYS * sizeof(*names));
+    struct read_cb_data *cbs = calloc(sizeof(struct read_cb_data), CHURN_KEYS);
+    unsigned long long values_written = 0;
+    for (int round = 0; round <= CHURN_ROUNDS + 1; round++) {
+        for (int i = 0; i < CHURN_KEYS; i++) {
+            // Round 0 writes every key, and the rest overwrite the odd ones, except that halfway through the even
+            // ones are deleted, and the last round writes every 10th of those again.
+            bool last = round == CHURN_ROUNDS + 1;
+            bool skip = round == 0 ? false : last ? i % 20 != 0 : i % 2 == 0 && round != CHURN_ROUNDS / 2;
+            if (skip) {
+                continue;
+            }
+            snprintf(names[i], sizeof(names[i]), "churn %d", i);
+            cbs[i].key = (db_data){.length=strlen(names[i]), .data=names[i]};
+            struct read_cb_data *data = calloc(sizeof(struct read_cb_data), 1);
+            data -> key = cbs[i].key;
+            data -> time_at_issue = get_time_us();
+            if (round == CHURN_ROUNDS / 2 && i % 2 == 0) {
+                cbs[i].deleted = true;
+                delete_value_async(db, cbs[i].key, write_callback, data);
+                poll_db(db);
+                continue;
+            }
+            unsigned long long length = 500 + (i * 37 + round) % 1000;
+            cbs[i].expected_value = (db_data){.length=length, .data=entropy + values_written++ * 4099 % (entropy_bytes - 1500)};
+            cbs[i].deleted = false;
+            data -> expected_value = cbs[i].expected_value;
+            if (i % 10 == 1) {
+                write_value_stream_async(db, data -> key, length, fill_value, write_callback, data);
+            } else {
+                write_value_async(db, data -> key, data -> expected_value, write_callback, data);
+            }
+            poll_db(db);
+        }
+        wait_for_zero_writes(db);
+    }
+
+    int errors_before = errors;
+    read_all(db, cbs, CHURN_KEYS);
+    struct db_stats stats;
+    get_db_stats(db, &stats);
+    // Every deleted key's older records are compacted away long before the end, wherever its tombstone ended up.
+    if (stats.tombstones_dropped != CHURN_KEYS / 2) {
+        printf("%llu tombstones were dropped, not %d\n", stats.tombstones_dropped, CHURN_KEYS / 2);
+        errors++;
+    }
+    printf("Churned deletes: %llu tombstones dropped, %llu regions compacted, %llu keys in the index: %d errors\n",
+        stats.tombstones_dropped, stats.regions_compacted, stats.index_keys, errors - errors_before);
+    free_db(db);
+
+    if (persistent_backend(argc, argv)) {
+        errors_before = errors;
+        db = open_db(argc, argv, false, CHURN_DEVICE_SIZE, true);
+        if (db == NULL) {
+            printf("got err reopening the churn db\n");
+            errors++;
+        } else {
+            read_all(db, cbs, CHURN_KEYS);
+            printf("Churned deletes after reopening: %d errors\n", errors - errors_before);
+            free_db(db);
+        }
+    }
+    free(cbs);
+    free(names);
+}
+
+// One line, "label: 2^i: count ..." for every non-empty bucket.
+static void print_histogram(const char *label, unsigned long long *buckets) {
+    printf("%s:", label);
+    for (int i = 0; i < DB_HISTOGRAM_BUCKETS; i++) {
+        if (buckets[i]) {
+            printf(" %llu: %llu", 1ULL << i, buckets[i]);
+        }
+    }
+    printf("\n");
+}
+
 int main(int argc, char **argv) {
     // TODO: implement mixed r/w workload, or full r/full w workloads, for perf testing.
     unsigned int seed = 1001;
+    if (argc < 2) {
+        printf("usage: %s num_keys [spdk|memory|file:<path>] [num_shards] [value_cache_mb] [compact|fresh|compact,fresh]\n", argv[0]);
+        return 1;
+    }
     int num_keys = atoi(argv[1]);
     printf("%d keys. pid %d\n", num_keys, getpid());
     unsigned long long num_bytes = num_keys * 60000;
     void *entropy = generate_entropy(5678, num_keys*60000); // approximate maximum entropy needed. for 100k keys this is 4gb
     printf("Generated entropy\n");
-    void *db = create_db();
+    void *db = open_db(argc, argv, true, 0, false);
+    if (db == NULL) {
+        printf("got err in create_db\n");
+        return 1;
+    }
     srandom(seed);
     int cpu_begin = clock();
     unsigned long long wall_begin = get_time_us();
@@ -196,21 +419,46 @@ int main(int argc, char **argv) {
         cbs[i].expected_value = value;
     }
 
-    shuffle(cbs, num_keys);
+    // Overwrite every 4th key with a new value, so the reads check that overwrites stick.
+    unsigned long long overwrite_entropy = entropy_used;
+    for (int i = 0; i < num_keys; i += 4) {
+        unsigned int value_len = generate_data_len();
+        db_data value = {.length=value_len, .data=entropy+overwrite_entropy};
+        overwrite_entropy += value_len;
 
-    for (int i = 0; i < num_keys; i++) {
-        cbs[i].time_at_issue = get_time_us();
-        read_value_async(db, cbs[i].key, read_cb, cbs+i);
-        for (int i = 0; i < 1000; i++) {
-            poll_db(db);
-        }
+        cbs[i].expected_value = value;
+        struct read_cb_data *data = calloc(sizeof(struct read_cb_data), 1);
+        data -> key = cbs[i].key;
+        data -> expected_value = value;
+        data -> time_at_issue = get_time_us();
+        write_value_async(db, cbs[i].key, value, write_callback, data);
+        poll_db(db);
     }
 
-    for (int i = 0; i < 1000; i++) {
+    // And delete every 8th, some of which were just overwritten.
+    for (int i = 2; i < num_keys; i += 8) {
+        cbs[i].deleted = true;
+        struct read_cb_data *data = calloc(sizeof(struct read_cb_data), 1);
+        data -> key = cbs[i].key;
+        data -> time_at_issue = get_time_us();
+        delete_value_async(db, cbs[i].key, write_callback, data);
         poll_db(db);
-        usleep(1000);
+    }
+    wait_for_zero_writes(db);
+
+    struct read_cb_data big[BIG_VALUES] = {0};
+    bool big_values = num_bytes >= (24 << 20);
+    if (big_values) {
+        write_big_values(db, big, entropy);
+        int errors_before = errors;
+        read_all(db, big, BIG_VALUES);
+        printf("Values bigger than a region: %d errors\n", errors - errors_before);
     }
 
+    shuffle(cbs, num_keys);
+
+    read_all(db, cbs, num_keys);
+
     // dump_sectors_to_file(db, 0, 10);
 
     for (int i = 0; i < 3000; i++) {
@@ -223,9 +471,50 @@ int main(int argc, char **argv) {
     avg_write_latency/=1000.0;
     avg_read_latency/=1000.0;
 
+    int errors_before_batched = errors;
+    read_all_batched(db, cbs, num_keys);
+    printf("Read everything again %d at a time: %d errors\n", READ_BATCH, errors - errors_before_batched);
+
+    struct db_stats stats;
+    get_db_stats(db, &stats);
+    printf("Write amplification %.3g (%llu bytes written, %llu relocated, %llu to the device). %llu bytes live, %llu dead, %llu regions compacted.\n",
+        stats.write_amplification, stats.user_bytes_written, stats.relocated_bytes_written, stats.device_bytes_written,
+        stats.live_bytes, stats.dead_bytes, stats.regions_compacted);
+    printf("DMA pool: %llu hits, %llu misses, %.3g MB high water. Request states high water: %llu reads, %llu writes, %llu flushes (%.3g MB of slabs).\n",
+        stats.dma_pool_hits, stats.dma_pool_misses, stats.dma_pool_high_water_bytes / 1e6,
+        stats.read_states_high_water, stats.write_states_high_water, stats.flush_states_high_water, stats.request_state_bytes / 1e6);
+    printf("%llu values read with %llu device reads, %llu from pending writes. Value cache: %llu hits, %llu misses, %llu entries, %.3g MB.\n",
+        stats.values_read, stats.read_commands, stats.pending_write_reads, stats.value_cache_hits, stats.value_cache_misses,
+        stats.value_cache_entries, stats.value_cache_bytes / 1e6);
+    printf("Read amplification %.3g (%llu value bytes, %llu read). Space utilization %.3g: %llu tail sectors filled up, %llu skipped, %llu records aligned.\n",
+        stats.read_amplification, stats.value_bytes_read, stats.device_bytes_read, stats.space_utilization,
+        stats.tail_sector_rewrites, stats.tail_sectors_skipped, stats.records_aligned);
+    print_histogram("Flush sizes (bytes)", stats.flush_batch_bytes);
+    print_histogram("Flush linger (us)", stats.flush_linger_us);
 
-    printf("Exiting! In total %d errors. Avg write latency: %.03gms. Avg read latency: %.03gms.\n", errors, avg_write_latency, avg_read_latency);
     free_db(db);
+
+    // Everything was acknowledged, so it should all still be there (deletes included) after reopening.
+    if (persistent_backend(argc, argv)) {
+        db = open_db(argc, argv, false, 0, false);
+        if (db == NULL) {
+            printf("got err reopening the db\n");
+            return 1;
+        }
+        int errors_before = errors;
+        read_all(db, cbs, num_keys);
+        if (big_values) {
+            read_all(db, big, BIG_VALUES);
+        }
+        printf("After reopening: %d errors\n", errors - errors_before);
+        free_db(db);
+    }
+
+    if (argc > 2 && strcmp(argv[2], "spdk") != 0) { // the other backends can be made small
+        churn_deletes(argc, argv, entropy, num_bytes);
+    }
+
+    printf("Exiting! In total %d errors. Avg write latency: %.03gms. Avg read latency: %.03gms.\n", errors, avg_write_latency, avg_read_latency);
     free(cbs);
     free(entropy);
     return errors;
@@ -0,0 +1,1879 @@
+#include "nvme_db/nvme_key.h"
+#include "nvme_db/nvme_index.h"
+#include "nvme_db/nvme_arena.h"
+#include "nvme_db/nvme_hash.h"
+#include "nvme_db/nvme_crc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Microbenchmarks for the pieces of sillydb that don't need a device (the scaling one uses the memory backend).
+// automated_interface is the end-to-end test.
+// usage: benchmark <name> [args], see main() for the list.
+
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long rng_state = 88172645463325252ULL;
+static unsigned long long rand64(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// count keys of key_length bytes each, back to back (and NUL-terminated after the last): prefix, then k
+// zero-padded to fill the rest, keeping only its last digits if there isn't room for all of them.
+static char *numbered_keys(const char *prefix, unsigned int key_length, long long count) {
+    unsigned int prefix_length = strlen(prefix);
+    char *keys = malloc(count * key_length + 1);
+    for (long long k = 0; k < count; k++) {
+        char *key = keys + k * key_length;
+        memcpy(key, prefix, prefix_length);
+        long long n = k;
+        for (unsigned int i = key_length; i-- > prefix_length; n /= 10) {
+            key[i] = '0' + n % 10;
+        }
+    }
+    keys[count * key_length] = '\0';
+    return keys;
+}
+
+// Keys live in a ram_stored_key array + vla exactly like in db_state, so both index structures pay for the
+// same pointer chasing the real thing does.
+struct key_set {
+    struct ram_stored_key *keys;
+    char *key_vla;
+    unsigned long long *hashes;
+    long long num_keys;
+};
+
+static void make_keys(struct key_set *set, long long num_keys, int key_length) {
+    set -> num_keys = num_keys;
+    set -> keys = malloc(sizeof(struct ram_stored_key) * num_keys);
+    set -> key_vla = malloc((unsigned long long)key_length * num_keys);
+    set -> hashes = malloc(sizeof(unsigned long long) * num_keys);
+    for (long long i = 0; i < num_keys; i++) {
+        char *key = set -> key_vla + i * key_length;
+        for (int j = 0; j < key_length; j += 8) {
+            unsigned long long r = rand64();
+            memcpy(key + j, &r, key_length - j < 8 ? key_length - j : 8);
+        }
+        set -> hashes[i] = hash_bytes(key, key_length);
+        set -> keys[i] = (struct ram_stored_key){
+            .key_hash = set -> hashes[i] >> 32,
+            .key_offset_low = i * key_length,
+            .key_length = key_length,
+        };
+    }
+}
+
+static void free_keys(struct key_set *set) {
+    free(set -> keys);
+    free(set -> key_vla);
+    free(set -> hashes);
+}
+
+// The unbalanced tree nvme_key.c used before nvme_index.c, kept here as the baseline.
+struct key_node {
+    int key_idx;
+    int left_idx;
+    int right_idx;
+};
+
+struct key_tree {
+    struct key_node *nodes;
+    long long num_nodes;
+};
+
+static long long tree_search(struct key_tree *tree, struct key_set *set, const char *key, int key_length, unsigned int key_hash, long long insert_idx) {
+    if (tree -> num_nodes == 0) {
+        if (insert_idx >= 0) {
+            tree -> nodes[tree -> num_nodes++] = (struct key_node){.key_idx = insert_idx, .left_idx = -1, .right_idx = -1};
+        }
+        return -1;
+    }
+
+    int node_idx = 0;
+    while (1) {
+        struct key_node cur_node = tree -> nodes[node_idx];
+        struct ram_stored_key cur_key = set -> keys[cur_node.key_idx];
+        bool left = cur_key.key_hash < key_hash;
+        if (cur_key.key_hash == key_hash) {
+            left = cur_key.key_length < key_length;
+            if (cur_key.key_length == key_length) {
+                int resp = memcmp(key, set -> key_vla + cur_key.key_offset_low, cur_key.key_length);
+                left = resp < 0;
+                if (resp == 0) {
+                    return cur_node.key_idx;
+                }
+            }
+        }
+
+        int *next = left ? &tree -> nodes[node_idx].left_idx : &tree -> nodes[node_idx].right_idx;
+        if (*next != -1) {
+            node_idx = *next;
+            continue;
+        }
+        if (insert_idx >= 0) {
+            *next = tree -> num_nodes;
+            tree -> nodes[tree -> num_nodes++] = (struct key_node){.key_idx = insert_idx, .left_idx = -1, .right_idx = -1};
+        }
+        return -1;
+    }
+}
+
+struct index_match_ctx {
+    struct key_set *set;
+    const char *key;
+    int key_length;
+};
+
+static bool index_match(void *opaque, unsigned int key_idx) {
+    struct index_match_ctx *ctx = opaque;
+    struct ram_stored_key *cur_key = &ctx -> set -> keys[key_idx];
+    return cur_key -> key_length == ctx -> key_length && memcmp(ctx -> key, ctx -> set -> key_vla + cur_key -> key_offset_low, ctx -> key_length) == 0;
+}
+
+static void shuffle_order(long long *order, long long n) {
+    for (long long i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (long long i = n - 1; i > 0; i--) {
+        long long j = rand64() % (i + 1);
+        long long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+// Compares the old key_node tree against nvme_index for inserting num_keys keys, then looking all of them up
+// in random order, then looking up as many keys that aren't there.
+static int bench_index(int argc, char **argv) {
+    long long num_keys = argc > 2 ? atoll(argv[2]) : 1000000;
+    int key_length = argc > 3 ? atoi(argv[3]) : 32;
+    printf("index: %lld keys of %d bytes\n", num_keys, key_length);
+
+    struct key_set set, misses;
+    make_keys(&set, num_keys, key_length);
+    make_keys(&misses, num_keys, key_length);
+    long long *order = malloc(sizeof(long long) * num_keys);
+    shuffle_order(order, num_keys);
+    int errors = 0;
+
+    struct key_tree tree = {.nodes = malloc(sizeof(struct key_node) * num_keys), .num_nodes = 0};
+    unsigned long long begin = get_time_ns();
+    for (long long i = 0; i < num_keys; i++) {
+        tree_search(&tree, &set, set.key_vla + set.keys[i].key_offset_low, key_length, set.keys[i].key_hash, i);
+    }
+    unsigned long long tree_insert_ns = get_time_ns() - begin;
+    begin = get_time_ns();
+    for (long long i = 0; i < num_keys; i++) {
+        long long idx = order[i];
+        errors += tree_search(&tree, &set, set.key_vla + set.keys[idx].key_offset_low, key_length, set.keys[idx].key_hash, -1) != idx;
+    }
+    unsigned long long tree_hit_ns = get_time_ns() - begin;
+    begin = get_time_ns();
+    for (long long i = 0; i < num_keys; i++) {
+        errors += tree_search(&tree, &set, misses.key_vla + misses.keys[i].key_offset_low, key_length, misses.keys[i].key_hash, -1) != -1;
+    }
+    unsigned long long tree_miss_ns = get_time_ns() - begin;
+    free(tree.nodes);
+
+    struct key_index index;
+    index_init(&index, 100); // same starting point as create_db, so growth is part of the measurement.
+    begin = get_time_ns();
+    unsigned long long worst_insert_ns = 0;
+    for (long long i = 0; i < num_keys; i++) {
+        unsigned long long insert_begin = get_time_ns();
+        index_insert(&index, set.hashes[i], i);
+        unsigned long long insert_ns = get_time_ns() - insert_begin;
+        worst_insert_ns = insert_ns > worst_insert_ns ? insert_ns : worst_insert_ns;
+    }
+    unsigned long long index_insert_ns = get_time_ns() - begin;
+    begin = get_time_ns();
+    for (long long i = 0; i < num_keys; i++) {
+        long long idx = order[i];
+        struct index_match_ctx ctx = {.set = &set, .key = set.key_vla + set.keys[idx].key_offset_low, .key_length = key_length};
+        errors += index_find(&index, set.hashes[idx], index_match, &ctx) != idx;
+    }
+    unsigned long long index_hit_ns = get_time_ns() - begin;
+    begin = get_time_ns();
+    for (long long i = 0; i < num_keys; i++) {
+        struct index_match_ctx ctx = {.set = &set, .key = misses.key_vla + misses.keys[i].key_offset_low, .key_length = key_length};
+        errors += index_find(&index, misses.hashes[i], index_match, &ctx) != -1;
+    }
+    unsigned long long index_miss_ns = get_time_ns() - begin;
+    index_free(&index);
+
+    printf("%-8s %12s %12s %12s\n", "", "insert ns", "hit ns", "miss ns");
+    printf("%-8s %12.1f %12.1f %12.1f\n", "tree", (double)tree_insert_ns / num_keys, (double)tree_hit_ns / num_keys, (double)tree_miss_ns / num_keys);
+    printf("%-8s %12.1f %12.1f %12.1f\n", "index", (double)index_insert_ns / num_keys, (double)index_hit_ns / num_keys, (double)index_miss_ns / num_keys);
+    printf("worst single index insert: %.1fus\n", worst_insert_ns / 1000.0);
+
+    free(order);
+    free_keys(&set);
+    free_keys(&misses);
+    if (errors) {
+        printf("%d lookups returned the wrong key!\n", errors);
+    }
+    return errors != 0;
+}
+
+// Same distribution as automated_interface.c: 28 bytes to 2.3KB, log-uniform-ish.
+static unsigned int generate_key_len(void) {
+    unsigned int key_exp = (random() % 7) + 4;
+    return (2<<key_exp) + ((1<<(key_exp-2))-(random()%(1<<(key_exp-1))));
+}
+
+// The hash nvme_key.c used before nvme_hash.c: xor of 4-byte words.
+static unsigned long long old_xor_hash(const void *data, unsigned long long length) {
+    unsigned int hash = 0x55555555;
+    const unsigned char *p = data;
+    for (unsigned long long i = 0; i < length>>2; i++) {
+        unsigned int word;
+        memcpy(&word, p + i * 4, 4);
+        hash ^= word;
+    }
+    return (unsigned long long)hash << 32; // count_collisions looks at the top bits
+}
+
+static int compare_u64(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Number of hashes equal to an earlier one, looking only at the top `bits` bits.
+static long long count_collisions(unsigned long long *hashes, long long n, int bits) {
+    unsigned long long *sorted = malloc(sizeof(unsigned long long) * n);
+    for (long long i = 0; i < n; i++) {
+        sorted[i] = bits == 64 ? hashes[i] : hashes[i] >> (64 - bits);
+    }
+    qsort(sorted, n, sizeof(unsigned long long), compare_u64);
+    long long collisions = 0;
+    for (long long i = 1; i < n; i++) {
+        collisions += sorted[i] == sorted[i - 1];
+    }
+    free(sorted);
+    return collisions;
+}
+
+// Collision counts for the old and new hash on three key sets (random keys, keys that only differ in their
+// last byte, keys that are permutations of the same words), then throughput of each hash_bytes variant.
+static int bench_hash(int argc, char **argv) {
+    long long num_keys = argc > 2 ? atoll(argv[2]) : 1000000;
+    srandom(1001);
+    unsigned int *lengths = malloc(sizeof(unsigned int) * num_keys);
+    unsigned long long *offsets = malloc(sizeof(unsigned long long) * num_keys);
+    unsigned long long total_bytes = 0;
+    for (long long i = 0; i < num_keys; i++) {
+        lengths[i] = generate_key_len();
+        offsets[i] = total_bytes;
+        total_bytes += lengths[i];
+    }
+    unsigned char *random_keys = malloc(total_bytes);
+    for (unsigned long long i = 0; i < total_bytes; i += 8) {
+        unsigned long long r = rand64();
+        memcpy(random_keys + i, &r, total_bytes - i < 8 ? total_bytes - i : 8);
+    }
+    printf("hash: %lld keys, %llu bytes, avg length %.0f. dispatching to %s\n", num_keys, total_bytes, (double)total_bytes / num_keys, hash_impl_name());
+
+    // Tail keys: one 4KB base key, key i is the first lengths[i] bytes of it with the last 3 bytes replaced by i.
+    // Permuted keys: 8 random 4-byte words, key i is them in the order given by i's digits in base 8.
+    unsigned char *tail_keys = malloc(4096);
+    memcpy(tail_keys, random_keys, total_bytes < 4096 ? total_bytes : 4096);
+    unsigned int words[8];
+    memcpy(words, random_keys, sizeof(words));
+
+    hash_fn hashes_to_test[2] = {old_xor_hash, hash_bytes};
+    const char *names[2] = {"old xor", "hash_bytes"};
+    unsigned long long *hashes = malloc(sizeof(unsigned long long) * num_keys);
+    printf("%-12s %-10s %14s %14s\n", "hash", "keys", "32-bit colls", "64-bit colls");
+    for (int h = 0; h < 2; h++) {
+        for (long long i = 0; i < num_keys; i++) {
+            hashes[i] = hashes_to_test[h](random_keys + offsets[i], lengths[i]);
+        }
+        printf("%-12s %-10s %14lld %14lld\n", names[h], "random", count_collisions(hashes, num_keys, 32), count_collisions(hashes, num_keys, 64));
+
+        for (long long i = 0; i < num_keys; i++) {
+            unsigned char key[4096];
+            memcpy(key, tail_keys, lengths[i]);
+            key[lengths[i] - 1] = i;
+            key[lengths[i] - 2] = i >> 8;
+            key[lengths[i] - 3] = i >> 16;
+            hashes[i] = hashes_to_test[h](key, lengths[i]);
+        }
+        printf("%-12s %-10s %14lld %14lld\n", names[h], "tail", count_collisions(hashes, num_keys, 32), count_collisions(hashes, num_keys, 64));
+
+        long long num_permuted = num_keys < 16777216 ? num_keys : 16777216; // 8^8
+        for (long long i = 0; i < num_permuted; i++) {
+            unsigned int key[8];
+            for (int w = 0; w < 8; w++) {
+                key[w] = words[(i >> (3 * w)) & 7];
+            }
+            hashes[i] = hashes_to_test[h](key, sizeof(key));
+        }
+        printf("%-12s %-10s %14lld %14lld\n", names[h], "permuted", count_collisions(hashes, num_permuted, 32), count_collisions(hashes, num_permuted, 64));
+    }
+
+    int errors = 0;
+    const char *variants[3] = {"scalar", "sse2", "avx2"};
+    hash_fn reference = hash_impl("scalar");
+    for (int v = 0; v < 3; v++) {
+        hash_fn fn = hash_impl(variants[v]);
+        if (fn == NULL) {
+            printf("%-8s not supported\n", variants[v]);
+            continue;
+        }
+        unsigned long long sink = 0;
+        unsigned long long begin = get_time_ns();
+        for (int rep = 0; rep < 5; rep++) {
+            for (long long i = 0; i < num_keys; i++) {
+                sink += fn(random_keys + offsets[i], lengths[i]);
+            }
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+        for (long long i = 0; i < num_keys; i++) {
+            errors += fn(random_keys + offsets[i], lengths[i]) != reference(random_keys + offsets[i], lengths[i]);
+        }
+        printf("%-8s %8.2f GB/s %8.1f ns/key (%llx)\n", variants[v], 5.0 * total_bytes / elapsed, (double)elapsed / (5 * num_keys), sink & 0xff);
+    }
+    if (errors) {
+        printf("%d hashes differ between variants!\n", errors);
+    }
+
+    free(hashes);
+    free(tail_keys);
+    free(random_keys);
+    free(offsets);
+    free(lengths);
+    return errors != 0;
+}
+
+#define SCALING_KEY_LENGTH 16
+#define SCALING_MAX_OUTSTANDING 256 // per client thread
+
+struct scaling_client {
+    void *db;
+    int id;
+    long long num_ops;
+    char *keys; // num_ops keys of SCALING_KEY_LENGTH. They have to stay valid until their writes complete.
+    char *value;
+    unsigned int value_length;
+    bool reading;
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    pthread_t thread;
+};
+
+static void scaling_write_cb(void *cb_arg, enum write_err error) {
+    struct scaling_client *client = cb_arg;
+    if (error != WRITE_SUCCESSFUL) {
+        atomic_fetch_add(&client -> errors, 1);
+    }
+    atomic_fetch_sub(&client -> outstanding, 1);
+}
+
+static void scaling_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct scaling_client *client = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != client -> value_length) {
+        atomic_fetch_add(&client -> errors, 1);
+    }
+    atomic_fetch_sub(&client -> outstanding, 1);
+}
+
+static void *scaling_client_main(void *arg) {
+    struct scaling_client *client = arg;
+    for (long long i = 0; i < client -> num_ops; i++) {
+        while (atomic_load(&client -> outstanding) >= SCALING_MAX_OUTSTANDING) {
+            sched_yield();
+        }
+        atomic_fetch_add(&client -> outstanding, 1);
+        db_data key = {.length=SCALING_KEY_LENGTH, .data=client -> keys + i * SCALING_KEY_LENGTH};
+        if (client -> reading) {
+            read_value_async(client -> db, key, scaling_read_cb, client);
+        } else {
+            write_value_async(client -> db, key, (db_data){.length=client -> value_length, .data=client -> value}, scaling_write_cb, client);
+        }
+    }
+    while (atomic_load(&client -> outstanding)) {
+        sched_yield();
+    }
+    return NULL;
+}
+
+// Runs every client's phase at once and returns the wall time in ns.
+static unsigned long long scaling_phase(struct scaling_client *clients, int num_threads, bool reading) {
+    unsigned long long begin = get_time_ns();
+    for (int i = 0; i < num_threads; i++) {
+        clients[i].reading = reading;
+        pthread_create(&clients[i].thread, NULL, scaling_client_main, &clients[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    return get_time_ns() - begin;
+}
+
+// For 1, 2, 4 ... max_threads threads: a db sharded that many ways with a poller thread per shard, on the memory
+// backend, and that many client threads that each write ops_per_thread keys and then read them all back. The
+// memory device has no IOPS limit, so this is how far the engine itself scales.
+static int bench_scaling(int argc, char **argv) {
+    int max_threads = argc > 2 ? atoi(argv[2]) : 32;
+    long long ops_per_thread = argc > 3 ? atoll(argv[3]) : 100000;
+    unsigned int value_length = argc > 4 ? atoi(argv[4]) : 100;
+    unsigned int latency_us = argc > 5 ? atoi(argv[5]) : 10;
+    printf("scaling: %lld ops per thread, %u byte values, %uus device latency\n", ops_per_thread, value_length, latency_us);
+    printf("%8s %14s %14s %8s\n", "threads", "write ops/s", "read ops/s", "errors");
+
+    int errors = 0;
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        struct db_options opts;
+        db_options_init(&opts);
+        opts.backend = DB_BACKEND_MEMORY;
+        opts.device_size = 4ULL<<30;
+        opts.memory_latency_us = latency_us;
+        opts.format = 1;
+        opts.num_shards = num_threads;
+        opts.poller_threads = 1;
+        void *db = create_db_with_options(&opts);
+        if (db == NULL) {
+            printf("couldn't create a db with %d shards\n", num_threads);
+            return 1;
+        }
+
+        struct scaling_client *clients = calloc(num_threads, sizeof(struct scaling_client));
+        for (int i = 0; i < num_threads; i++) {
+            clients[i].db = db;
+            clients[i].id = i;
+            clients[i].num_ops = ops_per_thread;
+            char prefix[16];
+            snprintf(prefix, sizeof(prefix), "%04d-", i);
+            clients[i].keys = numbered_keys(prefix, SCALING_KEY_LENGTH, ops_per_thread);
+            clients[i].value = malloc(value_length);
+            memset(clients[i].value, 'a' + i % 26, value_length);
+            clients[i].value_length = value_length;
+        }
+
+        unsigned long long write_ns = scaling_phase(clients, num_threads, false);
+        wait_for_zero_writes(db);
+        unsigned long long read_ns = scaling_phase(clients, num_threads, true);
+
+        long long phase_errors = 0;
+        for (int i = 0; i < num_threads; i++) {
+            phase_errors += clients[i].errors;
+            free(clients[i].keys);
+            free(clients[i].value);
+        }
+        double total_ops = (double)num_threads * ops_per_thread;
+        printf("%8d %14.0f %14.0f %8lld\n", num_threads, total_ops * 1e9 / write_ns, total_ops * 1e9 / read_ns, phase_errors);
+        errors += phase_errors;
+        free(clients);
+        free_db(db);
+    }
+    return errors != 0;
+}
+
+#define WRITEPATH_KEY_LENGTH 24
+
+struct writepath_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    char *expected;
+    unsigned int value_length;
+};
+
+static void writepath_write_cb(void *cb_arg, enum write_err error) {
+    struct writepath_state *state = cb_arg;
+    if (error != WRITE_SUCCESSFUL) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+static void writepath_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct writepath_state *state = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != state -> value_length || memcmp(value.data, state -> expected, value.length) != 0) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+// Writes num_values values of value_length through write_value_async (copied into the flush buffer) and then
+// write_value_dma_async (written from where they are), on the memory backend with no latency, and reads them
+// all back to check them.
+static int bench_writepath(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 20000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 65536;
+    printf("writepath: %lld values of %u bytes\n", num_values, value_length);
+    printf("%8s %10s %14s %8s\n", "path", "GB/s", "in place MB", "errors");
+
+    int errors = 0;
+    for (int dma = 0; dma < 2; dma++) {
+        struct db_options opts;
+        db_options_init(&opts);
+        opts.backend = DB_BACKEND_MEMORY;
+        opts.device_size = 4ULL<<30;
+        opts.memory_latency_us = 0;
+        opts.format = 1;
+        void *db = create_db_with_options(&opts);
+        if (db == NULL) {
+            printf("couldn't create a db\n");
+            return 1;
+        }
+
+        char *keys = numbered_keys("writepath-", WRITEPATH_KEY_LENGTH, num_values);
+        char *value = dma ? db_dma_alloc(db, value_length) : malloc(value_length);
+        for (unsigned int i = 0; i < value_length; i++) {
+            value[i] = rand64();
+        }
+        struct writepath_state state = {.outstanding=0, .errors=0, .expected=value, .value_length=value_length};
+
+        unsigned long long begin = get_time_ns();
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&state.outstanding, 1);
+            db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+            db_data val = {.length=value_length, .data=value};
+            if (dma) {
+                write_value_dma_async(db, key, val, writepath_write_cb, &state);
+            } else {
+                write_value_async(db, key, val, writepath_write_cb, &state);
+            }
+        }
+        wait_for_zero_writes(db);
+        unsigned long long elapsed = get_time_ns() - begin;
+
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&state.outstanding, 1);
+            read_value_async(db, (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH}, writepath_read_cb, &state);
+        }
+        while (atomic_load(&state.outstanding)) {
+            poll_db(db);
+        }
+
+        struct db_stats stats;
+        get_db_stats(db, &stats);
+        printf("%8s %10.2f %14.1f %8lld\n", dma ? "dma" : "copy", (double)num_values * value_length / elapsed,
+            stats.in_place_bytes_written / 1e6, (long long)state.errors);
+        errors += state.errors;
+
+        if (dma) {
+            db_dma_free(db, value);
+        } else {
+            free(value);
+        }
+        free(keys);
+        free_db(db);
+    }
+    return errors != 0;
+}
+
+#define READPATH_MAX_OUTSTANDING 64 // so the pool (16MB a size class) has buffers for all of them
+
+// What a consumer that keeps values past the callback does. Each read gets its own slot of app memory.
+struct readpath_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    unsigned int value_length;
+    void *db;
+    char **slots;
+};
+
+struct readpath_read {
+    struct readpath_state *state;
+    char *slot;
+};
+
+static void readpath_copy_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct readpath_read *read = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != read -> state -> value_length) {
+        atomic_fetch_add(&read -> state -> errors, 1);
+    } else {
+        memcpy(read -> slot, value.data, value.length);
+    }
+    atomic_fetch_sub(&read -> state -> outstanding, 1);
+}
+
+static void readpath_into_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct readpath_read *read = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != read -> state -> value_length) {
+        atomic_fetch_add(&read -> state -> errors, 1);
+    }
+    atomic_fetch_sub(&read -> state -> outstanding, 1);
+}
+
+static void readpath_lease_cb(void *cb_arg, enum read_err error, db_data value, void *lease) {
+    struct readpath_read *read = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != read -> state -> value_length) {
+        atomic_fetch_add(&read -> state -> errors, 1);
+    }
+    if (lease) { // where the app would be done with it
+        db_release_read(read -> state -> db, lease);
+    }
+    atomic_fetch_sub(&read -> state -> outstanding, 1);
+}
+
+// Reads num_values values of value_length back three ways: read_value_async and copying the value out, as
+// anything that keeps it has to, read_value_into_async, and read_value_leased_async. Memory backend, no latency.
+static int bench_readpath(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 20000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 65536;
+    printf("readpath: %lld values of %u bytes\n", num_values, value_length);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = 0;
+    opts.format = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+
+    char *keys = numbered_keys("readpath-", WRITEPATH_KEY_LENGTH, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'r', value_length);
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&write_state.outstanding) >= READPATH_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+        write_value_async(db, key, (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+
+    // As many slots as reads in flight, reused round robin.
+    unsigned long long slot_size = db_read_buffer_size(db, WRITEPATH_KEY_LENGTH, value_length);
+    char *slots[READPATH_MAX_OUTSTANDING];
+    struct readpath_read reads[READPATH_MAX_OUTSTANDING];
+    for (int i = 0; i < READPATH_MAX_OUTSTANDING; i++) {
+        slots[i] = db_dma_alloc(db, slot_size);
+    }
+
+    printf("%8s %10s %8s\n", "path", "GB/s", "errors");
+    long long errors = write_state.errors;
+    const char *paths[] = {"copy", "into", "leased"};
+    for (int path = 0; path < 3; path++) {
+        struct readpath_state state = {.outstanding=0, .errors=0, .value_length=value_length, .db=db, .slots=slots};
+        unsigned long long begin = get_time_ns();
+        for (long long k = 0; k < num_values; k++) {
+            // The memory backend completes reads in order, so with fewer than that in flight this slot's last read is done.
+            while (atomic_load(&state.outstanding) >= READPATH_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            int slot = k % READPATH_MAX_OUTSTANDING;
+            reads[slot] = (struct readpath_read){.state=&state, .slot=slots[slot]};
+            atomic_fetch_add(&state.outstanding, 1);
+            db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+            if (path == 0) {
+                read_value_async(db, key, readpath_copy_cb, &reads[slot]);
+            } else if (path == 1) {
+                read_value_into_async(db, key, slots[slot], slot_size, readpath_into_cb, &reads[slot]);
+            } else {
+                read_value_leased_async(db, key, readpath_lease_cb, &reads[slot]);
+            }
+        }
+        while (atomic_load(&state.outstanding)) {
+            poll_db(db);
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+        printf("%8s %10.2f %8lld\n", paths[path], (double)num_values * value_length / elapsed, (long long)state.errors);
+        errors += state.errors;
+    }
+
+    for (int i = 0; i < READPATH_MAX_OUTSTANDING; i++) {
+        db_dma_free(db, slots[i]);
+    }
+    free(value);
+    free(keys);
+    free_db(db);
+    return errors != 0;
+}
+
+struct multiget_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    unsigned int value_length;
+};
+
+static void multiget_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct multiget_state *state = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != state -> value_length) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+static void multiget_batch_cb(void *cb_arg, unsigned int num_keys, const enum read_err *errs, const db_data *values) {
+    struct multiget_state *state = cb_arg;
+    for (unsigned int i = 0; i < num_keys; i++) {
+        if (errs[i] != READ_SUCCESSFUL || values[i].length != state -> value_length) {
+            atomic_fetch_add(&state -> errors, 1);
+        }
+    }
+    atomic_fetch_sub(&state -> outstanding, num_keys);
+}
+
+// Writes num_values small values, then reads them all back with read_value_async and with read_values_async
+// batch keys at a time, in the order they were written (so neighbours share sectors) and shuffled. On the memory
+// backend with device_latency_us per I/O, so fewer, bigger reads pay off the way they would on a real device.
+static int bench_multiget(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 100000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 100;
+    unsigned int batch = argc > 4 ? atoi(argv[4]) : 64;
+    unsigned int latency_us = argc > 5 ? atoi(argv[5]) : 10;
+    batch = batch ? batch : 1;
+    printf("multiget: %lld values of %u bytes, batches of %u, %uus device latency\n", num_values, value_length, batch, latency_us);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = latency_us;
+    opts.format = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+
+    char *keys = numbered_keys("multiget-", WRITEPATH_KEY_LENGTH, num_values);
+    db_data *key_list = malloc(num_values * sizeof(db_data));
+    for (long long k = 0; k < num_values; k++) {
+        key_list[k] = (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+    }
+    char *value = malloc(value_length);
+    memset(value, 'v', value_length);
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        write_value_async(db, key_list[k], (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+
+    printf("%10s %8s %12s %14s %8s\n", "order", "batch", "reads/s", "device reads", "errors");
+    long long errors = write_state.errors;
+    for (int shuffled = 0; shuffled < 2; shuffled++) {
+        if (shuffled) {
+            for (long long k = num_values - 1; k > 0; k--) {
+                long long j = rand64() % (k + 1);
+                db_data tmp = key_list[k];
+                key_list[k] = key_list[j];
+                key_list[j] = tmp;
+            }
+        }
+        for (int batched = 0; batched < 2; batched++) {
+            struct multiget_state state = {.outstanding=0, .errors=0, .value_length=value_length};
+            struct db_stats before, after;
+            get_db_stats(db, &before);
+            unsigned long long begin = get_time_ns();
+            for (long long k = 0; k < num_values; k += batched ? batch : 1) {
+                while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                    poll_db(db);
+                }
+                if (batched) {
+                    unsigned int n = num_values - k < batch ? num_values - k : batch;
+                    atomic_fetch_add(&state.outstanding, n);
+                    read_values_async(db, key_list + k, n, NULL, NULL, multiget_batch_cb, &state);
+                } else {
+                    atomic_fetch_add(&state.outstanding, 1);
+                    read_value_async(db, key_list[k], multiget_read_cb, &state);
+                }
+            }
+            while (atomic_load(&state.outstanding)) {
+                poll_db(db);
+            }
+            unsigned long long elapsed = get_time_ns() - begin;
+            get_db_stats(db, &after);
+            printf("%10s %8u %12.0f %14llu %8lld\n", shuffled ? "shuffled" : "written", batched ? batch : 1,
+                num_values * 1e9 / elapsed, after.read_commands - before.read_commands, (long long)state.errors);
+            errors += state.errors;
+        }
+    }
+
+    free(value);
+    free(key_list);
+    free(keys);
+    free_db(db);
+    return errors != 0;
+}
+
+static void cache_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct multiget_state *state = cb_arg;
+    if (error != READ_SUCCESSFUL || value.length != state -> value_length) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+static int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Reads num_reads keys out of num_values, Zipf distributed (s = 0.99), one at a time so each read's latency is
+// its own, without a value cache and then with one cache_percent the size of the data. Memory backend with
+// device_latency_us per I/O.
+static int bench_cache(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 100000;
+    long long num_reads = argc > 3 ? atoll(argv[3]) : 200000;
+    unsigned int value_length = argc > 4 ? atoi(argv[4]) : 1024;
+    unsigned int cache_percent = argc > 5 ? atoi(argv[5]) : 10;
+    unsigned int latency_us = argc > 6 ? atoi(argv[6]) : 80;
+    printf("cache: %lld reads of %lld values of %u bytes, Zipf 0.99, %u%% cache, %uus device latency\n",
+        num_reads, num_values, value_length, cache_percent, latency_us);
+
+    // Rank r is picked with probability proportional to 1/r^0.99, by binary search of the cumulative weights.
+    double *cdf = malloc(num_values * sizeof(double));
+    double total = 0;
+    for (long long r = 0; r < num_values; r++) {
+        total += 1 / pow(r + 1, 0.99);
+        cdf[r] = total;
+    }
+    long long *order = malloc(num_reads * sizeof(long long));
+    for (long long i = 0; i < num_reads; i++) {
+        double x = (double)(rand64() >> 11) / (1ULL << 53) * total;
+        long long lo = 0, hi = num_values - 1;
+        while (lo < hi) {
+            long long mid = (lo + hi) / 2;
+            if (cdf[mid] < x) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        order[i] = lo * 2654435761ULL % num_values; // so the hot keys aren't all next to each other on disk
+    }
+
+    char *keys = numbered_keys("cache-", WRITEPATH_KEY_LENGTH, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'c', value_length);
+    unsigned long long *latencies = malloc(num_reads * sizeof(unsigned long long));
+
+    printf("%10s %10s %10s %10s %12s %8s\n", "cache MB", "hit rate", "p50 us", "p99 us", "reads/s", "errors");
+    long long errors = 0;
+    for (int cached = 0; cached < 2; cached++) {
+        struct db_options opts;
+        db_options_init(&opts);
+        opts.backend = DB_BACKEND_MEMORY;
+        opts.device_size = 4ULL<<30;
+        opts.memory_latency_us = latency_us;
+        opts.format = 1;
+        opts.value_cache_bytes = cached ? num_values * (value_length + 64) * cache_percent / 100 : 0;
+        void *db = create_db_with_options(&opts);
+        if (db == NULL) {
+            printf("couldn't create a db\n");
+            return 1;
+        }
+        struct writepath_state write_state = {.outstanding=0, .errors=0};
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&write_state.outstanding, 1);
+            db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+            write_value_async(db, key, (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+        }
+        wait_for_zero_writes(db);
+
+        struct multiget_state state = {.outstanding=0, .errors=0, .value_length=value_length};
+        unsigned long long begin = get_time_ns();
+        for (long long i = 0; i < num_reads; i++) {
+            unsigned long long start = get_time_ns();
+            atomic_fetch_add(&state.outstanding, 1);
+            read_value_async(db, (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + order[i] * WRITEPATH_KEY_LENGTH}, cache_read_cb, &state);
+            while (atomic_load(&state.outstanding)) {
+                poll_db(db);
+            }
+            latencies[i] = get_time_ns() - start;
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+
+        struct db_stats stats;
+        get_db_stats(db, &stats);
+        qsort(latencies, num_reads, sizeof(unsigned long long), compare_ull);
+        double lookups = stats.value_cache_hits + stats.value_cache_misses;
+        printf("%10.1f %9.1f%% %10.1f %10.1f %12.0f %8lld\n", opts.value_cache_bytes / 1e6,
+            lookups ? 100.0 * stats.value_cache_hits / lookups : 0, latencies[num_reads / 2] / 1e3,
+            latencies[num_reads * 99 / 100] / 1e3, num_reads * 1e9 / elapsed, (long long)(state.errors + write_state.errors));
+        errors += state.errors + write_state.errors;
+        free_db(db);
+    }
+
+    free(latencies);
+    free(value);
+    free(keys);
+    free(order);
+    free(cdf);
+    return errors != 0;
+}
+
+// Writes each of num_values keys and reads it straight back, timing the read, which gets the value from the
+// write still waiting to be flushed (or being flushed) rather than from the device. Memory backend with
+// device_latency_us per I/O.
+static int bench_ryw(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 100000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 1024;
+    unsigned int latency_us = argc > 4 ? atoi(argv[4]) : 80;
+    printf("ryw: %lld values of %u bytes, each read right after it's written, %uus device latency\n", num_values, value_length, latency_us);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = latency_us;
+    opts.format = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+    char *keys = numbered_keys("ryw-", WRITEPATH_KEY_LENGTH, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'r', value_length);
+    unsigned long long *latencies = malloc(num_values * sizeof(unsigned long long));
+
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    struct multiget_state state = {.outstanding=0, .errors=0, .value_length=value_length};
+    unsigned long long begin = get_time_ns();
+    for (long long k = 0; k < num_values; k++) {
+        db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+        while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        write_value_async(db, key, (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+
+        unsigned long long start = get_time_ns();
+        atomic_fetch_add(&state.outstanding, 1);
+        read_value_async(db, key, cache_read_cb, &state);
+        while (atomic_load(&state.outstanding)) {
+            poll_db(db);
+        }
+        latencies[k] = get_time_ns() - start;
+    }
+    wait_for_zero_writes(db);
+    unsigned long long elapsed = get_time_ns() - begin;
+
+    struct db_stats stats;
+    get_db_stats(db, &stats);
+    qsort(latencies, num_values, sizeof(unsigned long long), compare_ull);
+    printf("%12s %10s %10s %12s %8s\n", "from writes", "p50 us", "p99 us", "pairs/s", "errors");
+    printf("%11.1f%% %10.2f %10.2f %12.0f %8lld\n", 100.0 * stats.pending_write_reads / num_values, latencies[num_values / 2] / 1e3,
+        latencies[num_values * 99 / 100] / 1e3, num_values * 1e9 / elapsed, (long long)(state.errors + write_state.errors));
+
+    free(latencies);
+    free(value);
+    free(keys);
+    free_db(db);
+    return state.errors + write_state.errors != 0;
+}
+
+struct stream_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    unsigned long long value_length;
+    unsigned long long started_at; // of the read in flight
+    unsigned long long first_byte_ns; // summed over reads
+};
+
+static void stream_fill(void *cb_arg, unsigned long long offset, void *buf, unsigned long long length) {
+    memset(buf, 's', length);
+}
+
+static void stream_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct stream_state *state = cb_arg;
+    state -> first_byte_ns += get_time_ns() - state -> started_at; // the whole value comes at once
+    if (error != READ_SUCCESSFUL || value.length != state -> value_length) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+static void stream_chunk_cb(void *cb_arg, enum read_err error, unsigned long long offset, db_data chunk, unsigned long long length) {
+    struct stream_state *state = cb_arg;
+    if (offset == 0) {
+        state -> first_byte_ns += get_time_ns() - state -> started_at;
+    }
+    if (error != READ_SUCCESSFUL || length != state -> value_length) {
+        atomic_fetch_add(&state -> errors, 1);
+        atomic_fetch_sub(&state -> outstanding, 1);
+    } else if (offset + chunk.length == length) {
+        atomic_fetch_sub(&state -> outstanding, 1);
+    }
+}
+
+// Writes num_values values of value_length with write_value_stream_async, then reads them back one at a time
+// with read_value_async and read_value_stream_async, for how long the first byte takes and the throughput.
+// Memory backend with device_latency_us per I/O, where values past its 128KB commands are read in chunks.
+static int bench_stream(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 200;
+    unsigned long long value_length = argc > 3 ? atoll(argv[3]) : 3ULL<<20;
+    unsigned int latency_us = argc > 4 ? atoi(argv[4]) : 20;
+    printf("stream: %lld values of %llu bytes, %uus device latency\n", num_values, value_length, latency_us);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = latency_us;
+    opts.format = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+    char *keys = numbered_keys("stream-", WRITEPATH_KEY_LENGTH, num_values);
+
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    unsigned long long begin = get_time_ns();
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&write_state.outstanding) >= 4) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+        write_value_stream_async(db, key, value_length, stream_fill, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+    unsigned long long elapsed = get_time_ns() - begin;
+    printf("%8s %10s %14s %12s %8s\n", "path", "GB/s", "first byte us", "commands", "errors");
+    printf("%8s %10.2f %14s %12s %8lld\n", "write", (double)num_values * value_length / elapsed, "-", "-", (long long)write_state.errors);
+
+    long long errors = write_state.errors;
+    const char *paths[] = {"read", "stream"};
+    for (int path = 0; path < 2; path++) {
+        struct db_stats before, after;
+        get_db_stats(db, &before);
+        struct stream_state state = {.outstanding=0, .errors=0, .value_length=value_length, .first_byte_ns=0};
+        begin = get_time_ns();
+        for (long long k = 0; k < num_values; k++) {
+            db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+            atomic_fetch_add(&state.outstanding, 1);
+            state.started_at = get_time_ns();
+            if (path == 0) {
+                read_value_async(db, key, stream_read_cb, &state);
+            } else {
+                read_value_stream_async(db, key, stream_chunk_cb, &state);
+            }
+            while (atomic_load(&state.outstanding)) {
+                poll_db(db);
+            }
+        }
+        elapsed = get_time_ns() - begin;
+        get_db_stats(db, &after);
+        printf("%8s %10.2f %14.1f %12llu %8lld\n", paths[path], (double)num_values * value_length / elapsed,
+            state.first_byte_ns / 1e3 / num_values, after.read_commands - before.read_commands, (long long)state.errors);
+        errors += state.errors;
+    }
+
+    free(keys);
+    free_db(db);
+    return errors != 0;
+}
+
+struct scan_state {
+    _Atomic int done;
+    long long keys;
+    long long errors;
+    unsigned int value_length;
+    char last[WRITEPATH_KEY_LENGTH];
+};
+
+static void scan_batch_cb(void *cb_arg, unsigned int num_keys, const db_data *keys, const enum read_err *errs, const db_data *values, int last) {
+    struct scan_state *state = cb_arg;
+    for (unsigned int i = 0; i < num_keys; i++) {
+        if (errs[i] != READ_SUCCESSFUL || values[i].length != state -> value_length ||
+            (state -> keys && memcmp(state -> last, keys[i].data, WRITEPATH_KEY_LENGTH) >= 0)) {
+            state -> errors++;
+        }
+        memcpy(state -> last, keys[i].data, WRITEPATH_KEY_LENGTH);
+        state -> keys++;
+    }
+    if (last) {
+        atomic_store(&state -> done, 1);
+    }
+}
+
+// Writes num_values values under keys in a random order, so neighbouring keys aren't neighbours on the device,
+// then visits every key in key order: with scan_async, and with read_value_async and read_values_async of the
+// keys sorted, as an app would have to without an ordered index (if it had the keys to sort). Memory backend
+// with device_latency_us per I/O.
+static int bench_scan(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 200000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 100;
+    unsigned int latency_us = argc > 4 ? atoi(argv[4]) : 10;
+    printf("scan: %lld values of %u bytes, %uus device latency\n", num_values, value_length, latency_us);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = latency_us;
+    opts.format = 1;
+    opts.ordered_index = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+
+    char *keys = numbered_keys("scan-", WRITEPATH_KEY_LENGTH, num_values);
+    db_data *key_list = malloc(num_values * sizeof(db_data));
+    for (long long k = 0; k < num_values; k++) {
+        key_list[k] = (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+    }
+    long long *order = malloc(num_values * sizeof(long long));
+    shuffle_order(order, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'v', value_length);
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        write_value_async(db, key_list[order[k]], (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+
+    printf("%10s %12s %14s %8s\n", "path", "keys/s", "device reads", "errors");
+    long long errors = write_state.errors;
+    const char *paths[] = {"read", "multiget", "scan"};
+    for (int path = 0; path < 3; path++) {
+        struct db_stats before, after;
+        get_db_stats(db, &before);
+        unsigned long long begin = get_time_ns();
+        long long path_errors = 0;
+        if (path == 2) {
+            struct scan_state state = {.done=0, .keys=0, .errors=0, .value_length=value_length};
+            scan_async(db, (db_data){.length=0, .data=NULL}, (db_data){.length=0, .data=NULL}, 0, scan_batch_cb, &state);
+            while (!atomic_load(&state.done)) {
+                poll_db(db);
+            }
+            path_errors = state.errors + (state.keys != num_values);
+        } else {
+            struct multiget_state state = {.outstanding=0, .errors=0, .value_length=value_length};
+            for (long long k = 0; k < num_values; k += path ? 64 : 1) {
+                while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                    poll_db(db);
+                }
+                if (path) {
+                    unsigned int n = num_values - k < 64 ? num_values - k : 64;
+                    atomic_fetch_add(&state.outstanding, n);
+                    read_values_async(db, key_list + k, n, NULL, NULL, multiget_batch_cb, &state);
+                } else {
+                    atomic_fetch_add(&state.outstanding, 1);
+                    read_value_async(db, key_list[k], multiget_read_cb, &state);
+                }
+            }
+            while (atomic_load(&state.outstanding)) {
+                poll_db(db);
+            }
+            path_errors = state.errors;
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+        get_db_stats(db, &after);
+        printf("%10s %12.0f %14llu %8lld\n", paths[path], num_values * 1e9 / elapsed, after.read_commands - before.read_commands, path_errors);
+        errors += path_errors;
+    }
+    struct db_stats stats;
+    get_db_stats(db, &stats);
+    printf("ordered index: %.1f bytes/key\n", (double)stats.ordered_index_bytes / num_values);
+
+    free(value);
+    free(order);
+    free(key_list);
+    free(keys);
+    free_db(db);
+    return errors != 0;
+}
+
+struct scan_all_state {
+    _Atomic int done;
+    _Atomic long long records;
+    _Atomic long long errors;
+    unsigned int value_length;
+};
+
+static int scan_all_filter(void *cb_arg, db_data key, db_data value) {
+    const char *bytes = key.data;
+    return bytes[key.length - 2] == '7' && bytes[key.length - 1] == '7'; // 1 in 100
+}
+
+static void scan_all_cb(void *cb_arg, enum read_err err, unsigned int num_records, const db_data *keys, const db_data *values, int last) {
+    struct scan_all_state *state = cb_arg;
+    for (unsigned int i = 0; i < num_records; i++) {
+        if (values[i].length != state -> value_length) {
+            atomic_fetch_add(&state -> errors, 1);
+        }
+    }
+    atomic_fetch_add(&state -> records, num_records);
+    if (last) {
+        if (err != READ_SUCCESSFUL) {
+            atomic_fetch_add(&state -> errors, 1);
+        }
+        atomic_store(&state -> done, 1);
+    }
+}
+
+// Writes num_values values, then overwrites a quarter of them so the log has dead records in it, and visits
+// every key: with read_values_async 64 keys at a time (about the best an app can do with a list of its keys),
+// with scan_all_async, and with scan_all_async keeping 1 key in 100. Memory backend with device_latency_us per I/O.
+static int bench_scan_all(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 200000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 100;
+    unsigned int latency_us = argc > 4 ? atoi(argv[4]) : 10;
+    printf("scanall: %lld values of %u bytes, %uus device latency\n", num_values, value_length, latency_us);
+
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = latency_us;
+    opts.format = 1;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 1;
+    }
+
+    char *keys = numbered_keys("scan-", WRITEPATH_KEY_LENGTH, num_values);
+    db_data *key_list = malloc(num_values * sizeof(db_data));
+    for (long long k = 0; k < num_values; k++) {
+        key_list[k] = (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+    }
+    long long *order = malloc(num_values * sizeof(long long));
+    shuffle_order(order, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'v', value_length);
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    for (long long k = 0; k < num_values + num_values / 4; k++) {
+        while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        write_value_async(db, key_list[order[k % num_values]], (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+
+    printf("%10s %12s %10s %14s %8s\n", "path", "keys/s", "delivered", "device MB read", "errors");
+    long long errors = write_state.errors;
+    const char *paths[] = {"multiget", "scanall", "filtered"};
+    for (int path = 0; path < 3; path++) {
+        struct db_stats before, after;
+        get_db_stats(db, &before);
+        unsigned long long begin = get_time_ns();
+        long long path_errors = 0, delivered = num_values;
+        if (path) {
+            struct scan_all_state state = {.done=0, .records=0, .errors=0, .value_length=value_length};
+            scan_all_async(db, path == 2 ? scan_all_filter : NULL, scan_all_cb, &state);
+            while (!atomic_load(&state.done)) {
+                poll_db(db);
+            }
+            delivered = state.records;
+            path_errors = state.errors + (path == 1 && delivered != num_values) + (path == 2 && delivered != num_values / 100);
+        } else {
+            struct multiget_state state = {.outstanding=0, .errors=0, .value_length=value_length};
+            for (long long k = 0; k < num_values; k += 64) {
+                while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                    poll_db(db);
+                }
+                unsigned int n = num_values - k < 64 ? num_values - k : 64;
+                atomic_fetch_add(&state.outstanding, n);
+                read_values_async(db, key_list + k, n, NULL, NULL, multiget_batch_cb, &state);
+            }
+            while (atomic_load(&state.outstanding)) {
+                poll_db(db);
+            }
+            path_errors = state.errors;
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+        get_db_stats(db, &after);
+        unsigned long long bytes = after.device_bytes_read - before.device_bytes_read + after.scan_bytes_read - before.scan_bytes_read;
+        printf("%10s %12.0f %10lld %14.1f %8lld\n", paths[path], num_values * 1e9 / elapsed, delivered, bytes / 1e6, path_errors);
+        errors += path_errors;
+    }
+
+    free(value);
+    free(order);
+    free(key_list);
+    free(keys);
+    free_db(db);
+    return errors != 0;
+}
+
+struct compress_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    const char *values;
+    const unsigned long long *offsets; // value k is values[offsets[k]] to values[offsets[k + 1]]
+};
+
+struct compress_read {
+    struct compress_state *state;
+    long long k;
+};
+
+static void compress_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct compress_read *read = cb_arg;
+    struct compress_state *state = read -> state;
+    const char *expected = state -> values + state -> offsets[read -> k];
+    unsigned long long length = state -> offsets[read -> k + 1] - state -> offsets[read -> k];
+    if (error != READ_SUCCESSFUL || value.length != length || memcmp(value.data, expected, length) != 0) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+// Something like the JSON an app might store: the same field names every time, some repetitive values, some not.
+static unsigned long long compress_make_value(char *buf, long long k, unsigned int value_length) {
+    unsigned long long n = snprintf(buf, value_length, "{\"id\":%lld,\"user\":\"user-%llu\",\"country\":\"%s\",\"events\":[", k, rand64() % 100000,
+        (const char *[]){"US", "DE", "FR", "BR", "JP", "IN"}[rand64() % 6]);
+    while (n + 80 < value_length) {
+        n += snprintf(buf + n, value_length - n, "{\"type\":\"%s\",\"ts\":%llu,\"ok\":%s},",
+            (const char *[]){"click", "view", "purchase", "scroll"}[rand64() % 4], 1700000000ULL + rand64() % 100000000, rand64() % 4 ? "true" : "false");
+    }
+    n += snprintf(buf + n, value_length - n, "{}]}");
+    return n;
+}
+
+// Writes num_values JSON-ish values of about value_length with each codec, with and without a dictionary trained
+// on the first of them, and reads them all back, on the memory backend with no latency. Compression is on the
+// writing thread, decompression on whichever delivers the read (the one thread here).
+static int bench_compress(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 100000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 400;
+    printf("compress: %lld values of about %u bytes\n", num_values, value_length);
+
+    char *keys = numbered_keys("json-", WRITEPATH_KEY_LENGTH, num_values);
+    char *values = malloc(num_values * value_length);
+    unsigned long long *offsets = malloc((num_values + 1) * sizeof(unsigned long long));
+    offsets[0] = 0;
+    for (long long k = 0; k < num_values; k++) {
+        offsets[k + 1] = offsets[k] + compress_make_value(values + offsets[k], k, value_length);
+    }
+    unsigned int num_samples = num_values < 5000 ? num_values : 5000;
+    db_data *samples = malloc(num_samples * sizeof(db_data));
+    for (unsigned int i = 0; i < num_samples; i++) {
+        samples[i] = (db_data){.length=offsets[i + 1] - offsets[i], .data=values + offsets[i]};
+    }
+    unsigned long long dict_capacity = 16384;
+    char *dict = malloc(dict_capacity);
+    unsigned long long dict_length = db_train_dictionary(samples, num_samples, dict, dict_capacity);
+    printf("dictionary: %llu bytes from %u samples\n", dict_length, num_samples);
+
+    struct compress_read *reads = malloc(num_values * sizeof(struct compress_read));
+    printf("%10s %8s %16s %12s %12s %8s\n", "codec", "ratio", "device MB written", "writes/s", "reads/s", "errors");
+    long long errors = 0;
+    const char *names[] = {"none", "lz4", "zstd", "lz4+dict", "zstd+dict"};
+    for (int config = 0; config < 5; config++) {
+        struct db_options opts;
+        db_options_init(&opts);
+        opts.backend = DB_BACKEND_MEMORY;
+        opts.device_size = 4ULL<<30;
+        opts.format = 1;
+        opts.compression = config == 0 ? DB_COMPRESSION_NONE : config % 2 ? DB_COMPRESSION_LZ4 : DB_COMPRESSION_ZSTD;
+        if (config >= 3) {
+            opts.compression_dict = dict;
+            opts.compression_dict_length = dict_length;
+        }
+        void *db = create_db_with_options(&opts);
+        if (db == NULL) {
+            printf("couldn't create a db\n");
+            return 1;
+        }
+
+        struct compress_state state = {.outstanding=0, .errors=0, .values=values, .offsets=offsets};
+        struct writepath_state write_state = {.outstanding=0, .errors=0};
+        unsigned long long begin = get_time_ns();
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&write_state.outstanding, 1);
+            db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+            write_value_async(db, key, (db_data){.length=offsets[k + 1] - offsets[k], .data=values + offsets[k]}, writepath_write_cb, &write_state);
+        }
+        wait_for_zero_writes(db);
+        unsigned long long write_elapsed = get_time_ns() - begin;
+
+        begin = get_time_ns();
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&state.outstanding, 1);
+            reads[k] = (struct compress_read){.state=&state, .k=k};
+            read_value_async(db, (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH}, compress_read_cb, &reads[k]);
+        }
+        while (atomic_load(&state.outstanding)) {
+            poll_db(db);
+        }
+        unsigned long long read_elapsed = get_time_ns() - begin;
+
+        struct db_stats stats;
+        get_db_stats(db, &stats);
+        long long config_errors = state.errors + write_state.errors;
+        printf("%10s %8.2f %16.1f %12.0f %12.0f %8lld\n", names[config], stats.compression_ratio ? stats.compression_ratio : 1.0,
+            stats.device_bytes_written / 1e6, num_values * 1e9 / write_elapsed, num_values * 1e9 / read_elapsed, config_errors);
+        errors += config_errors;
+        free_db(db);
+    }
+
+    free(reads);
+    free(dict);
+    free(samples);
+    free(offsets);
+    free(values);
+    free(keys);
+    return errors != 0;
+}
+
+// Writes num_values values of value_length and times reading them all back with read_value_async. Returns the
+// elapsed ns, or 0 on errors.
+static unsigned long long checksum_read_pass(long long num_values, unsigned int value_length, unsigned int device_latency_us, bool verify) {
+    struct db_options opts;
+    db_options_init(&opts);
+    opts.backend = DB_BACKEND_MEMORY;
+    opts.device_size = 4ULL<<30;
+    opts.memory_latency_us = device_latency_us;
+    opts.format = 1;
+    opts.skip_checksum_verify = !verify;
+    void *db = create_db_with_options(&opts);
+    if (db == NULL) {
+        printf("couldn't create a db\n");
+        return 0;
+    }
+
+    char *keys = numbered_keys("checksum-", WRITEPATH_KEY_LENGTH, num_values);
+    char *value = malloc(value_length);
+    for (unsigned int i = 0; i < value_length; i++) {
+        value[i] = random();
+    }
+    struct writepath_state write_state = {.outstanding=0, .errors=0};
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&write_state.outstanding) >= READPATH_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        atomic_fetch_add(&write_state.outstanding, 1);
+        db_data key = {.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH};
+        write_value_async(db, key, (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+    }
+    wait_for_zero_writes(db);
+
+    char *slots[READPATH_MAX_OUTSTANDING];
+    struct readpath_read reads[READPATH_MAX_OUTSTANDING];
+    for (int i = 0; i < READPATH_MAX_OUTSTANDING; i++) {
+        slots[i] = malloc(value_length);
+    }
+    struct readpath_state state = {.outstanding=0, .errors=0, .value_length=value_length, .db=db, .slots=slots};
+    unsigned long long begin = get_time_ns();
+    for (long long k = 0; k < num_values; k++) {
+        while (atomic_load(&state.outstanding) >= READPATH_MAX_OUTSTANDING) {
+            poll_db(db);
+        }
+        int slot = k % READPATH_MAX_OUTSTANDING;
+        reads[slot] = (struct readpath_read){.state=&state, .slot=slots[slot]};
+        atomic_fetch_add(&state.outstanding, 1);
+        read_value_async(db, (db_data){.length=WRITEPATH_KEY_LENGTH, .data=keys + k * WRITEPATH_KEY_LENGTH}, readpath_copy_cb, &reads[slot]);
+    }
+    while (atomic_load(&state.outstanding)) {
+        poll_db(db);
+    }
+    unsigned long long elapsed = get_time_ns() - begin;
+    struct db_stats stats;
+    get_db_stats(db, &stats);
+    if (state.errors || write_state.errors || stats.checksum_errors) {
+        printf("%lld read errors, %lld write errors, %llu checksum errors\n", (long long)state.errors, (long long)write_state.errors, stats.checksum_errors);
+        elapsed = 0;
+    }
+
+    for (int i = 0; i < READPATH_MAX_OUTSTANDING; i++) {
+        free(slots[i]);
+    }
+    free(value);
+    free(keys);
+    free_db(db);
+    return elapsed;
+}
+
+// For each value size from 64B to 64KB: read throughput with read_value_async verifying every record's crc and
+// with db_options.skip_checksum_verify, and how much slower the first is. Then crc32c's own throughput over
+// records that size with each variant, and the share of the verifying reads' time the one in use would take,
+// which is the same thing without the noise of two separate runs. The memory backend with no latency is the worst
+// case, since then the reads cost little more than a memcpy. With device_latency_us it's closer to what a real
+// device would see.
+static int bench_checksum(int argc, char **argv) {
+    unsigned long long bytes_per_size = argc > 2 ? atoll(argv[2]) << 20 : 256ULL<<20;
+    unsigned int device_latency_us = argc > 3 ? atoi(argv[3]) : 0;
+    const unsigned int value_lengths[] = {64, 256, 1024, 4096, 16384, 65536};
+    const char *variants[] = {"pclmul", "sse4.2", "scalar"};
+    printf("checksum: %llu MB of values per size, device latency %uus. crc32c dispatching to %s\n", bytes_per_size >> 20, device_latency_us, crc_impl_name());
+    printf("%8s %10s %12s %12s %8s %10s %12s %12s %12s\n", "size", "values", "verify GB/s", "skip GB/s", "cost", "crc share", "pclmul GB/s", "sse4.2 GB/s", "scalar GB/s");
+
+    int errors = 0;
+    for (int s = 0; s < sizeof(value_lengths) / sizeof(value_lengths[0]); s++) {
+        unsigned int value_length = value_lengths[s];
+        long long num_values = bytes_per_size / value_length;
+        if (num_values > 1000000) {
+            num_values = 1000000;
+        }
+        // Alternated and the best of five kept, so noise doesn't land on one side.
+        unsigned long long verify_elapsed = 0, skip_elapsed = 0;
+        for (int round = 0; round < 5; round++) {
+            unsigned long long elapsed = checksum_read_pass(num_values, value_length, device_latency_us, true);
+            verify_elapsed = !verify_elapsed || elapsed < verify_elapsed ? elapsed : verify_elapsed;
+            errors += elapsed == 0;
+            elapsed = checksum_read_pass(num_values, value_length, device_latency_us, false);
+            skip_elapsed = !skip_elapsed || elapsed < skip_elapsed ? elapsed : skip_elapsed;
+            errors += elapsed == 0;
+        }
+
+        // What the read path checksums: header, key and value. Rotated through as many records as reads in
+        // flight, so they're about as warm in cache as the reads' buffers are.
+        unsigned long long record_length = sizeof(struct ssd_header) + WRITEPATH_KEY_LENGTH + value_length;
+        char *records = malloc(record_length * READPATH_MAX_OUTSTANDING);
+        for (unsigned long long i = 0; i < record_length * READPATH_MAX_OUTSTANDING; i++) {
+            records[i] = random();
+        }
+        double crc_gbps[3] = {0, 0, 0};
+        unsigned long long crc_elapsed = 0; // of the variant crc32c dispatches to
+        for (int v = 0; v < 3; v++) {
+            crc_fn crc = crc_impl(variants[v]);
+            if (crc == NULL) {
+                continue;
+            }
+            volatile unsigned int sink = 0; // so the loop isn't thrown away
+            unsigned long long begin = get_time_ns();
+            for (long long k = 0; k < num_values; k++) {
+                sink ^= crc(0, records + (k % READPATH_MAX_OUTSTANDING) * record_length, record_length);
+            }
+            unsigned long long elapsed = get_time_ns() - begin;
+            crc_gbps[v] = (double)num_values * record_length / elapsed;
+            if (strcmp(variants[v], crc_impl_name()) == 0) {
+                crc_elapsed = elapsed;
+            }
+        }
+        free(records);
+
+        printf("%8u %10lld %12.2f %12.2f %7.1f%% %9.1f%% %12.2f %12.2f %12.2f\n", value_length, num_values, (double)num_values * value_length / verify_elapsed,
+            (double)num_values * value_length / skip_elapsed, 100.0 * ((double)verify_elapsed / skip_elapsed - 1), 100.0 * crc_elapsed / verify_elapsed, crc_gbps[0], crc_gbps[1], crc_gbps[2]);
+    }
+    return errors != 0;
+}
+
+struct compact_read_state {
+    _Atomic long long outstanding;
+    _Atomic long long errors;
+    enum read_err expected; // READ_SUCCESSFUL for keys that were written, KEY_NOT_FOUND for ones that weren't
+    unsigned int value_length;
+};
+
+static void compact_read_cb(void *cb_arg, enum read_err error, db_data value) {
+    struct compact_read_state *state = cb_arg;
+    if (error != state -> expected || (error == READ_SUCCESSFUL && value.length != state -> value_length)) {
+        atomic_fetch_add(&state -> errors, 1);
+    }
+    atomic_fetch_sub(&state -> outstanding, 1);
+}
+
+// Writes num_values values under keys of generate_key_len() bytes, with and without db_options.compact_index,
+// and reports RAM for the index per key. Then reads them back one at a time in random order, and as many keys that
+// aren't there, which is only a lookup, timing each. Memory backend with device_latency_us per I/O; with 0 the
+// difference is the lookup and the check of the record's key against the one read, rather than the device.
+static int bench_compact_index(int argc, char **argv) {
+    long long num_values = argc > 2 ? atoll(argv[2]) : 200000;
+    unsigned int value_length = argc > 3 ? atoi(argv[3]) : 128;
+    unsigned int latency_us = argc > 4 ? atoi(argv[4]) : 0;
+    printf("compactindex: %lld values of %u bytes, keys of 28 bytes to 2.3KB, %uus device latency\n", num_values, value_length, latency_us);
+
+    // Every key, then as many more that are never written.
+    db_data *keys = malloc(2 * num_values * sizeof(db_data));
+    unsigned long long key_bytes = 0;
+    for (long long k = 0; k < 2 * num_values; k++) {
+        keys[k].length = generate_key_len();
+        keys[k].data = malloc(keys[k].length);
+        for (int i = 0; i < keys[k].length; i++) {
+            ((char *)keys[k].data)[i] = rand64();
+        }
+        key_bytes += k < num_values ? keys[k].length : 0;
+    }
+    long long *order = malloc(num_values * sizeof(long long));
+    shuffle_order(order, num_values);
+    char *value = malloc(value_length);
+    memset(value, 'v', value_length);
+    unsigned long long *latencies = malloc(num_values * sizeof(unsigned long long));
+    printf("average key %.0f bytes\n", (double)key_bytes / num_values);
+
+    printf("%8s %12s %10s %10s %10s %10s %12s %8s\n", "index", "bytes/key", "hit p50", "hit p99", "miss p50", "miss p99", "reads/s", "errors");
+    long long errors = 0;
+    for (int compact = 0; compact < 2; compact++) {
+        struct db_options opts;
+        db_options_init(&opts);
+        opts.backend = DB_BACKEND_MEMORY;
+        opts.device_size = 4ULL<<30;
+        opts.memory_latency_us = latency_us;
+        opts.format = 1;
+        opts.compact_index = compact;
+        void *db = create_db_with_options(&opts);
+        if (db == NULL) {
+            printf("couldn't create a db\n");
+            return 1;
+        }
+        struct writepath_state write_state = {.outstanding=0, .errors=0};
+        for (long long k = 0; k < num_values; k++) {
+            while (atomic_load(&write_state.outstanding) >= SCALING_MAX_OUTSTANDING) {
+                poll_db(db);
+            }
+            atomic_fetch_add(&write_state.outstanding, 1);
+            write_value_async(db, keys[k], (db_data){.length=value_length, .data=value}, writepath_write_cb, &write_state);
+        }
+        wait_for_zero_writes(db);
+
+        double percentiles[2][2];
+        unsigned long long hit_elapsed = 0;
+        long long read_errors = 0;
+        for (int miss = 0; miss < 2; miss++) {
+            struct compact_read_state state = {.outstanding=0, .errors=0, .expected=miss ? KEY_NOT_FOUND : READ_SUCCESSFUL, .value_length=value_length};
+            unsigned long long begin = get_time_ns();
+            for (long long i = 0; i < num_values; i++) {
+                unsigned long long start = get_time_ns();
+                atomic_fetch_add(&state.outstanding, 1);
+                read_value_async(db, keys[order[i] + (miss ? num_values : 0)], compact_read_cb, &state);
+                while (atomic_load(&state.outstanding)) {
+                    poll_db(db);
+                }
+                latencies[i] = get_time_ns() - start;
+            }
+            if (!miss) {
+                hit_elapsed = get_time_ns() - begin;
+            }
+            qsort(latencies, num_values, sizeof(unsigned long long), compare_ull);
+            percentiles[miss][0] = latencies[num_values / 2] / 1e3;
+            percentiles[miss][1] = latencies[num_values * 99 / 100] / 1e3;
+            read_errors += state.errors;
+        }
+
+        struct db_stats stats;
+        get_db_stats(db, &stats);
+        printf("%8s %12.1f %10.1f %10.1f %10.1f %10.1f %12.0f %8lld\n", compact ? "compact" : "full",
+            (double)stats.index_bytes / stats.index_keys, percentiles[0][0], percentiles[0][1], percentiles[1][0],
+            percentiles[1][1], num_values * 1e9 / hit_elapsed, (long long)(read_errors + write_state.errors + stats.key_mismatches));
+        errors += read_errors + write_state.errors + stats.key_mismatches;
+        free_db(db);
+    }
+
+    for (long long k = 0; k < 2 * num_values; k++) {
+        free(keys[k].data);
+    }
+    free(keys);
+    free(order);
+    free(value);
+    free(latencies);
+    return errors != 0;
+}
+
+// db -> keys and key_vla as nvme_key.c grew them before nvme_arena.c, kept here as the baseline: double, copy,
+// free the old copy (which really stayed around until reclaim_retired).
+struct doubling_keys {
+    struct ram_stored_key *keys;
+    unsigned long long key_capacity;
+    char *key_vla;
+    unsigned long long key_vla_length;
+    unsigned long long key_vla_capacity;
+    unsigned long long peak_bytes; // both copies, while growing
+};
+
+static void *doubling_grow(struct doubling_keys *d, void *data, unsigned long long length, unsigned long long new_capacity) {
+    void *grown = malloc(new_capacity);
+    memcpy(grown, data, length);
+    unsigned long long bytes = d -> key_capacity * sizeof(struct ram_stored_key) + d -> key_vla_capacity + new_capacity;
+    d -> peak_bytes = bytes > d -> peak_bytes ? bytes : d -> peak_bytes;
+    free(data);
+    return grown;
+}
+
+static void doubling_append(struct doubling_keys *d, long long key_idx, const char *key, unsigned int key_length) {
+    if (key_idx >= d -> key_capacity) {
+        d -> keys = doubling_grow(d, d -> keys, key_idx * sizeof(struct ram_stored_key), d -> key_capacity * 2 * sizeof(struct ram_stored_key));
+        d -> key_capacity *= 2;
+    }
+    if (d -> key_vla_length + key_length > d -> key_vla_capacity) {
+        d -> key_vla = doubling_grow(d, d -> key_vla, d -> key_vla_length, d -> key_vla_capacity * 2);
+        d -> key_vla_capacity *= 2;
+    }
+    memcpy(d -> key_vla + d -> key_vla_length, key, key_length);
+    d -> keys[key_idx] = (struct ram_stored_key){.key_offset_low = d -> key_vla_length, .key_length = key_length, .data_loc = -1};
+    d -> key_vla_length += key_length;
+}
+
+// What append_key does with db -> keys and key_vla.
+static void arena_append(struct arena *keys, struct arena *key_vla, unsigned long long *key_vla_length, long long key_idx, const char *key, unsigned int key_length) {
+    arena_reserve(keys, key_idx + 1);
+    unsigned long long offset = *key_vla_length;
+    if (key_vla -> capacity > offset && arena_run(key_vla, offset) < key_length) {
+        offset += arena_run(key_vla, offset);
+    }
+    arena_reserve(key_vla, offset + key_length);
+    memcpy(arena_at(key_vla, offset), key, key_length);
+    *(struct ram_stored_key *) arena_at(keys, key_idx) = (struct ram_stored_key){.key_offset_low = offset, .key_offset_high = offset >> 32, .key_length = key_length, .data_loc = -1};
+    *key_vla_length = offset + key_length;
+}
+
+// Appends num_keys keys of key_length bytes to db -> keys and key_vla, doubling and copying them like nvme_key.c
+// used to, then with segmented arenas, timing every append: what a write that adds a key pays, under the lock.
+static int bench_arena(int argc, char **argv) {
+    long long num_keys = argc > 2 ? atoll(argv[2]) : 4000000;
+    unsigned int key_length = argc > 3 ? atoi(argv[3]) : 32;
+    printf("arena: %lld keys of %u bytes\n", num_keys, key_length);
+    char *key = malloc(key_length + 8);
+    unsigned long long *latencies = malloc(num_keys * sizeof(unsigned long long));
+    long long errors = 0;
+
+    printf("%10s %10s %10s %10s %10s %12s %12s\n", "", "mean ns", "p50 ns", "p99.9 ns", "max us", "MB in use", "peak MB");
+    for (int segmented = 0; segmented < 2; segmented++) {
+        struct doubling_keys d = {.key_capacity = 100, .key_vla_capacity = 2000}; // create_shard's old sizes
+        d.keys = malloc(d.key_capacity * sizeof(struct ram_stored_key));
+        d.key_vla = malloc(d.key_vla_capacity);
+        struct arena keys, key_vla;
+        arena_init(&keys, sizeof(struct ram_stored_key), 12); // as in create_shard
+        arena_init(&key_vla, 1, 16);
+        unsigned long long key_vla_length = 0;
+
+        rng_state = 88172645463325252ULL;
+        unsigned long long begin = get_time_ns();
+        for (long long i = 0; i < num_keys; i++) {
+            for (unsigned int j = 0; j < key_length; j += 8) {
+                unsigned long long r = rand64();
+                memcpy(key + j, &r, 8);
+            }
+            unsigned long long start = get_time_ns();
+            if (segmented) {
+                arena_append(&keys, &key_vla, &key_vla_length, i, key, key_length);
+            } else {
+                doubling_append(&d, i, key, key_length);
+            }
+            latencies[i] = get_time_ns() - start;
+        }
+        unsigned long long elapsed = get_time_ns() - begin;
+
+        // Check every key made it, and where it should be.
+        rng_state = 88172645463325252ULL;
+        for (long long i = 0; i < num_keys; i++) {
+            for (unsigned int j = 0; j < key_length; j += 8) {
+                unsigned long long r = rand64();
+                memcpy(key + j, &r, 8);
+            }
+            struct ram_stored_key *stored = segmented ? arena_at(&keys, i) : &d.keys[i];
+            const char *bytes = segmented ? arena_at(&key_vla, (unsigned long long) stored -> key_offset_high << 32 | stored -> key_offset_low) : d.key_vla + stored -> key_offset_low;
+            errors += stored -> key_length != key_length || memcmp(bytes, key, key_length) != 0;
+        }
+
+        unsigned long long in_use = segmented ? arena_bytes(&keys) + arena_bytes(&key_vla) : d.key_capacity * sizeof(struct ram_stored_key) + d.key_vla_capacity;
+        unsigned long long peak = segmented ? in_use : d.peak_bytes;
+        qsort(latencies, num_keys, sizeof(unsigned long long), compare_ull);
+        printf("%10s %10.1f %10llu %10llu %10.1f %12.1f %12.1f\n", segmented ? "segmented" : "doubling", (double) elapsed / num_keys,
+            latencies[num_keys / 2], latencies[num_keys * 999 / 1000], latencies[num_keys - 1] / 1e3, in_use / 1e6, peak / 1e6);
+
+        free(d.keys);
+        free(d.key_vla);
+        arena_free(&keys);
+        arena_free(&key_vla);
+    }
+    if (errors) {
+        printf("%lld keys weren't where they should be!\n", errors);
+    }
+    free(latencies);
+    free(key);
+    return errors != 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "index") == 0) {
+        return bench_index(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "hash") == 0) {
+        return bench_hash(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "scaling") == 0) {
+        return bench_scaling(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "writepath") == 0) {
+        return bench_writepath(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "readpath") == 0) {
+        return bench_readpath(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "cache") == 0) {
+        return bench_cache(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "multiget") == 0) {
+        return bench_multiget(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "ryw") == 0) {
+        return bench_ryw(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "stream") == 0) {
+        return bench_stream(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+        return bench_scan(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "scanall") == 0) {
+        return bench_scan_all(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compress") == 0) {
+        return bench_compress(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "checksum") == 0) {
+        return bench_checksum(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compactindex") == 0) {
+        return bench_compact_index(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "arena") == 0) {
+        return bench_arena(argc, argv);
+    }
+    printf("usage: %s index [num_keys] [key_length]\n", argv[0]);
+    printf("       %s hash [num_keys]\n", argv[0]);
+    printf("       %s scaling [max_threads] [ops_per_thread] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s writepath [num_values] [value_length]\n", argv[0]);
+    printf("       %s readpath [num_values] [value_length]\n", argv[0]);
+    printf("       %s multiget [num_values] [value_length] [batch] [device_latency_us]\n", argv[0]);
+    printf("       %s cache [num_values] [num_reads] [value_length] [cache_percent] [device_latency_us]\n", argv[0]);
+    printf("       %s ryw [num_values] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s stream [num_values] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s scan [num_values] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s scanall [num_values] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s compress [num_values] [value_length]\n", argv[0]);
+    printf("       %s checksum [MB_per_size] [device_latency_us]\n", argv[0]);
+    printf("       %s compactindex [num_values] [value_length] [device_latency_us]\n", argv[0]);
+    printf("       %s arena [num_keys] [key_length]\n", argv[0]);
+    return 1;
+}
@@ -3,7 +3,109 @@ typedef struct data {
     void *data;
 } db_data;
 
+enum db_backend {
+    DB_BACKEND_SPDK, // first NVMe namespace SPDK can find. Needs the device bound to SPDK.
+    DB_BACKEND_FILE, // file or block device at `path`, opened O_DIRECT and driven with io_uring.
+    DB_BACKEND_MEMORY, // RAM only, with optional latency injection. For tests and load testing.
+};
+
+enum db_compression {
+    DB_COMPRESSION_NONE,
+    DB_COMPRESSION_ZSTD, // smaller
+    DB_COMPRESSION_LZ4, // faster
+};
+
+struct db_options {
+    enum db_backend backend;
+
+    const char *path; // DB_BACKEND_FILE
+    unsigned int queue_depth; // DB_BACKEND_FILE. 0 means the default.
+
+    // DB_BACKEND_FILE: regular files smaller than this are extended to it. DB_BACKEND_MEMORY: bytes to allocate.
+    unsigned long long device_size;
+
+    unsigned int memory_sector_size; // DB_BACKEND_MEMORY
+    unsigned int memory_latency_us; // DB_BACKEND_MEMORY: every I/O takes this long...
+    unsigned int memory_latency_jitter_us; // ...plus up to this much more, drawn from memory_seed
+    unsigned int memory_seed;
+
+    // By default create_db rebuilds the db from whatever is on the device. Nonzero ignores it and starts empty.
+    int format;
+
+    // A checkpoint of the index is written every this many regions (4MB each) of log, so restarts only have to
+    // replay that much. 0 means the default.
+    unsigned long long checkpoint_interval;
+
+    // Keys are split between this many shards, each with its own lock, index and I/O queue on its own slice of
+    // the device. 0 means 1. Has to be the same every time a device is opened.
+    unsigned int num_shards;
+    // Nonzero: every shard gets a thread polling it, so poll_db does nothing and callbacks run on those threads.
+    int poller_threads;
+
+    // Group commit (see nvme_db/nvme_commit.h). Writes are batched so that, counting the device's own latency,
+    // they're acknowledged within commit_latency_target_us. Or, if that's 0, in batches big enough to sustain
+    // commit_throughput_target bytes/s. Both 0 means a 1ms latency target.
+    unsigned int commit_latency_target_us;
+    unsigned long long commit_throughput_target;
+
+    // read_values_async reads values less than this many bytes apart on the device with one read, gap and all.
+    // 0 means the default, 16KB.
+    unsigned int read_merge_gap;
+
+    // Bytes of RAM to cache recently read values in (see nvme_db/nvme_cache.h), split between shards. Reads that
+    // hit complete before read_value_async returns. 0 means no cache.
+    unsigned long long value_cache_bytes;
+
+    // Nonzero: also keep every key in key order (see nvme_db/nvme_ordered.h), about 6 more bytes of RAM a key,
+    // so scan_async can be used.
+    int ordered_index;
+
+    // Nonzero: keys aren't kept in RAM, only their 64-bit hash, length and where their record is, about 26 bytes
+    // a key plus the hash table's 9 a slot, instead of that plus the key. Reads of a value from the device check
+    // the key in its record against the one asked for, and get KEY_NOT_FOUND if it's another key with the same
+    // hash and length (see db_stats.key_mismatches). A write of such a key overwrites the other one, which with
+    // 64-bit hashes takes billions of keys of the same length to become at all likely. A shard still holds at most
+    // 2^32 keys either way (see TOO_MANY_KEYS_ERROR). Can't be used with ordered_index. Can change between opens,
+    // but then the first open rebuilds the index from the whole device.
+    int compact_index;
+
+    // Values written with write_value_async are compressed on the calling thread (see nvme_db/nvme_compress.h)
+    // and decompressed when they're read. Ones shorter than compression_min_bytes (0: 128) are stored as they
+    // are, and so are ones compression doesn't make compression_min_saving percent (0: 12) smaller.
+    // compression_level is zstd's level or lz4's acceleration, 0 for the default. A dictionary (see
+    // db_train_dictionary) is what makes values of a few hundred bytes worth compressing. The db keeps its own
+    // copy, and it has to be the same one every time the device is opened, or values written with it can't be
+    // read. The compression settings can change between opens.
+    enum db_compression compression;
+    int compression_level;
+    unsigned int compression_min_bytes;
+    unsigned int compression_min_saving;
+    const void *compression_dict;
+    unsigned long long compression_dict_length;
+
+    // By default a flush starts by writing the sector the last one ended partway into again, with the new records
+    // after the ones already acknowledged there. That relies on a one-sector write never being torn by power loss:
+    // NVMe promises it for a write of one block (AWUPF counts from one), and drives keep to it for each block of a
+    // bigger write too, since flash is written out of place and a block is only remapped once all of it's there.
+    // Nonzero: every flush starts on a fresh sector instead, for devices that don't promise that (a file on a
+    // filesystem with blocks bigger than the sector size, say), at the cost of up to a sector of padding a flush.
+    int fresh_sector_flushes;
+
+    // Nonzero: reads don't check each record's checksum, only that it's the record they were after. Checksums are
+    // still written, so this can change between opens. For measuring what verifying costs.
+    int skip_checksum_verify;
+};
+
+// Fills in the defaults: SPDK backend, i.e. what create_db() does.
+void db_options_init(struct db_options *opts);
+
 void *create_db(void);
+void *create_db_with_options(const struct db_options *opts);
+
+// Trains a compression dictionary of at most capacity bytes into dict, from samples of the values the app
+// writes (a few thousand of them, ideally 100 times capacity all told). Returns its length, or 0 if there
+// weren't enough samples to train on. For db_options.compression_dict.
+unsigned long long db_train_dictionary(const db_data *samples, unsigned int num_samples, void *dict, unsigned long long capacity);
 void free_db(void *db);
 
 enum write_err {
@@ -18,24 +120,136 @@ enum write_err {
     VALUE_TOO_LONG_ERROR,
 
     GENERIC_WRITE_ERROR,
+    TOO_MANY_KEYS_ERROR, // a new key, but its shard already has 2^32 keys (counting deleted ones), all it can index
 };
 
 typedef void (*key_write_cb)(void *, enum write_err); // cb_arg and
 
+// A record bigger than a region (4MB, less on small devices) is written to a run of consecutive free regions,
+// waiting on compaction for one if it has to. VALUE_TOO_LONG_ERROR if it couldn't fit even with every region bar
+// the compaction reserve, NOT_ENOUGH_SPACE_ERROR if there's no run that long and compaction can't make one.
 void write_value_async(void *db, db_data key, db_data value, key_write_cb callback, void *cb_arg);
 
+// Like write_value_async, but value.data has to come from db_dma_alloc, and the device writes it straight from
+// there instead of it being copied into a buffer first (only the bits at either end the device can't take as they
+// are still get copied). The buffer belongs to the db until the callback is called, so don't touch it till then.
+void write_value_dma_async(void *db, db_data key, db_data value, key_write_cb callback, void *cb_arg);
+
+typedef void (*value_fill_cb)(void *, unsigned long long, void *, unsigned long long);
+// cb_arg, offset, buf, length: copy bytes [offset, offset + length) of the value into buf
+
+// Writes a value of length bytes that never has to be in memory all at once: fill is asked for it a piece at a
+// time, in order, as it's written out, and a big value goes to the device a command's worth at a time. fill is
+// called from poll_db (or a poller thread) with the db's lock held, so it mustn't call into the db. Until the
+// callback, reads of the key get whatever value it had before. At most INT_MAX bytes, like any other value, since
+// reads hand it back as a db_data: VALUE_TOO_LONG_ERROR past that.
+void write_value_stream_async(void *db, db_data key, unsigned long long length, value_fill_cb fill, key_write_cb callback, void *cb_arg);
+
+// Memory the device can read from directly, for write_value_dma_async. Zeroed.
+void *db_dma_alloc(void *db, unsigned long long length);
+void db_dma_free(void *db, void *buf);
+
+// Deleting a key that doesn't exist succeeds. The key keeps a tombstone, on the device and in the index, till
+// compaction has reclaimed every older record of it.
+void delete_value_async(void *db, db_data key, key_write_cb callback, void *cb_arg);
+
 enum read_err {
     READ_SUCCESSFUL,
     KEY_NOT_FOUND,
     READ_IO_ERROR,
+    READ_BUFFER_TOO_SMALL, // read_value_into_async: value.length is how big the value is, value.data NULL
     GENERIC_READ_ERROR,
+    // What came off the device isn't what was written there: the record's checksum didn't match, or it isn't the
+    // key's record at all. Torn or misdirected writes, or the media going bad. value.data is NULL.
+    READ_CHECKSUM_ERROR,
 };
 
 typedef void (*key_read_cb)(void *, enum read_err, db_data);
 // cb_arg, err, value
 
+// Reads see every write and delete made before them, even ones whose callback hasn't run yet: a value that isn't
+// on the device yet is copied from the write, and the callback is run right away, before this returns. So are
+// the callbacks of reads the value cache has the value for.
 void read_value_async(void *db, db_data key, key_read_cb callback, void *cb_arg);
 
+// Reads into buf, which has to come from db_dma_alloc, rather than a buffer of the db's that's gone once the
+// callback returns. The device reads whole sectors, from the start of the key's record (so its checksum can be
+// checked), so if buf is at least db_read_buffer_size(db, length of the key, length of the value) long they're
+// read straight into it, and value.data points a little way into buf, after the record's header and key. If it's
+// smaller than that but still fits the value, the value is copied in and value.data is buf. Too small for the
+// value is READ_BUFFER_TOO_SMALL. Compressed values are always decompressed into buf, so they only need it to fit
+// the value. Don't touch buf until the callback.
+void read_value_into_async(void *db, db_data key, void *buf, unsigned long long buf_length, key_read_cb callback, void *cb_arg);
+
+// Bytes of buffer read_value_into_async needs to read a value of value_length, of a key of key_length, without
+// copying it.
+unsigned long long db_read_buffer_size(void *db, unsigned long long key_length, unsigned long long value_length);
+
+typedef void (*key_read_lease_cb)(void *, enum read_err, db_data, void *);
+// cb_arg, err, value, and the lease on the value, or NULL if there's no value
+
+// Like read_value_async, but the value stays where it is after the callback returns, until the lease is given
+// to db_release_read, which can be from any thread.
+void read_value_leased_async(void *db, db_data key, key_read_lease_cb callback, void *cb_arg);
+void db_release_read(void *db, void *lease);
+
+typedef void (*key_read_chunk_cb)(void *, enum read_err, unsigned long long, db_data, unsigned long long);
+// cb_arg, err, where the chunk starts in the value, the chunk, and how long the whole value is
+
+// Reads a value a chunk at a time, so a big one never needs a buffer its size, and the first chunk comes in
+// without waiting for the rest. Chunks come in order, one callback at a time, each only valid during its
+// callback, and the value is done with the one that ends at its length. An error ends it with an empty chunk;
+// KEY_NOT_FOUND comes with length 0. A compressed value comes all in one chunk, once it's been decompressed.
+// The checksum can only be checked once the whole value's been read, so a READ_CHECKSUM_ERROR can come in place
+// of the last chunk, after the others were delivered.
+void read_value_stream_async(void *db, db_data key, key_read_chunk_cb callback, void *cb_arg);
+
+typedef void (*keys_read_cb)(void *, unsigned int, const enum read_err *, const db_data *);
+// cb_arg, num_keys, and each key's err and value, in the order the keys were passed
+
+// Reads num_keys keys at once. They're looked up together, and values that were written near each other (the
+// log packs small values many to a sector) are fetched with one device read between them, not one each.
+// callback, if not NULL, is called for each key as its value comes in, with cb_args[i] (or NULL if cb_args is
+// NULL) for keys[i]. batch_callback, if not NULL, is called once after all of them, with every value. Values are
+// only valid during the callback they're passed to. keys has to stay valid until this returns, cb_args until the
+// last callback.
+void read_values_async(void *db, const db_data *keys, unsigned int num_keys, key_read_cb callback, void **cb_args,
+    keys_read_cb batch_callback, void *batch_arg);
+
+typedef void (*keys_scan_cb)(void *, unsigned int, const db_data *, const enum read_err *, const db_data *, int);
+// cb_arg, num_keys, and each key, its err and its value, and nonzero if this is the last batch
+
+// Every key from start up to but not including end, in order (bytes compared with memcmp, shorter first on a
+// tie), with its value, at most limit of them (0: no limit). A start of length 0 starts at the first key, and
+// end.data NULL goes on to the last. They're delivered in batches, one callback at a time, each batch's keys
+// and values only valid during its callback, and the last batch (which may be empty) says so. While one's being
+// delivered the next few are already being read, with read_values_async. Sees every write made before it's
+// called, and some made while it's going. Can call callback before it returns. Returns -1 without calling it
+// if the db wasn't opened with ordered_index, 0 otherwise.
+int scan_async(void *db, db_data start, db_data end, unsigned long long limit, keys_scan_cb callback, void *cb_arg);
+
+// scan_async of every key starting with prefix. Also returns -1 if prefix is 65536 bytes or longer, more than a key can be.
+int scan_prefix_async(void *db, db_data prefix, unsigned long long limit, keys_scan_cb callback, void *cb_arg);
+
+typedef int (*record_filter_cb)(void *, db_data, db_data);
+// cb_arg, key, value: nonzero to keep it
+typedef void (*records_scan_cb)(void *, enum read_err, unsigned int, const db_data *, const db_data *, int);
+// cb_arg, err, num_records, and each one's key and value, and nonzero if this is the last batch
+
+// Every key with its value, in no particular order, read off the log a whole region at a time instead of a
+// random read per key (see nvme_db/nvme_log_scan.h), so it's much quicker than reading every key when most of
+// them are wanted, and works without ordered_index. Each record's checked against the index as it's parsed,
+// so overwritten, deleted and half-written ones are skipped, and then given to filter (if not NULL), on the
+// poller, which keeps it by returning nonzero. Kept ones are delivered in batches. Keys and values are only
+// valid during the callback, and callbacks can run on several threads at once. The last callback has no
+// records, and err READ_IO_ERROR if part of the log couldn't be read, or had records that failed their checksum
+// (and those keys were missed), otherwise READ_SUCCESSFUL, like every other callback. Every key on the device
+// when it's called comes exactly once, with the value it had then, unless it's deleted before the scan gets to
+// it. Keys first written since don't. Can call callback before it returns.
+void scan_all_async(void *db, record_filter_cb filter, records_scan_cb callback, void *cb_arg);
+
+// Callbacks run from poll_db (or a poller thread) without any of the db's locks held, so they can read and
+// write the db themselves.
 void poll_db(void *opaque);
 
 void dump_sectors_to_file(void *opaque, int start_lba, int num_blocks);
@@ -43,3 +257,74 @@ void dump_sectors_to_file(void *opaque, int start_lba, int num_blocks);
 void flush_commands(void *opaque);
 
 void wait_for_zero_writes(void *opaque);
+
+#define DB_HISTOGRAM_BUCKETS 32 // bucket i counts values in [2^i, 2^(i+1)), and bucket 0 counts 0 too.
+
+// Byte counts are of records (header + key + value) unless noted.
+struct db_stats {
+    unsigned long long user_bytes_written; // writes and deletes
+    unsigned long long relocated_bytes_written; // records the compactor moved
+    unsigned long long device_bytes_written; // everything written to the device, padding included
+    double write_amplification; // device_bytes_written / user_bytes_written
+    unsigned long long in_place_bytes_written; // bytes of write_value_dma_async values that didn't need copying
+    unsigned long long tail_sector_rewrites; // flushes that filled up the part-written sector the last one ended with
+    unsigned long long tail_sectors_skipped; // ...and ones that didn't (see db_options.fresh_sector_flushes)
+    unsigned long long records_aligned; // records (or DMA values) started on a fresh sector, to read in one sector fewer
+    // Record bytes over the bytes of the sectors they're in, across the regions in use: how little is padding.
+    double space_utilization;
+
+    // Buffer pools (see nvme_db/nvme_pool.h), summed over shards.
+    unsigned long long dma_pool_hits;
+    unsigned long long dma_pool_misses; // had to be allocated from the device
+    unsigned long long dma_pool_high_water_bytes; // most bytes of pooled buffers in use at once
+    // Request state slabs. These are shared by every db in the process. High-water marks are of structs in use
+    // at once (give or take what each thread keeps cached).
+    unsigned long long read_states_high_water;
+    unsigned long long write_states_high_water;
+    unsigned long long flush_states_high_water;
+    unsigned long long request_state_bytes; // slab memory for all three
+
+    unsigned long long values_read; // by read_value_async, read_values_async and read_value_stream_async
+    unsigned long long read_commands; // device reads for them: fewer than values_read when read_values_async merged some, more for values too big for one
+    unsigned long long pending_write_reads; // values_read copied from writes that weren't on the device yet
+    unsigned long long value_bytes_read; // of the values read from the device
+    unsigned long long device_bytes_read; // by the device reads for them
+    double read_amplification; // device_bytes_read / value_bytes_read
+    unsigned long long checksum_errors; // records read (by any kind of read, or scan_all_async) that were READ_CHECKSUM_ERROR
+
+    // Value cache, if there is one. Misses include reads of values too big to cache.
+    unsigned long long value_cache_hits;
+    unsigned long long value_cache_misses;
+    unsigned long long value_cache_bytes; // in use
+    unsigned long long value_cache_entries;
+    unsigned long long value_cache_evictions;
+    unsigned long long value_cache_rejections; // read less often lately than what they'd have evicted
+
+    unsigned long long ordered_index_bytes; // RAM for the ordered index, if there is one
+    unsigned long long index_bytes; // RAM for finding keys: ram_stored_keys, the keys themselves (unless compact_index) and the hash table
+    unsigned long long index_keys; // keys in it, deleted ones included (and dropped ones, see tombstones_dropped)
+    unsigned long long key_mismatches; // compact_index reads of a key that found another key's record
+    unsigned long long scan_bytes_read; // by scan_all_async, not part of device_bytes_read
+
+    // Compression, of values written since the db was opened. Byte counts are of values, not records.
+    unsigned long long values_compressed;
+    unsigned long long compression_bytes_in; // what those values were
+    unsigned long long compression_bytes_out; // what they were stored as
+    double compression_ratio; // compression_bytes_in / compression_bytes_out
+
+    unsigned long long live_bytes;
+    unsigned long long dead_bytes; // overwritten or deleted, not yet reclaimed
+    unsigned long long regions_compacted;
+    unsigned long long tombstones_dropped; // deleted keys taken out of the index once nothing older of theirs was left
+    unsigned long long free_regions;
+    unsigned long long num_regions;
+
+    unsigned long long checkpoints_written;
+    unsigned long long checkpoint_bytes_written; // not part of device_bytes_written
+
+    // Flushes of user writes, by bytes of records in them and by how long (us) the oldest one had waited.
+    unsigned long long flush_batch_bytes[DB_HISTOGRAM_BUCKETS];
+    unsigned long long flush_linger_us[DB_HISTOGRAM_BUCKETS];
+};
+
+void get_db_stats(void *opaque, struct db_stats *stats);
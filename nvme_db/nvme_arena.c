@@ -0,0 +1,91 @@
+//
+//  nvme_arena.c
+//
+//
+
+#include "nvme_arena.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// What's mapped for segment. Big ones are rounded up to whole huge pages, which also keeps their end page aligned.
+static unsigned long long segment_bytes(struct arena *arena, unsigned int segment) {
+    unsigned long long bytes = (1ULL << (arena -> first_shift + segment)) * arena -> elem_size;
+    if (bytes >= ARENA_HUGE_PAGE) {
+        bytes = (bytes + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+    }
+    return bytes;
+}
+
+// Straight from mmap, like the index's tables, so a segment is zero pages until it's written.
+static char *segment_map(unsigned long long bytes) {
+    if (bytes < ARENA_HUGE_PAGE) {
+        void *data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return data == MAP_FAILED ? NULL : data;
+    }
+    // Over-map by a huge page and trim, so the segment starts on a huge page boundary. mmap only promises a page.
+    char *data = mmap(NULL, bytes + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t) data + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+    if (aligned != data) {
+        munmap(data, aligned - data);
+    }
+    munmap(aligned + bytes, data + ARENA_HUGE_PAGE - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, bytes, MADV_HUGEPAGE); // only a hint, and fine if THP is off
+#endif
+    return aligned;
+}
+
+void arena_init(struct arena *arena, unsigned long long elem_size, unsigned int first_shift) {
+    memset(arena -> segments, 0, sizeof(arena -> segments));
+    arena -> num_segments = 0;
+    arena -> first_shift = first_shift;
+    arena -> elem_size = elem_size;
+    arena -> capacity = 0;
+}
+
+void arena_free(struct arena *arena) {
+    for (unsigned int i = 0; i < arena -> num_segments; i++) {
+        munmap(arena -> segments[i], segment_bytes(arena, i));
+    }
+    arena_init(arena, arena -> elem_size, arena -> first_shift);
+}
+
+int arena_reserve(struct arena *arena, unsigned long long capacity) {
+    while (arena -> capacity < capacity) {
+        unsigned int segment = arena -> num_segments;
+        if (segment == ARENA_SEGMENTS) {
+            return -1;
+        }
+        char *data = segment_map(segment_bytes(arena, segment));
+        if (data == NULL) {
+            return -1;
+        }
+        arena -> segments[segment] = data;
+        arena -> num_segments++;
+        arena -> capacity = arena_segment_start(arena, segment + 1); // after the segment, see arena_at
+    }
+    return 0;
+}
+
+void arena_copy(struct arena *arena, unsigned long long offset, void *buf, unsigned long long length, bool to_arena) {
+    while (length) {
+        unsigned long long i = offset / arena -> elem_size;
+        unsigned long long within = offset % arena -> elem_size;
+        unsigned long long run = arena_run(arena, i) * arena -> elem_size - within;
+        run = run < length ? run : length;
+        char *data = (char *) arena_at(arena, i) + within;
+        if (to_arena) {
+            memcpy(data, buf, run);
+        } else {
+            memcpy(buf, data, run);
+        }
+        buf = (char *) buf + run;
+        offset += run;
+        length -= run;
+    }
+}
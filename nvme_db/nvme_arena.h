@@ -0,0 +1,72 @@
+//
+//  nvme_arena.h
+//
+//
+//  A growable array that never moves, for db -> keys and key_vla. It's a list of segments, each twice the size of
+//  the one before, mmap'd as the array grows and only unmapped when the arena is freed. So growing never copies
+//  anything (a write used to copy the whole array under the lock each time it doubled, and need twice its size
+//  while doing it), an element's address stays good for as long as the arena does, and an offset into it is a
+//  plain 64-bit number. Segments past ARENA_HUGE_PAGE are aligned to it and marked MADV_HUGEPAGE, since a lookup
+//  is a random access into what can be GBs of keys.
+//
+//  Element i is in segment s = log2(i / first + 1), where first is how many elements segment 0 holds (a power of
+//  2), so finding it is a shift, a clz and a subtract.
+//
+//  arena_at can run while another thread grows the arena (see the optimistic lookups in nvme_key.c): capacity is
+//  published after the segments it covers, so a reader that checks an index against capacity first only ever
+//  looks at mapped segments.
+//
+
+#ifndef nvme_arena_h
+#define nvme_arena_h
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define ARENA_SEGMENTS 48
+#define ARENA_HUGE_PAGE (2ULL << 20)
+
+struct arena {
+    char *segments[ARENA_SEGMENTS];
+    unsigned int num_segments;
+    unsigned int first_shift; // segment s holds 1 << (first_shift + s) elements
+    unsigned long long elem_size;
+    _Atomic unsigned long long capacity; // elements in the segments mapped so far. Stored after them.
+};
+
+void arena_init(struct arena *arena, unsigned long long elem_size, unsigned int first_shift);
+void arena_free(struct arena *arena);
+
+// Maps segments until the arena has room for at least capacity elements. -1 if mmap fails.
+int arena_reserve(struct arena *arena, unsigned long long capacity);
+
+// Copies length bytes between buf and the arena, looked at as one flat array of bytes starting at byte offset.
+// to_arena says which way. All of it must be within capacity.
+void arena_copy(struct arena *arena, unsigned long long offset, void *buf, unsigned long long length, bool to_arena);
+
+static inline unsigned int arena_segment(const struct arena *arena, unsigned long long i) {
+    return 63 - __builtin_clzll((i >> arena -> first_shift) + 1);
+}
+
+// The first element in segment.
+static inline unsigned long long arena_segment_start(const struct arena *arena, unsigned int segment) {
+    return ((1ULL << segment) - 1) << arena -> first_shift;
+}
+
+// Must be within capacity.
+static inline void *arena_at(const struct arena *arena, unsigned long long i) {
+    unsigned int segment = arena_segment(arena, i);
+    return arena -> segments[segment] + (i - arena_segment_start(arena, segment)) * arena -> elem_size;
+}
+
+// How many elements from i on are contiguous with it, i.e. the rest of i's segment.
+static inline unsigned long long arena_run(const struct arena *arena, unsigned long long i) {
+    return arena_segment_start(arena, arena_segment(arena, i) + 1) - i;
+}
+
+// Bytes mapped.
+static inline unsigned long long arena_bytes(const struct arena *arena) {
+    return arena -> capacity * arena -> elem_size;
+}
+
+#endif /* nvme_arena_h */
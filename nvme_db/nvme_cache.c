@@ -0,0 +1,311 @@
+//
+//  nvme_cache.c
+//
+//
+
+#include "nvme_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_INITIAL_BUCKETS 1024
+#define SKETCH_MIN_WIDTH 1024
+#define SKETCH_MAX_WIDTH (1ULL<<22)
+#define SKETCH_BYTES_PER_COUNTER 256 // a guess at the smallest values worth sizing the sketch for
+
+// splitmix64's finalizer. Locations are multiples of nothing in particular, but this spreads them anyway.
+static inline unsigned long long mix64(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline struct cache_stripe *stripe_of(struct value_cache *cache, unsigned long long hash) {
+    return &cache -> stripes[hash >> 60 & (VALUE_CACHE_STRIPES - 1)];
+}
+
+// Every epoch of a location is in the same bucket, so value_cache_invalidate can find them all.
+static inline struct cache_entry **bucket_of(struct cache_stripe *stripe, unsigned long long hash) {
+    return &stripe -> buckets[hash & (stripe -> num_buckets - 1)];
+}
+
+static inline unsigned long long sketch_hash(unsigned long long loc, unsigned int epoch) {
+    return mix64(loc ^ ((unsigned long long)epoch << 40) ^ 0x9e3779b97f4a7c15ULL);
+}
+
+static inline unsigned long long entry_size(unsigned long long length) {
+    return sizeof(struct cache_entry) + length;
+}
+
+// Row r's counter is at (h1 + r * h2) mod width, the usual double hashing trick for count-min sketches.
+static unsigned int sketch_estimate(struct cache_stripe *stripe, unsigned long long hash) {
+    unsigned long long h2 = (hash >> 32) | 1;
+    unsigned int min = 255;
+    for (int r = 0; r < VALUE_CACHE_SKETCH_ROWS; r++) {
+        unsigned char count = stripe -> sketch[r * stripe -> sketch_width + ((hash + r * h2) & (stripe -> sketch_width - 1))];
+        min = count < min ? count : min;
+    }
+    return min;
+}
+
+static void sketch_increment(struct cache_stripe *stripe, unsigned long long hash) {
+    unsigned long long h2 = (hash >> 32) | 1;
+    for (int r = 0; r < VALUE_CACHE_SKETCH_ROWS; r++) {
+        unsigned char *count = &stripe -> sketch[r * stripe -> sketch_width + ((hash + r * h2) & (stripe -> sketch_width - 1))];
+        if (*count < 15) {
+            (*count)++;
+        }
+    }
+    if (++stripe -> sketch_increments >= 10 * stripe -> sketch_width) {
+        for (unsigned long long i = 0; i < VALUE_CACHE_SKETCH_ROWS * stripe -> sketch_width; i++) {
+            stripe -> sketch[i] >>= 1;
+        }
+        stripe -> sketch_increments /= 2;
+    }
+}
+
+// MUST HAVE stripe -> lock TO CALL THIS FUNCTION
+static void grow_buckets(struct cache_stripe *stripe) {
+    unsigned long long num_buckets = stripe -> num_buckets * 2;
+    struct cache_entry **buckets = calloc(num_buckets, sizeof(struct cache_entry *));
+    if (buckets == NULL) {
+        return; // chains get a bit longer, that's all
+    }
+    for (unsigned long long i = 0; i < stripe -> num_buckets; i++) {
+        struct cache_entry *entry = stripe -> buckets[i];
+        while (entry) {
+            struct cache_entry *next = entry -> hash_next;
+            struct cache_entry **bucket = &buckets[mix64(entry -> loc) & (num_buckets - 1)];
+            entry -> hash_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(stripe -> buckets);
+    stripe -> buckets = buckets;
+    stripe -> num_buckets = num_buckets;
+}
+
+// MUST HAVE stripe -> lock TO CALL THIS FUNCTION
+static void unlink_entry(struct cache_stripe *stripe, struct cache_entry *entry) {
+    struct cache_entry **prev = bucket_of(stripe, mix64(entry -> loc));
+    while (*prev != entry) {
+        prev = &(*prev) -> hash_next;
+    }
+    *prev = entry -> hash_next;
+    TAILQ_REMOVE(&stripe -> clock, entry, clock);
+    entry -> linked = false;
+    stripe -> bytes -= entry_size(entry -> length);
+    stripe -> num_entries--;
+    if (entry -> refs == 0) {
+        free(entry);
+    }
+}
+
+int value_cache_init(struct value_cache *cache, unsigned long long capacity) {
+    cache -> capacity = capacity;
+    cache -> stripes = NULL;
+    if (capacity == 0) {
+        return 0;
+    }
+    unsigned long long stripe_capacity = capacity / VALUE_CACHE_STRIPES;
+    cache -> max_value = stripe_capacity / VALUE_CACHE_MAX_SHARE;
+    unsigned long long sketch_width = SKETCH_MIN_WIDTH;
+    while (sketch_width < SKETCH_MAX_WIDTH && sketch_width * SKETCH_BYTES_PER_COUNTER < stripe_capacity) {
+        sketch_width *= 2;
+    }
+
+    cache -> stripes = aligned_alloc(_Alignof(struct cache_stripe), VALUE_CACHE_STRIPES * sizeof(struct cache_stripe));
+    if (cache -> stripes == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < VALUE_CACHE_STRIPES; i++) {
+        struct cache_stripe *stripe = &cache -> stripes[i];
+        pthread_mutex_init(&stripe -> lock, NULL);
+        stripe -> num_buckets = CACHE_INITIAL_BUCKETS;
+        stripe -> buckets = calloc(stripe -> num_buckets, sizeof(struct cache_entry *));
+        stripe -> num_entries = 0;
+        TAILQ_INIT(&stripe -> clock);
+        stripe -> bytes = 0;
+        stripe -> capacity = stripe_capacity;
+        stripe -> sketch_width = sketch_width;
+        stripe -> sketch = calloc(VALUE_CACHE_SKETCH_ROWS * sketch_width, 1);
+        stripe -> sketch_increments = 0;
+        stripe -> hits = 0;
+        stripe -> misses = 0;
+        stripe -> evictions = 0;
+        stripe -> rejections = 0;
+        if (stripe -> buckets == NULL || stripe -> sketch == NULL) {
+            for (int j = 0; j <= i; j++) {
+                free(cache -> stripes[j].buckets);
+                free(cache -> stripes[j].sketch);
+                pthread_mutex_destroy(&cache -> stripes[j].lock);
+            }
+            free(cache -> stripes);
+            cache -> stripes = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Nothing can still be holding an entry: reads are all done before a db is freed.
+void value_cache_free(struct value_cache *cache) {
+    if (!value_cache_enabled(cache)) {
+        return;
+    }
+    for (int i = 0; i < VALUE_CACHE_STRIPES; i++) {
+        struct cache_stripe *stripe = &cache -> stripes[i];
+        struct cache_entry *entry;
+        while ((entry = TAILQ_FIRST(&stripe -> clock)) != NULL) {
+            TAILQ_REMOVE(&stripe -> clock, entry, clock);
+            free(entry);
+        }
+        free(stripe -> buckets);
+        free(stripe -> sketch);
+        pthread_mutex_destroy(&stripe -> lock);
+    }
+    free(cache -> stripes);
+    cache -> stripes = NULL;
+}
+
+struct cache_entry *value_cache_get(struct value_cache *cache, unsigned long long loc, unsigned int epoch) {
+    if (!value_cache_enabled(cache)) {
+        return NULL;
+    }
+    unsigned long long hash = mix64(loc);
+    struct cache_stripe *stripe = stripe_of(cache, hash);
+    pthread_mutex_lock(&stripe -> lock);
+    sketch_increment(stripe, sketch_hash(loc, epoch));
+    struct cache_entry *entry = *bucket_of(stripe, hash);
+    while (entry && (entry -> loc != loc || entry -> epoch != epoch)) {
+        entry = entry -> hash_next;
+    }
+    if (entry) {
+        entry -> refs++;
+        entry -> referenced = true;
+        stripe -> hits++;
+    } else {
+        stripe -> misses++;
+    }
+    pthread_mutex_unlock(&stripe -> lock);
+    return entry;
+}
+
+void value_cache_put(struct value_cache *cache, struct cache_entry *entry) {
+    struct cache_stripe *stripe = stripe_of(cache, mix64(entry -> loc));
+    pthread_mutex_lock(&stripe -> lock);
+    bool dead = --entry -> refs == 0 && !entry -> linked;
+    pthread_mutex_unlock(&stripe -> lock);
+    if (dead) {
+        free(entry);
+    }
+}
+
+void value_cache_insert(struct value_cache *cache, unsigned long long loc, unsigned int epoch, const void *data, unsigned long long length) {
+    if (!value_cache_enabled(cache) || length > cache -> max_value) {
+        return;
+    }
+    // Copied before taking the lock, so other threads' hits don't wait on it.
+    struct cache_entry *entry = malloc(entry_size(length));
+    if (entry == NULL) {
+        return;
+    }
+    entry -> loc = loc;
+    entry -> epoch = epoch;
+    entry -> length = length;
+    entry -> refs = 0;
+    entry -> referenced = false;
+    entry -> linked = true;
+    memcpy(entry -> data, data, length);
+
+    unsigned long long hash = mix64(loc);
+    struct cache_stripe *stripe = stripe_of(cache, hash);
+    pthread_mutex_lock(&stripe -> lock);
+    struct cache_entry **bucket = bucket_of(stripe, hash);
+    for (struct cache_entry *cur = *bucket; cur; cur = cur -> hash_next) {
+        if (cur -> loc == loc && cur -> epoch == epoch) { // two reads of it missed at once
+            pthread_mutex_unlock(&stripe -> lock);
+            free(entry);
+            return;
+        }
+    }
+
+    // Make room. The hand gives everything it passes that's been hit a second chance, so it goes round at most
+    // twice before finding something.
+    unsigned int frequency = sketch_estimate(stripe, sketch_hash(loc, epoch));
+    unsigned long long passes = 2 * stripe -> num_entries + 1;
+    while (stripe -> bytes + entry_size(length) > stripe -> capacity && passes--) {
+        struct cache_entry *victim = TAILQ_FIRST(&stripe -> clock);
+        if (victim == NULL) {
+            break;
+        }
+        if (victim -> referenced) {
+            victim -> referenced = false;
+            TAILQ_REMOVE(&stripe -> clock, victim, clock);
+            TAILQ_INSERT_TAIL(&stripe -> clock, victim, clock);
+            continue;
+        }
+        if (sketch_estimate(stripe, sketch_hash(victim -> loc, victim -> epoch)) >= frequency) {
+            stripe -> rejections++;
+            pthread_mutex_unlock(&stripe -> lock);
+            free(entry);
+            return;
+        }
+        unlink_entry(stripe, victim);
+        stripe -> evictions++;
+    }
+    if (stripe -> bytes + entry_size(length) > stripe -> capacity) {
+        pthread_mutex_unlock(&stripe -> lock);
+        free(entry);
+        return;
+    }
+
+    entry -> hash_next = *bucket;
+    *bucket = entry;
+    TAILQ_INSERT_TAIL(&stripe -> clock, entry, clock);
+    stripe -> bytes += entry_size(length);
+    if (++stripe -> num_entries > stripe -> num_buckets) {
+        grow_buckets(stripe);
+    }
+    pthread_mutex_unlock(&stripe -> lock);
+}
+
+void value_cache_invalidate(struct value_cache *cache, unsigned long long loc) {
+    if (!value_cache_enabled(cache)) {
+        return;
+    }
+    unsigned long long hash = mix64(loc);
+    struct cache_stripe *stripe = stripe_of(cache, hash);
+    pthread_mutex_lock(&stripe -> lock);
+    struct cache_entry *entry = *bucket_of(stripe, hash);
+    while (entry) {
+        struct cache_entry *next = entry -> hash_next;
+        if (entry -> loc == loc) {
+            unlink_entry(stripe, entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&stripe -> lock);
+}
+
+void value_cache_stats(struct value_cache *cache, struct value_cache_stats *stats) {
+    memset(stats, 0, sizeof(struct value_cache_stats));
+    if (!value_cache_enabled(cache)) {
+        return;
+    }
+    for (int i = 0; i < VALUE_CACHE_STRIPES; i++) {
+        struct cache_stripe *stripe = &cache -> stripes[i];
+        pthread_mutex_lock(&stripe -> lock);
+        stats -> hits += stripe -> hits;
+        stats -> misses += stripe -> misses;
+        stats -> bytes += stripe -> bytes;
+        stats -> entries += stripe -> num_entries;
+        stats -> evictions += stripe -> evictions;
+        stats -> rejections += stripe -> rejections;
+        pthread_mutex_unlock(&stripe -> lock);
+    }
+}
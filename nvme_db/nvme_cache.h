@@ -0,0 +1,96 @@
+//
+//  nvme_cache.h
+//
+//
+//  Optional DRAM cache of values in front of the device (db_options.value_cache_bytes). Entries are keyed by
+//  where their record is (data_loc) and the epoch its region had when the record was written. A record never
+//  changes once it's written, so if the index says a key's record is at (loc, epoch), whatever is cached under
+//  (loc, epoch) is its value, and reads can use it without the db's lock. record_died drops the entry of a
+//  record that's been overwritten, deleted or relocated, just to get the memory back: no key will ever point at
+//  it again, so one that's missed is never hit, and is about the first thing evicted.
+//
+//  Split into VALUE_CACHE_STRIPES stripes by location, each with its own mutex, hash table and share of the
+//  capacity. Eviction is CLOCK. Admission is TinyLFU: a count-min sketch of how often each record has been
+//  asked for lately, and a value only gets in if it's been asked for more often than what it would evict, so a
+//  scan through cold keys doesn't flush out the hot ones.
+//
+
+#ifndef nvme_cache_h
+#define nvme_cache_h
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "spdk/queue.h"
+
+#define VALUE_CACHE_STRIPES 16
+#define VALUE_CACHE_SKETCH_ROWS 4
+#define VALUE_CACHE_MAX_SHARE 8 // values bigger than 1/8th of a stripe aren't cached
+
+struct cache_entry {
+    unsigned long long loc;
+    unsigned int epoch;
+    unsigned int length;
+    int refs; // callbacks using data right now
+    bool referenced; // CLOCK bit, set by every hit
+    bool linked; // in the table and the clock. Once it isn't, it's freed when refs gets to 0.
+    struct cache_entry *hash_next;
+    TAILQ_ENTRY(cache_entry) clock;
+    char data[];
+};
+
+struct cache_stripe {
+    pthread_mutex_t lock; // for everything here
+    struct cache_entry **buckets;
+    unsigned long long num_buckets; // power of two
+    unsigned long long num_entries;
+    TAILQ_HEAD(, cache_entry) clock; // the hand is the head. Entries it passes go to the tail.
+    unsigned long long bytes; // of linked entries, structs included
+    unsigned long long capacity;
+
+    unsigned char *sketch; // VALUE_CACHE_SKETCH_ROWS rows of sketch_width counters, up to 15 each
+    unsigned long long sketch_width; // power of two
+    unsigned long long sketch_increments; // every counter is halved after 10 * sketch_width of these, so it forgets
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long rejections; // values that weren't asked for as often as what they'd have evicted
+} __attribute__((aligned(64)));
+
+struct value_cache {
+    unsigned long long capacity; // 0: no cache
+    unsigned long long max_value;
+    struct cache_stripe *stripes;
+};
+
+struct value_cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long bytes;
+    unsigned long long entries;
+    unsigned long long evictions;
+    unsigned long long rejections;
+};
+
+// capacity 0 leaves it disabled, and then everything else does nothing. Returns 0 on success.
+int value_cache_init(struct value_cache *cache, unsigned long long capacity);
+void value_cache_free(struct value_cache *cache);
+
+static inline bool value_cache_enabled(struct value_cache *cache) {
+    return cache -> stripes != NULL;
+}
+
+// The entry for (loc, epoch), which stays valid until it's given to value_cache_put, or NULL. Either way it
+// counts towards how often (loc, epoch) has been asked for.
+struct cache_entry *value_cache_get(struct value_cache *cache, unsigned long long loc, unsigned int epoch);
+void value_cache_put(struct value_cache *cache, struct cache_entry *entry);
+
+// Copies the value in, if it's small enough and wins admission.
+void value_cache_insert(struct value_cache *cache, unsigned long long loc, unsigned int epoch, const void *data, unsigned long long length);
+
+// Drops whatever's cached for the record at loc.
+void value_cache_invalidate(struct value_cache *cache, unsigned long long loc);
+
+void value_cache_stats(struct value_cache *cache, struct value_cache_stats *stats);
+
+#endif /* nvme_cache_h */
@@ -0,0 +1,517 @@
+//
+//  nvme_checkpoint.c
+//
+//
+
+#include "nvme_checkpoint.h"
+#include "nvme_key.h"
+#include "nvme_hash.h"
+#include "nvme_workers.h"
+#include "nvme_write_key_async.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHECKPOINT_MAGIC 0x74706b63796c6c73ULL // "sllyckpt"
+#define CHECKPOINT_RESERVE_DIVISOR 64 // each slot gets 1/64th of the regions, rounded up
+#define CHECKPOINT_DEFAULT_INTERVAL 256 // regions, i.e. 1GB of log at the default region size
+#define CHECKPOINT_CHUNK_SIZE (1ULL<<20) // capped to max_transfer_size
+#define CHECKPOINT_READS_IN_FLIGHT 32 // when loading
+#define CHECKPOINT_HASH_RANGES_PER_WORKER 4
+
+// The first sector of a slot. The body follows it: the region table, then keys, then key_vla, each starting
+// on a sector boundary.
+struct checkpoint_header {
+    unsigned long long magic;
+    unsigned long long generation;
+    unsigned long long num_regions;
+    unsigned long long region_sectors;
+    unsigned long long sector_size;
+    unsigned long long key_size; // sizeof(struct ram_stored_key), in case that ever changes
+    unsigned long long compact_index; // keys hold hashes rather than key_vla offsets, see db -> compact_index
+    unsigned long long key_vla_first_shift; // key_vla offsets depend on where its segments start, see append_key
+    unsigned long long num_key_entries;
+    unsigned long long key_vla_length;
+    unsigned long long next_seq;
+    unsigned long long next_epoch;
+    unsigned long long body_bytes;
+    unsigned long long checksum; // hash_bytes of everything above
+};
+
+// Where one piece of the body lives in memory: data, or for keys and key_vla, arena.
+struct body_section {
+    void *data;
+    struct arena *arena;
+    unsigned long long offset; // in the body
+    unsigned long long length;
+};
+
+#define BODY_SECTIONS 3
+
+static unsigned long long sector_align(struct db_state *db, unsigned long long bytes) {
+    return (bytes + db -> sector_size - 1) / db -> sector_size * db -> sector_size;
+}
+
+// Fills in sections for a checkpoint of num_keys keys and returns the size of the body.
+static unsigned long long body_layout(struct db_state *db, struct checkpoint_region *regions, unsigned long long num_keys, unsigned long long key_vla_length, struct body_section *sections) {
+    unsigned long long regions_length = db -> num_regions * sizeof(struct checkpoint_region);
+    unsigned long long keys_offset = sector_align(db, regions_length);
+    unsigned long long keys_length = num_keys * sizeof(struct ram_stored_key);
+    unsigned long long vla_offset = sector_align(db, keys_offset + keys_length);
+    sections[0] = (struct body_section){.data=regions, .offset=0, .length=regions_length};
+    sections[1] = (struct body_section){.arena=&db -> keys, .offset=keys_offset, .length=keys_length};
+    sections[2] = (struct body_section){.arena=&db -> key_vla, .offset=vla_offset, .length=key_vla_length};
+    return sector_align(db, vla_offset + key_vla_length);
+}
+
+// Copies the part of the body at [offset, offset + length) between buf and memory. to_body is for writing
+// a checkpoint, otherwise it's being loaded.
+static void copy_body(struct body_section *sections, void *buf, unsigned long long offset, unsigned long long length, bool to_body) {
+    if (to_body) {
+        memset(buf, 0, length);
+    }
+    for (int i = 0; i < BODY_SECTIONS; i++) {
+        struct body_section *section = &sections[i];
+        unsigned long long start = offset > section -> offset ? offset : section -> offset;
+        unsigned long long end = offset + length < section -> offset + section -> length ? offset + length : section -> offset + section -> length;
+        if (start >= end) {
+            continue;
+        }
+        if (section -> arena) {
+            arena_copy(section -> arena, start - section -> offset, buf + (start - offset), end - start, !to_body);
+        } else if (to_body) {
+            memcpy(buf + (start - offset), section -> data + (start - section -> offset), end - start);
+        } else {
+            memcpy(section -> data + (start - section -> offset), buf + (start - offset), end - start);
+        }
+    }
+}
+
+static unsigned long long slot_lba(struct db_state *db, int slot) {
+    return db -> num_regions * db -> region_sectors + slot * db -> checkpoint.slot_sectors;
+}
+
+static unsigned long long header_checksum(struct checkpoint_header *header) {
+    return hash_bytes(header, offsetof(struct checkpoint_header, checksum));
+}
+
+unsigned long long checkpoint_reserve(struct db_state *db) {
+    memset(&db -> checkpoint, 0, sizeof(struct checkpoint));
+    unsigned long long slot_regions = (db -> num_regions + CHECKPOINT_RESERVE_DIVISOR - 1) / CHECKPOINT_RESERVE_DIVISOR;
+    db -> checkpoint.slot_sectors = slot_regions * db -> region_sectors;
+    return CHECKPOINT_SLOTS * slot_regions;
+}
+
+void checkpoint_init(struct db_state *db, unsigned long long interval) {
+    struct checkpoint *cp = &db -> checkpoint;
+    if (interval == 0) {
+        interval = db -> num_regions / 4 < CHECKPOINT_DEFAULT_INTERVAL ? db -> num_regions / 4 : CHECKPOINT_DEFAULT_INTERVAL;
+        interval = interval ? interval : 1;
+    }
+    cp -> interval = interval;
+    cp -> slot = CHECKPOINT_SLOTS - 1; // so the first one goes to slot 0
+    cp -> header = device_dma_malloc(db -> device, db -> sector_size);
+
+    cp -> chunk_size = CHECKPOINT_CHUNK_SIZE < db -> max_transfer_size ? CHECKPOINT_CHUNK_SIZE : db -> max_transfer_size;
+    cp -> chunk_size -= cp -> chunk_size % db -> sector_size;
+    cp -> chunk_size = cp -> chunk_size ? cp -> chunk_size : db -> sector_size;
+    for (int i = 0; i < CHECKPOINT_WRITES_IN_FLIGHT; i++) {
+        cp -> chunks[i].db = db;
+        cp -> chunks[i].buf = device_dma_malloc(db -> device, cp -> chunk_size);
+        cp -> chunks[i].busy = false;
+    }
+}
+
+void checkpoint_free(struct db_state *db) {
+    struct checkpoint *cp = &db -> checkpoint;
+    device_dma_free(db -> device, cp -> header);
+    for (int i = 0; i < CHECKPOINT_WRITES_IN_FLIGHT; i++) {
+        device_dma_free(db -> device, cp -> chunks[i].buf);
+    }
+    free(cp -> regions);
+}
+
+// WRITING
+
+static void abandon_checkpoint(struct db_state *db) {
+    struct checkpoint *cp = &db -> checkpoint;
+    printf("Writing checkpoint failed, trying again later\n");
+    free(cp -> regions);
+    cp -> regions = NULL;
+    cp -> epoch = cp -> next_epoch; // wait another interval
+    cp -> state = CHECKPOINT_IDLE;
+}
+
+static void finish_checkpoint(struct db_state *db) {
+    struct checkpoint *cp = &db -> checkpoint;
+    cp -> generation++;
+    cp -> slot = (cp -> slot + 1) % CHECKPOINT_SLOTS;
+    cp -> epoch = cp -> next_epoch;
+    cp -> checkpoints_written++;
+    free(cp -> regions);
+    cp -> regions = NULL;
+    cp -> state = CHECKPOINT_IDLE;
+#ifdef DEBUG
+    printf("Wrote checkpoint %llu: %llu keys, %llu bytes\n", cp -> generation, cp -> num_key_entries, cp -> body_bytes);
+#endif
+}
+
+// For the header writes and the flushes around them.
+static void checkpoint_io_cb(void *cb_arg, int status) {
+    struct db_state *db = cb_arg;
+    struct checkpoint *cp = &db -> checkpoint;
+    int slot = (cp -> slot + 1) % CHECKPOINT_SLOTS;
+    if (status != 0) {
+        abandon_checkpoint(db);
+        return;
+    }
+
+    switch (cp -> state) {
+        case CHECKPOINT_INVALIDATING:
+            cp -> state = CHECKPOINT_WRITING; // checkpoint_step takes it from here
+            break;
+        case CHECKPOINT_SYNCING: {
+            struct checkpoint_header *header = cp -> header;
+            memset(header, 0, db -> sector_size);
+            *header = (struct checkpoint_header){
+                .magic = CHECKPOINT_MAGIC,
+                .generation = cp -> generation + 1,
+                .num_regions = db -> num_regions,
+                .region_sectors = db -> region_sectors,
+                .sector_size = db -> sector_size,
+                .key_size = sizeof(struct ram_stored_key),
+                .compact_index = db -> compact_index,
+                .key_vla_first_shift = db -> key_vla.first_shift,
+                .num_key_entries = cp -> num_key_entries,
+                .key_vla_length = cp -> key_vla_length,
+                .next_seq = cp -> next_seq,
+                .next_epoch = cp -> next_epoch,
+                .body_bytes = cp -> body_bytes,
+            };
+            header -> checksum = header_checksum(header);
+            cp -> state = CHECKPOINT_COMMITTING;
+            device_write(db -> queue, cp -> header, slot_lba(db, slot), 1, checkpoint_io_cb, db);
+            break;
+        }
+        case CHECKPOINT_COMMITTING:
+            cp -> state = CHECKPOINT_SYNCING_HEADER;
+            device_flush(db -> queue, checkpoint_io_cb, db);
+            break;
+        case CHECKPOINT_SYNCING_HEADER:
+            finish_checkpoint(db);
+            break;
+    }
+}
+
+static void checkpoint_chunk_cb(void *cb_arg, int status) {
+    struct checkpoint_chunk *chunk = cb_arg;
+    struct checkpoint *cp = &chunk -> db -> checkpoint;
+    chunk -> busy = false;
+    cp -> writes_in_flight--;
+    if (status != 0) {
+        cp -> error = true;
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static void start_checkpoint(struct db_state *db) {
+    struct checkpoint *cp = &db -> checkpoint;
+    struct body_section sections[BODY_SECTIONS];
+    unsigned long long body_bytes = body_layout(db, NULL, db -> num_key_entries, db -> key_vla_length, sections);
+    if (body_bytes + db -> sector_size > cp -> slot_sectors * db -> sector_size) {
+        if (!cp -> too_big) {
+            printf("Index is too big to checkpoint (%llu bytes, slots are %llu), restarts will replay more of the log\n",
+                body_bytes, cp -> slot_sectors * db -> sector_size);
+            cp -> too_big = true;
+        }
+        cp -> epoch = db -> next_epoch;
+        return;
+    }
+
+    // The snapshot. Keys and key_vla are copied out later, a chunk at a time, but only the first
+    // num_key_entries keys and key_vla_length bytes, which never move.
+    cp -> num_key_entries = db -> num_key_entries;
+    cp -> key_vla_length = db -> key_vla_length;
+    cp -> next_seq = db -> next_seq;
+    cp -> next_epoch = db -> next_epoch;
+    cp -> body_bytes = body_bytes;
+    cp -> next_byte = 0;
+    cp -> error = false;
+
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    unsigned long long *replay_from = malloc(db -> num_regions * sizeof(unsigned long long));
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        replay_from[i] = region_bytes;
+    }
+    for (int i = 0; i < NUM_HEADS; i++) {
+        struct log_head *head = &db -> heads[i];
+        if (head -> region >= 0) {
+            unsigned long long loc = head -> current_sector_ssd * db -> sector_size + head -> current_sector_bytes;
+            replay_from[head -> region] = loc - head -> region * region_bytes;
+        }
+    }
+    unapplied_flush_starts(db, replay_from);
+
+    cp -> regions = malloc(db -> num_regions * sizeof(struct checkpoint_region));
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        struct region *region = &db -> regions[i];
+        cp -> regions[i] = (struct checkpoint_region){
+            .record_bytes = region -> record_bytes,
+            .sectors_written = region -> sectors_written,
+            .replay_from = replay_from[i],
+            .epoch = region -> epoch,
+            .state = region -> state == REGION_ERASING ? REGION_FREE : region -> state, // nothing in it's needed
+        };
+    }
+    free(replay_from);
+
+    memset(cp -> header, 0, db -> sector_size);
+    cp -> state = CHECKPOINT_INVALIDATING;
+    device_write(db -> queue, cp -> header, slot_lba(db, (cp -> slot + 1) % CHECKPOINT_SLOTS), 1, checkpoint_io_cb, db);
+}
+
+void checkpoint_step(struct db_state *db) {
+    struct checkpoint *cp = &db -> checkpoint;
+    if (cp -> state == CHECKPOINT_IDLE && db -> next_epoch - cp -> epoch >= cp -> interval) {
+        start_checkpoint(db);
+        return;
+    }
+    if (cp -> state != CHECKPOINT_WRITING) {
+        return;
+    }
+
+    if (cp -> error) {
+        if (cp -> writes_in_flight == 0) {
+            abandon_checkpoint(db);
+        }
+        return;
+    }
+
+    if (cp -> next_byte == cp -> body_bytes) {
+        if (cp -> writes_in_flight == 0) {
+            cp -> state = CHECKPOINT_SYNCING;
+            device_flush(db -> queue, checkpoint_io_cb, db);
+        }
+        return;
+    }
+
+    // One chunk per poll, so a checkpoint never holds the lock for long.
+    struct checkpoint_chunk *chunk = NULL;
+    for (int i = 0; i < CHECKPOINT_WRITES_IN_FLIGHT; i++) {
+        if (!cp -> chunks[i].busy) {
+            chunk = &cp -> chunks[i];
+            break;
+        }
+    }
+    if (chunk == NULL) {
+        return;
+    }
+
+    struct body_section sections[BODY_SECTIONS];
+    body_layout(db, cp -> regions, cp -> num_key_entries, cp -> key_vla_length, sections);
+    unsigned long long length = cp -> body_bytes - cp -> next_byte;
+    length = length < cp -> chunk_size ? length : cp -> chunk_size;
+    copy_body(sections, chunk -> buf, cp -> next_byte, length, true);
+
+    chunk -> busy = true;
+    cp -> writes_in_flight++;
+    device_write(
+        db -> queue,
+        chunk -> buf,
+        slot_lba(db, (cp -> slot + 1) % CHECKPOINT_SLOTS) + 1 + cp -> next_byte / db -> sector_size,
+        length / db -> sector_size,
+        checkpoint_chunk_cb,
+        chunk
+    );
+    cp -> next_byte += length;
+    cp -> bytes_written += length;
+}
+
+// LOADING
+
+static void sync_io_cb(void *cb_arg, int status) {
+    int *result = cb_arg;
+    *result = status;
+}
+
+static int read_sync(struct db_state *db, void *buf, unsigned long long lba, unsigned int lba_count) {
+    int result = 1; // statuses are 0 or negative
+    device_read(db -> queue, buf, lba, lba_count, sync_io_cb, &result);
+    while (result == 1) {
+        device_process_completions(db -> queue, 0);
+    }
+    return result;
+}
+
+static bool header_valid(struct db_state *db, struct checkpoint_header *header) {
+    struct body_section sections[BODY_SECTIONS];
+    return header -> magic == CHECKPOINT_MAGIC &&
+        header -> checksum == header_checksum(header) &&
+        header -> num_regions == db -> num_regions &&
+        header -> region_sectors == db -> region_sectors &&
+        header -> sector_size == db -> sector_size &&
+        header -> key_size == sizeof(struct ram_stored_key) &&
+        header -> compact_index == db -> compact_index && // otherwise the whole device is scanned, in the new mode
+        header -> key_vla_first_shift == db -> key_vla.first_shift &&
+        header -> body_bytes + db -> sector_size <= db -> checkpoint.slot_sectors * db -> sector_size &&
+        header -> body_bytes == body_layout(db, NULL, header -> num_key_entries, header -> key_vla_length, sections);
+}
+
+struct load_chunk {
+    struct load_state *load;
+    void *buf;
+    unsigned long long offset;
+    unsigned long long length;
+    bool busy;
+};
+
+struct load_state {
+    struct body_section sections[BODY_SECTIONS];
+    int reads_in_flight;
+    bool error;
+};
+
+static void load_chunk_cb(void *cb_arg, int status) {
+    struct load_chunk *chunk = cb_arg;
+    chunk -> busy = false;
+    chunk -> load -> reads_in_flight--;
+    if (status != 0) {
+        chunk -> load -> error = true;
+        return;
+    }
+    copy_body(chunk -> load -> sections, chunk -> buf, chunk -> offset, chunk -> length, false);
+}
+
+static int load_body(struct db_state *db, struct checkpoint_header *header, int slot, struct checkpoint_region *regions) {
+    struct checkpoint *cp = &db -> checkpoint;
+    struct load_state load = {.reads_in_flight = 0, .error = false};
+    body_layout(db, regions, header -> num_key_entries, header -> key_vla_length, load.sections);
+
+    struct load_chunk chunks[CHECKPOINT_READS_IN_FLIGHT];
+    for (int i = 0; i < CHECKPOINT_READS_IN_FLIGHT; i++) {
+        chunks[i] = (struct load_chunk){.load = &load, .buf = device_dma_malloc(db -> device, cp -> chunk_size)};
+    }
+
+    unsigned long long next_byte = 0;
+    while (next_byte < header -> body_bytes || load.reads_in_flight) {
+        for (int i = 0; i < CHECKPOINT_READS_IN_FLIGHT && next_byte < header -> body_bytes && !load.error; i++) {
+            if (chunks[i].busy) {
+                continue;
+            }
+            unsigned long long length = header -> body_bytes - next_byte;
+            chunks[i].offset = next_byte;
+            chunks[i].length = length < cp -> chunk_size ? length : cp -> chunk_size;
+            chunks[i].busy = true;
+            load.reads_in_flight++;
+            device_read(db -> queue, chunks[i].buf, slot_lba(db, slot) + 1 + next_byte / db -> sector_size,
+                chunks[i].length / db -> sector_size, load_chunk_cb, &chunks[i]);
+            next_byte += chunks[i].length;
+        }
+        if (load.error && load.reads_in_flight == 0) {
+            break;
+        }
+        device_process_completions(db -> queue, 0);
+    }
+
+    for (int i = 0; i < CHECKPOINT_READS_IN_FLIGHT; i++) {
+        device_dma_free(db -> device, chunks[i].buf);
+    }
+    return load.error ? -1 : 0;
+}
+
+struct hash_range {
+    struct db_state *db;
+    unsigned long long *hashes;
+    unsigned long long start;
+    unsigned long long end;
+};
+
+static void hash_keys(void *arg) {
+    struct hash_range *range = arg;
+    struct db_state *db = range -> db;
+    for (unsigned long long i = range -> start; i < range -> end; i++) {
+        range -> hashes[i] = stored_key_hash(db, key_at(db, i));
+    }
+}
+
+// The index isn't in the checkpoint, so hash every key (in parallel) and insert them all.
+static void rebuild_index(struct db_state *db, struct worker_pool *workers) {
+    unsigned long long num_keys = db -> num_key_entries;
+    unsigned long long *hashes = malloc(num_keys * sizeof(unsigned long long) + 1);
+    unsigned int threads = workers_count(workers);
+    unsigned long long num_ranges = threads ? threads * CHECKPOINT_HASH_RANGES_PER_WORKER : 1; // 1: hashed right here
+    struct hash_range *ranges = malloc(num_ranges * sizeof(struct hash_range));
+    for (unsigned long long i = 0; i < num_ranges; i++) {
+        ranges[i] = (struct hash_range){
+            .db = db,
+            .hashes = hashes,
+            .start = num_keys * i / num_ranges,
+            .end = num_keys * (i + 1) / num_ranges,
+        };
+        workers_submit(workers, hash_keys, &ranges[i]);
+    }
+    workers_wait(workers);
+
+    index_free(&db -> index);
+    index_init(&db -> index, num_keys);
+    for (unsigned long long i = 0; i < num_keys; i++) {
+        if (!(key_at(db, i) -> flags & DATA_FLAG_DROPPED)) { // its key may have been written again since, as a new slot
+            index_insert(&db -> index, hashes[i], i);
+        }
+    }
+    free(ranges);
+    free(hashes);
+}
+
+struct checkpoint_region *checkpoint_load(struct db_state *db, struct worker_pool *workers) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct checkpoint *cp = &db -> checkpoint;
+
+    // Use the newest slot with a valid header.
+    struct checkpoint_header header;
+    int slot = -1;
+    void *buf = device_dma_malloc(db -> device, db -> sector_size);
+    for (int i = 0; i < CHECKPOINT_SLOTS; i++) {
+        struct checkpoint_header candidate;
+        if (read_sync(db, buf, slot_lba(db, i), 1) != 0) {
+            continue;
+        }
+        memcpy(&candidate, buf, sizeof(candidate));
+        if (header_valid(db, &candidate) && (slot < 0 || candidate.generation > header.generation)) {
+            header = candidate;
+            slot = i;
+        }
+    }
+    device_dma_free(db -> device, buf);
+    if (slot < 0) {
+        return NULL;
+    }
+
+    if (arena_reserve(&db -> keys, header.num_key_entries) != 0 || arena_reserve(&db -> key_vla, header.key_vla_length) != 0) {
+        printf("Not enough memory for checkpoint %llu, scanning the whole device instead\n", header.generation);
+        return NULL;
+    }
+    struct checkpoint_region *regions = malloc(db -> num_regions * sizeof(struct checkpoint_region));
+    if (load_body(db, &header, slot, regions) != 0) {
+        printf("Couldn't read checkpoint %llu, scanning the whole device instead\n", header.generation);
+        free(regions);
+        return NULL;
+    }
+    db -> num_key_entries = header.num_key_entries;
+    db -> key_vla_length = header.key_vla_length;
+    rebuild_index(db, workers);
+
+    db -> next_seq = header.next_seq;
+    db -> next_epoch = header.next_epoch;
+    cp -> generation = header.generation;
+    cp -> slot = slot;
+    cp -> epoch = header.next_epoch;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Loaded checkpoint %llu: %llu keys, %.3g MB in %.3g s\n", header.generation, header.num_key_entries,
+        header.body_bytes / 1e6, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return regions;
+}
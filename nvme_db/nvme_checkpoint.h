@@ -0,0 +1,98 @@
+//
+//  nvme_checkpoint.h
+//
+//
+//  Index checkpoints, so a restart doesn't have to scan the whole device (see nvme_recover.h).
+//
+//  The last few regions of the device are set aside for two checkpoint slots, written alternately so there's
+//  always a complete one. A checkpoint holds db -> keys, db -> key_vla and a snapshot of the region table,
+//  and is written a chunk at a time from poll_db while writes carry on. That makes the keys it saves fuzzy,
+//  since some of them change while it's being written, but every record written after the snapshot is still
+//  on the device and carries a seq, so replaying them fixes up every key that changed. The replay has to
+//  cover regions opened since the snapshot (their epoch is newer than the checkpoint's) and the tail of
+//  whatever regions were open or had flushes not yet applied at the snapshot.
+//
+//  The lookup structure isn't saved, since it gets resized in place as keys are added and so can't be copied
+//  out incrementally. Recovery rebuilds it from the saved keys instead, hashing them on the worker threads.
+//
+//  Writing a checkpoint: zero the slot's header, write the body, flush, write the header, flush. The header is
+//  only valid once everything it describes is on the device.
+//
+
+#ifndef nvme_checkpoint_h
+#define nvme_checkpoint_h
+
+#include <stdbool.h>
+
+#define CHECKPOINT_SLOTS 2
+#define CHECKPOINT_WRITES_IN_FLIGHT 4
+
+#define CHECKPOINT_IDLE 0
+#define CHECKPOINT_INVALIDATING 1 // zeroing the header of the slot about to be overwritten
+#define CHECKPOINT_WRITING 2
+#define CHECKPOINT_SYNCING 3 // flushing the body, before writing the header
+#define CHECKPOINT_COMMITTING 4 // writing the header
+#define CHECKPOINT_SYNCING_HEADER 5
+
+// What a checkpoint says about one region when it was taken.
+struct checkpoint_region {
+    unsigned long long record_bytes;
+    unsigned long long sectors_written;
+    unsigned long long replay_from; // records from here on may not be in the checkpoint. Region size if there are none.
+    unsigned int epoch;
+    char state;
+};
+
+struct checkpoint_chunk {
+    struct db_state *db;
+    void *buf;
+    bool busy;
+};
+
+struct checkpoint {
+    unsigned long long slot_sectors; // size of each slot. They come right after the last region.
+    unsigned long long interval; // regions opened between checkpoints, i.e. at most how much log a restart replays.
+    unsigned long long generation; // of the last complete checkpoint, 0 if there isn't one
+    int slot; // where the last complete checkpoint is
+    unsigned int epoch; // db -> next_epoch when the last complete checkpoint was taken
+    unsigned long long checkpoints_written;
+    unsigned long long bytes_written;
+    bool too_big; // the index doesn't fit in a slot any more, and we've said so
+
+    // The checkpoint being written
+    int state;
+    void *header; // one sector, DMA
+    struct checkpoint_region *regions; // snapshot of the region table
+    unsigned long long num_key_entries; // how many keys, and how much of key_vla, the snapshot covers
+    unsigned long long key_vla_length;
+    unsigned long long next_seq;
+    unsigned int next_epoch;
+    unsigned long long body_bytes;
+    unsigned long long next_byte; // of the body, to write next
+    int writes_in_flight;
+    bool error;
+    struct checkpoint_chunk chunks[CHECKPOINT_WRITES_IN_FLIGHT];
+    unsigned long long chunk_size;
+};
+
+struct db_state;
+struct worker_pool;
+
+// Called by regions_init once the region size is known. Sets aside the slots and returns how many regions they took.
+unsigned long long checkpoint_reserve(struct db_state *db);
+
+// interval is in regions, 0 for the default.
+void checkpoint_init(struct db_state *db, unsigned long long interval);
+void checkpoint_free(struct db_state *db);
+
+// Loads the newest complete checkpoint into db -> keys, db -> key_vla and db -> index, and sets next_seq and
+// next_epoch from it. Returns its region table (which the caller frees) or NULL if there's no usable checkpoint.
+// Only for recovery, before anything else has touched the device.
+struct checkpoint_region *checkpoint_load(struct db_state *db, struct worker_pool *workers);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Called from poll_db. Starts a checkpoint once enough regions have been opened since the last, and writes out
+// at most one chunk of it.
+void checkpoint_step(struct db_state *db);
+
+#endif /* nvme_checkpoint_h */
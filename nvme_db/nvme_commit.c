@@ -0,0 +1,112 @@
+//
+//  nvme_commit.c
+//
+//
+
+#include "nvme_key.h"
+#include "nvme_commit.h"
+
+#include <string.h>
+#include <time.h>
+
+static unsigned int log2_bucket(unsigned long long value) {
+    unsigned int bucket = value ? 63 - __builtin_clzll(value) : 0;
+    return bucket < DB_HISTOGRAM_BUCKETS ? bucket : DB_HISTOGRAM_BUCKETS - 1;
+}
+
+unsigned long long commit_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Largest batch worth waiting for: one device write, rounded down to sectors.
+static unsigned long long max_batch(struct db_state *db) {
+    unsigned long long limit = COMMIT_MAX_BATCH_BYTES;
+    if (db -> max_transfer_size >= db -> sector_size && db -> max_transfer_size < limit) {
+        limit = db -> max_transfer_size;
+    }
+    return limit - limit % db -> sector_size;
+}
+
+static unsigned long long clamp(unsigned long long value, unsigned long long min, unsigned long long max) {
+    return value < min ? min : value > max ? max : value;
+}
+
+static void recompute_policy(struct db_state *db) {
+    struct group_commit *gc = &db -> commit;
+    // Flushes go out at arrival_rate / batch per us and each takes device_latency_us, so this is the smallest
+    // batch that keeps no more than COMMIT_QUEUE_DEPTH of them in flight.
+    double keeps_up = gc -> arrival_rate * gc -> device_latency_us / COMMIT_QUEUE_DEPTH;
+    unsigned long long batch;
+    if (gc -> latency_target_us) {
+        double wait = gc -> latency_target_us - gc -> device_latency_us;
+        gc -> linger_us = wait > 0 ? wait : 0;
+        // No point waiting for more than arrives within the linger, we'd flush on time first.
+        double fills_in_time = gc -> arrival_rate * gc -> linger_us;
+        batch = keeps_up < fills_in_time ? keeps_up : fills_in_time;
+    } else {
+        double needed = (double) gc -> throughput_target * gc -> device_latency_us / 1e6 / COMMIT_QUEUE_DEPTH;
+        batch = keeps_up > needed ? keeps_up : needed;
+        batch = clamp(batch, db -> sector_size, max_batch(db));
+        gc -> linger_us = gc -> arrival_rate > 0 ? clamp(batch / gc -> arrival_rate, 0, COMMIT_MAX_LINGER_US) : COMMIT_MAX_LINGER_US;
+    }
+    batch = clamp(batch, db -> sector_size, max_batch(db));
+    gc -> batch_bytes = batch - batch % db -> sector_size;
+}
+
+void commit_init(struct db_state *db, const struct db_options *opts) {
+    struct group_commit *gc = &db -> commit;
+    memset(gc, 0, sizeof(struct group_commit));
+    gc -> latency_target_us = opts -> commit_latency_target_us;
+    gc -> throughput_target = opts -> commit_throughput_target;
+    if (gc -> latency_target_us == 0 && gc -> throughput_target == 0) {
+        gc -> latency_target_us = COMMIT_DEFAULT_LATENCY_TARGET_US;
+    }
+    gc -> sampled_at = commit_now_us();
+    recompute_policy(db);
+}
+
+void commit_enqueued(struct db_state *db, unsigned long long bytes) {
+    db -> commit.queued_bytes += bytes;
+    db -> commit.queued_writes++;
+    db -> commit.arrived_bytes += bytes;
+}
+
+void commit_dequeued(struct db_state *db, unsigned long long bytes) {
+    db -> commit.queued_bytes -= bytes;
+    db -> commit.queued_writes--;
+}
+
+void commit_flushing(struct db_state *db, unsigned long long bytes, unsigned long long oldest_us) {
+    unsigned long long now = commit_now_us();
+    db -> commit.batch_histogram[log2_bucket(bytes)]++;
+    db -> commit.linger_histogram[log2_bucket(now > oldest_us ? now - oldest_us : 0)]++;
+}
+
+void commit_flush_done(struct db_state *db, unsigned long long submitted_us) {
+    struct group_commit *gc = &db -> commit;
+    double latency = commit_now_us() - submitted_us;
+    gc -> device_latency_us = gc -> device_latency_us ? gc -> device_latency_us * 0.875 + latency * 0.125 : latency;
+}
+
+bool commit_should_flush(struct db_state *db) {
+    struct group_commit *gc = &db -> commit;
+    unsigned long long now = commit_now_us();
+    if (now - gc -> sampled_at >= COMMIT_SAMPLE_US) {
+        double rate = (double) gc -> arrived_bytes / (now - gc -> sampled_at);
+        gc -> arrival_rate = gc -> arrival_rate * 0.75 + rate * 0.25;
+        gc -> arrived_bytes = 0;
+        gc -> sampled_at = now;
+        recompute_policy(db);
+    }
+
+    if (gc -> queued_writes == 0 || db -> writes_in_flight > COMMIT_MAX_FLUSHES_IN_FLIGHT) {
+        return false;
+    }
+    if (gc -> queued_bytes >= gc -> batch_bytes) {
+        return true;
+    }
+    struct write_cb_state *oldest = TAILQ_FIRST(&db -> write_callback_queue);
+    return now - oldest -> clock_time_enqueued >= gc -> linger_us;
+}
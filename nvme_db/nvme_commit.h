@@ -0,0 +1,77 @@
+//
+//  nvme_commit.h
+//
+//
+//  Group commit: when to flush the queued user writes. Flushing every write as it comes wastes a device write
+//  (and most of a sector) per record, waiting too long adds latency, and what's right depends on how fast
+//  writes are arriving and how long the device takes, so both are measured and the policy is recomputed from
+//  them every millisecond or so.
+//
+//  Batches are sized so that no more than COMMIT_QUEUE_DEPTH flushes are in flight at the observed arrival
+//  rate and device latency: a sector when it's quiet, growing under load so the device isn't swamped with tiny
+//  writes. With a latency target T, the oldest write never waits more than T minus the device's latency, and
+//  a batch is never bigger than what arrives in that time. With a throughput target X instead, batches are at
+//  least big enough for COMMIT_QUEUE_DEPTH flushes in flight to move X bytes/s, and writes wait as long as it
+//  takes that much to arrive, up to COMMIT_MAX_LINGER_US.
+//
+//  Batches are at least a sector and at most max_transfer_size (or COMMIT_MAX_BATCH_BYTES). The running
+//  totals of the queue replace walking it on every write.
+//
+
+#ifndef nvme_commit_h
+#define nvme_commit_h
+
+#include <stdbool.h>
+// db_interface.h has to be included first, for DB_HISTOGRAM_BUCKETS.
+
+#define COMMIT_DEFAULT_LATENCY_TARGET_US 1000
+#define COMMIT_MAX_LINGER_US 10000
+#define COMMIT_MAX_BATCH_BYTES (1ULL<<20)
+#define COMMIT_QUEUE_DEPTH 8 // flushes in flight the throughput target is planned around
+#define COMMIT_MAX_FLUSHES_IN_FLIGHT 200 // past this, writes wait however long it takes
+#define COMMIT_SAMPLE_US 1000 // how often the arrival rate is sampled and the policy recomputed
+
+struct group_commit {
+    // db -> write_callback_queue, in bytes of records and in writes
+    unsigned long long queued_bytes;
+    unsigned long long queued_writes;
+
+    unsigned long long latency_target_us; // 0 if there's a throughput target instead
+    unsigned long long throughput_target; // bytes/s
+
+    // What's been measured
+    double arrival_rate; // bytes/us, moving average
+    double device_latency_us; // of flushes, moving average
+    unsigned long long arrived_bytes; // since sampled_at
+    unsigned long long sampled_at;
+
+    // The policy: flush once batch_bytes are queued or the oldest write has waited linger_us
+    unsigned long long batch_bytes;
+    unsigned long long linger_us;
+
+    unsigned long long batch_histogram[DB_HISTOGRAM_BUCKETS]; // flushes by floor(log2(bytes of records))
+    unsigned long long linger_histogram[DB_HISTOGRAM_BUCKETS]; // flushes by floor(log2(us the oldest write waited))
+};
+
+struct db_state;
+struct db_options;
+
+void commit_init(struct db_state *db, const struct db_options *opts);
+
+unsigned long long commit_now_us(void);
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+
+// A user write of `bytes` was added to or taken off the queue.
+void commit_enqueued(struct db_state *db, unsigned long long bytes);
+void commit_dequeued(struct db_state *db, unsigned long long bytes);
+
+// A flush of `bytes` of user records is going out, the oldest of which was enqueued at oldest_us.
+void commit_flushing(struct db_state *db, unsigned long long bytes, unsigned long long oldest_us);
+// A flush submitted at submitted_us has completed.
+void commit_flush_done(struct db_state *db, unsigned long long submitted_us);
+
+// Whether poll_db (or a write) should flush the user queue now.
+bool commit_should_flush(struct db_state *db);
+
+#endif /* nvme_commit_h */
@@ -0,0 +1,560 @@
+//
+//  nvme_compact.c
+//
+//
+
+#include "nvme_compact.h"
+#include "nvme_key.h"
+#include "nvme_hash.h"
+#include "nvme_log_scan.h"
+#include "nvme_write_key_async.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define GC_RESERVE_REGIONS 2 // free regions only the compactor can use
+#define GC_CHUNK_SIZE (256*1024) // bytes of the victim read at a time
+#define GC_YIELD_READS 16 // don't issue compaction reads while more user reads than this are in flight
+
+// One read of part of the victim. Relocated records point straight into buf, so it's only freed once all of
+// them have been written out.
+struct gc_chunk {
+    struct db_state *db;
+    void *buf; // from db -> dma_pool
+    unsigned long long buf_size;
+    int refs;
+};
+
+int regions_init(struct db_state *db) {
+    db -> region_sectors = REGION_SIZE / db -> sector_size;
+    while (db -> region_sectors > 1 && db -> num_sectors / db -> region_sectors < MIN_REGIONS) {
+        db -> region_sectors /= 2;
+    }
+    db -> num_regions = db -> num_sectors / db -> region_sectors;
+    db -> num_regions -= checkpoint_reserve(db); // the last few regions hold index checkpoints
+    if (db -> num_regions < GC_RESERVE_REGIONS + 2) {
+        printf("Device is too small: %llu sectors\n", db -> num_sectors);
+        return -1;
+    }
+
+    db -> regions = calloc(db -> num_regions, sizeof(struct region));
+    db -> free_regions = malloc(db -> num_regions * sizeof(unsigned int));
+    // Stack, so push in reverse and region 0 gets used first.
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        db -> free_regions[i] = db -> num_regions - 1 - i;
+    }
+    db -> num_free_regions = db -> num_regions;
+    db -> seal_clock = 0;
+    db -> next_seq = 1;
+    db -> next_epoch = 1; // so a zeroed header never matches
+
+    for (int i = 0; i < NUM_HEADS; i++) {
+        db -> heads[i].region = -1;
+        db -> heads[i].current_sector_ssd = 0;
+        db -> heads[i].current_sector_bytes = 0;
+        db -> heads[i].current_sector_data = calloc(1, db -> sector_size);
+        db -> heads[i].tail_writer = NULL;
+    }
+
+    memset(&db -> compaction, 0, sizeof(struct compaction));
+    db -> compaction.victim = -1;
+    return 0;
+}
+
+void regions_free(struct db_state *db) {
+    for (int i = 0; i < NUM_HEADS; i++) {
+        free(db -> heads[i].current_sector_data);
+    }
+    free(db -> compaction.gone);
+    free(db -> regions);
+    free(db -> free_regions);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+bool open_region(struct db_state *db, int head_idx) {
+    struct log_head *head = &db -> heads[head_idx];
+    unsigned long long reserve = head_idx == HEAD_GC ? 0 : GC_RESERVE_REGIONS;
+    if (db -> num_free_regions <= reserve) {
+        return false;
+    }
+
+    if (head -> region >= 0) {
+        db -> regions[head -> region].state = REGION_SEALED;
+        db -> regions[head -> region].sealed_at = ++db -> seal_clock;
+    }
+
+    unsigned int region = db -> free_regions[--db -> num_free_regions];
+    db -> regions[region].state = REGION_OPEN;
+    db -> regions[region].epoch = db -> next_epoch++;
+    db -> regions[region].sealed_at = db -> seal_clock; // see stale_gc_region
+    head -> region = region;
+    head -> current_sector_ssd = region * db -> region_sectors;
+    head -> current_sector_bytes = 0;
+    head -> tail_writer = NULL;
+#ifdef DEBUG
+    printf("Head %d now writing to region %u, %llu free\n", head_idx, region, db -> num_free_regions);
+#endif
+    return true;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+long long open_run(struct db_state *db, unsigned long long count, bool *short_of_space) {
+    *short_of_space = db -> num_free_regions < count + GC_RESERVE_REGIONS;
+    if (*short_of_space) {
+        return -1;
+    }
+    unsigned long long first = 0;
+    unsigned long long found = 0;
+    for (unsigned long long i = 0; i < db -> num_regions && found < count; i++) {
+        if (db -> regions[i].state == REGION_FREE) {
+            found++;
+        } else {
+            first = i + 1;
+            found = 0;
+        }
+    }
+    if (found < count) {
+        return -1;
+    }
+
+    // Off the free stack, which otherwise keeps its order.
+    unsigned long long kept = 0;
+    for (unsigned long long i = 0; i < db -> num_free_regions; i++) {
+        if (db -> free_regions[i] < first || db -> free_regions[i] >= first + count) {
+            db -> free_regions[kept++] = db -> free_regions[i];
+        }
+    }
+    db -> num_free_regions = kept;
+
+    // Sealed from the start, since nothing else is ever appended to it.
+    db -> regions[first].state = REGION_SEALED;
+    db -> regions[first].epoch = db -> next_epoch++;
+    db -> regions[first].sealed_at = ++db -> seal_clock;
+    for (unsigned long long i = 1; i < count; i++) {
+        db -> regions[first + i].state = REGION_SPANNED;
+    }
+#ifdef DEBUG
+    printf("Regions %llu to %llu taken for one record, %llu free\n", first, first + count - 1, db -> num_free_regions);
+#endif
+    return first;
+}
+
+unsigned long long max_record_bytes(struct db_state *db) {
+    return (db -> num_regions - GC_RESERVE_REGIONS) * db -> region_sectors * db -> sector_size;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void record_written(struct db_state *db, unsigned long long loc, unsigned long long size) {
+    struct region *region = &db -> regions[region_of(db, loc)];
+    region -> record_bytes += size;
+    region -> live_bytes += size;
+    db -> live_bytes += size;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void record_died(struct db_state *db, unsigned long long loc, unsigned long long size) {
+    struct region *region = &db -> regions[region_of(db, loc)];
+    region -> live_bytes -= size;
+    db -> live_bytes -= size;
+    db -> dead_bytes += size;
+    value_cache_invalidate(&db -> value_cache, loc);
+    if (db -> log_scans) {
+        log_scan_record_died(db, loc);
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Takes a tombstone that has no record left out of the index (and the ordered index), so the key costs nothing
+// but its slot in db -> keys, which isn't reused. A later write of the key gets a new slot.
+static void drop_tombstone(struct db_state *db, long long key_idx) {
+    struct ram_stored_key *key = key_at(db, key_idx);
+    index_write_begin(db);
+    index_remove(&db -> index, stored_key_hash(db, key), key_idx);
+    key -> flags = DATA_FLAG_DELETED | DATA_FLAG_INCOMPLETE | DATA_FLAG_DROPPED;
+    index_write_end(db);
+    ordered_remove(&db -> ordered, key_idx);
+    db -> tombstones_dropped++;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void tombstone_check(struct db_state *db, long long key_idx) {
+    struct ram_stored_key *key = key_at(db, key_idx);
+    if ((key -> flags & (DATA_FLAG_DELETED | DATA_FLAG_DROPPED)) != DATA_FLAG_DELETED || key -> older_records) {
+        return;
+    }
+    if (!(key -> flags & DATA_FLAG_INCOMPLETE)) {
+        // Nothing left for it to hide, so it's dead space. But it's still on the device, where it's now the one
+        // older record, till its region's freed.
+        record_died(db, key -> data_loc, sizeof(struct ssd_header) + key -> key_length);
+        index_write_begin(db);
+        key -> flags |= DATA_FLAG_INCOMPLETE;
+        key -> data_loc = -1;
+        key -> older_records = 1;
+        index_write_end(db);
+        return;
+    }
+    if (!write_on_its_way(db, key_idx)) { // else it's left be, a tombstone with no record, like a new key's slot
+        drop_tombstone(db, key_idx);
+    }
+}
+
+// Whether region is the GC head's, and has been open while a good part of the device was filled and sealed. The
+// GC head only moves on once relocations fill its region, which can take a long time, and till its region's freed
+// the tombstones that died in it can't be dropped (see tombstone_check), so such a region is compacted too.
+static bool stale_gc_region(struct db_state *db, struct region *region) {
+    long long head_region = db -> heads[HEAD_GC].region;
+    unsigned long long stale_after = db -> num_regions/4 ? db -> num_regions/4 : 1;
+    return head_region >= 0 && region == &db -> regions[head_region] && region -> state == REGION_OPEN &&
+        region -> record_bytes != region -> live_bytes && db -> seal_clock - region -> sealed_at >= stale_after;
+}
+
+// Relocating a region this full frees up almost nothing, so it's not worth the writes. A run's record is bigger
+// than a region, so a run only qualifies once that's dead.
+static bool worth_compacting(struct db_state *db, struct region *region) {
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    bool candidate = region -> state == REGION_SEALED || stale_gc_region(db, region);
+    return candidate && region -> live_bytes < region_bytes - region_bytes/16;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static long long pick_victim(struct db_state *db) {
+    double region_bytes = db -> region_sectors * db -> sector_size;
+    long long best = -1;
+    double best_score = 0;
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        struct region *region = &db -> regions[i];
+        // Regions that still have flushes in flight aren't fully on disk yet.
+        if (!worth_compacting(db, region) || region -> writers || region -> scanners) {
+            continue;
+        }
+        double u = region -> live_bytes / region_bytes;
+        double age = db -> seal_clock - region -> sealed_at + 1;
+        double score = (1 - u) * age / (1 + u);
+        if (score > best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+bool compaction_possible(struct db_state *db) {
+    if (db -> compaction.victim >= 0) {
+        return true;
+    }
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        if (worth_compacting(db, &db -> regions[i])) {
+            return true;
+        }
+    }
+    return db -> compaction.erases_in_flight > 0;
+}
+
+static void release_chunk(struct gc_chunk *chunk) {
+    if (--chunk -> refs == 0) {
+        dma_pool_put(&chunk -> db -> dma_pool, chunk -> buf, chunk -> buf_size);
+        free(chunk);
+    }
+}
+
+static void relocation_cb(void *cb_arg, enum write_err err) {
+    struct gc_chunk *chunk = cb_arg;
+    chunk -> db -> compaction.relocations_in_flight--;
+    if (err != WRITE_SUCCESSFUL) {
+        printf("Failed to relocate record: %d\n", err);
+    }
+    release_chunk(chunk);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static void gone_push(struct compaction *gc, long long key_idx) {
+    if (gc -> num_gone == gc -> gone_capacity) {
+        gc -> gone_capacity = gc -> gone_capacity ? gc -> gone_capacity * 2 : 1024;
+        gc -> gone = realloc(gc -> gone, gc -> gone_capacity * sizeof(long long));
+    }
+    gc -> gone[gc -> num_gone++] = key_idx;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static void relocate_if_live(struct db_state *db, struct gc_chunk *chunk, unsigned long long loc, void *record, struct ssd_header header) {
+    db_data key = {.length=header.key_length, .data=record + sizeof(struct ssd_header)};
+    long long key_idx = search_for_key(db, key, hash_bytes(key.data, key.length), false);
+    if (key_idx < 0) { // can't be: a key's only dropped once none of its records are left
+        return;
+    }
+    gone_push(&db -> compaction, key_idx); // once the victim's freed, whatever happens to it here
+    struct ram_stored_key *stored = key_at(db, key_idx);
+    if (stored -> data_loc != (long long) loc) {
+        return; // overwritten or deleted since, so there's nothing to keep.
+    }
+    if ((stored -> flags & DATA_FLAG_DELETED) && stored -> older_records == 0) {
+        tombstone_check(db, key_idx); // not worth keeping, see the top of nvme_compact.h
+        return;
+    }
+
+    struct write_cb_state *relocation = slab_alloc(&write_state_cache); // FREED BY THE WRITE CALLBACK
+    relocation -> db = db;
+    relocation -> callback = relocation_cb;
+    relocation -> cb_arg = chunk;
+    relocation -> key = key;
+    relocation -> value = (db_data){.length=header.data_length, .data=key.data + key.length};
+    relocation -> flags = header.flags;
+    relocation -> crc = header.crc; // copied as is, not checked: a bad record stays bad, and reads still see that
+    relocation -> value_dma = true; // the chunk is DMA memory, and it's kept until relocation_cb
+    relocation -> fill = NULL;
+    relocation -> seq = header.seq;
+    relocation -> key_index = key_idx;
+    relocation -> clock_time_enqueued = 0;
+    relocation -> relocated_from = loc;
+
+    chunk -> refs++;
+    db -> compaction.relocations_in_flight++;
+    TAILQ_INSERT_TAIL(&db -> gc_write_queue, relocation, link);
+}
+
+static void gc_read_cb(void *cb_arg, int status) {
+    struct gc_chunk *chunk = cb_arg;
+    struct db_state *db = chunk -> db;
+    struct compaction *gc = &db -> compaction;
+    struct region *victim = &db -> regions[gc -> victim];
+    // Lock is acquired by the caller of device_process_completions.
+    gc -> read_in_flight = false;
+
+    unsigned long long region_start = gc -> victim * db -> region_sectors * db -> sector_size;
+    unsigned long long chunk_start = gc -> next_offset - gc -> next_offset % db -> sector_size; // within the region
+    unsigned long long region_end = victim -> sectors_written * db -> sector_size;
+    unsigned long long end = chunk_start + gc -> chunk_length;
+    unsigned long long pos = gc -> next_offset;
+
+    if (status != 0) {
+        // Leave the region alone, its live records stay readable where they are.
+        printf("Compaction read of region %lld failed, giving up on it\n", gc -> victim);
+        pos = region_end;
+    }
+
+    // Records are packed back to back, and a flush pads out its last sector with zeroes, which can't be a
+    // header since keys are at least 1 byte. Headers never straddle sectors (see flush_region_writes), so a
+    // zero key_length or a sector too close to full for a header means skip to the next sector. Filler records
+    // (DATA_FLAG_PADDING) are skipped like any other, by their length.
+    gc -> need_bytes = 0;
+    while (pos < end) {
+        unsigned long long sector_left = db -> sector_size - pos % db -> sector_size;
+        void *record = chunk -> buf + (pos - chunk_start);
+        struct ssd_header header;
+        if (sector_left < sizeof(header)) {
+            pos += sector_left;
+            continue;
+        }
+        memcpy(&header, record, sizeof(header));
+        if (header.key_length == 0 && header.flags == DATA_FLAG_PADDING) {
+            pos += sizeof(header) + header.data_length;
+            continue;
+        }
+        if (header.key_length == 0) {
+            pos += sector_left;
+            continue;
+        }
+
+        unsigned long long size = sizeof(header) + header.key_length + header.data_length;
+        if (pos + size > region_end) {
+            printf("Corrupt record header at %llu in region %lld, giving up on it\n", pos, gc -> victim);
+            pos = region_end;
+            break;
+        }
+        if (pos + size > end) { // continues in the next chunk
+            gc -> need_bytes = size;
+            break;
+        }
+        relocate_if_live(db, chunk, region_start + pos, record, header);
+        pos += size;
+    }
+    gc -> next_offset = pos;
+
+    release_chunk(chunk);
+    if (!TAILQ_EMPTY(&db -> gc_write_queue)) {
+        flush_writes(db, HEAD_GC);
+    }
+
+    // Normally the next chunk waits for the next poll_db, but if writes are stuck waiting on us keep going.
+    if (gc -> writes_blocked) {
+        compact_step(db);
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static void issue_chunk_read(struct db_state *db) {
+    struct compaction *gc = &db -> compaction;
+    struct region *victim = &db -> regions[gc -> victim];
+
+    unsigned long long chunk_size = GC_CHUNK_SIZE;
+    if (db -> max_transfer_size >= db -> sector_size && db -> max_transfer_size < chunk_size) {
+        chunk_size = db -> max_transfer_size;
+    }
+    unsigned long long first_sector = gc -> next_offset / db -> sector_size;
+    unsigned long long within_sector = gc -> next_offset % db -> sector_size;
+    if (within_sector + gc -> need_bytes > chunk_size) { // a record bigger than a chunk
+        chunk_size = within_sector + gc -> need_bytes;
+    }
+    unsigned long long num_sectors = (chunk_size + db -> sector_size - 1) / db -> sector_size;
+    if (first_sector + num_sectors > victim -> sectors_written) {
+        num_sectors = victim -> sectors_written - first_sector;
+    }
+
+    struct gc_chunk *chunk = malloc(sizeof(struct gc_chunk));
+    chunk -> db = db;
+    chunk -> refs = 1;
+    chunk -> buf_size = num_sectors * db -> sector_size;
+    chunk -> buf = dma_pool_get(&db -> dma_pool, chunk -> buf_size);
+    gc -> chunk_length = num_sectors * db -> sector_size;
+    gc -> read_in_flight = true;
+    device_read(
+        db -> queue,
+        chunk -> buf,
+        gc -> victim * db -> region_sectors + first_sector,
+        num_sectors,
+        gc_read_cb,
+        chunk
+    );
+}
+
+// A freed region (and the rest of its run), till its first sector's been zeroed.
+struct region_erase {
+    struct db_state *db;
+    long long region;
+    unsigned long long span;
+    void *sector; // zeroes, from db -> dma_pool
+    long long *gone; // see compaction.gone
+    unsigned long long num_gone;
+};
+
+static void erase_cb(void *cb_arg, int status) {
+    struct region_erase *erase = cb_arg;
+    struct db_state *db = erase -> db;
+    // Lock is acquired by the caller of device_process_completions.
+    // Pushed in reverse, so the first region is on top of the stack.
+    for (unsigned long long i = erase -> region + erase -> span; i-- > (unsigned long long) erase -> region;) {
+        db -> regions[i].state = REGION_FREE;
+        db -> free_regions[db -> num_free_regions++] = i;
+    }
+    if (status == 0) {
+        for (unsigned long long i = 0; i < erase -> num_gone; i++) {
+            struct ram_stored_key *key = key_at(db, erase -> gone[i]);
+            if (!(key -> flags & DATA_FLAG_DROPPED)) {
+                older_record_gone(key);
+                tombstone_check(db, erase -> gone[i]);
+            }
+        }
+    } else { // its records could still turn up in a scan, so the keys' tombstones stay
+        printf("Couldn't erase region %lld, its keys keep their tombstones\n", erase -> region);
+    }
+    db -> compaction.erases_in_flight--;
+#ifdef DEBUG
+    printf("Reclaimed region %lld, %llu free\n", erase -> region, db -> num_free_regions);
+#endif
+    dma_pool_put(&db -> dma_pool, erase -> sector, db -> sector_size);
+    free(erase -> gone);
+    free(erase);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Along with the rest of its run, if it starts one. It's handed out again once its first sector's been zeroed.
+static void free_region(struct db_state *db, long long idx) {
+    struct region *region = &db -> regions[idx];
+    struct compaction *gc = &db -> compaction;
+    unsigned long long span = region_span(db, region);
+    if (span > 1 && region -> run_key >= 0) { // never parsed, so its one record's key is kept here
+        gone_push(gc, region -> run_key);
+    }
+    db -> dead_bytes -= region -> record_bytes;
+    for (unsigned long long i = idx; i < idx + span; i++) {
+        memset(&db -> regions[i], 0, sizeof(struct region));
+        db -> regions[i].state = REGION_ERASING;
+    }
+
+    struct region_erase *erase = malloc(sizeof(struct region_erase));
+    erase -> db = db;
+    erase -> region = idx;
+    erase -> span = span;
+    erase -> gone = gc -> gone;
+    erase -> num_gone = gc -> num_gone;
+    gc -> gone = NULL;
+    gc -> num_gone = 0;
+    gc -> gone_capacity = 0;
+    erase -> sector = dma_pool_get(&db -> dma_pool, db -> sector_size);
+    memset(erase -> sector, 0, db -> sector_size);
+    gc -> erases_in_flight++;
+    gc -> regions_compacted++;
+    db -> device_bytes_written += db -> sector_size;
+    device_write(db -> queue, erase -> sector, idx * db -> region_sectors, 1, erase_cb, erase);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void compact_step(struct db_state *db) {
+    struct compaction *gc = &db -> compaction;
+    unsigned long long start_below = db -> num_regions/8;
+    if (start_below < GC_RESERVE_REGIONS + 2) {
+        start_below = GC_RESERVE_REGIONS + 2;
+    }
+
+    if (gc -> victim < 0) {
+        if (db -> num_free_regions >= start_below && !gc -> writes_blocked) {
+            return;
+        }
+        gc -> victim = pick_victim(db);
+        if (gc -> victim < 0) {
+            return;
+        }
+        if (gc -> victim == db -> heads[HEAD_GC].region) { // a stale one, so it's sealed here instead
+            struct log_head *head = &db -> heads[HEAD_GC];
+            head -> region = -1;
+            head -> current_sector_bytes = 0;
+            head -> tail_writer = NULL; // it has no writers, so there's no flush of it in flight
+        }
+        db -> regions[gc -> victim].state = REGION_COMPACTING;
+        gc -> next_offset = 0;
+        gc -> need_bytes = 0;
+        if (region_span(db, &db -> regions[gc -> victim]) > 1) {
+            // A run's only ever worth compacting once its record's dead (see worth_compacting), so there's
+            // nothing to read.
+            gc -> next_offset = db -> regions[gc -> victim].sectors_written * db -> sector_size;
+        }
+#ifdef DEBUG
+        printf("Compacting region %lld, %llu of %llu bytes live\n", gc -> victim, db -> regions[gc -> victim].live_bytes, db -> regions[gc -> victim].record_bytes);
+#endif
+    }
+    struct region *victim = &db -> regions[gc -> victim];
+
+    if (gc -> read_in_flight) {
+        return;
+    }
+    if (gc -> next_offset < victim -> sectors_written * db -> sector_size) {
+        // User reads come first, unless writes are stuck waiting on us.
+        bool urgent = gc -> writes_blocked || db -> num_free_regions <= GC_RESERVE_REGIONS;
+        if (!urgent && db -> reads_in_flight > GC_YIELD_READS) {
+            return;
+        }
+        issue_chunk_read(db);
+        return;
+    }
+
+    if (gc -> relocations_in_flight) {
+        if (!TAILQ_EMPTY(&db -> gc_write_queue)) { // the GC head was out of space last time
+            flush_writes(db, HEAD_GC);
+        }
+        return;
+    }
+
+    if (victim -> live_bytes != 0) { // a read or relocation failed
+        printf("Region %lld still has %llu live bytes after compaction\n", gc -> victim, victim -> live_bytes);
+        victim -> state = REGION_SEALED;
+        gc -> victim = -1;
+        gc -> num_gone = 0; // its records are all still there
+        return;
+    }
+    if (victim -> readers || victim -> scanners) { // someone is still reading a record that has since moved
+        return;
+    }
+    free_region(db, gc -> victim);
+    gc -> victim = -1;
+}
@@ -0,0 +1,124 @@
+//
+//  nvme_compact.h
+//
+//
+//  Space reclamation. The device is split into fixed-size regions, and records are only ever appended to a
+//  region through a log head. Every region keeps track of how many of its record bytes are still live
+//  (pointed at by some key), and when free regions run low the compactor picks a region with little live
+//  data, reads it back, rewrites the live records through the GC head and then hands the region back out.
+//
+//  There are two heads, one for user writes and one for relocations, so records that have already survived
+//  a compaction (and so are probably cold) are packed together instead of being mixed back in with fresh
+//  ones that will likely be overwritten soon. Victims are picked by cost-benefit, (1-u)*age/(1+u), so a cold
+//  region is compacted at a higher utilization than a hot one that's still dying off by itself.
+//
+//  Compaction runs inside poll_db, one chunk at a time with at most one read of its own outstanding, and it
+//  backs off while many user reads are in flight, so it doesn't show up in read tail latency.
+//
+//  A record bigger than a region gets a run of free regions in a row to itself (see open_run), starting at the
+//  beginning of the first. The run is accounted for as one region, the first, and is never compacted: it's
+//  freed whole once its record is dead.
+//
+//  A freed region has its first sector zeroed before it's handed out again, so a scan of the device can't find
+//  anything that was in it (see nvme_recover.h). Only once that's on the device are its records really gone, and
+//  the keys they were older records of told so (see ram_stored_key.older_records). A tombstone is only there to
+//  hide its key's older records from such a scan, so once a key has none it's dropped: its tombstone becomes dead
+//  space like any other record, and once that's gone too, the key comes out of the index (see drop_tombstone).
+//
+
+#ifndef nvme_compact_h
+#define nvme_compact_h
+
+#include <stdbool.h>
+
+#define REGION_SIZE (4ULL<<20) // bytes, shrunk on small devices so there are at least MIN_REGIONS.
+#define MIN_REGIONS 16
+
+#define REGION_FREE 0
+#define REGION_OPEN 1 // a log head is appending to it
+#define REGION_SEALED 2
+#define REGION_COMPACTING 3
+#define REGION_SPANNED 4 // part of a run, but not its first region, which has all the run's accounting
+#define REGION_ERASING 5 // freed, and its first sector's being zeroed, see free_region
+
+#define HEAD_USER 0
+#define HEAD_GC 1
+#define NUM_HEADS 2
+
+struct region {
+    unsigned long long record_bytes; // header + key + value of every record written here
+    unsigned long long live_bytes; // the part of record_bytes some key still points at
+    unsigned long long sectors_written; // records are only ever in the first sectors_written sectors (of its run)
+    unsigned long long sealed_at; // db -> seal_clock when it filled up, or while it's open, when it was opened
+    unsigned int epoch; // db -> next_epoch when it was last opened. Written into every record header.
+    int readers; // user reads in flight against it. It can't be reused until they're done.
+    int writers; // flushes in flight into it. It can't be compacted until they're done.
+    int scanners; // scan_all_async scans that are going to read it but haven't yet. It's left alone till then.
+    long long run_key; // the first region of a run: the key idx of its record, or -1 if that isn't known
+    char state;
+};
+
+struct flush_writes_state;
+
+// Where a stream of records is being appended.
+struct log_head {
+    long long region; // -1 if it doesn't have one yet
+    unsigned long long current_sector_ssd; // which sector will the next record go to.
+    void *current_sector_data; // sector_size bytes capacity, current_sector_bytes length.
+    // We write at sector_size granularity, but often receive smaller inputs (e.g. 50 bytes) so we write to the
+    // same sector multiple times. This stores the data we've already written to that sector.
+    unsigned short current_sector_bytes; // How many bytes are we into the current sector?
+    struct flush_writes_state *tail_writer; // the flush writing current_sector_ssd, till the device is done with it
+};
+
+struct compaction {
+    long long victim; // region being compacted, -1 if none
+    unsigned long long next_offset; // within the victim, where the next record header starts
+    unsigned long long need_bytes; // size of the record at next_offset, if it didn't fit in the last chunk
+    unsigned long long chunk_length; // bytes being read
+    bool read_in_flight;
+    int relocations_in_flight; // relocated records whose writes haven't been applied yet
+    bool writes_blocked; // user writes are waiting for a free region, so don't hold back.
+    // The key idxs of the victim's records so far, live or dead: each is an older record of its key once the victim's
+    // freed, if it isn't already. See free_region.
+    long long *gone;
+    unsigned long long num_gone;
+    unsigned long long gone_capacity;
+    int erases_in_flight;
+    unsigned long long regions_compacted;
+};
+
+struct db_state;
+
+int regions_init(struct db_state *db);
+void regions_free(struct db_state *db);
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+
+// Seal the head's current region (if any) and give it a free one. The user head can't take the last few free
+// regions, since the compactor needs somewhere to relocate to. Returns false if there's nothing to give.
+bool open_region(struct db_state *db, int head);
+
+// Takes count free regions in a row for a record bigger than a region, and returns the first. -1 if there aren't
+// count in a row, not counting the ones kept for the compactor: then *short_of_space says if that's because there
+// aren't count free at all, which compaction can fix, rather than because the free ones are scattered.
+long long open_run(struct db_state *db, unsigned long long count, bool *short_of_space);
+
+// How big a record can be, the header included: all of the regions the user head can have.
+unsigned long long max_record_bytes(struct db_state *db);
+
+// Space accounting for a record of `size` bytes at `loc`.
+void record_written(struct db_state *db, unsigned long long loc, unsigned long long size);
+void record_died(struct db_state *db, unsigned long long loc, unsigned long long size);
+
+// If the key's a tombstone with no older records, makes its record dead space, or if it has no record any more
+// drops it altogether (unless a write of the key is still on its way). See the top of this file.
+void tombstone_check(struct db_state *db, long long key_idx);
+
+// Whether compacting could still free up a region, i.e. whether writes waiting for space should keep waiting.
+bool compaction_possible(struct db_state *db);
+
+// Called from poll_db. Does a bounded amount of compaction work if it's needed.
+void compact_step(struct db_state *db);
+
+#endif /* nvme_compact_h */
@@ -0,0 +1,204 @@
+//
+//  nvme_compress.c
+//
+//
+
+#include "nvme_key.h" // which has nvme_compress.h
+
+#include <lz4.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zdict.h>
+#include <zstd.h>
+
+// Each thread's, made the first time it needs them.
+struct compress_contexts {
+    ZSTD_CCtx *zstd_compress;
+    ZSTD_DCtx *zstd_decompress;
+    LZ4_stream_t *lz4_stream;
+};
+
+static __thread struct compress_contexts contexts;
+static __thread bool contexts_registered; // for contexts_key's destructor
+static pthread_key_t contexts_key;
+static pthread_once_t contexts_key_once = PTHREAD_ONCE_INIT;
+
+static void contexts_release(void *unused) {
+    ZSTD_freeCCtx(contexts.zstd_compress);
+    ZSTD_freeDCtx(contexts.zstd_decompress);
+    free(contexts.lz4_stream);
+    memset(&contexts, 0, sizeof(contexts));
+}
+
+static void contexts_key_create(void) {
+    pthread_key_create(&contexts_key, contexts_release);
+}
+
+static struct compress_contexts *thread_contexts(void) {
+    if (!contexts_registered) {
+        pthread_once(&contexts_key_once, contexts_key_create);
+        contexts_registered = true;
+        pthread_setspecific(contexts_key, &contexts); // any non-NULL value gets the destructor called
+    }
+    return &contexts;
+}
+
+int compressor_init(struct compressor *compressor, const struct db_options *opts) {
+    compressor -> codec = opts -> compression;
+    compressor -> level = opts -> compression_level;
+    if (compressor -> level == 0) {
+        compressor -> level = compressor -> codec == DB_COMPRESSION_ZSTD ? ZSTD_CLEVEL_DEFAULT : 1;
+    }
+    compressor -> min_bytes = opts -> compression_min_bytes ? opts -> compression_min_bytes : COMPRESS_MIN_BYTES_DEFAULT;
+    compressor -> min_saving = opts -> compression_min_saving ? opts -> compression_min_saving : COMPRESS_MIN_SAVING_DEFAULT;
+    compressor -> dict = NULL;
+    compressor -> dict_length = 0;
+    compressor -> zstd_cdict = NULL;
+    compressor -> zstd_ddict = NULL;
+    compressor -> lz4_dict = NULL;
+    compressor -> values_compressed = 0;
+    compressor -> bytes_in = 0;
+    compressor -> bytes_out = 0;
+    if (opts -> compression_dict == NULL || opts -> compression_dict_length == 0) {
+        return 0;
+    }
+
+    // Both codecs' digested forms, whichever we're writing with: reads have to handle values written either way.
+    compressor -> dict = malloc(opts -> compression_dict_length);
+    memcpy(compressor -> dict, opts -> compression_dict, opts -> compression_dict_length);
+    compressor -> dict_length = opts -> compression_dict_length;
+    compressor -> zstd_cdict = ZSTD_createCDict(compressor -> dict, compressor -> dict_length, compressor -> codec == DB_COMPRESSION_ZSTD ? compressor -> level : ZSTD_CLEVEL_DEFAULT);
+    compressor -> zstd_ddict = ZSTD_createDDict(compressor -> dict, compressor -> dict_length);
+    compressor -> lz4_dict = malloc(sizeof(LZ4_stream_t));
+    if (compressor -> zstd_cdict == NULL || compressor -> zstd_ddict == NULL || compressor -> lz4_dict == NULL) {
+        printf("Couldn't load the compression dictionary\n");
+        compressor_free(compressor);
+        return -1;
+    }
+    LZ4_initStream(compressor -> lz4_dict, sizeof(LZ4_stream_t));
+    LZ4_loadDict(compressor -> lz4_dict, compressor -> dict, compressor -> dict_length);
+    return 0;
+}
+
+void compressor_free(struct compressor *compressor) {
+    ZSTD_freeCDict(compressor -> zstd_cdict);
+    ZSTD_freeDDict(compressor -> zstd_ddict);
+    free(compressor -> lz4_dict);
+    free(compressor -> dict);
+    compressor -> zstd_cdict = NULL;
+    compressor -> zstd_ddict = NULL;
+    compressor -> lz4_dict = NULL;
+    compressor -> dict = NULL;
+}
+
+char compress_value(struct compressor *compressor, db_data value, db_data *stored) {
+    unsigned long long length = value.length;
+    if (compressor -> codec == DB_COMPRESSION_NONE || length < compressor -> min_bytes || length > COMPRESS_MAX_BYTES) {
+        return 0;
+    }
+    struct compress_contexts *ctx = thread_contexts();
+    // Anything that doesn't fit in this isn't worth storing compressed anyway.
+    unsigned long long capacity = length - length * compressor -> min_saving / 100;
+    if (capacity <= COMPRESS_HEADER) {
+        return 0;
+    }
+    char *buf = malloc(capacity); // FREED BY deliver_writes
+    char *dst = buf + COMPRESS_HEADER;
+    long long compressed = -1;
+    char flag = 0;
+    if (compressor -> codec == DB_COMPRESSION_ZSTD) {
+        if (ctx -> zstd_compress == NULL) {
+            ctx -> zstd_compress = ZSTD_createCCtx();
+        }
+        size_t n = compressor -> zstd_cdict ?
+            ZSTD_compress_usingCDict(ctx -> zstd_compress, dst, capacity - COMPRESS_HEADER, value.data, length, compressor -> zstd_cdict) :
+            ZSTD_compressCCtx(ctx -> zstd_compress, dst, capacity - COMPRESS_HEADER, value.data, length, compressor -> level);
+        compressed = ZSTD_isError(n) ? -1 : (long long) n; // too big for capacity is an error too
+        flag = DATA_FLAG_ZSTD;
+    } else {
+        int n;
+        if (compressor -> lz4_dict) { // a copy of the loaded stream, which is the cheap way to start from the dictionary
+            if (ctx -> lz4_stream == NULL) {
+                ctx -> lz4_stream = malloc(sizeof(LZ4_stream_t));
+            }
+            memcpy(ctx -> lz4_stream, compressor -> lz4_dict, sizeof(LZ4_stream_t));
+            n = LZ4_compress_fast_continue(ctx -> lz4_stream, value.data, dst, length, capacity - COMPRESS_HEADER, compressor -> level);
+        } else {
+            n = LZ4_compress_fast(value.data, dst, length, capacity - COMPRESS_HEADER, compressor -> level);
+        }
+        compressed = n > 0 ? n : -1;
+        flag = DATA_FLAG_LZ4;
+    }
+    if (compressed < 0) { // didn't fit, so not worth it
+        free(buf);
+        return 0;
+    }
+    unsigned int raw_length = length;
+    memcpy(buf, &raw_length, COMPRESS_HEADER);
+    stored -> data = buf;
+    stored -> length = COMPRESS_HEADER + compressed;
+    atomic_fetch_add_explicit(&compressor -> values_compressed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&compressor -> bytes_in, length, memory_order_relaxed);
+    atomic_fetch_add_explicit(&compressor -> bytes_out, stored -> length, memory_order_relaxed);
+    return flag;
+}
+
+unsigned long long decompressed_length(const void *stored, unsigned long long stored_length) {
+    if (stored_length <= COMPRESS_HEADER) {
+        return 0;
+    }
+    unsigned int raw_length;
+    memcpy(&raw_length, stored, COMPRESS_HEADER);
+    return raw_length <= COMPRESS_MAX_BYTES ? raw_length : 0; // so a corrupt one can't have us allocate 4GB
+}
+
+bool decompress_value(struct compressor *compressor, char flags, const void *stored, unsigned long long stored_length, void *dst) {
+    unsigned long long raw_length = decompressed_length(stored, stored_length);
+    if (raw_length == 0) {
+        return false;
+    }
+    const char *src = (const char *)stored + COMPRESS_HEADER;
+    unsigned long long src_length = stored_length - COMPRESS_HEADER;
+    struct compress_contexts *ctx = thread_contexts();
+    if (flags & DATA_FLAG_ZSTD) {
+        if (ctx -> zstd_decompress == NULL) {
+            ctx -> zstd_decompress = ZSTD_createDCtx();
+        }
+        size_t n = compressor -> zstd_ddict ?
+            ZSTD_decompress_usingDDict(ctx -> zstd_decompress, dst, raw_length, src, src_length, compressor -> zstd_ddict) :
+            ZSTD_decompressDCtx(ctx -> zstd_decompress, dst, raw_length, src, src_length);
+        return !ZSTD_isError(n) && n == raw_length;
+    }
+    int n = compressor -> dict ?
+        LZ4_decompress_safe_usingDict(src, dst, src_length, raw_length, compressor -> dict, compressor -> dict_length) :
+        LZ4_decompress_safe(src, dst, src_length, raw_length);
+    return n >= 0 && (unsigned long long) n == raw_length;
+}
+
+// PUBLIC API
+
+unsigned long long db_train_dictionary(const db_data *samples, unsigned int num_samples, void *dict, unsigned long long capacity) {
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < num_samples; i++) {
+        total += samples[i].length;
+    }
+    // ZDICT wants them end to end.
+    char *joined = malloc(total ? total : 1);
+    size_t *lengths = malloc((num_samples ? num_samples : 1) * sizeof(size_t));
+    unsigned long long at = 0;
+    for (unsigned int i = 0; i < num_samples; i++) {
+        memcpy(joined + at, samples[i].data, samples[i].length);
+        lengths[i] = samples[i].length;
+        at += samples[i].length;
+    }
+    size_t n = ZDICT_trainFromBuffer(dict, capacity, joined, lengths, num_samples);
+    free(lengths);
+    free(joined);
+    if (ZDICT_isError(n)) {
+        printf("Couldn't train a dictionary: %s\n", ZDICT_getErrorName(n));
+        return 0;
+    }
+    return n;
+}
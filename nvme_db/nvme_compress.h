@@ -0,0 +1,64 @@
+//
+//  nvme_compress.h
+//
+//
+//  Per-value compression (db_options.compression): zstd or lz4, optionally with a dictionary trained on samples
+//  of the app's values (db_train_dictionary), which is what makes small values compress at all.
+//
+//  Values are compressed on the thread that calls write_value_async, before the write goes on the write ring,
+//  so the poller only ever sees the compressed copy and has no more to do than for any other write. A value is
+//  stored as it is if it's shorter than min_bytes, or compressing it doesn't save min_saving percent. DMA and
+//  streamed writes are always stored as they are: the point of those is that the db doesn't copy them.
+//
+//  A compressed value is stored as its length, 4 bytes, then the compressed bytes, with DATA_FLAG_ZSTD or
+//  DATA_FLAG_LZ4 in its record's flags, and ram_stored_key.data_length is the stored length. Reads decompress
+//  it when they're delivered, on whichever thread runs the callback, without the lock, into a pool buffer of
+//  its own, or read_value_into_async's buffer. The value cache holds decompressed values.
+//
+//  zstd and lz4 contexts are kept per thread, and freed when the thread exits.
+//
+
+#ifndef nvme_compress_h
+#define nvme_compress_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+// db_interface.h has to be included first, for db_data and db_options.
+
+#define COMPRESS_MIN_BYTES_DEFAULT 128
+#define COMPRESS_MIN_SAVING_DEFAULT 12 // percent
+#define COMPRESS_MAX_BYTES (1ULL<<20) // bigger values are stored as they are, they'd hold up the writer too long
+#define COMPRESS_HEADER 4 // the raw length, in front of the compressed bytes
+
+struct compressor {
+    enum db_compression codec;
+    int level; // zstd's level, or lz4's acceleration
+    unsigned long long min_bytes;
+    unsigned int min_saving;
+
+    void *dict; // our own copy of db_options.compression_dict, or NULL
+    unsigned long long dict_length;
+    struct ZSTD_CDict_s *zstd_cdict; // dict, digested once rather than for every value
+    struct ZSTD_DDict_s *zstd_ddict;
+    union LZ4_stream_u *lz4_dict; // a stream with dict loaded, copied for every value compressed
+
+    _Atomic unsigned long long values_compressed;
+    _Atomic unsigned long long bytes_in; // of the values compressed
+    _Atomic unsigned long long bytes_out; // what they were stored as, COMPRESS_HEADER included
+};
+
+int compressor_init(struct compressor *compressor, const struct db_options *opts);
+void compressor_free(struct compressor *compressor);
+
+// Any thread. If value's worth compressing, *stored is a malloc'd compressed copy of it and the return is the
+// record flag saying how, otherwise 0 and *stored is untouched.
+char compress_value(struct compressor *compressor, db_data value, db_data *stored);
+
+// How long the value stored compressed as stored is, or 0 if it can't be one.
+unsigned long long decompressed_length(const void *stored, unsigned long long stored_length);
+
+// Any thread. Decompresses stored into dst, which is decompressed_length() long. flags is the record's. Returns
+// false if it doesn't decompress to exactly that, or the db was opened without the dictionary it needs.
+bool decompress_value(struct compressor *compressor, char flags, const void *stored, unsigned long long stored_length, void *dst);
+
+#endif /* nvme_compress_h */
@@ -0,0 +1,299 @@
+//
+//  nvme_crc.c
+//
+//
+
+#include "nvme_crc.h"
+
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78U // reflected
+#define CRC_LONG 8192 // bytes in each of the three streams, for big buffers...
+#define CRC_SHORT 256 // ...and for what's left after those
+#define FOLD_LONG 60 // pclmul: 64 byte steps folded alongside three 24 byte steps of crc32, in big blocks...
+#define FOLD_SHORT 6 // ...and small ones
+
+static unsigned int crc_table[8][256]; // crc_table[k][b]: byte b followed by k zero bytes
+static unsigned int crc_long_shift[4][256]; // a crc, a byte at a time, followed by CRC_LONG zero bytes
+static unsigned int crc_short_shift[4][256];
+static unsigned int fold_long_shift[4][256]; // over a stream of a pclmul block, 24 * FOLD_LONG bytes
+static unsigned int fold_short_shift[4][256];
+static unsigned int fold_k[3][2]; // pclmul constants folding 16 bytes forward over 64, 32 and 16 bytes
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static inline unsigned long long read64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v)); // values can be anywhere
+    return v;
+}
+
+// TABLES
+
+// Zeroes shifted through a crc are linear over GF(2), so a shift is a 32x32 bit matrix, stored a column (the
+// image of one bit) per entry.
+static unsigned int gf2_times(const unsigned int *matrix, unsigned int vector) {
+    unsigned int sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        sum ^= vector & 1 ? *matrix : 0;
+    }
+    return sum;
+}
+
+static void gf2_square(unsigned int *square, const unsigned int *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+// Tables shifting a crc over length zero bytes: the one zero bit matrix raised to length * 8.
+static void shift_tables(unsigned int tables[4][256], unsigned long long length) {
+    unsigned int power[32], op[32], next[32];
+    power[0] = CRC32C_POLY; // one zero bit
+    for (int n = 1; n < 32; n++) {
+        power[n] = 1U << (n - 1);
+    }
+    for (int n = 0; n < 32; n++) {
+        op[n] = 1U << n; // no bits
+    }
+    for (unsigned long long bits = length * 8; bits; bits >>= 1) {
+        if (bits & 1) {
+            for (int n = 0; n < 32; n++) {
+                next[n] = gf2_times(power, op[n]);
+            }
+            memcpy(op, next, sizeof(op));
+        }
+        gf2_square(next, power);
+        memcpy(power, next, sizeof(power));
+    }
+    for (unsigned int b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            tables[k][b] = gf2_times(op, b << (8 * k));
+        }
+    }
+}
+
+static void make_tables(void) {
+    for (unsigned int b = 0; b < 256; b++) {
+        unsigned int crc = b;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][b] = crc;
+    }
+    for (unsigned int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+        }
+    }
+    shift_tables(crc_long_shift, CRC_LONG);
+    shift_tables(crc_short_shift, CRC_SHORT);
+    shift_tables(fold_long_shift, 24 * FOLD_LONG);
+    shift_tables(fold_short_shift, 24 * FOLD_SHORT);
+    // x^n mod P, bit reflected like the crc, is x^0 (the top bit) shifted over n zero bits. A 64 bit half of a
+    // 16 byte lane carried distance bytes forward is multiplied by x^(8 * distance + 31) for the low (earlier)
+    // half and x^(8 * distance - 33) for the high one, the extra 32 and the odd 1 being the crc's own x^32 and
+    // the reflected carryless multiply's result coming out a bit short.
+    unsigned int distances[3] = {64, 32, 16};
+    for (int d = 0; d < 3; d++) {
+        for (int half = 0; half < 2; half++) {
+            unsigned int x = 0x80000000U;
+            for (unsigned int bits = 8 * distances[d] + (half ? -33 : 31); bits; bits--) {
+                x = x & 1 ? (x >> 1) ^ CRC32C_POLY : x >> 1;
+            }
+            fold_k[d][half] = x;
+        }
+    }
+}
+
+static inline unsigned int crc_shift(unsigned int tables[4][256], unsigned int crc) {
+    return tables[0][crc & 0xff] ^ tables[1][(crc >> 8) & 0xff] ^ tables[2][(crc >> 16) & 0xff] ^ tables[3][crc >> 24];
+}
+
+// SCALAR
+
+static unsigned int crc_scalar(unsigned int crc, const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (; length >= 8; length -= 8, p += 8) {
+        unsigned long long v = read64(p) ^ crc; // little endian
+        crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^ crc_table[5][(v >> 16) & 0xff] ^
+            crc_table[4][(v >> 24) & 0xff] ^ crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+            crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+    }
+    for (; length; length--, p++) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xff];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+// SSE4.2: block bytes of three streams, each stream's crc started from 0 except the first, then the first is
+// shifted over the second's bytes and xored into it, and again for the third.
+
+__attribute__((target("sse4.2")))
+static inline unsigned long long crc_streams_sse42(unsigned long long crc, const unsigned char *p, unsigned long long block, unsigned int shift[4][256]) {
+    unsigned long long crc1 = 0, crc2 = 0;
+    for (const unsigned char *end = p + block; p < end; p += 8) {
+        crc = _mm_crc32_u64(crc, read64(p));
+        crc1 = _mm_crc32_u64(crc1, read64(p + block));
+        crc2 = _mm_crc32_u64(crc2, read64(p + 2 * block));
+    }
+    crc = crc_shift(shift, crc) ^ crc1;
+    return crc_shift(shift, crc) ^ crc2;
+}
+
+__attribute__((target("sse4.2")))
+static unsigned int crc_sse42(unsigned int crc, const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    unsigned long long c = ~crc;
+    for (; length && ((unsigned long long)p & 7); length--, p++) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    for (; length >= 3 * CRC_LONG; length -= 3 * CRC_LONG, p += 3 * CRC_LONG) {
+        c = crc_streams_sse42(c, p, CRC_LONG, crc_long_shift);
+    }
+    for (; length >= 3 * CRC_SHORT; length -= 3 * CRC_SHORT, p += 3 * CRC_SHORT) {
+        c = crc_streams_sse42(c, p, CRC_SHORT, crc_short_shift);
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        c = _mm_crc32_u64(c, read64(p));
+    }
+    for (; length; length--, p++) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return ~(unsigned int)c;
+}
+
+// SSE4.2 + PCLMUL: crc32 only issues on one port, and carryless multiplies go on another, so a block is split
+// into a part folded 64 bytes at a time with pclmul, the way Intel's crc papers do it, and three streams of crc32
+// after it, and the two run at once. The folded part is reduced to a crc by putting its last 16 bytes through
+// crc32, then the streams are joined on as in crc_streams_sse42.
+
+__attribute__((target("sse4.2,pclmul")))
+static inline __m128i fold_lane(__m128i x, __m128i k, __m128i next) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline unsigned long long crc_fold_streams(unsigned long long crc, const unsigned char *p, unsigned long long steps, unsigned int shift[4][256]) {
+    const unsigned char *s = p + 64 * steps;
+    unsigned long long stream = 24 * steps;
+    __m128i k = _mm_setr_epi32(fold_k[0][0], 0, fold_k[0][1], 0);
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p), _mm_cvtsi32_si128(crc));
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+    unsigned long long crc0 = 0, crc1 = 0, crc2 = 0;
+    for (unsigned long long i = 0; ; ) {
+        for (int j = 0; j < 24; j += 8, s += 8) {
+            crc0 = _mm_crc32_u64(crc0, read64(s));
+            crc1 = _mm_crc32_u64(crc1, read64(s + stream));
+            crc2 = _mm_crc32_u64(crc2, read64(s + 2 * stream));
+        }
+        if (++i == steps) {
+            break;
+        }
+        p += 64;
+        x0 = fold_lane(x0, k, _mm_loadu_si128((const __m128i *)p));
+        x1 = fold_lane(x1, k, _mm_loadu_si128((const __m128i *)(p + 16)));
+        x2 = fold_lane(x2, k, _mm_loadu_si128((const __m128i *)(p + 32)));
+        x3 = fold_lane(x3, k, _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+    x1 = fold_lane(x0, _mm_setr_epi32(fold_k[2][0], 0, fold_k[2][1], 0), x1);
+    x3 = fold_lane(x2, _mm_setr_epi32(fold_k[2][0], 0, fold_k[2][1], 0), x3);
+    x3 = fold_lane(x1, _mm_setr_epi32(fold_k[1][0], 0, fold_k[1][1], 0), x3);
+    crc = _mm_crc32_u64(0, _mm_extract_epi64(x3, 0));
+    crc = _mm_crc32_u64(crc, _mm_extract_epi64(x3, 1));
+    crc = crc_shift(shift, crc) ^ crc0;
+    crc = crc_shift(shift, crc) ^ crc1;
+    return crc_shift(shift, crc) ^ crc2;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static unsigned int crc_pclmul(unsigned int crc, const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    unsigned long long c = ~crc;
+    for (; length && ((unsigned long long)p & 7); length--, p++) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    for (; length >= 136 * FOLD_LONG; length -= 136 * FOLD_LONG, p += 136 * FOLD_LONG) {
+        c = crc_fold_streams(c, p, FOLD_LONG, fold_long_shift);
+    }
+    for (; length >= 136 * FOLD_SHORT; length -= 136 * FOLD_SHORT, p += 136 * FOLD_SHORT) {
+        c = crc_fold_streams(c, p, FOLD_SHORT, fold_short_shift);
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        c = _mm_crc32_u64(c, read64(p));
+    }
+    for (; length; length--, p++) {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return ~(unsigned int)c;
+}
+
+#endif
+
+// DISPATCH
+
+static unsigned int crc_resolve(unsigned int crc, const void *data, unsigned long long length);
+static crc_fn crc_dispatch = crc_resolve;
+static const char *crc_dispatch_name = NULL;
+
+// Both variants need the tables, so they're made before either's handed out.
+static void pick_impl(void) {
+    pthread_once(&crc_tables_once, make_tables);
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        crc_dispatch_name = "pclmul";
+        crc_dispatch = crc_pclmul;
+        return;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_dispatch_name = "sse4.2";
+        crc_dispatch = crc_sse42;
+        return;
+    }
+#endif
+    crc_dispatch_name = "scalar";
+    crc_dispatch = crc_scalar;
+}
+
+// First call through crc_dispatch lands here. Racing threads all pick the same thing, so no lock needed.
+static unsigned int crc_resolve(unsigned int crc, const void *data, unsigned long long length) {
+    pick_impl();
+    return crc_dispatch(crc, data, length);
+}
+
+unsigned int crc32c(unsigned int crc, const void *data, unsigned long long length) {
+    return crc_dispatch(crc, data, length);
+}
+
+const char *crc_impl_name(void) {
+    if (crc_dispatch_name == NULL) {
+        pick_impl();
+    }
+    return crc_dispatch_name;
+}
+
+crc_fn crc_impl(const char *name) {
+    pthread_once(&crc_tables_once, make_tables);
+    if (strcmp(name, "scalar") == 0) {
+        return crc_scalar;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(name, "pclmul") == 0 && __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        return crc_pclmul;
+    }
+    if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+        return crc_sse42;
+    }
+#endif
+    return NULL;
+}
@@ -0,0 +1,29 @@
+//
+//  nvme_crc.h
+//
+//
+//  CRC32C (Castagnoli), the checksum on every record (see ssd_header.crc). On x86-64 with SSE4.2 it's the crc32
+//  instruction, run on three independent streams at once since it has a latency of three cycles but a throughput
+//  of one, and the three are joined up with tables that shift a crc over a block of zeroes. With PCLMUL as well,
+//  another part of each block is folded with carryless multiplies at the same time, since those run on a
+//  different port. Otherwise a table a byte at a time, sliced eight ways. Every variant computes the same
+//  function, so which one runs is only a matter of speed. The best one the CPU supports is picked the first time
+//  crc32c is called, like hash_bytes.
+//
+
+#ifndef nvme_crc_h
+#define nvme_crc_h
+
+typedef unsigned int (*crc_fn)(unsigned int crc, const void *data, unsigned long long length);
+
+// crc of what was passed in so far (0 to start), followed by length bytes of data. So it can be done in pieces:
+// crc32c(crc32c(0, a, n), b, m) is the crc of a then b.
+unsigned int crc32c(unsigned int crc, const void *data, unsigned long long length);
+
+// Name of the variant crc32c dispatches to ("pclmul", "sse4.2" or "scalar").
+const char *crc_impl_name(void);
+
+// The individual variants, for benchmarking. NULL if not supported by this CPU/build.
+crc_fn crc_impl(const char *name);
+
+#endif /* nvme_crc_h */
@@ -0,0 +1,106 @@
+//
+//  nvme_device.h
+//
+//
+//  The block device underneath the log. SPDK is one implementation, but the engine only ever talks
+//  to a struct db_device so it can also run on an O_DIRECT file through io_uring, or purely in RAM.
+//
+
+#ifndef nvme_device_h
+#define nvme_device_h
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct db_device;
+struct db_queue;
+
+// status is 0 on success and a negative errno on failure.
+typedef void (*device_io_cb)(void *cb_arg, int status);
+
+// One piece of a scatter-gather write.
+struct db_iovec {
+    void *base;
+    unsigned long long length;
+};
+
+struct db_device_ops {
+    // A queue is the equivalent of an spdk_nvme_qpair: it isn't thread-safe, so only one thread should
+    // submit to / poll a given queue at a time.
+    struct db_queue *(*alloc_queue)(struct db_device *dev);
+    void (*free_queue)(struct db_queue *queue);
+
+    // Buffers must come from dma_malloc. Submitting can't fail: cb is always called, from process_completions
+    // and never from in here. An I/O the device can't take yet waits in the backend, and one it can't do at all
+    // (out of range LBAs, say) completes with a negative errno like any other failed I/O.
+    void (*read)(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg);
+    void (*write)(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg);
+    void (*flush)(struct db_queue *queue, device_io_cb cb, void *cb_arg);
+
+    // Writes the concatenation of iov to lba_count sectors at lba. Only called if the device has an sgl_alignment,
+    // and every segment has to start at a multiple of it, and be a multiple of it long unless it's the last one.
+    // iov has to stay as it is until cb is called.
+    void (*writev)(struct db_queue *queue, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg);
+
+    // Calls the callbacks of finished I/O, at most max_completions of them (0 means no limit). Returns how many ran.
+    int (*process_completions)(struct db_queue *queue, unsigned int max_completions);
+
+    // Zeroed, sector aligned memory the device can DMA to/from.
+    void *(*dma_malloc)(struct db_device *dev, size_t size);
+    void (*dma_free)(struct db_device *dev, void *buf);
+
+    void (*close)(struct db_device *dev);
+};
+
+struct db_device {
+    const struct db_device_ops *ops;
+    const char *name;
+
+    unsigned int sector_size;
+    unsigned long long num_sectors;
+    unsigned int max_transfer_size; // in bytes
+    unsigned int sgl_alignment; // see writev. 0 means the device can't do scatter-gather, so don't call writev.
+};
+
+// Backends embed this as the first member of their own queue struct.
+struct db_queue {
+    struct db_device *dev;
+};
+
+// Each returns NULL (after printing why) if the device couldn't be opened.
+struct db_device *spdk_device_open(void);
+struct db_device *uring_device_open(const char *path, unsigned long long size, unsigned int queue_depth);
+struct db_device *mem_device_open(unsigned long long size, unsigned int sector_size, unsigned int latency_us, unsigned int latency_jitter_us, unsigned int seed);
+
+// num_sectors of parent starting at first_sector, as a device of its own. Closing it leaves parent open.
+struct db_device *part_device_open(struct db_device *parent, unsigned long long first_sector, unsigned long long num_sectors);
+
+static inline void device_read(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    queue -> dev -> ops -> read(queue, buf, lba, lba_count, cb, cb_arg);
+}
+
+static inline void device_write(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    queue -> dev -> ops -> write(queue, buf, lba, lba_count, cb, cb_arg);
+}
+
+static inline void device_writev(struct db_queue *queue, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    queue -> dev -> ops -> writev(queue, iov, iovcnt, lba, lba_count, cb, cb_arg);
+}
+
+static inline void device_flush(struct db_queue *queue, device_io_cb cb, void *cb_arg) {
+    queue -> dev -> ops -> flush(queue, cb, cb_arg);
+}
+
+static inline int device_process_completions(struct db_queue *queue, unsigned int max_completions) {
+    return queue -> dev -> ops -> process_completions(queue, max_completions);
+}
+
+static inline void *device_dma_malloc(struct db_device *dev, size_t size) {
+    return dev -> ops -> dma_malloc(dev, size);
+}
+
+static inline void device_dma_free(struct db_device *dev, void *buf) {
+    dev -> ops -> dma_free(dev, buf);
+}
+
+#endif /* nvme_device_h */
@@ -0,0 +1,241 @@
+//
+//  nvme_device_mem.c
+//
+//
+//  db_device that lives in RAM. Every I/O completes latency_us (plus up to latency_jitter_us, drawn from a
+//  seeded PRNG) after it was submitted, and data only moves when the I/O completes, so the write batching
+//  and read paths can be load-tested deterministically without any hardware.
+//
+
+#include "nvme_device.h"
+#include "nvme_pool.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#define MEM_MAX_TRANSFER_SIZE (128*1024) // what most NVMe drives report, so chunking gets exercised.
+
+struct mem_device {
+    struct db_device dev; // must be first
+    char *data;
+
+    unsigned int latency_us;
+    unsigned int latency_jitter_us;
+    unsigned int seed; // each queue gets its own PRNG stream derived from this.
+    unsigned int queues_allocated;
+};
+
+enum mem_op {
+    MEM_OP_READ,
+    MEM_OP_WRITE,
+    MEM_OP_WRITEV,
+    MEM_OP_FLUSH,
+};
+
+struct mem_request {
+    enum mem_op op;
+    void *buf; // struct db_iovec * for MEM_OP_WRITEV
+    int iovcnt;
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long deadline_us;
+    int status; // not 0 if it couldn't be done at all, in which case it completes with this and moves nothing
+
+    device_io_cb cb;
+    void *cb_arg;
+
+    TAILQ_ENTRY(mem_request) link;
+};
+
+static struct slab_cache mem_request_cache = SLAB_CACHE_INIT("mem_request", sizeof(struct mem_request));
+
+struct mem_queue {
+    struct db_queue queue; // must be first
+    unsigned long long rng;
+    TAILQ_HEAD(mem_pending_head, mem_request) pending; // sorted by deadline_us
+};
+
+static unsigned long long get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// xorshift64*: fast, and the same seed gives the same latencies every run.
+static unsigned long long mem_rand(struct mem_queue *queue) {
+    queue -> rng ^= queue -> rng >> 12;
+    queue -> rng ^= queue -> rng << 25;
+    queue -> rng ^= queue -> rng >> 27;
+    return queue -> rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void mem_queue_request(struct db_queue *opaque, enum mem_op op, void *buf, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct mem_queue *queue = (struct mem_queue *)opaque;
+    struct mem_device *dev = (struct mem_device *)opaque -> dev;
+    struct mem_request *req = slab_alloc(&mem_request_cache);
+    req -> status = 0;
+    if (op != MEM_OP_FLUSH && lba + lba_count > dev -> dev.num_sectors) {
+        req -> status = -EINVAL;
+    }
+    if ((unsigned long long)lba_count * dev -> dev.sector_size > dev -> dev.max_transfer_size) {
+        // A real device would fail it too, so anything that forgets to split its I/O shows up here.
+        printf("mem device: %u sectors is more than the most one command can transfer\n", lba_count);
+        req -> status = -EINVAL;
+    }
+
+    req -> op = op;
+    req -> buf = buf;
+    req -> iovcnt = iovcnt;
+    req -> offset = lba * dev -> dev.sector_size;
+    req -> length = (unsigned long long)lba_count * dev -> dev.sector_size;
+    req -> cb = cb;
+    req -> cb_arg = cb_arg;
+    req -> deadline_us = get_time_us() + dev -> latency_us;
+    if (dev -> latency_jitter_us) {
+        req -> deadline_us += mem_rand(queue) % (dev -> latency_jitter_us + 1);
+    }
+
+    // Keep the list sorted. With no jitter this always inserts at the tail.
+    struct mem_request *after = TAILQ_LAST(&queue -> pending, mem_pending_head);
+    while (after && after -> deadline_us > req -> deadline_us) {
+        after = TAILQ_PREV(after, mem_pending_head, link);
+    }
+    if (after) {
+        TAILQ_INSERT_AFTER(&queue -> pending, after, req, link);
+    } else {
+        TAILQ_INSERT_HEAD(&queue -> pending, req, link);
+    }
+}
+
+static void mem_dev_read(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    mem_queue_request(queue, MEM_OP_READ, buf, 0, lba, lba_count, cb, cb_arg);
+}
+
+static void mem_dev_write(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    mem_queue_request(queue, MEM_OP_WRITE, buf, 0, lba, lba_count, cb, cb_arg);
+}
+
+static void mem_dev_writev(struct db_queue *queue, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    mem_queue_request(queue, MEM_OP_WRITEV, iov, iovcnt, lba, lba_count, cb, cb_arg);
+}
+
+// Copies the segments one after the other, stopping at the end of the request like a real device would.
+static void mem_gather(char *dst, unsigned long long length, struct db_iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt && length; i++) {
+        unsigned long long n = iov[i].length < length ? iov[i].length : length;
+        memcpy(dst, iov[i].base, n);
+        dst += n;
+        length -= n;
+    }
+}
+
+static void mem_dev_flush(struct db_queue *queue, device_io_cb cb, void *cb_arg) {
+    mem_queue_request(queue, MEM_OP_FLUSH, NULL, 0, 0, 0, cb, cb_arg);
+}
+
+static int mem_dev_process_completions(struct db_queue *opaque, unsigned int max_completions) {
+    struct mem_queue *queue = (struct mem_queue *)opaque;
+    struct mem_device *dev = (struct mem_device *)opaque -> dev;
+    unsigned long long now = get_time_us();
+
+    int completed = 0;
+    struct mem_request *req;
+    while ((max_completions == 0 || completed < max_completions) &&
+           (req = TAILQ_FIRST(&queue -> pending)) && req -> deadline_us <= now) {
+        TAILQ_REMOVE(&queue -> pending, req, link);
+        if (req -> status != 0) {
+            fprintf(stderr, "I/O error status: %s (op %d, offset %llu, length %llu)\n", strerror(-req -> status), req -> op, req -> offset, req -> length);
+        } else if (req -> op == MEM_OP_READ) {
+            memcpy(req -> buf, dev -> data + req -> offset, req -> length);
+        } else if (req -> op == MEM_OP_WRITE) {
+            memcpy(dev -> data + req -> offset, req -> buf, req -> length);
+        } else if (req -> op == MEM_OP_WRITEV) {
+            mem_gather(dev -> data + req -> offset, req -> length, req -> buf, req -> iovcnt);
+        }
+        req -> cb(req -> cb_arg, req -> status);
+        slab_free(&mem_request_cache, req);
+        completed++;
+    }
+    return completed;
+}
+
+static struct db_queue *mem_dev_alloc_queue(struct db_device *opaque) {
+    struct mem_device *dev = (struct mem_device *)opaque;
+    struct mem_queue *queue = calloc(1, sizeof(struct mem_queue));
+    queue -> queue.dev = opaque;
+    queue -> rng = ((unsigned long long)dev -> seed << 32) + (++dev -> queues_allocated) * 0x9E3779B97F4A7C15ULL;
+    TAILQ_INIT(&queue -> pending);
+    return &queue -> queue;
+}
+
+static void mem_dev_free_queue(struct db_queue *opaque) {
+    struct mem_queue *queue = (struct mem_queue *)opaque;
+    struct mem_request *req;
+    while ((req = TAILQ_FIRST(&queue -> pending))) {
+        TAILQ_REMOVE(&queue -> pending, req, link);
+        slab_free(&mem_request_cache, req);
+    }
+    free(queue);
+}
+
+static void *mem_dev_dma_malloc(struct db_device *dev, size_t size) {
+    void *buf;
+    if (posix_memalign(&buf, dev -> sector_size, size)) {
+        return NULL;
+    }
+    memset(buf, 0, size);
+    return buf;
+}
+
+static void mem_dev_dma_free(struct db_device *dev, void *buf) {
+    free(buf);
+}
+
+static void mem_dev_close(struct db_device *opaque) {
+    struct mem_device *dev = (struct mem_device *)opaque;
+    free(dev -> data);
+    free(dev);
+}
+
+static const struct db_device_ops mem_device_ops = {
+    .alloc_queue = mem_dev_alloc_queue,
+    .free_queue = mem_dev_free_queue,
+    .read = mem_dev_read,
+    .write = mem_dev_write,
+    .writev = mem_dev_writev,
+    .flush = mem_dev_flush,
+    .process_completions = mem_dev_process_completions,
+    .dma_malloc = mem_dev_dma_malloc,
+    .dma_free = mem_dev_dma_free,
+    .close = mem_dev_close,
+};
+
+struct db_device *mem_device_open(unsigned long long size, unsigned int sector_size, unsigned int latency_us, unsigned int latency_jitter_us, unsigned int seed) {
+    if (sector_size == 0 || size < sector_size) {
+        fprintf(stderr, "memory device of %llu bytes can't hold a %u byte sector\n", size, sector_size);
+        return NULL;
+    }
+
+    struct mem_device *dev = calloc(1, sizeof(struct mem_device));
+    dev -> data = calloc(1, size);
+    if (dev -> data == NULL) {
+        fprintf(stderr, "couldn't allocate %llu bytes for memory device\n", size);
+        free(dev);
+        return NULL;
+    }
+    dev -> latency_us = latency_us;
+    dev -> latency_jitter_us = latency_jitter_us;
+    dev -> seed = seed;
+    dev -> dev.ops = &mem_device_ops;
+    dev -> dev.name = "memory";
+    dev -> dev.sector_size = sector_size;
+    dev -> dev.num_sectors = size / sector_size;
+    dev -> dev.max_transfer_size = MEM_MAX_TRANSFER_SIZE;
+    dev -> dev.sgl_alignment = 1;
+    return &dev -> dev;
+}
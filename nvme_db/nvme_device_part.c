@@ -0,0 +1,165 @@
+//
+//  nvme_device_part.c
+//
+//
+//  db_device that is a slice of another one, so shards can each run a whole db over their own part of the
+//  device. Every queue allocated on it is a real queue on the parent (a qpair of its own, for SPDK), with
+//  LBAs shifted by first_sector.
+//
+
+#include "nvme_device.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+struct part_device {
+    struct db_device dev; // must be first
+    struct db_device *parent;
+    unsigned long long first_sector;
+};
+
+// An I/O outside the slice. It never reaches the parent, and fails from the next process_completions.
+struct part_failed_io {
+    device_io_cb cb;
+    void *cb_arg;
+    TAILQ_ENTRY(part_failed_io) link;
+};
+
+struct part_queue {
+    struct db_queue queue; // must be first
+    struct db_queue *parent_queue;
+    TAILQ_HEAD(part_failed_head, part_failed_io) failed;
+};
+
+// Whether lba_count sectors at lba are in the slice. If they aren't, the I/O is set up to fail.
+static bool part_in_range(struct db_queue *opaque, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    if (lba + lba_count <= opaque -> dev -> num_sectors) {
+        return true;
+    }
+    struct part_failed_io *io = malloc(sizeof(struct part_failed_io));
+    io -> cb = cb;
+    io -> cb_arg = cb_arg;
+    TAILQ_INSERT_TAIL(&queue -> failed, io, link);
+    return false;
+}
+
+static void part_dev_read(struct db_queue *opaque, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    struct part_device *dev = (struct part_device *)opaque -> dev;
+    if (part_in_range(opaque, lba, lba_count, cb, cb_arg)) {
+        device_read(queue -> parent_queue, buf, dev -> first_sector + lba, lba_count, cb, cb_arg);
+    }
+}
+
+static void part_dev_write(struct db_queue *opaque, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    struct part_device *dev = (struct part_device *)opaque -> dev;
+    if (part_in_range(opaque, lba, lba_count, cb, cb_arg)) {
+        device_write(queue -> parent_queue, buf, dev -> first_sector + lba, lba_count, cb, cb_arg);
+    }
+}
+
+static void part_dev_writev(struct db_queue *opaque, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    struct part_device *dev = (struct part_device *)opaque -> dev;
+    if (part_in_range(opaque, lba, lba_count, cb, cb_arg)) {
+        device_writev(queue -> parent_queue, iov, iovcnt, dev -> first_sector + lba, lba_count, cb, cb_arg);
+    }
+}
+
+static void part_dev_flush(struct db_queue *opaque, device_io_cb cb, void *cb_arg) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    device_flush(queue -> parent_queue, cb, cb_arg);
+}
+
+static int part_dev_process_completions(struct db_queue *opaque, unsigned int max_completions) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    unsigned int completed = 0;
+    struct part_failed_io *io;
+    while ((max_completions == 0 || completed < max_completions) && (io = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, io, link);
+        fprintf(stderr, "I/O error status: %s (outside the slice)\n", strerror(EINVAL));
+        io -> cb(io -> cb_arg, -EINVAL);
+        free(io);
+        completed++;
+    }
+    if (max_completions && completed == max_completions) {
+        return completed;
+    }
+    return completed + device_process_completions(queue -> parent_queue, max_completions ? max_completions - completed : 0);
+}
+
+static struct db_queue *part_dev_alloc_queue(struct db_device *opaque) {
+    struct part_device *dev = (struct part_device *)opaque;
+    struct db_queue *parent_queue = dev -> parent -> ops -> alloc_queue(dev -> parent);
+    if (parent_queue == NULL) {
+        return NULL;
+    }
+    struct part_queue *queue = calloc(1, sizeof(struct part_queue));
+    queue -> queue.dev = opaque;
+    queue -> parent_queue = parent_queue;
+    TAILQ_INIT(&queue -> failed);
+    return &queue -> queue;
+}
+
+static void part_dev_free_queue(struct db_queue *opaque) {
+    struct part_queue *queue = (struct part_queue *)opaque;
+    struct part_device *dev = (struct part_device *)opaque -> dev;
+    dev -> parent -> ops -> free_queue(queue -> parent_queue);
+    struct part_failed_io *io;
+    while ((io = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, io, link);
+        free(io);
+    }
+    free(queue);
+}
+
+static void *part_dev_dma_malloc(struct db_device *opaque, size_t size) {
+    struct part_device *dev = (struct part_device *)opaque;
+    return device_dma_malloc(dev -> parent, size);
+}
+
+static void part_dev_dma_free(struct db_device *opaque, void *buf) {
+    struct part_device *dev = (struct part_device *)opaque;
+    device_dma_free(dev -> parent, buf);
+}
+
+// The parent is left open, since other slices are still using it.
+static void part_dev_close(struct db_device *opaque) {
+    free(opaque);
+}
+
+static const struct db_device_ops part_device_ops = {
+    .alloc_queue = part_dev_alloc_queue,
+    .free_queue = part_dev_free_queue,
+    .read = part_dev_read,
+    .write = part_dev_write,
+    .writev = part_dev_writev,
+    .flush = part_dev_flush,
+    .process_completions = part_dev_process_completions,
+    .dma_malloc = part_dev_dma_malloc,
+    .dma_free = part_dev_dma_free,
+    .close = part_dev_close,
+};
+
+struct db_device *part_device_open(struct db_device *parent, unsigned long long first_sector, unsigned long long num_sectors) {
+    if (first_sector + num_sectors > parent -> num_sectors) {
+        fprintf(stderr, "slice of %llu sectors at %llu doesn't fit in a %llu sector device\n", num_sectors, first_sector, parent -> num_sectors);
+        return NULL;
+    }
+
+    struct part_device *dev = calloc(1, sizeof(struct part_device));
+    dev -> parent = parent;
+    dev -> first_sector = first_sector;
+    dev -> dev.ops = &part_device_ops;
+    dev -> dev.name = parent -> name;
+    dev -> dev.sector_size = parent -> sector_size;
+    dev -> dev.num_sectors = num_sectors;
+    dev -> dev.max_transfer_size = parent -> max_transfer_size;
+    dev -> dev.sgl_alignment = parent -> sgl_alignment;
+    return &dev -> dev;
+}
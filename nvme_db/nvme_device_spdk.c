@@ -0,0 +1,455 @@
+//
+//  nvme_device_spdk.c
+//
+//
+//  db_device backed by the first active namespace SPDK can find. This is the setup code that used to
+//  live directly in initialize().
+//
+
+#include "nvme_device.h"
+#include "nvme_pool.h"
+
+#include "spdk/stdinc.h"
+#include "spdk/nvme.h"
+#include "spdk/vmd.h"
+#include "spdk/nvme_zns.h"
+#include "spdk/env.h"
+
+struct ctrlr_entry {
+    struct spdk_nvme_ctrlr        *ctrlr;
+    TAILQ_ENTRY(ctrlr_entry)    link;
+    char                name[1024];
+};
+
+struct ns_entry {
+    struct spdk_nvme_ctrlr    *ctrlr;
+    struct spdk_nvme_ns    *ns;
+    TAILQ_ENTRY(ns_entry)    link;
+};
+
+struct spdk_device {
+    struct db_device dev; // must be first
+
+    TAILQ_HEAD(control_head, ctrlr_entry) g_controllers;
+    TAILQ_HEAD(namespace_head, ns_entry) g_namespaces;
+    struct ns_entry *main_namespace;
+};
+
+enum spdk_op {
+    SPDK_OP_READ,
+    SPDK_OP_WRITE,
+    SPDK_OP_WRITEV,
+    SPDK_OP_FLUSH,
+};
+
+// SPDK callbacks get a completion struct rather than a status, so every I/O carries one of these. It also
+// holds everything needed to submit the I/O again, for when the qpair had no room for it.
+struct spdk_io {
+    struct spdk_queue *queue;
+    device_io_cb cb;
+    void *cb_arg;
+
+    enum spdk_op op;
+    void *buf;
+    unsigned long long lba;
+    unsigned int lba_count;
+    int status; // what it fails with, once it's in the queue's failed list
+    TAILQ_ENTRY(spdk_io) link;
+
+    // writev only: where SPDK is in the list as it builds the SGL (or PRP list).
+    struct db_iovec *iov;
+    int iovcnt;
+    int iov_idx;
+    unsigned long long iov_offset; // into iov[iov_idx]
+};
+
+static struct slab_cache spdk_io_cache = SLAB_CACHE_INIT("spdk_io", sizeof(struct spdk_io));
+
+struct spdk_queue {
+    struct db_queue queue; // must be first
+    struct spdk_nvme_qpair *qpair;
+    struct spdk_nvme_ns *ns;
+
+    // The qpair has a fixed number of requests, and SPDK returns -ENOMEM once they're all in use. I/O then waits
+    // here, in order, and is submitted again as completions free requests up, so callers can treat the queue as
+    // unbounded like the other backends'.
+    TAILQ_HEAD(spdk_io_head, spdk_io) backlog;
+    // I/O SPDK refused for any other reason. Completed with its status by the next process_completions, since
+    // callbacks can't run from inside a submission.
+    struct spdk_io_head failed;
+};
+
+static void
+register_ns(struct spdk_device *state, struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
+{
+    struct ns_entry *entry;
+
+    if (!spdk_nvme_ns_is_active(ns)) {
+        return;
+    }
+
+    entry = malloc(sizeof(struct ns_entry));
+    if (entry == NULL) {
+        perror("ns_entry malloc");
+        exit(1);
+    }
+
+    entry->ctrlr = ctrlr;
+    entry->ns = ns;
+    TAILQ_INSERT_TAIL(&state -> g_namespaces, entry, link);
+
+    printf("  Namespace ID: %d size: %juGB\n", spdk_nvme_ns_get_id(ns),
+           spdk_nvme_ns_get_size(ns) / 1000000000);
+}
+
+static bool
+probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+     struct spdk_nvme_ctrlr_opts *opts)
+{
+    printf("Attaching to %s\n", trid->traddr);
+
+    return true;
+}
+
+static void
+attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
+      struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
+{
+    int nsid;
+    struct ctrlr_entry *entry;
+    struct spdk_nvme_ns *ns;
+    const struct spdk_nvme_ctrlr_data *cdata;
+    struct spdk_device *state = cb_ctx;
+
+    entry = malloc(sizeof(struct ctrlr_entry));
+    if (entry == NULL) {
+        perror("ctrlr_entry malloc");
+        exit(1);
+    }
+
+    /*
+     * spdk_nvme_ctrlr is the logical abstraction in SPDK for an NVMe
+     *  controller.  During initialization, the IDENTIFY data for the
+     *  controller is read using an NVMe admin command, and that data
+     *  can be retrieved using spdk_nvme_ctrlr_get_data() to get
+     *  detailed information on the controller.  Refer to the NVMe
+     *  specification for more details on IDENTIFY for NVMe controllers.
+     */
+    cdata = spdk_nvme_ctrlr_get_data(ctrlr);
+
+    snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
+
+    entry->ctrlr = ctrlr;
+    TAILQ_INSERT_TAIL(&state -> g_controllers, entry, link);
+
+#ifdef DEBUG
+    printf("io queues: %d io_queue_size: %d io_queue_requests: %d \n", opts -> num_io_queues, opts -> io_queue_size, opts -> io_queue_requests);
+#endif
+
+    /*
+     * Each controller has one or more namespaces.  An NVMe namespace is basically
+     *  equivalent to a SCSI LUN.  The controller's IDENTIFY data tells us how
+     *  many namespaces exist on the controller.  For Intel(R) P3X00 controllers,
+     *  it will just be one namespace.
+     *
+     * Note that in NVMe, namespace IDs start at 1, not 0.
+     */
+    for (nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr); nsid != 0;
+         nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid)) {
+        ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
+        if (ns == NULL) {
+            continue;
+        }
+        register_ns(state, ctrlr, ns);
+    }
+}
+
+static void spdk_io_complete(void *arg, const struct spdk_nvme_cpl *completion) {
+    struct spdk_io *io = arg;
+    int status = 0;
+
+    /* See if an error occurred. If so, display information
+     * about it, and set completion value so that I/O
+     * caller is aware that an error occurred.
+     */
+    if (spdk_nvme_cpl_is_error(completion)) {
+        spdk_nvme_qpair_print_completion(io -> queue -> qpair, (struct spdk_nvme_cpl *)completion);
+        fprintf(stderr, "I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
+        status = -EIO;
+    }
+
+    device_io_cb cb = io -> cb;
+    void *cb_arg = io -> cb_arg;
+    slab_free(&spdk_io_cache, io);
+    cb(cb_arg, status);
+}
+
+static struct spdk_io *spdk_io_alloc(struct spdk_queue *queue, enum spdk_op op, device_io_cb cb, void *cb_arg) {
+    struct spdk_io *io = slab_alloc(&spdk_io_cache);
+    io -> queue = queue;
+    io -> op = op;
+    io -> cb = cb;
+    io -> cb_arg = cb_arg;
+    io -> iov = NULL;
+    io -> status = 0;
+    return io;
+}
+
+static void spdk_io_reset_sgl(void *arg, uint32_t offset) {
+    struct spdk_io *io = arg;
+    io -> iov_idx = 0;
+    while (io -> iov_idx < io -> iovcnt && offset >= io -> iov[io -> iov_idx].length) {
+        offset -= io -> iov[io -> iov_idx].length;
+        io -> iov_idx++;
+    }
+    io -> iov_offset = offset;
+}
+
+static int spdk_io_next_sge(void *arg, void **address, uint32_t *length) {
+    struct spdk_io *io = arg;
+    if (io -> iov_idx >= io -> iovcnt) {
+        return -1;
+    }
+    struct db_iovec *iov = &io -> iov[io -> iov_idx];
+    *address = (char *)iov -> base + io -> iov_offset;
+    *length = iov -> length - io -> iov_offset;
+    io -> iov_idx++;
+    io -> iov_offset = 0;
+    return 0;
+}
+
+static int spdk_io_submit(struct spdk_io *io) {
+    struct spdk_queue *queue = io -> queue;
+    switch (io -> op) {
+        case SPDK_OP_READ:
+            return spdk_nvme_ns_cmd_read(queue -> ns, queue -> qpair, io -> buf, io -> lba, io -> lba_count, spdk_io_complete, io, 0);
+        case SPDK_OP_WRITE:
+            // flags. Worth considering implementing at some point: streams directive for big writes.
+            return spdk_nvme_ns_cmd_write(queue -> ns, queue -> qpair, io -> buf, io -> lba, io -> lba_count, spdk_io_complete, io, 0);
+        case SPDK_OP_WRITEV:
+            spdk_io_reset_sgl(io, 0);
+            return spdk_nvme_ns_cmd_writev(queue -> ns, queue -> qpair, io -> lba, io -> lba_count, spdk_io_complete, io, 0,
+                spdk_io_reset_sgl, spdk_io_next_sge);
+        case SPDK_OP_FLUSH:
+            return spdk_nvme_ns_cmd_flush(queue -> ns, queue -> qpair, spdk_io_complete, io);
+    }
+    return -EINVAL;
+}
+
+// Submits io, or queues it behind the ones already waiting.
+static void spdk_io_start(struct spdk_io *io) {
+    struct spdk_queue *queue = io -> queue;
+    int rc = TAILQ_EMPTY(&queue -> backlog) ? spdk_io_submit(io) : -ENOMEM;
+    if (rc == -ENOMEM) {
+        TAILQ_INSERT_TAIL(&queue -> backlog, io, link);
+    } else if (rc != 0) {
+        io -> status = rc;
+        TAILQ_INSERT_TAIL(&queue -> failed, io, link);
+    }
+}
+
+static void spdk_dev_read(struct db_queue *opaque, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct spdk_io *io = spdk_io_alloc((struct spdk_queue *)opaque, SPDK_OP_READ, cb, cb_arg);
+    io -> buf = buf;
+    io -> lba = lba;
+    io -> lba_count = lba_count;
+    spdk_io_start(io);
+}
+
+static void spdk_dev_write(struct db_queue *opaque, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct spdk_io *io = spdk_io_alloc((struct spdk_queue *)opaque, SPDK_OP_WRITE, cb, cb_arg);
+    io -> buf = buf;
+    io -> lba = lba;
+    io -> lba_count = lba_count;
+    spdk_io_start(io);
+}
+
+static void spdk_dev_writev(struct db_queue *opaque, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct spdk_io *io = spdk_io_alloc((struct spdk_queue *)opaque, SPDK_OP_WRITEV, cb, cb_arg);
+    io -> iov = iov;
+    io -> iovcnt = iovcnt;
+    io -> lba = lba;
+    io -> lba_count = lba_count;
+    spdk_io_start(io);
+}
+
+static void spdk_dev_flush(struct db_queue *opaque, device_io_cb cb, void *cb_arg) {
+    spdk_io_start(spdk_io_alloc((struct spdk_queue *)opaque, SPDK_OP_FLUSH, cb, cb_arg));
+}
+
+static int spdk_dev_process_completions(struct db_queue *opaque, unsigned int max_completions) {
+    struct spdk_queue *queue = (struct spdk_queue *)opaque;
+    int completed = 0;
+    struct spdk_io *io;
+    while ((max_completions == 0 || completed < max_completions) && (io = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, io, link);
+        fprintf(stderr, "I/O error status: %s (couldn't submit)\n", strerror(-io -> status));
+        device_io_cb cb = io -> cb;
+        void *cb_arg = io -> cb_arg;
+        int status = io -> status;
+        slab_free(&spdk_io_cache, io);
+        cb(cb_arg, status);
+        completed++;
+    }
+    if (max_completions == 0 || completed < max_completions) {
+        int rc = spdk_nvme_qpair_process_completions(queue -> qpair, max_completions ? max_completions - completed : 0);
+        completed += rc > 0 ? rc : 0;
+    }
+
+    // Completions just freed up requests for whatever's waiting.
+    while ((io = TAILQ_FIRST(&queue -> backlog))) {
+        TAILQ_REMOVE(&queue -> backlog, io, link);
+        int rc = spdk_io_submit(io);
+        if (rc == -ENOMEM) {
+            TAILQ_INSERT_HEAD(&queue -> backlog, io, link);
+            break;
+        }
+        if (rc != 0) {
+            io -> status = rc;
+            TAILQ_INSERT_TAIL(&queue -> failed, io, link);
+        }
+    }
+    return completed;
+}
+
+static struct db_queue *spdk_dev_alloc_queue(struct db_device *dev) {
+    struct spdk_device *state = (struct spdk_device *)dev;
+    struct spdk_queue *queue = calloc(1, sizeof(struct spdk_queue));
+    queue -> queue.dev = dev;
+    queue -> ns = state -> main_namespace -> ns;
+    TAILQ_INIT(&queue -> backlog);
+    TAILQ_INIT(&queue -> failed);
+    queue -> qpair = spdk_nvme_ctrlr_alloc_io_qpair(state -> main_namespace -> ctrlr, NULL, 0);
+    if (queue -> qpair == NULL) {
+        printf("ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed\n");
+        free(queue);
+        return NULL;
+    }
+    return &queue -> queue;
+}
+
+static void spdk_dev_free_queue(struct db_queue *opaque) {
+    struct spdk_queue *queue = (struct spdk_queue *)opaque;
+    spdk_nvme_ctrlr_free_io_qpair(queue -> qpair);
+    struct spdk_io *io;
+    while ((io = TAILQ_FIRST(&queue -> backlog))) {
+        TAILQ_REMOVE(&queue -> backlog, io, link);
+        slab_free(&spdk_io_cache, io);
+    }
+    while ((io = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, io, link);
+        slab_free(&spdk_io_cache, io);
+    }
+    free(queue);
+}
+
+static void *spdk_dev_dma_malloc(struct db_device *dev, size_t size) {
+    return spdk_zmalloc(size, dev -> sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+}
+
+static void spdk_dev_dma_free(struct db_device *dev, void *buf) {
+    spdk_free(buf);
+}
+
+static void spdk_dev_close(struct db_device *dev) {
+    struct spdk_device *state = (struct spdk_device *)dev;
+
+    struct ns_entry *ns_entry, *tmp_ns_entry;
+    TAILQ_FOREACH_SAFE(ns_entry, &state -> g_namespaces, link, tmp_ns_entry) {
+        TAILQ_REMOVE(&state -> g_namespaces, ns_entry, link);
+        free(ns_entry);
+    }
+
+    struct ctrlr_entry *ctrlr_entry, *tmp_ctrlr_entry;
+    TAILQ_FOREACH_SAFE(ctrlr_entry, &state -> g_controllers, link, tmp_ctrlr_entry) {
+        TAILQ_REMOVE(&state -> g_controllers, ctrlr_entry, link);
+        spdk_nvme_detach(ctrlr_entry -> ctrlr);
+        free(ctrlr_entry);
+    }
+
+    free(state);
+}
+
+static const struct db_device_ops spdk_device_ops = {
+    .alloc_queue = spdk_dev_alloc_queue,
+    .free_queue = spdk_dev_free_queue,
+    .read = spdk_dev_read,
+    .write = spdk_dev_write,
+    .writev = spdk_dev_writev,
+    .flush = spdk_dev_flush,
+    .process_completions = spdk_dev_process_completions,
+    .dma_malloc = spdk_dev_dma_malloc,
+    .dma_free = spdk_dev_dma_free,
+    .close = spdk_dev_close,
+};
+
+struct db_device *spdk_device_open(void) {
+    struct spdk_device *state = calloc(1, sizeof(struct spdk_device));
+    TAILQ_INIT(&state -> g_namespaces);
+    TAILQ_INIT(&state -> g_controllers);
+
+    struct spdk_env_opts opts;
+
+    /*
+     * SPDK relies on an abstraction around the local environment
+     * named env that handles memory allocation and PCI device operations.
+     * This library must be initialized first.
+     *
+     */
+    spdk_env_opts_init(&opts);
+    opts.name = "nvme_db";
+    opts.shm_id = 0;
+    if (spdk_env_init(&opts) < 0) {
+        fprintf(stderr, "Unable to initialize SPDK env\n");
+        free(state);
+        return NULL;
+    }
+
+    printf("about to init\n");
+
+    if (spdk_vmd_init()) {
+        fprintf(stderr, "Failed to initialize VMD."
+            " Some NVMe devices can be unavailable.\n");
+        free(state);
+        return NULL;
+    }
+
+    printf("about to probe\n");
+
+    /*
+     * Start the SPDK NVMe enumeration process.  probe_cb will be called
+     *  for each NVMe controller found, giving our application a choice on
+     *  whether to attach to each controller.  attach_cb will then be
+     *  called for each controller after the SPDK NVMe driver has completed
+     *  initializing the controller we chose to attach.
+     */
+    int rc = spdk_nvme_probe(NULL, state, probe_cb, attach_cb, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "spdk_nvme_probe() failed\n");
+        spdk_dev_close(&state -> dev);
+        return NULL;
+    }
+
+    printf("about to tailq empty\n");
+
+    if (TAILQ_EMPTY(&state -> g_controllers) || TAILQ_EMPTY(&state -> g_namespaces)) {
+        fprintf(stderr, "no NVMe controllers found\n");
+        spdk_dev_close(&state -> dev);
+        return NULL;
+    }
+
+    state -> main_namespace = TAILQ_FIRST(&state -> g_namespaces);
+    state -> dev.ops = &spdk_device_ops;
+    state -> dev.name = "spdk";
+    state -> dev.sector_size = spdk_nvme_ns_get_sector_size(state -> main_namespace -> ns);
+    state -> dev.num_sectors = spdk_nvme_ns_get_num_sectors(state -> main_namespace -> ns);
+    state -> dev.max_transfer_size = spdk_nvme_ns_get_max_io_xfer_size(state -> main_namespace -> ns);
+    // With SGLs segments only have to be dword aligned. Without them SPDK builds a PRP list, which needs every
+    // segment but the last to be whole 4KB pages.
+    if (spdk_nvme_ns_get_flags(state -> main_namespace -> ns) & SPDK_NVME_NS_SGL_SUPPORTED) {
+        state -> dev.sgl_alignment = 4;
+    } else {
+        state -> dev.sgl_alignment = 4096;
+    }
+    return &state -> dev;
+}
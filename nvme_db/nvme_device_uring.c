@@ -0,0 +1,313 @@
+//
+//  nvme_device_uring.c
+//
+//
+//  db_device backed by a regular file or a block device opened with O_DIRECT and driven through io_uring.
+//  No kernel-bypass setup required, so this is what runs on cloud VMs, in CI and on laptops.
+//
+
+#define _GNU_SOURCE // O_DIRECT
+#include "nvme_device.h"
+#include "nvme_pool.h"
+
+#include <liburing.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#define URING_DEFAULT_QUEUE_DEPTH 256
+#define URING_FILE_SECTOR_SIZE 4096 // regular files don't have a sector size, but O_DIRECT wants the fs block size.
+#define URING_MAX_TRANSFER_SIZE (1<<20)
+
+struct uring_device {
+    struct db_device dev; // must be first
+    int fd;
+    unsigned int queue_depth;
+};
+
+enum uring_op {
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_WRITEV,
+    URING_OP_FLUSH,
+};
+
+struct uring_request {
+    enum uring_op op;
+    void *buf;
+    struct iovec *iov; // URING_OP_WRITEV
+    int iovcnt;
+    unsigned long long offset;
+    unsigned int length;
+    int status; // for requests in failed: what they complete with
+
+    device_io_cb cb;
+    void *cb_arg;
+
+    TAILQ_ENTRY(uring_request) link;
+};
+
+static struct slab_cache uring_request_cache = SLAB_CACHE_INIT("uring_request", sizeof(struct uring_request));
+
+struct uring_queue {
+    struct db_queue queue; // must be first
+    struct io_uring ring;
+
+    unsigned int in_flight; // submitted to the kernel and not yet reaped
+    unsigned int unsubmitted; // have an sqe but io_uring_submit hasn't been called yet
+
+    // Requests beyond queue_depth wait here rather than failing, so callers can treat the queue as unbounded.
+    TAILQ_HEAD(uring_backlog_head, uring_request) backlog;
+    // Requests that could never be done, e.g. past the end of the device. Completed with their status by the
+    // next process_completions, since callbacks can't run from inside a submission.
+    struct uring_backlog_head failed;
+};
+
+static bool uring_prep(struct uring_queue *queue, struct uring_request *req) {
+    struct uring_device *dev = (struct uring_device *)queue -> queue.dev;
+    if (queue -> in_flight + queue -> unsubmitted >= dev -> queue_depth) {
+        return false;
+    }
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&queue -> ring);
+    if (sqe == NULL) {
+        return false;
+    }
+
+    switch (req -> op) {
+        case URING_OP_READ:
+            io_uring_prep_read(sqe, dev -> fd, req -> buf, req -> length, req -> offset);
+            break;
+        case URING_OP_WRITE:
+            io_uring_prep_write(sqe, dev -> fd, req -> buf, req -> length, req -> offset);
+            break;
+        case URING_OP_WRITEV:
+            io_uring_prep_writev(sqe, dev -> fd, req -> iov, req -> iovcnt, req -> offset);
+            break;
+        case URING_OP_FLUSH:
+            io_uring_prep_fsync(sqe, dev -> fd, IORING_FSYNC_DATASYNC);
+            break;
+    }
+    io_uring_sqe_set_data(sqe, req);
+    queue -> unsubmitted++;
+    return true;
+}
+
+static void uring_queue_request(struct db_queue *opaque, enum uring_op op, void *buf, struct iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct uring_queue *queue = (struct uring_queue *)opaque;
+    struct db_device *dev = opaque -> dev;
+    struct uring_request *req = slab_alloc(&uring_request_cache);
+    req -> op = op;
+    req -> buf = buf;
+    req -> iov = iov;
+    req -> iovcnt = iovcnt;
+    req -> offset = lba * dev -> sector_size;
+    req -> length = lba_count * dev -> sector_size;
+    req -> cb = cb;
+    req -> cb_arg = cb_arg;
+    req -> status = 0;
+    if (op != URING_OP_FLUSH && lba + lba_count > dev -> num_sectors) {
+        req -> status = -EINVAL;
+        TAILQ_INSERT_TAIL(&queue -> failed, req, link);
+        return;
+    }
+
+    // Submission is batched: sqes are handed to the kernel all at once in process_completions.
+    if (!TAILQ_EMPTY(&queue -> backlog) || !uring_prep(queue, req)) {
+        TAILQ_INSERT_TAIL(&queue -> backlog, req, link);
+    }
+}
+
+static void uring_dev_read(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    uring_queue_request(queue, URING_OP_READ, buf, NULL, 0, lba, lba_count, cb, cb_arg);
+}
+
+static void uring_dev_write(struct db_queue *queue, void *buf, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    uring_queue_request(queue, URING_OP_WRITE, buf, NULL, 0, lba, lba_count, cb, cb_arg);
+}
+
+// The kernel wants struct iovecs, which it reads when the sqe is submitted, so they live as long as the request.
+static void uring_dev_writev(struct db_queue *queue, struct db_iovec *iov, int iovcnt, unsigned long long lba, unsigned int lba_count, device_io_cb cb, void *cb_arg) {
+    struct iovec *kernel_iov = malloc(iovcnt * sizeof(struct iovec));
+    for (int i = 0; i < iovcnt; i++) {
+        kernel_iov[i] = (struct iovec){.iov_base=iov[i].base, .iov_len=iov[i].length};
+    }
+    uring_queue_request(queue, URING_OP_WRITEV, NULL, kernel_iov, iovcnt, lba, lba_count, cb, cb_arg);
+}
+
+static void uring_dev_flush(struct db_queue *queue, device_io_cb cb, void *cb_arg) {
+    uring_queue_request(queue, URING_OP_FLUSH, NULL, NULL, 0, 0, 0, cb, cb_arg);
+}
+
+static void uring_complete(struct uring_request *req, int status) {
+    if (status != 0) {
+        fprintf(stderr, "I/O error status: %s (op %d, offset %llu, length %u)\n", strerror(-status), req -> op, req -> offset, req -> length);
+    }
+    req -> cb(req -> cb_arg, status);
+    free(req -> iov);
+    slab_free(&uring_request_cache, req);
+}
+
+static int uring_dev_process_completions(struct db_queue *opaque, unsigned int max_completions) {
+    struct uring_queue *queue = (struct uring_queue *)opaque;
+    int completed = 0;
+    struct uring_request *failed;
+    while ((max_completions == 0 || completed < max_completions) && (failed = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, failed, link);
+        uring_complete(failed, failed -> status);
+        completed++;
+    }
+
+    while (!TAILQ_EMPTY(&queue -> backlog) && uring_prep(queue, TAILQ_FIRST(&queue -> backlog))) {
+        TAILQ_REMOVE(&queue -> backlog, TAILQ_FIRST(&queue -> backlog), link);
+    }
+    if (queue -> unsubmitted) {
+        int submitted = io_uring_submit(&queue -> ring);
+        if (submitted > 0) {
+            queue -> unsubmitted -= submitted;
+            queue -> in_flight += submitted;
+        }
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((max_completions == 0 || completed < max_completions) && io_uring_peek_cqe(&queue -> ring, &cqe) == 0) {
+        struct uring_request *req = io_uring_cqe_get_data(cqe);
+        int status = 0;
+        if (cqe -> res < 0) {
+            status = cqe -> res;
+        } else if (req -> op != URING_OP_FLUSH && (unsigned int)cqe -> res != req -> length) {
+            status = -EIO; // short read/write. O_DIRECT on a sized file shouldn't do this.
+        }
+        io_uring_cqe_seen(&queue -> ring, cqe);
+        queue -> in_flight--;
+        uring_complete(req, status);
+        completed++;
+    }
+    return completed;
+}
+
+static struct db_queue *uring_dev_alloc_queue(struct db_device *opaque) {
+    struct uring_device *dev = (struct uring_device *)opaque;
+    struct uring_queue *queue = calloc(1, sizeof(struct uring_queue));
+    queue -> queue.dev = opaque;
+    TAILQ_INIT(&queue -> backlog);
+    TAILQ_INIT(&queue -> failed);
+    int rc = io_uring_queue_init(dev -> queue_depth, &queue -> ring, 0);
+    if (rc < 0) {
+        fprintf(stderr, "io_uring_queue_init failed: %s\n", strerror(-rc));
+        free(queue);
+        return NULL;
+    }
+    return &queue -> queue;
+}
+
+static void uring_dev_free_queue(struct db_queue *opaque) {
+    struct uring_queue *queue = (struct uring_queue *)opaque;
+    io_uring_queue_exit(&queue -> ring);
+    struct uring_request *req;
+    while ((req = TAILQ_FIRST(&queue -> backlog))) {
+        TAILQ_REMOVE(&queue -> backlog, req, link);
+        free(req -> iov);
+        slab_free(&uring_request_cache, req);
+    }
+    while ((req = TAILQ_FIRST(&queue -> failed))) {
+        TAILQ_REMOVE(&queue -> failed, req, link);
+        free(req -> iov);
+        slab_free(&uring_request_cache, req);
+    }
+    free(queue);
+}
+
+static void *uring_dev_dma_malloc(struct db_device *dev, size_t size) {
+    void *buf;
+    if (posix_memalign(&buf, dev -> sector_size, size)) {
+        return NULL;
+    }
+    memset(buf, 0, size);
+    return buf;
+}
+
+static void uring_dev_dma_free(struct db_device *dev, void *buf) {
+    free(buf);
+}
+
+static void uring_dev_close(struct db_device *opaque) {
+    struct uring_device *dev = (struct uring_device *)opaque;
+    close(dev -> fd);
+    free(dev);
+}
+
+static const struct db_device_ops uring_device_ops = {
+    .alloc_queue = uring_dev_alloc_queue,
+    .free_queue = uring_dev_free_queue,
+    .read = uring_dev_read,
+    .write = uring_dev_write,
+    .writev = uring_dev_writev,
+    .flush = uring_dev_flush,
+    .process_completions = uring_dev_process_completions,
+    .dma_malloc = uring_dev_dma_malloc,
+    .dma_free = uring_dev_dma_free,
+    .close = uring_dev_close,
+};
+
+// size is only used for regular files, which are extended to it if they're smaller.
+struct db_device *uring_device_open(const char *path, unsigned long long size, unsigned int queue_depth) {
+    int fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return NULL;
+    }
+
+    unsigned int sector_size = URING_FILE_SECTOR_SIZE;
+    unsigned long long device_bytes = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+        int logical_block_size;
+        if (ioctl(fd, BLKSSZGET, &logical_block_size) != 0 || ioctl(fd, BLKGETSIZE64, &device_bytes) != 0) {
+            perror("ioctl");
+            close(fd);
+            return NULL;
+        }
+        sector_size = logical_block_size;
+    } else if (device_bytes < size) {
+        if (ftruncate(fd, size) != 0) {
+            perror("ftruncate");
+            close(fd);
+            return NULL;
+        }
+        device_bytes = size;
+    }
+
+    if (device_bytes < sector_size) {
+        fprintf(stderr, "%s is too small to hold a database (%llu bytes)\n", path, device_bytes);
+        close(fd);
+        return NULL;
+    }
+
+    struct uring_device *dev = calloc(1, sizeof(struct uring_device));
+    dev -> fd = fd;
+    dev -> queue_depth = queue_depth ? queue_depth : URING_DEFAULT_QUEUE_DEPTH;
+    dev -> dev.ops = &uring_device_ops;
+    dev -> dev.name = "uring";
+    dev -> dev.sector_size = sector_size;
+    dev -> dev.num_sectors = device_bytes / sector_size;
+    dev -> dev.max_transfer_size = URING_MAX_TRANSFER_SIZE;
+    // O_DIRECT needs every segment of a writev to be a multiple of the logical block size long, which we take
+    // to be the sector size, and starting at an address aligned to it.
+    dev -> dev.sgl_alignment = sector_size;
+    printf("Opened %s: %llu sectors of %u bytes\n", path, dev -> dev.num_sectors, sector_size);
+    return &dev -> dev;
+}
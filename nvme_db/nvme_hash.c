@@ -0,0 +1,288 @@
+//
+//  nvme_hash.c
+//
+//
+
+#include "nvme_hash.h"
+
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define STRIPE_BYTES 32
+#define STRIPES_PER_SCRAMBLE 16 // accumulators are scrambled every 512 bytes so long keys keep mixing
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define HASH_SEED 0x5555555555555555ULL // 0b01010101, for old times' sake
+
+// Arbitrary constants. Each stripe lane is xored with one before multiplying, and the accumulators
+// with another at every scramble and at the end.
+static const unsigned long long stripe_secret[4] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+};
+static const unsigned long long scramble_secret[4] = {
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+static const unsigned long long merge_secret[4] = {
+    0xcb00c391bb52283cULL, 0xa32e531b8b65d088ULL, 0x4ef90da297486471ULL, 0xd8acdea946ef1938ULL,
+};
+static const unsigned long long acc_init[4] = {
+    PRIME32_1, PRIME64_1, PRIME64_2, 0x165667B19E3779F9ULL,
+};
+
+static inline unsigned long long read64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v)); // keys in key_vla aren't aligned
+    return v;
+}
+
+static inline unsigned long long read32(const unsigned char *p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 64x64->128 multiply folded back to 64 bits.
+static inline unsigned long long mum(unsigned long long a, unsigned long long b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (unsigned long long)product ^ (unsigned long long)(product >> 64);
+}
+
+static inline unsigned long long avalanche(unsigned long long h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Keys of up to 32 bytes, which every variant hashes the same way. Every byte of the key is read,
+// including the last length % 8, which is the main thing the old xor hash got wrong.
+static unsigned long long hash_short(const unsigned char *p, unsigned long long length) {
+    unsigned long long a, b;
+    if (length > 16) {
+        a = read64(p) ^ read64(p + length - 16);
+        b = read64(p + 8) ^ read64(p + length - 8);
+        a = mum(a ^ stripe_secret[0], read64(p + 8) ^ stripe_secret[1]) ^ a;
+        b = mum(b ^ stripe_secret[2], read64(p + length - 16) ^ stripe_secret[3]) ^ b;
+    } else if (length >= 8) {
+        a = read64(p);
+        b = read64(p + length - 8);
+    } else if (length >= 4) {
+        a = read32(p);
+        b = read32(p + length - 4);
+    } else if (length > 0) {
+        a = ((unsigned long long)p[0] << 16) | ((unsigned long long)p[length >> 1] << 8) | p[length - 1];
+        b = 0;
+    } else {
+        a = b = 0;
+    }
+    return avalanche(mum(a ^ stripe_secret[0] ^ HASH_SEED, b ^ stripe_secret[1] ^ length));
+}
+
+static unsigned long long merge_accumulators(const unsigned long long acc[4], unsigned long long length) {
+    unsigned long long h = length * PRIME64_1;
+    h += mum(acc[0] ^ merge_secret[0], acc[1] ^ merge_secret[1]);
+    h += mum(acc[2] ^ merge_secret[2], acc[3] ^ merge_secret[3]);
+    return avalanche(h);
+}
+
+// SCALAR
+
+static inline void stripe_scalar(unsigned long long acc[4], const unsigned char *p) {
+    for (int i = 0; i < 4; i++) {
+        unsigned long long data = read64(p + 8 * i);
+        unsigned long long data_key = data ^ stripe_secret[i];
+        acc[i ^ 1] += data; // keeps the raw data around so it can't be multiplied away by a zero
+        acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+    }
+}
+
+static inline void scramble_scalar(unsigned long long acc[4]) {
+    for (int i = 0; i < 4; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= scramble_secret[i];
+        acc[i] *= PRIME32_1;
+    }
+}
+
+static unsigned long long hash_scalar(const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    if (length <= STRIPE_BYTES) {
+        return hash_short(p, length);
+    }
+
+    unsigned long long acc[4] = {acc_init[0], acc_init[1], acc_init[2], acc_init[3]};
+    unsigned long long stripes = (length - 1) / STRIPE_BYTES; // full stripes, not counting the final one
+    unsigned long long s = 0;
+    for (; s + STRIPES_PER_SCRAMBLE <= stripes; s += STRIPES_PER_SCRAMBLE) {
+        for (int i = 0; i < STRIPES_PER_SCRAMBLE; i++) {
+            stripe_scalar(acc, p + (s + i) * STRIPE_BYTES);
+        }
+        scramble_scalar(acc);
+    }
+    for (; s < stripes; s++) {
+        stripe_scalar(acc, p + s * STRIPE_BYTES);
+    }
+    stripe_scalar(acc, p + length - STRIPE_BYTES); // last 32 bytes, overlapping the previous stripe
+    return merge_accumulators(acc, length);
+}
+
+#if defined(__x86_64__)
+
+// SSE2: the four accumulators as two vectors of two. _mm_mul_epu32 multiplies the low 32 bits of each
+// 64-bit lane, and swapping the 64-bit halves gives the acc[i ^ 1] += data pairing.
+
+static inline void stripe_sse2(__m128i acc[2], const unsigned char *p) {
+    for (int i = 0; i < 2; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        __m128i data_key = _mm_xor_si128(data, _mm_loadu_si128((const __m128i *)(stripe_secret + 2 * i)));
+        __m128i product = _mm_mul_epu32(data_key, _mm_srli_epi64(data_key, 32));
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+    }
+}
+
+static inline void scramble_sse2(__m128i acc[2]) {
+    __m128i prime = _mm_set1_epi32(PRIME32_1);
+    for (int i = 0; i < 2; i++) {
+        __m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(scramble_secret + 2 * i)));
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+}
+
+static unsigned long long hash_sse2(const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    if (length <= STRIPE_BYTES) {
+        return hash_short(p, length);
+    }
+
+    __m128i acc[2] = {
+        _mm_loadu_si128((const __m128i *)acc_init),
+        _mm_loadu_si128((const __m128i *)(acc_init + 2)),
+    };
+    unsigned long long stripes = (length - 1) / STRIPE_BYTES;
+    unsigned long long s = 0;
+    for (; s + STRIPES_PER_SCRAMBLE <= stripes; s += STRIPES_PER_SCRAMBLE) {
+        for (int i = 0; i < STRIPES_PER_SCRAMBLE; i++) {
+            stripe_sse2(acc, p + (s + i) * STRIPE_BYTES);
+        }
+        scramble_sse2(acc);
+    }
+    for (; s < stripes; s++) {
+        stripe_sse2(acc, p + s * STRIPE_BYTES);
+    }
+    stripe_sse2(acc, p + length - STRIPE_BYTES);
+
+    unsigned long long acc_out[4];
+    _mm_storeu_si128((__m128i *)acc_out, acc[0]);
+    _mm_storeu_si128((__m128i *)(acc_out + 2), acc[1]);
+    return merge_accumulators(acc_out, length);
+}
+
+// AVX2: all four accumulators in one vector. _mm256_shuffle_epi32 works within 128-bit halves, so the
+// pairing is the same as SSE2's.
+
+__attribute__((target("avx2")))
+static inline void stripe_avx2(__m256i *acc, const unsigned char *p, __m256i secret) {
+    __m256i data = _mm256_loadu_si256((const __m256i *)p);
+    __m256i data_key = _mm256_xor_si256(data, secret);
+    __m256i product = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+    __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+    *acc = _mm256_add_epi64(*acc, _mm256_add_epi64(product, swapped));
+}
+
+__attribute__((target("avx2")))
+static unsigned long long hash_avx2(const void *data, unsigned long long length) {
+    const unsigned char *p = data;
+    if (length <= STRIPE_BYTES) {
+        return hash_short(p, length);
+    }
+
+    __m256i acc = _mm256_loadu_si256((const __m256i *)acc_init);
+    __m256i secret = _mm256_loadu_si256((const __m256i *)stripe_secret);
+    __m256i scramble = _mm256_loadu_si256((const __m256i *)scramble_secret);
+    __m256i prime = _mm256_set1_epi32(PRIME32_1);
+    unsigned long long stripes = (length - 1) / STRIPE_BYTES;
+    unsigned long long s = 0;
+    for (; s + STRIPES_PER_SCRAMBLE <= stripes; s += STRIPES_PER_SCRAMBLE) {
+        for (int i = 0; i < STRIPES_PER_SCRAMBLE; i++) {
+            stripe_avx2(&acc, p + (s + i) * STRIPE_BYTES, secret);
+        }
+        __m256i a = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+        a = _mm256_xor_si256(a, scramble);
+        __m256i lo = _mm256_mul_epu32(a, prime);
+        __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+        acc = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+    for (; s < stripes; s++) {
+        stripe_avx2(&acc, p + s * STRIPE_BYTES, secret);
+    }
+    stripe_avx2(&acc, p + length - STRIPE_BYTES, secret);
+
+    unsigned long long acc_out[4];
+    _mm256_storeu_si256((__m256i *)acc_out, acc);
+    return merge_accumulators(acc_out, length);
+}
+
+#endif
+
+// DISPATCH
+
+static unsigned long long hash_resolve(const void *data, unsigned long long length);
+static hash_fn hash_dispatch = hash_resolve;
+static const char *hash_dispatch_name = NULL;
+
+static void pick_impl(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hash_dispatch_name = "avx2";
+        hash_dispatch = hash_avx2;
+        return;
+    }
+    hash_dispatch_name = "sse2"; // always there on x86-64
+    hash_dispatch = hash_sse2;
+#else
+    hash_dispatch_name = "scalar";
+    hash_dispatch = hash_scalar;
+#endif
+}
+
+// First call through hash_dispatch lands here. Racing threads all pick the same thing, so no lock needed.
+static unsigned long long hash_resolve(const void *data, unsigned long long length) {
+    pick_impl();
+    return hash_dispatch(data, length);
+}
+
+unsigned long long hash_bytes(const void *data, unsigned long long length) {
+    return hash_dispatch(data, length);
+}
+
+const char *hash_impl_name(void) {
+    if (hash_dispatch_name == NULL) {
+        pick_impl();
+    }
+    return hash_dispatch_name;
+}
+
+hash_fn hash_impl(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return hash_scalar;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) {
+        return hash_sse2;
+    }
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        return hash_avx2;
+    }
+#endif
+    return NULL;
+}
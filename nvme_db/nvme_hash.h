@@ -0,0 +1,24 @@
+//
+//  nvme_hash.h
+//
+//
+//  64-bit key hash. It's an xxh3-style design: keys over 32 bytes are folded through four 64-bit
+//  accumulators 32 bytes at a time, which maps directly onto SSE2 (2x2 lanes) and AVX2 (4 lanes), and
+//  every variant computes exactly the same function, so which one runs is only a matter of speed. The
+//  best one the CPU supports is picked the first time hash_bytes is called.
+//
+
+#ifndef nvme_hash_h
+#define nvme_hash_h
+
+typedef unsigned long long (*hash_fn)(const void *data, unsigned long long length);
+
+unsigned long long hash_bytes(const void *data, unsigned long long length);
+
+// Name of the variant hash_bytes dispatches to ("avx2", "sse2" or "scalar").
+const char *hash_impl_name(void);
+
+// The individual variants, for benchmarking. NULL if not supported by this CPU/build.
+hash_fn hash_impl(const char *name);
+
+#endif /* nvme_hash_h */
@@ -0,0 +1,260 @@
+//
+//  nvme_index.c
+//
+//
+
+#include "nvme_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define CTRL_EMPTY 0
+#define CTRL_DELETED 1
+
+// Groups moved from the old table per insert while resizing. The new table has twice the slots, so even
+// at 1 this finishes long before the new table fills up. 4 keeps the window where lookups have to
+// check both tables short.
+#define MIGRATE_GROUPS_PER_INSERT 4
+
+// The upper 32 bits of the hash are kept in the slot and also pick the group, so they can be recovered
+// when moving slots between tables without going back to the keys. The control byte takes 7 bits from
+// the lower half so it's independent of both.
+static inline unsigned int hash_fingerprint(unsigned long long hash) {
+    return hash >> 32;
+}
+
+static inline unsigned char hash_ctrl(unsigned long long hash) {
+    return 0x80 | ((hash >> 25) & 0x7f);
+}
+
+// Bitmask of the slots in group whose control byte equals ctrl.
+static inline unsigned int group_match(const struct index_group *group, unsigned char ctrl) {
+#ifdef __SSE2__
+    __m128i ctrl_bytes = _mm_loadu_si128((const __m128i *)group -> ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_bytes, _mm_set1_epi8((char)ctrl)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < INDEX_GROUP_SLOTS; i++) {
+        mask |= (group -> ctrl[i] == ctrl) << i;
+    }
+    return mask;
+#endif
+}
+
+static bool table_alloc(struct index_table *table, unsigned long long num_groups) {
+    // Straight from mmap so the table is backed by zero pages until it's actually used. calloc can't be
+    // trusted with that: once glibc has freed an mmap'd chunk it raises its mmap threshold, and then
+    // calloc memsets tens of MB on the write path.
+    void *groups = mmap(NULL, num_groups * sizeof(struct index_group), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (groups == MAP_FAILED) {
+        return false;
+    }
+    table -> groups = groups;
+    table -> used = 0;
+    table -> num_groups = num_groups; // last, so a concurrent index_find never sees more groups than there are
+    return true;
+}
+
+static void table_free(struct index_table *table) {
+    if (table -> num_groups) {
+        munmap(table -> groups, table -> num_groups * sizeof(struct index_group));
+    }
+    table -> groups = NULL;
+    table -> num_groups = 0;
+    table -> used = 0;
+}
+
+// Empties the table, but leaves its groups mapped until index_reclaim in case a lookup is still in them.
+static void table_retire(struct key_index *index, struct index_table *table) {
+    struct retired_table *retired = malloc(sizeof(struct retired_table));
+    retired -> groups = table -> groups;
+    retired -> num_groups = table -> num_groups;
+    retired -> next = index -> retired;
+    index -> retired = retired;
+    table -> num_groups = 0; // groups stays pointing at the old table, see index_find
+    table -> used = 0;
+}
+
+static inline bool table_too_full(struct index_table *table) {
+    return (table -> used + 1) * 8 > table -> num_groups * INDEX_GROUP_SLOTS * 7;
+}
+
+// Probes table for a full slot with this ctrl/fingerprint that match accepts. On success sets *group_out and *slot_out.
+static bool table_find(struct index_table *table, unsigned char ctrl, unsigned int fingerprint, index_match_cb match, void *ctx,
+                       struct index_group **group_out, int *slot_out) {
+    // num_groups before groups: groups is then at least as new, and tables only ever get replaced by bigger
+    // ones, so even if a resize is going on this never reads past the end of a table.
+    unsigned long long num_groups = table -> num_groups;
+    if (num_groups == 0) {
+        return false;
+    }
+    struct index_group *groups = table -> groups;
+
+    unsigned long long group_mask = num_groups - 1;
+    unsigned long long group_idx = fingerprint & group_mask;
+    for (unsigned long long step = 1; step <= num_groups; step++) { // triangular probing visits every group
+        struct index_group *group = &groups[group_idx];
+        unsigned int candidates = group_match(group, ctrl);
+        while (candidates) {
+            int slot = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            if (group -> slots[slot].fingerprint == fingerprint && match(ctx, group -> slots[slot].key_idx)) {
+                *group_out = group;
+                *slot_out = slot;
+                return true;
+            }
+        }
+        if (group_match(group, CTRL_EMPTY)) { // the key would have been put here
+            return false;
+        }
+        group_idx = (group_idx + step) & group_mask;
+    }
+    return false;
+}
+
+static void table_insert(struct index_table *table, unsigned char ctrl, unsigned int fingerprint, unsigned int key_idx) {
+    unsigned long long group_mask = table -> num_groups - 1;
+    unsigned long long group_idx = fingerprint & group_mask;
+    for (unsigned long long step = 1; ; step++) {
+        struct index_group *group = &table -> groups[group_idx];
+        unsigned int empty = group_match(group, CTRL_EMPTY);
+        unsigned int free_slots = empty | group_match(group, CTRL_DELETED);
+        if (free_slots) {
+            int slot = __builtin_ctz(free_slots);
+            if (empty & (1 << slot)) {
+                table -> used++;
+            }
+            group -> slots[slot] = (struct index_slot){.fingerprint = fingerprint, .key_idx = key_idx};
+            group -> ctrl[slot] = ctrl;
+            return;
+        }
+        group_idx = (group_idx + step) & group_mask;
+    }
+}
+
+static void migrate_groups(struct key_index *index, unsigned long long max_groups) {
+    struct index_table *old = &index -> old;
+    unsigned long long end = index -> migrate_pos + max_groups;
+    if (end > old -> num_groups) {
+        end = old -> num_groups;
+    }
+
+    for (; index -> migrate_pos < end; index -> migrate_pos++) {
+        struct index_group *group = &old -> groups[index -> migrate_pos];
+        for (int slot = 0; slot < INDEX_GROUP_SLOTS; slot++) {
+            if (group -> ctrl[slot] & 0x80) {
+                table_insert(&index -> current, group -> ctrl[slot], group -> slots[slot].fingerprint, group -> slots[slot].key_idx);
+            }
+        }
+    }
+
+    if (index -> migrate_pos == old -> num_groups) {
+        table_retire(index, old);
+        index -> migrate_pos = 0;
+    }
+}
+
+static void start_resize(struct key_index *index) {
+    if (index -> old.num_groups) { // previous resize still going (only possible with lots of deletes). Finish it first.
+        migrate_groups(index, index -> old.num_groups);
+    }
+
+    // If most of `used` is deleted slots, rehashing into the same size is enough.
+    unsigned long long num_groups = index -> current.num_groups;
+    if (index -> num_keys * 2 >= index -> current.used) {
+        num_groups *= 2;
+    }
+
+    index -> old.groups = index -> current.groups;
+    index -> old.used = index -> current.used;
+    index -> old.num_groups = index -> current.num_groups;
+    index -> migrate_pos = 0;
+    if (!table_alloc(&index -> current, num_groups)) {
+        abort(); // nothing sensible to do if we can't grow the index.
+    }
+}
+
+void index_init(struct key_index *index, unsigned long long initial_capacity) {
+    memset(index, 0, sizeof(struct key_index));
+    unsigned long long num_groups = 1;
+    while (num_groups * INDEX_GROUP_SLOTS * 7 / 8 < initial_capacity) {
+        num_groups *= 2;
+    }
+    table_alloc(&index -> current, num_groups);
+}
+
+void index_reclaim(struct key_index *index) {
+    while (index -> retired) {
+        struct retired_table *retired = index -> retired;
+        index -> retired = retired -> next;
+        munmap(retired -> groups, retired -> num_groups * sizeof(struct index_group));
+        free(retired);
+    }
+}
+
+void index_free(struct key_index *index) {
+    table_free(&index -> current);
+    table_free(&index -> old);
+    index_reclaim(index);
+    memset(index, 0, sizeof(struct key_index));
+}
+
+long long index_find(struct key_index *index, unsigned long long hash, index_match_cb match, void *ctx) {
+    unsigned char ctrl = hash_ctrl(hash);
+    unsigned int fingerprint = hash_fingerprint(hash);
+    struct index_group *group;
+    int slot;
+    if (table_find(&index -> current, ctrl, fingerprint, match, ctx, &group, &slot) ||
+        table_find(&index -> old, ctrl, fingerprint, match, ctx, &group, &slot)) {
+        return group -> slots[slot].key_idx;
+    }
+    return -1;
+}
+
+void index_insert(struct key_index *index, unsigned long long hash, unsigned int key_idx) {
+    if (table_too_full(&index -> current)) {
+        start_resize(index);
+    }
+    table_insert(&index -> current, hash_ctrl(hash), hash_fingerprint(hash), key_idx);
+    index -> num_keys++;
+
+    if (index -> old.num_groups) {
+        migrate_groups(index, MIGRATE_GROUPS_PER_INSERT);
+    }
+}
+
+static bool match_key_idx(void *ctx, unsigned int key_idx) {
+    return *(unsigned int *)ctx == key_idx;
+}
+
+static bool table_remove(struct index_table *table, unsigned char ctrl, unsigned int fingerprint, unsigned int key_idx) {
+    struct index_group *group;
+    int slot;
+    if (!table_find(table, ctrl, fingerprint, match_key_idx, &key_idx, &group, &slot)) {
+        return false;
+    }
+    // If the group has never been full, no probe sequence continued past it and the slot can go straight back to empty.
+    if (group_match(group, CTRL_EMPTY)) {
+        group -> ctrl[slot] = CTRL_EMPTY;
+        table -> used--;
+    } else {
+        group -> ctrl[slot] = CTRL_DELETED;
+    }
+    return true;
+}
+
+bool index_remove(struct key_index *index, unsigned long long hash, unsigned int key_idx) {
+    unsigned char ctrl = hash_ctrl(hash);
+    unsigned int fingerprint = hash_fingerprint(hash);
+    // While resizing, a migrated key can be in both tables.
+    bool removed = table_remove(&index -> current, ctrl, fingerprint, key_idx);
+    removed |= table_remove(&index -> old, ctrl, fingerprint, key_idx);
+    if (removed) {
+        index -> num_keys--;
+    }
+    return removed;
+}
@@ -0,0 +1,85 @@
+//
+//  nvme_index.h
+//
+//
+//  Flat open-addressing hash index from key hash -> index in db -> keys. Replaces the old key_node tree.
+//
+//  Slots are grouped 16 at a time behind 16 control bytes (SwissTable style), and a whole group's
+//  control bytes are compared with one SSE2 instruction. Each slot also carries 32 more bits of the hash,
+//  so a lookup only touches db -> keys for what is almost certainly the right key: one miss for the
+//  group, usually none more for the slot since it sits right behind the control bytes.
+//
+//  Growth is incremental. When the table gets too full a table twice the size is mmap'd (zero pages, so
+//  it costs nothing up front) and every insert then moves a few groups over from the old table, so no
+//  single write ever pays for rehashing the whole index.
+//
+//  index_find can run while another thread modifies the index (see the optimistic lookups in nvme_key.c).
+//  It can then give a wrong answer, which the caller has to detect, but it never touches unmapped memory:
+//  tables replaced by a resize stay mapped until index_reclaim, and num_groups is always published after
+//  the groups it describes.
+//
+
+#ifndef nvme_index_h
+#define nvme_index_h
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define INDEX_GROUP_SLOTS 16
+
+struct index_slot {
+    unsigned int fingerprint; // upper 32 bits of the hash
+    unsigned int key_idx; // idx in db -> keys, so there can be at most MAX_KEY_ENTRIES (see nvme_key.h)
+};
+
+// A control byte is 0 for empty, 1 for deleted, and 0x80 | (7 bits of the hash) for full. Empty being 0
+// means a freshly mmap'd table is already initialized.
+struct index_group {
+    unsigned char ctrl[INDEX_GROUP_SLOTS];
+    struct index_slot slots[INDEX_GROUP_SLOTS];
+};
+
+struct index_table {
+    struct index_group *groups;
+    _Atomic unsigned long long num_groups; // always a power of 2. 0 if the table is empty, in which case groups may be stale.
+    unsigned long long used; // full + deleted slots, which is what determines probe lengths
+};
+
+struct retired_table {
+    struct index_group *groups;
+    unsigned long long num_groups;
+    struct retired_table *next;
+};
+
+struct key_index {
+    struct index_table current;
+    struct index_table old; // only non-empty while a resize is in progress
+    unsigned long long migrate_pos; // next group of `old` to move into `current`
+    unsigned long long num_keys;
+    struct retired_table *retired; // replaced tables, kept until index_reclaim
+};
+
+// Called on every slot whose fingerprint matches, to check whether it's really the key being looked for.
+typedef bool (*index_match_cb)(void *ctx, unsigned int key_idx);
+
+void index_init(struct key_index *index, unsigned long long initial_capacity);
+void index_free(struct key_index *index);
+
+// Unmaps the tables replaced by resizes so far. Only once no index_find could still be looking at them.
+void index_reclaim(struct key_index *index);
+
+// Returns the key_idx match accepted, or -1.
+long long index_find(struct key_index *index, unsigned long long hash, index_match_cb match, void *ctx);
+
+// The key must not already be in the index.
+void index_insert(struct key_index *index, unsigned long long hash, unsigned int key_idx);
+
+// Returns whether key_idx was found (and removed).
+bool index_remove(struct key_index *index, unsigned long long hash, unsigned int key_idx);
+
+// Bytes of table the index has mapped, both tables' while it's resizing.
+static inline unsigned long long index_bytes(struct key_index *index) {
+    return (index -> current.num_groups + index -> old.num_groups) * sizeof(struct index_group);
+}
+
+#endif /* nvme_index_h */
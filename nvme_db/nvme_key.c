@@ -6,330 +6,854 @@
 //
 
 #include "nvme_key.h"
+#include "nvme_hash.h"
 #include "nvme_key_init.h"
 #include "nvme_read_key_async.h"
+#include "nvme_recover.h"
+#include "nvme_shard.h"
 #include "nvme_write_key_async.h"
 
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
-#include <sys/time.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define INITIAL_CAPACITY (100)
+// The first segments of db -> keys and key_vla (see nvme_arena.h): 4096 keys, and 64KB of key bytes, which is
+// just enough for the longest key. Each one after that is twice as big.
+#define KEYS_FIRST_SEGMENT_SHIFT 12
+#define KEY_VLA_FIRST_SEGMENT_SHIFT 16
+#define OPTIMISTIC_LOOKUP_TRIES 4 // before a read gives up and looks the key up under the lock
+
+struct slab_cache write_state_cache = SLAB_CACHE_INIT("write_cb_state", sizeof(struct write_cb_state));
 
 // HELPER FUNCTIONS
 
+// Tries at the lock before parking on the futex. A poll usually holds it for a few us, which this about covers.
+#define LOCK_SPINS 64
+#define LOCK_MAX_BACKOFF 64 // PAUSEs between tries
+
+static inline void cpu_relax(void) {
+#ifdef __SSE2__
+    _mm_pause(); // tells the core we're spinning, so it doesn't flood the lock's cache line and frees up the sibling hyperthread.
+#endif
+}
+
+// The lock is 0 when free, 1 when held and 2 when held and someone may be parked on it in the kernel, so
+// release_lock only makes a syscall when it could be needed (this is the mutex from Drepper's "Futexes Are Tricky").
+// Waiters spin first, with exponential backoff between tries, and only check the lock with a plain load so
+// they share its cache line instead of bouncing it around with cmpxchgs. If that doesn't get it they park,
+// and the kernel wakes them about in arrival order.
 void acq_lock(struct db_state *db) {
-    // C atomics have weird semantics. Here's what this compiles to on x86:
-    /**
-     acq_lock:                               # @acq_lock
-             mov     ecx, 1
-     .LBB0_1:                                # =>This Inner Loop Header: Depth=1
-             xor     eax, eax
-             lock            cmpxchg dword ptr [rdi], ecx
-             jne     .LBB0_1
-             ret
-     */
-    // So to start, we set ECX to 1 (the third parameter to atomic_compare_exchange_strong).
-    // Then we enter our loop body. We set EAX to 0 (success) and then issue a `lock cmpxchg`.
-    // https://www.felixcloutier.com/x86/cmpxchg
-    // This compares EAX (0) with the destination operand ([rdi], which is db -> lock).
-    // If the two values are equal (i.e. the lock is 0) load ecx (1) into the destination operand (the lock) atomically, and
-    // set the zero flag. If they are not, clear the zero flag. `jne .LBB0_1` returns to the top of our loop
-    // if the zero flag is not set. So we continually try to get the lock.
-    //
-    // This way there is no race between making sure the lock is 0 and then acquiring the lock.
-    int success = 0;
-    atomic_compare_exchange_strong(&db -> lock, &success, 1);
-    while (success != 0) {
-        success = 0;
-        atomic_compare_exchange_strong(&db -> lock, &success, 1);
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&db -> lock, &expected, 1)) {
+        return;
+    }
+
+    unsigned int backoff = 1;
+    for (int i = 0; i < LOCK_SPINS; i++) {
+        for (unsigned int j = 0; j < backoff; j++) {
+            cpu_relax();
+        }
+        if (backoff < LOCK_MAX_BACKOFF) {
+            backoff *= 2;
+        }
+        expected = 0;
+        if (atomic_load_explicit(&db -> lock, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak(&db -> lock, &expected, 1)) {
+            return;
+        }
+    }
+
+    // Whoever gets it this way has to assume others are still parked, hence 2.
+    while (atomic_exchange(&db -> lock, 2) != 0) {
+        syscall(SYS_futex, &db -> lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
     }
 }
 
 void release_lock(struct db_state *db) {
-    db -> lock = 0;
+    if (atomic_exchange(&db -> lock, 0) == 2) {
+        syscall(SYS_futex, &db -> lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
 }
 
-static unsigned int hash_key(db_data key) {
-    unsigned int hash = 0x55555555; // 0b01010101
-    unsigned int *int_data = key.data;
-    for (int i = 0; i < key.length>>2; i++) {
-        hash ^= int_data[i];
+static unsigned long long hash_key(db_data key) {
+    return hash_bytes(key.data, key.length);
+}
+
+struct key_match_ctx {
+    struct db_state *db;
+    db_data key;
+    unsigned long long hash;
+};
+
+static bool key_matches(void *opaque, unsigned int key_idx) {
+    struct key_match_ctx *ctx = opaque;
+    struct ram_stored_key *cur_key = key_at(ctx -> db, key_idx);
+    if (cur_key -> key_length != ctx -> key.length) {
+        return false;
+    }
+    if (ctx -> db -> compact_index) { // the index already matched the upper 32 bits
+        return cur_key -> key_hash_low == (unsigned int) ctx -> hash;
     }
-    return hash;
+    return memcmp(ctx -> key.data, key_bytes(ctx -> db, cur_key), cur_key -> key_length) == 0;
 }
 
 // MUST HAVE LOCK TO CALL THIS FUNCTION
-static bool search_for_key(struct db_state *db, db_data search_key, struct ram_stored_key *found_key, bool insert) {
-    unsigned int key_hash = hash_key(search_key);
+long long search_for_key(struct db_state *db, db_data search_key, unsigned long long hash, bool insert) {
+    struct key_match_ctx ctx = {.db = db, .key = search_key, .hash = hash};
 
-    if (db -> num_nodes == 0) { // If there are no nodes, create the first node.
-        if (insert) {
-            db -> nodes[0] = (struct key_node){.key_idx=db -> num_key_entries, .left_idx = -1, .right_idx = -1};
-            db -> num_nodes++;
+    long long key_idx = index_find(&db -> index, hash, key_matches, &ctx);
+    if (key_idx >= 0) {
+        return key_idx;
+    }
+
+    if (insert) {
+        index_insert(&db -> index, hash, db -> num_key_entries);
 #ifdef DEBUG
-            printf("Inserted node key %.16s as first key\n", search_key.data);
+        printf("Inserted key %.16s as key %lld\n", search_key.data, db -> num_key_entries);
 #endif
-        }
+    }
+    return -1;
+}
+
+// The ordered index's view of a key. Only used with the lock held.
+static const void *ordered_key_of(void *ctx, unsigned int key_idx, unsigned int *length) {
+    struct db_state *db = ctx;
+    struct ram_stored_key *key = key_at(db, key_idx);
+    *length = key -> key_length;
+    return key_bytes(db, key);
+}
+
+// LOCK-FREE LOOKUPS
+
+enum lookup_result {
+    LOOKUP_FOUND,
+    LOOKUP_NOT_FOUND,
+    LOOKUP_RACED, // a writer changed something while we were looking, so the answer can't be trusted.
+};
+
+// Like key_match_ctx, but with the capacities loaded once, and never trusting what's in the arenas: a writer can
+// be halfway through changing any of it.
+struct optimistic_match_ctx {
+    struct db_state *db;
+    unsigned long long key_capacity;
+    unsigned long long key_vla_capacity;
+    bool compact_index;
+    db_data key;
+    unsigned long long hash;
+    bool torn; // saw something that can't be right, which also means a writer got in the way
+};
+
+static bool key_matches_optimistic(void *opaque, unsigned int key_idx) {
+    struct optimistic_match_ctx *ctx = opaque;
+    if (key_idx >= ctx -> key_capacity) {
+        ctx -> torn = true;
         return false;
     }
+    struct ram_stored_key cur_key = *key_at(ctx -> db, key_idx);
+    if (ctx -> compact_index) {
+        return cur_key.key_length == ctx -> key.length && cur_key.key_hash_low == (unsigned int) ctx -> hash;
+    }
+    unsigned long long offset = key_vla_offset(&cur_key);
+    if (offset + cur_key.key_length > ctx -> key_vla_capacity || arena_run(&ctx -> db -> key_vla, offset) < cur_key.key_length) {
+        ctx -> torn = true;
+        return false;
+    }
+    return cur_key.key_length == ctx -> key.length &&
+        memcmp(ctx -> key.data, key_bytes(ctx -> db, &cur_key), cur_key.key_length) == 0;
+}
+
+// Looks the key up without taking the lock. On LOOKUP_FOUND, *found is a copy of its ram_stored_key and
+// *region_epoch the epoch of the region its record is in, which the caller checks again under the lock before
+// pinning the region: if it's unchanged the region hasn't been reused since, so the record is still there.
+static enum lookup_result lookup_optimistic(struct db_state *db, db_data key, unsigned long long hash, struct ram_stored_key *found, unsigned int *region_epoch) {
+    atomic_fetch_add(&db -> lookups_in_progress, 1); // nothing we might look at gets freed until this is 0 again
+    enum lookup_result result = LOOKUP_RACED;
+    unsigned long long version = atomic_load_explicit(&db -> index_version, memory_order_acquire);
+    if (version & 1) { // a writer is in the middle of something
+        goto out;
+    }
+
+    // The capacities first. They're stored after the segments they cover, so anything below them is mapped.
+    struct optimistic_match_ctx ctx = {.db = db, .compact_index = db -> compact_index, .key = key, .hash = hash, .torn = false};
+    ctx.key_capacity = db -> keys.capacity;
+    ctx.key_vla_capacity = db -> key_vla.capacity;
 
-    int node_idx = 0;
-    while (1) {
-        struct key_node cur_node = db -> nodes[node_idx];
-
-        // We use three different levels of comparison to try to reduce the odds of a memcmp().
-        struct ram_stored_key cur_key = db -> keys[cur_node.key_idx];
-        bool left = cur_key.key_hash < key_hash;
-        if (cur_key.key_hash == key_hash) {
-            left = cur_key.key_length < search_key.length;
-            if (cur_key.key_length == search_key.length) {
-                int resp = memcmp(search_key.data, db -> key_vla + cur_key.key_offset, cur_key.key_length);
-                left = resp == -1;
-                if (resp == 0) {
-                    // We've got a match
-                    *found_key = cur_key;
-                    return true;
-                }
+    long long key_idx = index_find(&db -> index, hash, key_matches_optimistic, &ctx);
+    if (key_idx >= 0) { // key_matches_optimistic checked it's in bounds
+        *found = *key_at(db, key_idx);
+        if (found -> data_loc >= 0) {
+            unsigned long long region = region_of(db, found -> data_loc);
+            if (region >= db -> num_regions) {
+                goto out;
             }
+            *region_epoch = db -> regions[region].epoch;
         }
+    }
 
-        // It's not equal, so we try to find a lower value on the tree.
-        if (left) {
-            if (cur_node.left_idx != -1) { // Recurse lower
-                node_idx = cur_node.left_idx;
-                continue;
-            } else if (insert) { // Couldn't find it - if insert, this is where we inesrt.
-                db -> nodes[node_idx].left_idx = db -> num_nodes;
-                db -> nodes[db -> num_nodes++] = (struct key_node){.key_idx = db -> num_key_entries, .left_idx=-1, .right_idx=-1};
-            }
-        } else {
-            if (cur_node.right_idx != -1) {
-                node_idx = cur_node.right_idx;
-                continue;
-            } else if (insert) {
-                db -> nodes[node_idx].right_idx = db -> num_nodes;
-                db -> nodes[db -> num_nodes++] = (struct key_node){.key_idx = db -> num_key_entries, .left_idx=-1, .right_idx=-1};
-            }
+    atomic_thread_fence(memory_order_acquire); // everything above was read before we check the version again
+    if (!ctx.torn && atomic_load_explicit(&db -> index_version, memory_order_relaxed) == version) {
+        result = key_idx >= 0 ? LOOKUP_FOUND : LOOKUP_NOT_FOUND;
+    }
+out:
+    atomic_fetch_sub(&db -> lookups_in_progress, 1);
+    return result;
+}
+
+bool find_key(struct db_state *db, db_data key, struct ram_stored_key *found, unsigned int *region_epoch) {
+    unsigned long long hash = hash_key(key);
+    enum lookup_result result = LOOKUP_RACED;
+    for (int i = 0; i < OPTIMISTIC_LOOKUP_TRIES && result == LOOKUP_RACED; i++) {
+        result = lookup_optimistic(db, key, hash, found, region_epoch);
+    }
+    if (result != LOOKUP_RACED) {
+        return result == LOOKUP_FOUND;
+    }
+    acq_lock(db); // ACQUIRE LOCK
+    long long key_idx = search_for_key(db, key, hash, false);
+    if (key_idx >= 0) {
+        *found = *key_at(db, key_idx);
+        if (found -> data_loc >= 0) {
+            *region_epoch = db -> regions[region_of(db, found -> data_loc)].epoch;
         }
-        return false;
     }
+    release_lock(db); // RELEASE LOCK
+    return key_idx >= 0;
 }
 
-static unsigned long long get_time_us(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (tv.tv_sec * 10000000) + tv.tv_usec;
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Frees the index tables resizes replaced, if no lookup is running. Any lookup that starts after this loads the
+// new ones.
+static void reclaim_retired(struct db_state *db) {
+    if (db -> index.retired == NULL) {
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst); // the new tables were published before we look at the count
+    if (atomic_load(&db -> lookups_in_progress) != 0) {
+        return;
+    }
+    index_reclaim(&db -> index);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+long long append_key(struct db_state *db, db_data key, unsigned long long hash) {
+    // Get key index in list, possibly mapping another segment of db -> keys. Nothing already there moves.
+    long long key_idx = db -> num_key_entries++;
+    if (arena_reserve(&db -> keys, key_idx + 1) != 0) {
+        abort(); // like the index, nothing sensible to do if we can't grow
+    }
+
+    struct ram_stored_key ram_key;
+    ram_key.key_length = key.length;
+    ram_key.key_hash = hash >> 32;
+    if (db -> compact_index) { // the hash stands in for the key
+        ram_key.key_hash_low = hash;
+        ram_key.key_offset_high = 0;
+    } else {
+        // Write the key itself to the VLA, possibly mapping another segment of it. A key that doesn't fit in
+        // what's left of the current segment starts the next one, so it can be compared in one piece.
+        unsigned long long current_key_vla_offset = db -> key_vla_length;
+        if (db -> key_vla.capacity > current_key_vla_offset && arena_run(&db -> key_vla, current_key_vla_offset) < key.length) {
+            current_key_vla_offset += arena_run(&db -> key_vla, current_key_vla_offset);
+        }
+        if (arena_reserve(&db -> key_vla, current_key_vla_offset + key.length) != 0) {
+            abort();
+        }
+        memcpy(arena_at(&db -> key_vla, current_key_vla_offset), key.data, key.length);
+        db -> key_vla_length = current_key_vla_offset + key.length;
+        ram_key.key_offset_low = current_key_vla_offset;
+        ram_key.key_offset_high = current_key_vla_offset >> 32;
+    }
+    ram_key.data_length = 0; // set along with data_loc once the value is on disk
+    ram_key.flags = DATA_FLAG_INCOMPLETE;
+    ram_key.data_loc = -1;
+    ram_key.older_records = 0;
+    *key_at(db, key_idx) = ram_key;
+    return key_idx;
+}
+
+unsigned long long stored_key_hash(struct db_state *db, const struct ram_stored_key *key) {
+    if (db -> compact_index) { // no key to hash, but then the whole hash is already there
+        return (unsigned long long) key -> key_hash << 32 | key -> key_hash_low;
+    }
+    return hash_bytes(key_bytes(db, key), key -> key_length);
 }
 
 unsigned long long callback_ssd_size(struct write_cb_state *write_callback) {
     return write_callback -> value.length + write_callback -> key.length + sizeof(struct ssd_header);
 }
 
+unsigned int record_crc_begin(db_data key, unsigned long long data_length, char flags) {
+    struct ssd_header header = {.key_length=key.length, .data_length=data_length, .flags=flags};
+    unsigned int crc = crc32c(0, &header, offsetof(struct ssd_header, seq));
+    return crc32c(crc, key.data, key.length);
+}
+
+unsigned int record_crc_end(unsigned int crc, unsigned long long seq) {
+    return crc32c(crc, &seq, sizeof(seq));
+}
+
+bool record_intact(const void *record) {
+    struct ssd_header header;
+    memcpy(&header, record, sizeof(header));
+    unsigned int crc = crc32c(0, record, offsetof(struct ssd_header, seq));
+    crc = crc32c(crc, (const char *)record + sizeof(header), header.key_length + (unsigned long long) header.data_length);
+    return record_crc_end(crc, header.seq) == header.crc;
+}
+
+bool record_is(const void *record, unsigned short key_length, unsigned int data_length, unsigned int key_hash, unsigned int epoch) {
+    struct ssd_header header;
+    memcpy(&header, record, sizeof(header));
+    return header.key_length == key_length && header.data_length == data_length && header.epoch == epoch &&
+        hash_bytes((const char *)record + sizeof(header), key_length) >> 32 == key_hash;
+}
+
+bool record_has_key(const void *record, const void *key, unsigned short key_length) {
+    return memcmp((const char *)record + sizeof(struct ssd_header), key, key_length) == 0;
+}
+
+static void print_key(struct db_state *db, struct ram_stored_key key) {
+#ifdef DEBUG
+            printf("Key has length %d, hash %d, vla offset %llu, flags %d, data length %d data loc %llu\n",
+        key.key_length, key.key_hash, key_vla_offset(&key), key.flags, key.data_length, key.data_loc);
+        // printf("key itself is %s\n", key_bytes(db, &key)); // todo print only till end of key
+#endif
+}
+
 // MUST HAVE LOCK TO CALL THIS FUNCTION
-unsigned long long calc_write_bytes_queued(struct db_state *db) {
-    unsigned long long write_bytes_queued = 0;
-    struct write_cb_state *write_callback;
-    TAILQ_FOREACH(write_callback, &db -> write_callback_queue, link) {
-        write_bytes_queued += callback_ssd_size(write_callback);
+static void enqueue_write(struct db_state *db, long long key_idx, db_data key, db_data value, db_data raw_value, char flags, unsigned int crc, bool value_dma, value_fill_cb fill, key_write_cb callback, void *cb_arg) {
+    struct write_cb_state *callback_arg = slab_alloc(&write_state_cache); // FREED BY THE WRITE CALLBACK
+    callback_arg -> db = db;
+    callback_arg -> callback = callback;
+    callback_arg -> cb_arg = cb_arg;
+    callback_arg -> key_index = key_idx;
+    callback_arg -> key = key;
+    callback_arg -> value = value;
+    callback_arg -> raw_value = raw_value;
+    callback_arg -> flags = flags;
+    callback_arg -> crc = crc;
+    callback_arg -> value_dma = value_dma;
+    callback_arg -> fill = fill;
+    callback_arg -> seq = db -> next_seq++;
+    callback_arg -> flushed_value = NULL;
+    callback_arg -> relocated_from = -1;
+    callback_arg -> clock_time_enqueued = commit_now_us();
+#ifdef DEBUG
+    printf("Got write request for key %.16s\n", (char *)key.data);
+#endif
+    // From here on reads of the key get this value (or, for a delete, don't find it), see start_read. Streamed
+    // values aren't anywhere they could be read from till they're on the device.
+    if (fill == NULL) {
+        pending_write_add(db, callback_arg);
+    } else {
+        db -> streams_in_flight++; // see write_on_its_way
+    }
+    if (fill == NULL && !(key_at(db, key_idx) -> flags & DATA_FLAG_WRITE_PENDING)) {
+        index_write_begin(db);
+        key_at(db, key_idx) -> flags |= DATA_FLAG_WRITE_PENDING;
+        index_write_end(db);
+    }
+    TAILQ_INSERT_TAIL(&db -> write_callback_queue, callback_arg, link); // Append the callback to a linked list of write callbacks
+    commit_enqueued(db, callback_ssd_size(callback_arg));
+
+    if (commit_should_flush(db)) {
+        flush_writes(db, HEAD_USER);
     }
-    return write_bytes_queued;
 }
 
 // MUST HAVE LOCK TO CALL THIS FUNCTION
-static bool should_flush_writes(struct db_state *db) {
-    if (TAILQ_EMPTY(&db -> write_callback_queue) || db -> writes_in_flight > 200 /*|| db -> flushes_in_flight*/) {
-        return false;
+// Runs a request's callback with err, without writing anything.
+static void complete_request(struct db_state *db, struct write_request *request, enum write_err err) {
+    struct write_cb_state *done = slab_alloc(&write_state_cache);
+    done -> callback = request -> callback;
+    done -> cb_arg = request -> cb_arg;
+    done -> key_index = -1;
+    done -> value = request -> value; // so deliver_writes frees it, if it's compress_value's copy
+    done -> flags = request -> flags;
+    done -> fill = NULL;
+    done -> relocated_from = -1;
+    complete_write(db, done, err);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// What write_value_async and delete_value_async used to do themselves, for a request taken off the write ring.
+static void apply_write_request(struct db_state *db, struct write_request *request) {
+    long long key_idx = search_for_key(db, request -> key, request -> hash, false);
+    if (request -> flags & DATA_FLAG_DELETED) {
+        if (key_idx < 0) { // nothing to delete
+            complete_request(db, request, WRITE_SUCCESSFUL);
+            return;
+        }
+        // The key stays in the index, pointing at the tombstone, and the tombstone is kept (relocated like any live
+        // record) as long as a scan of the log could find an older record of the key, so it can always tell the key
+        // was deleted. Then it's dropped, see nvme_compact.h.
+        enqueue_write(db, key_idx, request -> key, request -> value, request -> raw_value, DATA_FLAG_DELETED, request -> crc, false, NULL, request -> callback, request -> cb_arg);
+        return;
     }
 
-    // Check if there are enough bytes enqueued to fill a sector.
-    // TODO: possibly store the current number of write bytes enqueued and update it when callbacks are enqueued.
-    // Current behavior could get ~O(n^2) with hundreds of tiny callbacks.
-    if (calc_write_bytes_queued(db) >= db -> sector_size) {
-        return true;
+    // If the key exists already this is an overwrite. The key keeps pointing at the old value (so reads keep
+    // working) until the new one has been flushed, and then flush_writes_cb repoints it.
+    if (key_idx < 0) {
+        if (db -> num_key_entries >= MAX_KEY_ENTRIES) {
+            complete_request(db, request, TOO_MANY_KEYS_ERROR);
+            return;
+        }
+        // New key. It goes into the index and db -> keys in one go, so a lookup never sees it in one and not the other.
+        index_write_begin(db);
+        search_for_key(db, request -> key, request -> hash, true);
+        key_idx = append_key(db, request -> key, request -> hash);
+        index_write_end(db);
+        ordered_insert(&db -> ordered, key_idx); // only ever looked at with the lock held, so after is fine
     }
-    
-    // Check if oldest write in queue has been waiting more than 1ms.
-    unsigned long long cur_t = get_time_us();
-    struct write_cb_state *last = TAILQ_FIRST(&db -> write_callback_queue);
-    unsigned long long elapsed_us = cur_t - last -> clock_time_enqueued;
-    if (elapsed_us > 1000) { // more than 1ms
-        return true;
+    enqueue_write(db, key_idx, request -> key, request -> value, request -> raw_value, request -> flags, request -> crc, request -> dma, request -> fill, request -> callback, request -> cb_arg);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Takes what's been pushed to the write ring, at most one ring's worth so producers can't keep us here forever.
+static int drain_write_ring(struct db_state *db) {
+    struct write_request request;
+    int drained = 0;
+    while (drained < WRITE_RING_SLOTS && write_ring_pop(&db -> write_ring, &request)) {
+        apply_write_request(db, &request);
+        drained++;
     }
+    write_ring_mark_applied(&db -> write_ring);
+    return drained;
+}
 
-    return false;
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// So a read sees every write that was pushed before it started: drains the ring up to pushed. A producer that
+// claimed a cell before pushed can still be filling it in, in which case the lock's let go while it finishes.
+void apply_pushed_writes(struct db_state *db, unsigned long long pushed) {
+    drain_write_ring(db);
+    while (write_ring_applied(&db -> write_ring) < pushed) {
+        release_lock(db); // RELEASE LOCK
+        sched_yield();
+        acq_lock(db); // ACQUIRE LOCK
+        drain_write_ring(db);
+    }
 }
 
-static void print_key(struct db_state *db, struct ram_stored_key key) {
-#ifdef DEBUG
-            printf("Key has length %d, hash %d, vla offset %d, flags %d, data length %d data loc %llu\n",
-        key.key_length, key.key_hash, key.key_offset, key.flags, key.data_length, key.data_loc);
-        // printf("key itself is %s\n", db -> key_vla + key.key_offset); // todo print only till end of key
-#endif
+// Hands a write or delete to the shard's poller. Doesn't take the lock unless the ring is full and there's no
+// poller thread to empty it, in which case we poll ourselves.
+static void submit_write(struct db_state *db, const struct write_request *request) {
+    while (!write_ring_push(&db -> write_ring, request)) {
+        if (db -> shards[0] -> num_pollers) {
+            sched_yield();
+        } else {
+            poll_shard(db);
+        }
+    }
 }
 
 // PUBLIC API
 
 void *create_db() {
-    struct db_state *state = malloc(sizeof(struct db_state));
+    struct db_options opts;
+    db_options_init(&opts);
+    return create_db_with_options(&opts);
+}
+
+// One shard (or the whole db, unsharded) on device.
+static struct db_state *create_shard(struct db_device *device, const struct db_options *opts) {
+    struct db_state *state = aligned_alloc(_Alignof(struct db_state), sizeof(struct db_state)); // see lookups_in_progress
 
     state -> lock = 0;
+    state -> index_version = 0;
+    state -> lookups_in_progress = 0;
 
     state -> num_key_entries = 0;
-    state -> key_capacity = INITIAL_CAPACITY;
-    state -> keys = calloc(sizeof(struct ram_stored_key), INITIAL_CAPACITY);
+    arena_init(&state -> keys, sizeof(struct ram_stored_key), KEYS_FIRST_SEGMENT_SHIFT);
 
-    state -> nodes = malloc(sizeof(struct key_node) * INITIAL_CAPACITY);
-    state -> num_nodes = 0;
-    state -> node_capacity = INITIAL_CAPACITY;
+    index_init(&state -> index, INITIAL_CAPACITY);
+    state -> compact_index = opts -> compact_index;
+    ordered_init(&state -> ordered, ordered_key_of, state);
 
-    state -> key_vla_capacity = INITIAL_CAPACITY*20;
     state -> key_vla_length = 0;
-    state -> key_vla = calloc(sizeof(char), state -> key_vla_capacity);
+    arena_init(&state -> key_vla, 1, KEY_VLA_FIRST_SEGMENT_SHIFT);
 
     state -> writes_in_flight = 0;
     state -> reads_in_flight = 0;
     state -> flushes_in_flight = 0;
 
-    if (initialize(state) != 0) {
-        free(state -> keys);
-        free(state -> key_vla);
+    if (initialize(state, device) != 0) {
+        arena_free(&state -> keys);
+        index_free(&state -> index);
+        arena_free(&state -> key_vla);
         free(state);
         return NULL;
     }
 
-    state -> current_sector_ssd = 0;
-    state -> current_sector_bytes = 0;
-    state -> current_sector_data = calloc(1, state -> sector_size);
-
     TAILQ_INIT(&state -> write_callback_queue);
+    TAILQ_INIT(&state -> gc_write_queue);
+    TAILQ_INIT(&state -> flushes_in_order);
+    commit_init(state, opts);
+    dma_pool_init(&state -> dma_pool, state -> device);
+    unsigned int num_shards = opts -> num_shards ? opts -> num_shards : 1;
+    state -> write_ring.cells = NULL; // so whichever of these didn't get initialized can still be freed
+    state -> pending_writes.slots = NULL;
+    memset(&state -> compressor, 0, sizeof(struct compressor));
+    if (value_cache_init(&state -> value_cache, opts -> value_cache_bytes / num_shards) != 0 ||
+        write_ring_init(&state -> write_ring, WRITE_RING_SLOTS) != 0 ||
+        pending_writes_init(&state -> pending_writes) != 0 ||
+        compressor_init(&state -> compressor, opts) != 0) {
+        pending_writes_free(&state -> pending_writes);
+        write_ring_free(&state -> write_ring);
+        value_cache_free(&state -> value_cache);
+        compressor_free(&state -> compressor);
+        dma_pool_free(&state -> dma_pool);
+        state -> device -> ops -> free_queue(state -> queue);
+        arena_free(&state -> keys);
+        index_free(&state -> index);
+        arena_free(&state -> key_vla);
+        free(state);
+        return NULL;
+    }
+    TAILQ_INIT(&state -> completed_writes);
+    TAILQ_INIT(&state -> completed_reads);
+    state -> callbacks_pending = 0;
+    state -> live_bytes = 0;
+    state -> dead_bytes = 0;
+    state -> user_bytes_written = 0;
+    state -> relocated_bytes_written = 0;
+    state -> device_bytes_written = 0;
+    state -> in_place_bytes_written = 0;
+    state -> tail_sector_rewrites = 0;
+    state -> tail_sectors_skipped = 0;
+    state -> records_aligned = 0;
+    state -> tombstones_dropped = 0;
+    state -> streams_in_flight = 0;
+    state -> read_merge_gap = opts -> read_merge_gap ? opts -> read_merge_gap : READ_MERGE_GAP_DEFAULT;
+    state -> verify_checksums = !opts -> skip_checksum_verify;
+    state -> fresh_sector_flushes = opts -> fresh_sector_flushes;
+    state -> values_read = 0;
+    state -> read_commands = 0;
+    state -> value_bytes_read = 0;
+    state -> device_bytes_read = 0;
+    state -> pending_write_reads = 0;
+    state -> scan_bytes_read = 0;
+    state -> checksum_errors = 0;
+    state -> key_mismatches = 0;
+    state -> log_scans = NULL;
+
+    bool regions_ok = regions_init(state) == 0;
+    if (regions_ok) {
+        checkpoint_init(state, opts -> checkpoint_interval);
+    }
+    // Whatever's already on the device is the db, unless we were asked to start over.
+    if (!regions_ok || (!opts -> format && recover_db(state) != 0)) {
+        if (regions_ok) {
+            checkpoint_free(state);
+            regions_free(state);
+        }
+        pending_writes_free(&state -> pending_writes);
+        write_ring_free(&state -> write_ring);
+        value_cache_free(&state -> value_cache);
+        compressor_free(&state -> compressor);
+        dma_pool_free(&state -> dma_pool);
+        state -> device -> ops -> free_queue(state -> queue);
+        arena_free(&state -> keys);
+        index_free(&state -> index);
+        arena_free(&state -> key_vla);
+        free(state);
+        return NULL;
+    }
+
+    reclaim_retired(state); // whatever recovery grew out of
+    if (opts -> ordered_index) { // built in one go from whatever recovery found, then kept up by apply_write_request
+        unsigned int *idxs = malloc(state -> num_key_entries * sizeof(unsigned int) + 1); // all < MAX_KEY_ENTRIES
+        unsigned long long num_idxs = 0;
+        for (long long i = 0; i < state -> num_key_entries; i++) {
+            if (!(key_at(state, i) -> flags & DATA_FLAG_DROPPED)) {
+                idxs[num_idxs++] = i;
+            }
+        }
+        ordered_build(&state -> ordered, idxs, num_idxs);
+        free(idxs);
+    }
 
     // write_zeroes(state, 0, 50000);
-    
+
     return state;
 }
 
-void free_db(void *opaque) {
-    struct db_state *db = opaque;
+static void free_shard(struct db_state *db) {
     acq_lock(db);
+    reclaim_retired(db); // nothing's looking any more
 
-    free(db -> keys);
-    free(db -> key_vla);
-    free(db -> current_sector_data);
-    free(db -> nodes);
-    free(TAILQ_FIRST(&db -> g_controllers));
+    arena_free(&db -> keys);
+    arena_free(&db -> key_vla);
+    write_ring_free(&db -> write_ring);
+    pending_writes_free(&db -> pending_writes);
+    checkpoint_free(db);
+    regions_free(db);
+    index_free(&db -> index);
+    ordered_free(&db -> ordered);
+    value_cache_free(&db -> value_cache);
+    compressor_free(&db -> compressor);
+    dma_pool_free(&db -> dma_pool);
+    db -> device -> ops -> free_queue(db -> queue);
+    if (db -> device != db -> base_device) {
+        db -> device -> ops -> close(db -> device);
+    }
     free(db);
     // TODO: TAILQ_FREE our tail queues
     // make sure all writes have persisted? this shouldn't really happen very much. mostly we expect the process to exit instead.
 }
 
-void write_value_async(void *opaque, db_data key, db_data value, key_write_cb callback, void *cb_arg) {
+void *create_db_with_options(const struct db_options *opts) {
+    unsigned int num_shards = opts -> num_shards ? opts -> num_shards : 1;
+    if (num_shards > MAX_SHARDS) {
+        printf("%u shards is more than the %u supported\n", num_shards, MAX_SHARDS);
+        return NULL;
+    }
+    if (opts -> compact_index && opts -> ordered_index) {
+        printf("ordered_index needs the keys, which compact_index doesn't keep\n");
+        return NULL;
+    }
+
+    struct db_device *device = open_device(opts);
+    if (device == NULL) {
+        return NULL;
+    }
+
+    // Each shard gets an equal slice of the device.
+    struct db_state **shards = calloc(num_shards, sizeof(struct db_state *));
+    unsigned long long shard_sectors = device -> num_sectors / num_shards;
+    for (unsigned int i = 0; i < num_shards; i++) {
+        struct db_device *shard_device = num_shards == 1 ? device : part_device_open(device, i * shard_sectors, shard_sectors);
+        if (shard_device != NULL) {
+            shards[i] = create_shard(shard_device, opts);
+        }
+        if (shards[i] == NULL) {
+            if (shard_device != NULL && shard_device != device) {
+                shard_device -> ops -> close(shard_device);
+            }
+            for (unsigned int j = 0; j < i; j++) {
+                free_shard(shards[j]);
+            }
+            free(shards);
+            device -> ops -> close(device);
+            return NULL;
+        }
+        shards[i] -> shards = shards;
+        shards[i] -> num_shards = num_shards;
+        shards[i] -> base_device = device;
+        shards[i] -> num_pollers = 0;
+    }
+
+    struct db_state *db = shards[0];
+    if (opts -> poller_threads && pollers_start(db) != 0) {
+        free_db(db);
+        return NULL;
+    }
+    printf("Initialization complete (%s backend, %u shard%s).\n", device -> name, num_shards, num_shards == 1 ? "" : "s");
+    return db;
+}
+
+void free_db(void *opaque) {
     struct db_state *db = opaque;
-    acq_lock(db);
+    pollers_stop(db);
 
+    struct db_state **shards = db -> shards;
+    unsigned int num_shards = db -> num_shards;
+    struct db_device *device = db -> base_device;
+    for (unsigned int i = 0; i < num_shards; i++) {
+        free_shard(shards[i]);
+    }
+    free(shards);
+    device -> ops -> close(device);
+}
+
+static void submit_value(struct db_state *db, db_data key, db_data value, bool dma, value_fill_cb fill, key_write_cb callback, void *cb_arg) {
     enum write_err err = WRITE_SUCCESSFUL;
     if (key.length == 0) {
         err = KEY_TOO_SHORT_ERROR;
-    } else if (key.length > (1ULL<<16)) {
+    } else if (key.length >= (1ULL<<16)) {
         err = KEY_TOO_LONG_ERROR;
     } else if (value.length == 0) {
         err = VALUE_TOO_SHORT_ERROR;
-    } else if (value.length >= (1ULL<<32)) {
-        err = VALUE_TOO_LONG_ERROR;
+    } else if (value.length < 0) {
+        err = VALUE_TOO_LONG_ERROR; // past INT_MAX, and wrapped on its way into db_data
+    } else if (sizeof(struct ssd_header) + key.length + (unsigned long long) value.length > max_record_bytes(db)) {
+        err = VALUE_TOO_LONG_ERROR; // more than a shard can hold, even with every region to itself
     }
     if (err != WRITE_SUCCESSFUL) {
-        release_lock(db);
         callback(cb_arg, err);
+        return;
     }
 
-    // Check if the key exists already, which requires special logic that's not yet implemented.
-    struct ram_stored_key prev_key;
-    if (db -> node_capacity <= db -> num_nodes) {
-        db -> node_capacity *= 2;
-        db -> nodes = realloc(db -> nodes, db -> node_capacity * sizeof(struct key_node));
-#ifdef DEBUG
-        printf("resizing node area\n");
-#endif
+    unsigned long long hash = hash_key(key);
+    struct db_state *shard = shard_for_hash(db, hash);
+    struct write_request request = {.key=key, .value=value, .raw_value=value, .hash=hash, .flags=0, .dma=dma, .fill=fill, .callback=callback, .cb_arg=cb_arg};
+    if (!dma && fill == NULL) { // here, so it's not the poller doing it. See nvme_compress.h.
+        request.flags = compress_value(&shard -> compressor, value, &request.value);
     }
-    bool found = search_for_key(db, key, &prev_key, true); // insert key to nodes if not found
-    if (found) {
-        release_lock(db);
-        printf("Key %.16s len %d has already been written (%d)\n", key.data, key.length, prev_key.data_length);
-        callback(cb_arg, GENERIC_WRITE_ERROR); // in order to support this we would have to delete the previous key and do a bunch of other work, so not implemented yet.
-        return;
+    // The checksum too, of the value as it's stored. A streamed one isn't there yet, so the flush does it.
+    request.crc = record_crc_begin(key, request.value.length, request.flags);
+    if (fill == NULL) {
+        request.crc = crc32c(request.crc, request.value.data, request.value.length);
     }
+    submit_write(shard, &request);
+}
 
-    // Get key index in list, possibly resizing db -> keys
-    long long key_idx = db -> num_key_entries++;
-    if (key_idx >= db -> key_capacity) {
-        db -> key_capacity *= 2;
-        db -> keys = realloc(db -> keys, db -> key_capacity * sizeof(struct ram_stored_key));
-#ifdef DEBUG
-        printf("resizing key area\n");
-#endif
-    }
+void write_value_async(void *opaque, db_data key, db_data value, key_write_cb callback, void *cb_arg) {
+    submit_value(opaque, key, value, false, NULL, callback, cb_arg);
+}
 
-    // Write the key itself to the VLA, possibly resizing db -> key_vla
-    long long current_key_vla_offset = db -> key_vla_length;
-    if ((key.length + current_key_vla_offset) > db -> key_vla_capacity) { // resize VLA
-        db -> key_vla_capacity *= 2;
-        db -> key_vla = realloc(db -> key_vla, db -> key_vla_capacity);
-#ifdef DEBUG
-        printf("resizing VLA to %lld\n", db -> key_vla_capacity);
-#endif
+void write_value_dma_async(void *opaque, db_data key, db_data value, key_write_cb callback, void *cb_arg) {
+    submit_value(opaque, key, value, true, NULL, callback, cb_arg);
+}
+
+void write_value_stream_async(void *opaque, db_data key, unsigned long long length, value_fill_cb fill, key_write_cb callback, void *cb_arg) {
+    if (length > INT_MAX) { // db_data's length is an int, and reads hand the value back as one
+        callback(cb_arg, VALUE_TOO_LONG_ERROR);
+        return;
     }
-    memcpy(db -> key_vla + current_key_vla_offset, key.data, key.length);
-    db -> key_vla_length += key.length;
+    submit_value(opaque, key, (db_data){.data=NULL, .length=length}, false, fill, callback, cb_arg);
+}
 
-    struct ram_stored_key ram_key;
-    ram_key.key_length = key.length;
-    ram_key.key_hash = hash_key(key);
-    ram_key.key_offset = current_key_vla_offset;
-    ram_key.data_length = value.length;
-    ram_key.flags = DATA_FLAG_INCOMPLETE;
-    ram_key.data_loc = -1;
-    db -> keys[key_idx] = ram_key;
+// Every shard's device is a slice of base_device, so memory from it works for all of them.
+void *db_dma_alloc(void *opaque, unsigned long long length) {
+    struct db_state *db = opaque;
+    return device_dma_malloc(db -> base_device, length);
+}
 
-    struct write_cb_state *callback_arg = malloc(sizeof(struct write_cb_state)); // FREED BY THE WRITE CALLBACK
-    callback_arg -> db = db;
-    callback_arg -> callback = callback;
-    callback_arg -> cb_arg = cb_arg;
-    callback_arg -> key_index = key_idx;
-    callback_arg -> key = key;
-    callback_arg -> value = value;
-    callback_arg -> clock_time_enqueued = get_time_us();
-#ifdef DEBUG
-    printf("Got write request for key %.16s\n", (char *)key.data);
-#endif
-    TAILQ_INSERT_TAIL(&db -> write_callback_queue, callback_arg, link); // Append the callback to a linked list of write callbacks
+void db_dma_free(void *opaque, void *buf) {
+    struct db_state *db = opaque;
+    device_dma_free(db -> base_device, buf);
+}
+
+void delete_value_async(void *opaque, db_data key, key_write_cb callback, void *cb_arg) {
+    struct db_state *db = opaque;
 
-    if (should_flush_writes(db)) {
-        flush_writes(db);
+    enum write_err err = WRITE_SUCCESSFUL;
+    if (key.length == 0) {
+        err = KEY_TOO_SHORT_ERROR;
+    } else if (key.length >= (1ULL<<16)) {
+        err = KEY_TOO_LONG_ERROR;
+    }
+    if (err != WRITE_SUCCESSFUL) {
+        callback(cb_arg, err);
+        return;
     }
 
-    // print_keylist(db);
-    release_lock(db);
+    unsigned long long hash = hash_key(key);
+    struct write_request request = {.key=key, .value={.data=key.data, .length=0}, .raw_value={.data=key.data, .length=0}, .hash=hash, .flags=DATA_FLAG_DELETED, .dma=false, .fill=NULL, .callback=callback, .cb_arg=cb_arg};
+    request.crc = record_crc_begin(key, 0, DATA_FLAG_DELETED);
+    submit_write(shard_for_hash(db, hash), &request);
 }
 
-void read_value_async(void *opaque, db_data read_key, key_read_cb callback, void *cb_arg) {
-    struct db_state *db = opaque;
-    acq_lock(db); // ACQUIRE LOCK
+static void read_done_early(const struct read_target *target, enum read_err err, db_data value) {
+    if (target -> lease_callback) {
+        target -> lease_callback(target -> cb_arg, err, value, NULL);
+    } else {
+        target -> callback(target -> cb_arg, err, value);
+    }
+}
+
+// What read_value_async and its variants do, which only differ in where the value goes.
+static void start_read(void *opaque, db_data read_key, const struct read_target *target) {
+    unsigned long long hash = hash_key(read_key);
+    struct db_state *db = shard_for_hash(opaque, hash);
+
+    // Writes pushed before this read (by this thread, at least) have to be in the index first. Usually the
+    // poller's applied them already.
+    bool locked = false;
+    unsigned long long pushed = write_ring_pushed(&db -> write_ring);
+    if (write_ring_applied(&db -> write_ring) < pushed) {
+        acq_lock(db); // ACQUIRE LOCK
+        locked = true;
+        apply_pushed_writes(db, pushed);
+    }
 
+    // Look the key up without the lock, which is only needed to pin the record's region and submit the read.
     struct ram_stored_key found_key;
-    bool found = search_for_key(db, read_key, &found_key, false);
-    if (!found) { // couldn't find key
-        release_lock(db); // RELEASE LOCK
-        callback(cb_arg, KEY_NOT_FOUND, (db_data){.data=NULL, .length=0});
+    unsigned int region_epoch = 0;
+    enum lookup_result result = LOOKUP_RACED;
+    for (int i = 0; i < OPTIMISTIC_LOOKUP_TRIES && result == LOOKUP_RACED && !locked; i++) {
+        result = lookup_optimistic(db, read_key, hash, &found_key, &region_epoch);
+    }
+    if (result == LOOKUP_FOUND && (found_key.flags & DATA_FLAG_WRITE_PENDING)) {
+        result = LOOKUP_RACED; // its value's in db -> pending_writes, which needs the lock
+    }
+
+    if (result == LOOKUP_FOUND && !(found_key.flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED))) {
+        // The record at (data_loc, region_epoch) never changes, so if it's cached that's the value, lock or no lock.
+        struct cache_entry *cached = value_cache_get(&db -> value_cache, found_key.data_loc, region_epoch);
+        if (cached) {
+            deliver_cached_read(db, cached, target);
+            return;
+        }
+        acq_lock(db); // ACQUIRE LOCK
+        locked = true;
+        struct region *region = &db -> regions[region_of(db, found_key.data_loc)];
+        if (region -> epoch != region_epoch || region -> state == REGION_FREE) {
+            result = LOOKUP_RACED; // compacted and freed since, so the key has moved. Look again.
+        }
+    }
+    if (result == LOOKUP_RACED) { // writers kept getting in the way, do it the slow way
+        if (!locked) {
+            acq_lock(db); // ACQUIRE LOCK
+            locked = true;
+        }
+        long long key_idx = search_for_key(db, read_key, hash, false);
+        result = key_idx < 0 ? LOOKUP_NOT_FOUND : LOOKUP_FOUND;
+        if (key_idx >= 0 && (key_at(db, key_idx) -> flags & DATA_FLAG_WRITE_PENDING)) {
+            struct pending_write *pending = pending_write_find(db, key_idx);
+            if (pending && (pending -> latest -> flags & DATA_FLAG_DELETED)) {
+                release_lock(db); // RELEASE LOCK
+                read_done_early(target, KEY_NOT_FOUND, (db_data){.data=NULL, .length=0});
+                return;
+            }
+            if (pending && target -> buf && target -> buf_length < pending -> latest -> raw_value.length) {
+                release_lock(db); // RELEASE LOCK
+                read_done_early(target, READ_BUFFER_TOO_SMALL, (db_data){.data=NULL, .length=pending -> latest -> raw_value.length});
+                return;
+            }
+            if (pending) { // read-your-writes, without waiting for the device
+                struct read_cb_state *read_cb = copy_pending_write(db, pending -> latest, target);
+                release_lock(db); // RELEASE LOCK
+                deliver_copied_read(read_cb);
+                return;
+            }
+            // Left over from a write that failed. What's in keys is right, so stop sending reads this way.
+            index_write_begin(db);
+            key_at(db, key_idx) -> flags &= ~DATA_FLAG_WRITE_PENDING;
+            index_write_end(db);
+        }
+        if (key_idx >= 0) {
+            // Copied, so a concurrent overwrite or relocation repointing the key doesn't affect this read. The old record
+            // stays where it is on disk (issue_nvme_read pins its region), so the read still returns a consistent, if
+            // slightly stale, value.
+            found_key = *key_at(db, key_idx);
+        }
+    }
+
+    // A key that's INCOMPLETE without a write pending is one whose first write failed.
+    if (result == LOOKUP_NOT_FOUND || (found_key.flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED))) {
+        if (locked) {
+            release_lock(db); // RELEASE LOCK
+        }
+        read_done_early(target, KEY_NOT_FOUND, (db_data){.data=NULL, .length=0});
         return;
     }
-    if (found_key.flags & DATA_FLAG_INCOMPLETE) { // The key is in the process of being written, so it's effectively not there.
-        release_lock(db);
-        callback(cb_arg, KEY_NOT_FOUND, (db_data){.data=NULL, .length=0});
-        printf("Returning can't found for key because data not yet written: %d\n", found_key.flags & DATA_FLAG_INCOMPLETE);
+    // Compressed values aren't decompressed till they're read, so their length isn't known till then.
+    if (target -> buf && !(found_key.flags & DATA_FLAGS_COMPRESSED) && target -> buf_length < found_key.data_length) {
+        release_lock(db); // RELEASE LOCK
+        read_done_early(target, READ_BUFFER_TOO_SMALL, (db_data){.data=NULL, .length=found_key.data_length});
         return;
     }
 
@@ -339,35 +863,335 @@ void read_value_async(void *opaque, db_data read_key, key_read_cb callback, void
 #endif
 
     db -> reads_in_flight++;
-    issue_nvme_read(db, found_key, callback, cb_arg);
-    release_lock(db);
+    issue_nvme_read(db, found_key, read_key, target);
+    release_lock(db); // RELEASE LOCK
+}
+
+void read_value_async(void *opaque, db_data read_key, key_read_cb callback, void *cb_arg) {
+    struct read_target target = {.callback=callback, .lease_callback=NULL, .cb_arg=cb_arg, .buf=NULL, .buf_length=0};
+    start_read(opaque, read_key, &target);
+}
+
+void read_value_into_async(void *opaque, db_data read_key, void *buf, unsigned long long buf_length, key_read_cb callback, void *cb_arg) {
+    struct read_target target = {.callback=callback, .lease_callback=NULL, .cb_arg=cb_arg, .buf=buf, .buf_length=buf_length};
+    start_read(opaque, read_key, &target);
+}
+
+// However far into its first sector the record starts, it can't need more sectors than this.
+unsigned long long db_read_buffer_size(void *opaque, unsigned long long key_length, unsigned long long value_length) {
+    struct db_state *db = opaque;
+    unsigned long long record_length = sizeof(struct ssd_header) + key_length + value_length;
+    return (record_length + 2 * db -> sector_size - 2) / db -> sector_size * db -> sector_size;
+}
+
+void read_value_leased_async(void *opaque, db_data read_key, key_read_lease_cb callback, void *cb_arg) {
+    struct read_target target = {.callback=NULL, .lease_callback=callback, .cb_arg=cb_arg, .buf=NULL, .buf_length=0};
+    start_read(opaque, read_key, &target);
+}
+
+void db_release_read(void *opaque, void *lease) {
+    read_buffer_release(lease);
+}
+
+// Streams are for big values, so there's no point racing writers for the lookup: it's nothing next to the reads.
+void read_value_stream_async(void *opaque, db_data read_key, key_read_chunk_cb callback, void *cb_arg) {
+    unsigned long long hash = hash_key(read_key);
+    struct db_state *db = shard_for_hash(opaque, hash);
+
+    acq_lock(db); // ACQUIRE LOCK
+    apply_pushed_writes(db, write_ring_pushed(&db -> write_ring));
+    long long key_idx = search_for_key(db, read_key, hash, false);
+    if (key_idx >= 0 && (key_at(db, key_idx) -> flags & DATA_FLAG_WRITE_PENDING)) {
+        struct pending_write *pending = pending_write_find(db, key_idx);
+        if (pending && (pending -> latest -> flags & DATA_FLAG_DELETED)) {
+            key_idx = -1;
+        } else if (pending) { // it's all in memory already, so it's one chunk
+            struct read_target target = {.callback=NULL, .lease_callback=NULL, .cb_arg=NULL, .buf=NULL, .buf_length=0};
+            struct read_cb_state *read_cb = copy_pending_write(db, pending -> latest, &target);
+            release_lock(db); // RELEASE LOCK
+            db_data value = {.data=read_cb -> data, .length=read_cb -> data_length};
+            callback(cb_arg, READ_SUCCESSFUL, 0, value, value.length);
+            read_buffer_release(read_cb);
+            return;
+        }
+    }
+    struct ram_stored_key found_key;
+    if (key_idx >= 0) {
+        found_key = *key_at(db, key_idx);
+    }
+    if (key_idx < 0 || (found_key.flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED))) {
+        release_lock(db); // RELEASE LOCK
+        callback(cb_arg, KEY_NOT_FOUND, 0, (db_data){.data=NULL, .length=0}, 0);
+        return;
+    }
+    if (found_key.data_length == 0) {
+        release_lock(db); // RELEASE LOCK
+        callback(cb_arg, READ_SUCCESSFUL, 0, (db_data){.data=NULL, .length=0}, 0);
+        return;
+    }
+    issue_stream_read(db, found_key, read_key, callback, cb_arg);
+    release_lock(db); // RELEASE LOCK
+}
+
+void read_values_async(void *opaque, const db_data *keys, unsigned int num_keys, key_read_cb callback, void **cb_args,
+    keys_read_cb batch_callback, void *batch_arg) {
+    struct db_state *handle = opaque;
+    unsigned long long batch_bytes = batch_callback ?
+        num_keys * (sizeof(enum read_err) + sizeof(db_data) + 2 * sizeof(struct read_cb_state *)) : 0;
+    unsigned long long key_bytes = 0; // compact_index: copies of the keys, since keys can go once this returns
+    for (unsigned int k = 0; handle -> compact_index && k < num_keys; k++) {
+        key_bytes += keys[k].length;
+    }
+    struct multi_read *multi = malloc(sizeof(struct multi_read) + num_keys * sizeof(struct multi_read_entry) + batch_bytes + key_bytes);
+    multi -> pending = 1;
+    multi -> num_keys = num_keys;
+    multi -> callback = callback;
+    multi -> cb_args = cb_args;
+    multi -> batch_callback = batch_callback;
+    multi -> batch_arg = batch_arg;
+    multi -> num_held = 0;
+    multi -> values = (db_data *)&multi -> entries[num_keys];
+    multi -> held = (struct read_cb_state **)&multi -> values[batch_callback ? num_keys : 0];
+    multi -> errors = (enum read_err *)&multi -> held[batch_callback ? 2 * num_keys : 0];
+    char *key_copies = (char *)&multi -> errors[batch_callback ? num_keys : 0];
+
+    // Group the keys by shard, so each shard's lock is only taken once.
+    unsigned long long *hashes = malloc(num_keys * sizeof(unsigned long long));
+    unsigned int *missing = malloc(num_keys * sizeof(unsigned int));
+    struct read_cb_state **ready = calloc(num_keys, sizeof(struct read_cb_state *)); // by key: cache hits and pending writes
+    unsigned int shard_start[MAX_SHARDS + 1] = {0};
+    for (unsigned int k = 0; k < num_keys; k++) {
+        hashes[k] = hash_key(keys[k]);
+        shard_start[shard_index(handle, hashes[k]) + 1]++;
+    }
+    for (unsigned int i = 0; i < handle -> num_shards; i++) {
+        shard_start[i + 1] += shard_start[i];
+    }
+    unsigned int placed[MAX_SHARDS];
+    memcpy(placed, shard_start, sizeof(placed));
+    for (unsigned int k = 0; k < num_keys; k++) {
+        multi -> entries[placed[shard_index(handle, hashes[k])]++].key = k;
+    }
+
+    unsigned int num_missing = 0;
+    for (unsigned int i = 0; i < handle -> num_shards; i++) {
+        unsigned int first = shard_start[i];
+        if (first == shard_start[i + 1]) {
+            continue;
+        }
+        struct db_state *db = handle -> shards[i];
+        unsigned int found = 0;
+        unsigned long long pushed = write_ring_pushed(&db -> write_ring);
+        acq_lock(db); // ACQUIRE LOCK
+        apply_pushed_writes(db, pushed); // like start_read, so the batch sees writes made before it
+        for (unsigned int j = first; j < shard_start[i + 1]; j++) {
+            unsigned int k = multi -> entries[j].key;
+            long long key_idx = search_for_key(db, keys[k], hashes[k], false);
+            struct pending_write *pending = NULL;
+            if (key_idx >= 0 && (key_at(db, key_idx) -> flags & DATA_FLAG_WRITE_PENDING)) {
+                pending = pending_write_find(db, key_idx);
+            }
+            if (pending && !(pending -> latest -> flags & DATA_FLAG_DELETED)) {
+                struct read_target target = {.callback=NULL, .lease_callback=NULL, .cb_arg=NULL, .buf=NULL, .buf_length=0};
+                ready[k] = copy_pending_write(db, pending -> latest, &target);
+                continue;
+            }
+            if (pending || key_idx < 0 || (key_at(db, key_idx) -> flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED))) {
+                missing[num_missing++] = k;
+                continue;
+            }
+            // Copied, like read_value_async does, and the read pins the region, so it doesn't matter if it's overwritten.
+            struct ram_stored_key key = *key_at(db, key_idx);
+            struct cache_entry *cached = value_cache_get(&db -> value_cache, key.data_loc, db -> regions[region_of(db, key.data_loc)].epoch);
+            if (cached) {
+                ready[k] = slab_alloc(&read_state_cache);
+                ready[k] -> db = db;
+                ready[k] -> buffer = READ_BUFFER_CACHE;
+                ready[k] -> data = cached;
+                continue;
+            }
+            multi -> entries[first + found++] = (struct multi_read_entry){
+                .key = k,
+                .data_length = key.data_length,
+                .data_loc = key.data_loc,
+                .value_loc = key.data_loc + sizeof(struct ssd_header) + key.key_length,
+                .key_hash = key.key_hash,
+                .key_copy = db -> compact_index ? key_copies : NULL,
+                .flags = key.flags & DATA_FLAGS_COMPRESSED,
+            };
+            if (db -> compact_index) {
+                memcpy(key_copies, keys[k].data, keys[k].length);
+                key_copies += keys[k].length;
+            }
+        }
+        if (found) {
+            issue_multi_read(db, multi, first, found);
+        }
+        release_lock(db); // RELEASE LOCK
+    }
+
+    for (unsigned int m = 0; m < num_missing; m++) {
+        unsigned int k = missing[m];
+        if (callback) {
+            callback(cb_args ? cb_args[k] : NULL, KEY_NOT_FOUND, (db_data){.data=NULL, .length=0});
+        }
+        if (batch_callback) {
+            multi -> errors[k] = KEY_NOT_FOUND;
+            multi -> values[k] = (db_data){.data=NULL, .length=0};
+        }
+    }
+    for (unsigned int k = 0; k < num_keys; k++) {
+        if (ready[k] == NULL) {
+            continue;
+        }
+        db_data value = {.length=ready[k] -> data_length, .data=ready[k] -> data};
+        if (ready[k] -> buffer == READ_BUFFER_CACHE) {
+            struct cache_entry *cached = ready[k] -> data;
+            value = (db_data){.length=cached -> length, .data=cached -> data};
+        }
+        if (callback) {
+            callback(cb_args ? cb_args[k] : NULL, READ_SUCCESSFUL, value);
+        }
+        if (batch_callback) { // held like a read's buffer, till the batch callback's run
+            multi -> errors[k] = READ_SUCCESSFUL;
+            multi -> values[k] = value;
+            multi -> held[atomic_fetch_add(&multi -> num_held, 1)] = ready[k];
+        } else {
+            read_buffer_release(ready[k]);
+        }
+    }
+    free(ready);
+    free(missing);
+    free(hashes);
+    multi_read_release(multi);
 }
 
 // 59e5b1e5f7070b1c
 
 void poll_db(void *opaque) {
     struct db_state *db = opaque;
+    if (db -> num_pollers) { // the poller threads are doing it
+        return;
+    }
+    for (unsigned int i = 0; i < db -> num_shards; i++) {
+        poll_shard(db -> shards[i]);
+    }
+}
+
+int poll_shard(struct db_state *db) {
     acq_lock(db); // ACQUIRE LOCK
     
-    if (should_flush_writes(db)) {
+    int completions = drain_write_ring(db);
+    if (commit_should_flush(db)) {
 #ifdef DEBUG
         printf("flushing writes\n");
 #endif
-        flush_writes(db);
+        flush_writes(db, HEAD_USER);
+        completions++;
     }
 
-    spdk_nvme_qpair_process_completions(db->main_namespace->qpair, 0); // We acquire lock for callbacks.
-    // TOCONSIDER: currently we acquire the lock on behalf of the callbacks so there isn't a weird gap
-    // where the lock would be taken away. However, as stands, the read cbs don't need the lock, so
-    // if there are a lot of read cbs + contention there will be problems.
+    completions += device_process_completions(db -> queue, 0); // We acquire lock for callbacks.
+    compact_step(db);
+    checkpoint_step(db);
+    reclaim_retired(db);
+
+    // The user callbacks run after the lock is dropped, so readers and writers on other threads aren't stuck
+    // behind them, and callbacks can call back into the db.
+    struct write_cb_head writes;
+    struct read_cb_head reads;
+    TAILQ_INIT(&writes);
+    TAILQ_INIT(&reads);
+    TAILQ_CONCAT(&writes, &db -> completed_writes, link);
+    TAILQ_CONCAT(&reads, &db -> completed_reads, link);
     release_lock(db);
+
+    deliver_writes(db, &writes);
+    deliver_reads(db, &reads);
+    return completions;
+}
+
+void get_db_stats(void *opaque, struct db_stats *stats) {
+    struct db_state *handle = opaque;
+    memset(stats, 0, sizeof(struct db_stats));
+    unsigned long long record_bytes = 0, sector_bytes = 0;
+    for (unsigned int i = 0; i < handle -> num_shards; i++) {
+        struct db_state *db = handle -> shards[i];
+        acq_lock(db);
+        stats -> user_bytes_written += db -> user_bytes_written;
+        stats -> relocated_bytes_written += db -> relocated_bytes_written;
+        stats -> device_bytes_written += db -> device_bytes_written;
+        stats -> in_place_bytes_written += db -> in_place_bytes_written;
+        stats -> tail_sector_rewrites += db -> tail_sector_rewrites;
+        stats -> tail_sectors_skipped += db -> tail_sectors_skipped;
+        stats -> records_aligned += db -> records_aligned;
+        stats -> tombstones_dropped += db -> tombstones_dropped;
+        for (unsigned long long r = 0; r < db -> num_regions; r++) {
+            if (db -> regions[r].state != REGION_FREE) {
+                record_bytes += db -> regions[r].record_bytes;
+                sector_bytes += db -> regions[r].sectors_written * db -> sector_size;
+            }
+        }
+        stats -> dma_pool_hits += db -> dma_pool.hits;
+        stats -> dma_pool_misses += db -> dma_pool.misses;
+        stats -> dma_pool_high_water_bytes += db -> dma_pool.high_water_bytes;
+        stats -> values_read += db -> values_read;
+        stats -> read_commands += db -> read_commands;
+        stats -> value_bytes_read += db -> value_bytes_read;
+        stats -> device_bytes_read += db -> device_bytes_read;
+        stats -> pending_write_reads += db -> pending_write_reads;
+        struct value_cache_stats cache_stats;
+        value_cache_stats(&db -> value_cache, &cache_stats);
+        stats -> value_cache_hits += cache_stats.hits;
+        stats -> value_cache_misses += cache_stats.misses;
+        stats -> value_cache_bytes += cache_stats.bytes;
+        stats -> value_cache_entries += cache_stats.entries;
+        stats -> value_cache_evictions += cache_stats.evictions;
+        stats -> value_cache_rejections += cache_stats.rejections;
+        stats -> ordered_index_bytes += db -> ordered.enabled ? db -> ordered.bytes : 0;
+        stats -> scan_bytes_read += db -> scan_bytes_read;
+        stats -> checksum_errors += db -> checksum_errors;
+        stats -> key_mismatches += db -> key_mismatches;
+        stats -> index_bytes += db -> num_key_entries * sizeof(struct ram_stored_key) + db -> key_vla_length + index_bytes(&db -> index);
+        stats -> index_keys += db -> num_key_entries;
+        stats -> values_compressed += db -> compressor.values_compressed;
+        stats -> compression_bytes_in += db -> compressor.bytes_in;
+        stats -> compression_bytes_out += db -> compressor.bytes_out;
+        stats -> live_bytes += db -> live_bytes;
+        stats -> dead_bytes += db -> dead_bytes;
+        stats -> regions_compacted += db -> compaction.regions_compacted;
+        stats -> free_regions += db -> num_free_regions;
+        stats -> num_regions += db -> num_regions;
+        stats -> checkpoints_written += db -> checkpoint.checkpoints_written;
+        stats -> checkpoint_bytes_written += db -> checkpoint.bytes_written;
+        for (int b = 0; b < DB_HISTOGRAM_BUCKETS; b++) {
+            stats -> flush_batch_bytes[b] += db -> commit.batch_histogram[b];
+            stats -> flush_linger_us[b] += db -> commit.linger_histogram[b];
+        }
+        release_lock(db);
+    }
+
+    struct slab_stats slab;
+    slab_cache_stats(&read_state_cache, &slab);
+    stats -> read_states_high_water = slab.high_water;
+    stats -> request_state_bytes = slab.bytes;
+    slab_cache_stats(&write_state_cache, &slab);
+    stats -> write_states_high_water = slab.high_water;
+    stats -> request_state_bytes += slab.bytes;
+    slab_cache_stats(&flush_state_cache, &slab);
+    stats -> flush_states_high_water = slab.high_water;
+    stats -> request_state_bytes += slab.bytes;
+
+    stats -> write_amplification = stats -> user_bytes_written ? ((double) stats -> device_bytes_written) / stats -> user_bytes_written : 0;
+    stats -> read_amplification = stats -> value_bytes_read ? ((double) stats -> device_bytes_read) / stats -> value_bytes_read : 0;
+    stats -> compression_ratio = stats -> compression_bytes_out ? ((double) stats -> compression_bytes_in) / stats -> compression_bytes_out : 0;
+    stats -> space_utilization = sector_bytes ? ((double) record_bytes) / sector_bytes : 0;
 }
 
 void print_keylist(struct db_state *db) {
     // acq_lock(db);
 
     for (int i = 0; i < db -> num_key_entries; i++) {
-        struct ram_stored_key key = db -> keys[i];
+        struct ram_stored_key key = *key_at(db, i);
         print_key(db, key);
     }
 
@@ -11,57 +11,77 @@
 #include "db_interface.h"
 #include <stdio.h>
 #include <stdatomic.h>
-#include "spdk/env.h"
-
-struct ctrlr_entry {
-    struct spdk_nvme_ctrlr        *ctrlr;
-    TAILQ_ENTRY(ctrlr_entry)    link;
-    char                name[1024];
-};
-
-struct ns_entry {
-    struct spdk_nvme_ctrlr    *ctrlr;
-    struct spdk_nvme_ns    *ns;
-    TAILQ_ENTRY(ns_entry)    link;
-    struct spdk_nvme_qpair    *qpair;
-};
+#include <stdbool.h>
+#include <pthread.h>
+#include "spdk/queue.h"
+#include "nvme_device.h"
+#include "nvme_index.h"
+#include "nvme_arena.h"
+#include "nvme_compact.h"
+#include "nvme_checkpoint.h"
+#include "nvme_ring.h"
+#include "nvme_commit.h"
+#include "nvme_pool.h"
+#include "nvme_cache.h"
+#include "nvme_ordered.h"
+#include "nvme_compress.h"
+#include "nvme_crc.h"
 
 #define DATA_FLAG_ZSTD 1
 #define DATA_FLAG_INCOMPLETE 2
-
+#define DATA_FLAG_DELETED 4 // tombstone, written by delete_value_async. data_length is 0.
+// Only ever in db -> keys, never on the device: a write or delete of the key hasn't been applied yet, so reads
+// take the lock and look in db -> pending_writes. Can be left set after the write's gone, see start_read.
+#define DATA_FLAG_WRITE_PENDING 8
+// A filler record, with no key, padding out the space before a record (or a DMA value) that starts a sector. See
+// record_padding in nvme_write_key_async.c.
+#define DATA_FLAG_PADDING 16
+#define DATA_FLAG_LZ4 32 // like DATA_FLAG_ZSTD, see nvme_compress.h
+// Only ever in db -> keys: a tombstone that's been dropped (see drop_tombstone in nvme_compact.c). The slot is out
+// of the index and the ordered index for good, and always has DATA_FLAG_DELETED and DATA_FLAG_INCOMPLETE set too.
+#define DATA_FLAG_DROPPED 64
+#define DATA_FLAGS_COMPRESSED (DATA_FLAG_ZSTD | DATA_FLAG_LZ4)
+
+// 26 bytes, packed. With db_options.compact_index it's all a key costs besides its index slot.
 __attribute__((packed))
 struct ram_stored_key {
-    unsigned int key_hash; // for speed. we have a shitty architecture where you have to search through the entire list of keys to find any key.
-    unsigned int key_offset; // Offset in key_vla
+    unsigned int key_hash; // upper 32 bits of hash_bytes(key), for speed, so most mismatches don't need a memcmp.
+    union {
+        unsigned int key_offset_low; // Offset in key_vla, with key_offset_high. See key_vla_offset.
+        unsigned int key_hash_low; // with db_options.compact_index, which has no key_vla: the lower 32 bits of the hash
+    };
+    unsigned char key_offset_high; // so key_vla can go past 4GB, up to 1TB
     unsigned short key_length; // max key length: 2^16
 
     char flags; // contains flags, notably DATA_FLAG_INCOMPLETE which indicates whether the data is yet to be written to disk.
     unsigned int data_length; // max data length: 2^32
     long long data_loc; // location within ssd.
+    // The key's records on the device other than the one at data_loc, which a scan of the log could still find. A
+    // tombstone can only be dropped once there are none. Sticks at OLDER_RECORDS_MAX, see older_record_added.
+    unsigned short older_records;
 };
 
-__attribute__((packed))
-struct key_node {
-    int key_idx; // idx in keys. -1 == NULL
+#define OLDER_RECORDS_MAX 65535
 
-    int left_idx; // idx in tree. -1 == NULL.
-    int right_idx;
-};
+// How many slots db -> keys can have, dropped ones included. Key idxs are 32 bits in the index and the ordered
+// index, so a new key past this is refused with TOO_MANY_KEYS_ERROR (see apply_write_request).
+#define MAX_KEY_ENTRIES (1LL<<32)
 
-// header for all nvme data
-__attribute__((packed))
-struct ssd_header {
+// header for all nvme data. Every record describes itself, so the index can be rebuilt by scanning the device
+// (see nvme_recover.h).
+struct __attribute__((packed)) ssd_header {
     unsigned short key_length;
     unsigned int data_length;
     char flags; // followed by key_length bytes of key and data_length bytes of data.
     // TOCONSIDER: unsigned int padding_length?Can be used to not cross big block boundaries.
+    unsigned long long seq; // order of writes to the same key. Relocated records keep their original seq.
+    unsigned int epoch; // the region's epoch when this was written, to tell it from leftovers of the region's last use.
+    unsigned int crc; // see record_crc_begin. 0 in fillers.
 };
 
 #define WRITE_CB_FLAG_PARTIALLY_WRITTEN 1
 #define WRITE_CB_FLAG_PERSISTED 2
 
-// 92 bytes as stands, and created for every write. Could it be smaller?
-
 // all the data needed to process a write callback
 struct write_cb_state {
     struct db_state *db;
@@ -71,31 +91,67 @@ struct write_cb_state {
 
     db_data key;
     db_data value;
+    db_data raw_value; // value as the caller gave it. The same as value, unless value is a compressed copy of it.
+    char flags; // flags for the record's ssd_header: 0, DATA_FLAG_DELETED, or how value's compressed
+    unsigned int crc; // of the record so far, see record_crc_begin. Streamed values are added as they're flushed.
+    bool value_dma; // value is in DMA memory, so flushes can have the device write it from where it is.
+    value_fill_cb fill; // for write_value_stream_async, which has no value.data: asked for the value as it's written out
+    unsigned long long seq; // for the record's ssd_header
 
-    int key_index; // TODO: if we implement deletes this has to become more complicated. Perhaps deletes can't occur while a key is in flight?
+    long long key_index;
+    // For overwrites, key_index already points at the old value, which stays readable until this write is applied.
 
-    unsigned long long clock_time_enqueued; // clock() time at which this write was enqueued. After a certain amount of time, or when we have enough writes to fill a sector, this will be unqueued.
+    unsigned long long clock_time_enqueued; // commit_now_us() when this write was enqueued. See nvme_commit.h for when it's flushed.
 
     unsigned long long ssd_loc; // written in flush_writes and read when the callback returns.
+    void *flushed_value; // once it's flushed, where the device is writing the value from: the flush's buffer, or value.data. NULL before.
+    long long relocated_from; // -1, unless this is the compactor moving a live record from there.
+    enum write_err error; // set when it completes, for the callback
+
 
     TAILQ_ENTRY(write_cb_state)    link;
 };
 
+extern struct slab_cache write_state_cache; // every write_cb_state comes from here
+
+// User writes and deletes that have been taken off the write ring but not applied to db -> keys yet, by key, so
+// reads can be given the value that's on its way rather than the one on disk. Open addressing, linear probing.
+struct pending_write {
+    long long key_index; // -1 for an empty slot
+    unsigned int count; // writes to the key still pending
+    struct write_cb_state *latest; // the last of them, whose value a read should see
+};
+
+struct pending_writes {
+    struct pending_write *slots;
+    unsigned long long mask; // slots - 1, a power of two
+    unsigned long long count; // slots in use
+};
+
 struct db_state {
-    _Atomic int lock;
+    _Atomic int lock; // 0 unlocked, 1 locked, 2 locked and someone might be parked waiting for it. See acq_lock.
+
+    // Reads look keys up without the lock, seqlock style: index_version is odd while keys, key_vla or index are
+    // being changed, and a lookup that saw it change (or odd) retries. Writers bracket changes with
+    // index_write_begin/end. keys and key_vla never move, but index tables that get replaced while growing are
+    // retired rather than freed, and only freed once lookups_in_progress has been 0 since. See lookup_optimistic.
+    _Atomic unsigned long long index_version;
+    _Atomic int lookups_in_progress __attribute__((aligned(64))); // CAN BE ACCESSED WITHOUT LOCK. Own cache line, readers hammer it.
 
     long long num_key_entries;
-    long long key_capacity;
-    struct ram_stored_key *keys;
-    // Each key is stored here in fixed-width form for enumeration. But the keys themselves are variable-width, so we have key_vla to store the keys themselves. `key_offset` in `struct ram_stored_key` refers to an offset in `key_vla`.
+    struct arena keys; // of struct ram_stored_key, see key_at. See nvme_arena.h.
+    // Each key is stored here in fixed-width form for enumeration. But the keys themselves are variable-width, so
+    // we have key_vla to store the keys themselves. `key_vla_offset()` of a `struct ram_stored_key` is its offset
+    // in `key_vla`.
 
-    struct key_node *nodes;
-    long long num_nodes;
-    long long node_capacity;
+    struct key_index index; // key hash -> idx in keys. See nvme_index.h.
+    // db_options.compact_index: keys aren't kept, so key_vla stays empty, and a key is found by its 64-bit hash
+    // (key_hash and key_hash_low) and length alone. Reads check the key in the record they get is the one asked for.
+    bool compact_index;
+    struct ordered_index ordered; // every key in order, if db_options.ordered_index. See nvme_ordered.h.
 
     long long key_vla_length; // end point at which bytes should be written in key_vla
-    long long key_vla_capacity; // capacity of key_vla
-    void *key_vla;
+    struct arena key_vla; // of bytes. A key never spans two segments, see key_bytes.
 
     _Atomic int writes_in_flight; // CAN BE ACCESSED WITHOUT LOCK
     _Atomic int reads_in_flight; // CAN BE ACCESSED WITHOUT LOCK
@@ -105,18 +161,78 @@ struct db_state {
     unsigned long long num_sectors; // https://spdk.io/doc/nvme_8h.html#a7c522609f730db26f66e7f5b6b3501e0
     unsigned int max_transfer_size; // https://spdk.io/doc/nvme_8h.html#ac2aac85501f13bff557d3a224d8ec156
 
-    // Writes are queued until there are sufficiently many to write a whole sector, or else for a few ms.
+    // Writes and deletes from every thread, waiting for poll_db to take them. See nvme_ring.h.
+    struct write_ring write_ring;
+
+    // Writes are queued until there are enough for a batch, or the oldest has waited long enough. See nvme_commit.h.
     TAILQ_HEAD(write_cb_head, write_cb_state) write_callback_queue;
-    
-    unsigned long long current_sector_ssd; // how many sectors are we into the current SSD (i.e. where will the next value be stored).
-    void *current_sector_data; // sector_size bytes capacity, current_sector_bytes length.
-    // We write at sector_size granularity, but often receive smaller inputs (e.g. 50 bytes) so we write to the same sector multiple times.
-    // This stores the data we've already written to that sector.
-    unsigned short current_sector_bytes; // How many bytes are we into the current sector? Mostly this should be 0.
-
-    TAILQ_HEAD(control_head, ctrlr_entry) g_controllers;
-    TAILQ_HEAD(namespace_head, ns_entry) g_namespaces;
-    struct ns_entry *main_namespace;
+    struct pending_writes pending_writes; // every user write from enqueue_write till it completes
+    struct group_commit commit;
+    struct write_cb_head gc_write_queue; // records the compactor is relocating, written through heads[HEAD_GC].
+
+    struct log_head heads[NUM_HEADS];
+
+    // Every flush that's been submitted, in submission order. Completions can come back in any order, but they're
+    // only applied to db -> keys from the front, so if a key is overwritten twice in different flushes it always
+    // ends up pointing at the newer value.
+    TAILQ_HEAD(flush_order_head, flush_writes_state) flushes_in_order;
+
+    // Finished user reads and writes. Their callbacks are run by poll_db after it's dropped the lock, so a slow
+    // callback doesn't hold up every other thread, and callbacks can call back into the db.
+    struct write_cb_head completed_writes;
+    TAILQ_HEAD(read_cb_head, read_cb_state) completed_reads;
+    _Atomic int callbacks_pending; // CAN BE ACCESSED WITHOUT LOCK. Completed, but the callback hasn't run yet.
+
+    // Space accounting, in bytes of records (header + key + value). See nvme_compact.h.
+    unsigned long long live_bytes; // records some key points at
+    unsigned long long dead_bytes; // records that have since been overwritten or deleted, until their region is reclaimed.
+    unsigned long long user_bytes_written;
+    unsigned long long relocated_bytes_written;
+    unsigned long long device_bytes_written; // everything handed to the device, padding included
+    unsigned long long in_place_bytes_written; // of DMA values the device wrote from where they were, not a copy
+    unsigned long long tail_sector_rewrites; // flushes that started by writing a head's part-written sector again
+    unsigned long long tail_sectors_skipped; // ...or that left the rest of it as padding, see flush_region_writes
+    unsigned long long records_aligned; // started on a fresh sector so their value reads in fewer
+    unsigned long long tombstones_dropped; // see drop_tombstone
+    unsigned int streams_in_flight; // write_value_stream_async writes from enqueue_write till complete_write
+
+    unsigned long long region_sectors; // the device is split into regions of this many sectors
+    unsigned long long num_regions;
+    struct region *regions;
+    unsigned int *free_regions; // stack of free region numbers
+    unsigned long long num_free_regions;
+    unsigned long long seal_clock; // incremented every time a region fills up, so region ages are in regions written.
+    unsigned long long next_seq; // seq of the next write or delete
+    unsigned int next_epoch; // epoch of the next region opened
+    struct compaction compaction;
+    struct checkpoint checkpoint;
+
+    struct db_device *device; // SPDK namespace, io_uring file, or RAM. See nvme_device.h. A slice of it if sharded.
+    struct db_queue *queue; // the one queue all of this shard's I/O goes through
+    struct dma_pool dma_pool; // buffers for reads, flushes and compaction. See nvme_pool.h.
+    struct value_cache value_cache; // see nvme_cache.h. Has its own locks.
+    struct compressor compressor; // see nvme_compress.h. Used without the lock.
+
+    unsigned long long read_merge_gap; // see db_options
+    bool verify_checksums; // !db_options.skip_checksum_verify
+    bool fresh_sector_flushes; // see db_options
+    unsigned long long values_read;
+    unsigned long long read_commands;
+    unsigned long long value_bytes_read; // of values read from the device
+    unsigned long long device_bytes_read; // whole sectors, to get those
+    unsigned long long pending_write_reads; // values_read that were copied from a pending write
+    unsigned long long scan_bytes_read; // by scan_all_async, which aren't value reads
+    _Atomic unsigned long long checksum_errors; // CAN BE ACCESSED WITHOUT LOCK. Records read that failed record_intact.
+    _Atomic unsigned long long key_mismatches; // CAN BE ACCESSED WITHOUT LOCK. compact_index reads that got another key's record.
+    struct log_scan_shard *log_scans; // scan_all_async scans still reading this shard, see nvme_log_scan.h
+
+    // See nvme_shard.h. Unsharded is one shard, which is its own shards[0].
+    struct db_state **shards;
+    unsigned int num_shards;
+    struct db_device *base_device; // the whole device
+    pthread_t poller;
+    _Atomic bool stop_poller;
+    unsigned int num_pollers; // on the handle: how many poller threads are running
 };
 
 
@@ -134,9 +250,109 @@ void free_db(void *db);
 void acq_lock(struct db_state *db);
 void release_lock(struct db_state *db);
 
-unsigned long long calc_write_bytes_queued(struct db_state *db);
 unsigned long long callback_ssd_size(struct write_cb_state *write_callback);
 
+// ssd_header.crc is the CRC32C of the header up to seq, the key, the value, then seq. It's worked out in that
+// order, as the bits are known: the thread that calls write_value_async does everything up to seq, starting with
+// this, and the flush adds seq with record_crc_end. epoch isn't in it, so a relocated record keeps its crc.
+unsigned int record_crc_begin(db_data key, unsigned long long data_length, char flags);
+unsigned int record_crc_end(unsigned int crc, unsigned long long seq);
+
+// Any thread. Whether record, a header then its key and value as they came off the device, is intact.
+bool record_intact(const void *record);
+
+// Any thread. Whether the header and key at record are the ones a read of a key with ram_stored_key's
+// key_length, data_length and key_hash, in a region with that epoch, is after: not a record left over from the
+// region's last use, or one written somewhere else by mistake. Doesn't look at the value.
+bool record_is(const void *record, unsigned short key_length, unsigned int data_length, unsigned int key_hash, unsigned int epoch);
+
+// Any thread. Whether the key in record, a header then its key, is key. For compact_index reads, whose lookups
+// only went by the key's hash.
+bool record_has_key(const void *record, const void *key, unsigned short key_length);
+
 void print_keylist(struct db_state *db);
 
+// key_idx must be below num_key_entries (or keys.capacity, for optimistic lookups). The address never changes.
+static inline struct ram_stored_key *key_at(struct db_state *db, unsigned long long key_idx) {
+    return arena_at(&db -> keys, key_idx);
+}
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+// One more, or one fewer, of the key's records on the device besides the one at data_loc. Once the count's
+// reached OLDER_RECORDS_MAX it isn't trusted to come back down, so the key's tombstone is kept for good.
+static inline void older_record_added(struct ram_stored_key *key) {
+    if (key -> older_records < OLDER_RECORDS_MAX) {
+        key -> older_records++;
+    }
+}
+
+static inline void older_record_gone(struct ram_stored_key *key) {
+    if (key -> older_records > 0 && key -> older_records < OLDER_RECORDS_MAX) {
+        key -> older_records--;
+    }
+}
+
+static inline unsigned long long key_vla_offset(const struct ram_stored_key *key) {
+    return (unsigned long long) key -> key_offset_high << 32 | key -> key_offset_low;
+}
+
+// Where key's bytes are in key_vla. Not with compact_index.
+static inline char *key_bytes(struct db_state *db, const struct ram_stored_key *key) {
+    return arena_at(&db -> key_vla, key_vla_offset(key));
+}
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+// Any change to db -> keys, key_vla or index once the db is open goes between these, so optimistic lookups notice.
+static inline void index_write_begin(struct db_state *db) {
+    atomic_store_explicit(&db -> index_version, db -> index_version + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // the odd version is visible before any of the changes
+}
+
+static inline void index_write_end(struct db_state *db) {
+    atomic_store_explicit(&db -> index_version, db -> index_version + 1, memory_order_release);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Returns the key's idx in db -> keys, or -1. If insert is set and the key isn't found, it's added to the
+// index as key number db -> num_key_entries (the caller then has to append_key, inside the same index_write_begin/end).
+long long search_for_key(struct db_state *db, db_data search_key, unsigned long long hash, bool insert);
+
+// The key's hash_bytes, as the index has it: from its bytes, or with compact_index the two halves it keeps.
+unsigned long long stored_key_hash(struct db_state *db, const struct ram_stored_key *key);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Adds a new key to db -> keys and key_vla, after search_for_key inserted it into the index. Returns its idx.
+long long append_key(struct db_state *db, db_data key, unsigned long long hash);
+
+// Looks the key up the way a read does, without the lock unless writers keep getting in the way. Returns false
+// if it's not there, otherwise *found is a copy of its ram_stored_key and *region_epoch the epoch of the region
+// its record is in.
+bool find_key(struct db_state *db, db_data key, struct ram_stored_key *found, unsigned int *region_epoch);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Applies every write pushed to the write ring up to pushed (which the caller read before taking the lock), so
+// a read sees the writes made before it. Can drop the lock and take it again while a producer finishes pushing.
+void apply_pushed_writes(struct db_state *db, unsigned long long pushed);
+
+// What poll_db does for one shard. Returns roughly how much work there was: completions, plus 1 if it flushed.
+int poll_shard(struct db_state *db);
+
+// Most bytes to read or write with one device command: max_transfer_size in whole sectors, or no limit if the
+// device didn't give one. Anything bigger is split up.
+static inline unsigned long long max_io_bytes(struct db_state *db) {
+    if (db -> max_transfer_size < db -> sector_size) {
+        return ~0ULL;
+    }
+    return db -> max_transfer_size - db -> max_transfer_size % db -> sector_size;
+}
+
+static inline unsigned long long region_of(struct db_state *db, unsigned long long loc) {
+    return loc / (db -> region_sectors * db -> sector_size);
+}
+
+// Regions that region takes up: more than 1 if it's the first of a run (see open_run).
+static inline unsigned long long region_span(struct db_state *db, const struct region *region) {
+    return region -> sectors_written <= db -> region_sectors ? 1 : (region -> sectors_written + db -> region_sectors - 1) / db -> region_sectors;
+}
+
 #endif /* nvme_key_h */
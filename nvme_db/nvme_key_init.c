@@ -7,161 +7,45 @@
 
 #include "nvme_key_init.h"
 
-#include "spdk/stdinc.h"
-#include "spdk/nvme.h"
-#include "spdk/vmd.h"
-#include "spdk/nvme_zns.h"
-#include "spdk/env.h"
+#include <stdlib.h>
+#include <string.h>
 
-static void
-register_ns(struct db_state *state, struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns *ns)
-{
-    struct ns_entry *entry;
+#define DEFAULT_MEMORY_DEVICE_SIZE (1ULL<<30)
+#define DEFAULT_MEMORY_SECTOR_SIZE 4096
 
-    if (!spdk_nvme_ns_is_active(ns)) {
-        return;
-    }
-
-    entry = malloc(sizeof(struct ns_entry));
-    if (entry == NULL) {
-        perror("ns_entry malloc");
-        exit(1);
-    }
-
-    entry->ctrlr = ctrlr;
-    entry->ns = ns;
-    TAILQ_INSERT_TAIL(&state -> g_namespaces, entry, link);
-
-    printf("  Namespace ID: %d size: %juGB\n", spdk_nvme_ns_get_id(ns),
-           spdk_nvme_ns_get_size(ns) / 1000000000);
-}
-
-static bool
-probe_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-     struct spdk_nvme_ctrlr_opts *opts)
-{
-    printf("Attaching to %s\n", trid->traddr);
-
-    return true;
+void db_options_init(struct db_options *opts) {
+    memset(opts, 0, sizeof(struct db_options));
+    opts -> backend = DB_BACKEND_SPDK;
+    opts -> device_size = DEFAULT_MEMORY_DEVICE_SIZE;
+    opts -> memory_sector_size = DEFAULT_MEMORY_SECTOR_SIZE;
 }
 
-static void
-attach_cb(void *cb_ctx, const struct spdk_nvme_transport_id *trid,
-      struct spdk_nvme_ctrlr *ctrlr, const struct spdk_nvme_ctrlr_opts *opts)
-{
-    int nsid;
-    struct ctrlr_entry *entry;
-    struct spdk_nvme_ns *ns;
-    const struct spdk_nvme_ctrlr_data *cdata;
-    struct db_state *state = cb_ctx;
-
-    entry = malloc(sizeof(struct ctrlr_entry));
-    if (entry == NULL) {
-        perror("ctrlr_entry malloc");
-        exit(1);
-    }
-
-    /*
-     * spdk_nvme_ctrlr is the logical abstraction in SPDK for an NVMe
-     *  controller.  During initialization, the IDENTIFY data for the
-     *  controller is read using an NVMe admin command, and that data
-     *  can be retrieved using spdk_nvme_ctrlr_get_data() to get
-     *  detailed information on the controller.  Refer to the NVMe
-     *  specification for more details on IDENTIFY for NVMe controllers.
-     */
-    cdata = spdk_nvme_ctrlr_get_data(ctrlr);
-    
-    snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
-
-    entry->ctrlr = ctrlr;
-    TAILQ_INSERT_TAIL(&state -> g_controllers, entry, link);
-
-#ifdef DEBUG
-    printf("io queues: %d io_queue_size: %d io_queue_requests: %d \n", opts -> num_io_queues, opts -> io_queue_size, opts -> io_queue_requests);
-#endif
-    
-    /*
-     * Each controller has one or more namespaces.  An NVMe namespace is basically
-     *  equivalent to a SCSI LUN.  The controller's IDENTIFY data tells us how
-     *  many namespaces exist on the controller.  For Intel(R) P3X00 controllers,
-     *  it will just be one namespace.
-     *
-     * Note that in NVMe, namespace IDs start at 1, not 0.
-     */
-    for (nsid = spdk_nvme_ctrlr_get_first_active_ns(ctrlr); nsid != 0;
-         nsid = spdk_nvme_ctrlr_get_next_active_ns(ctrlr, nsid)) {
-        ns = spdk_nvme_ctrlr_get_ns(ctrlr, nsid);
-        if (ns == NULL) {
-            continue;
-        }
-        register_ns(state, ctrlr, ns);
-    }
+struct db_device *open_device(const struct db_options *opts) {
+    switch (opts -> backend) {
+        case DB_BACKEND_SPDK:
+            return spdk_device_open();
+        case DB_BACKEND_FILE:
+            if (opts -> path == NULL) {
+                fprintf(stderr, "DB_BACKEND_FILE needs a path\n");
+                return NULL;
+            }
+            return uring_device_open(opts -> path, opts -> device_size, opts -> queue_depth);
+        case DB_BACKEND_MEMORY:
+            return mem_device_open(opts -> device_size, opts -> memory_sector_size,
+                opts -> memory_latency_us, opts -> memory_latency_jitter_us, opts -> memory_seed);
+    }
+    fprintf(stderr, "unknown backend %d\n", opts -> backend);
+    return NULL;
 }
 
-int initialize(struct db_state *state) {
-    TAILQ_INIT(&state -> g_namespaces);
-    TAILQ_INIT(&state -> g_controllers);
-
-    struct spdk_env_opts opts;
-
-    /*
-     * SPDK relies on an abstraction around the local environment
-     * named env that handles memory allocation and PCI device operations.
-     * This library must be initialized first.
-     *
-     */
-    spdk_env_opts_init(&opts);
-    opts.name = "nvme_db";
-    opts.shm_id = 0;
-    if (spdk_env_init(&opts) < 0) {
-        fprintf(stderr, "Unable to initialize SPDK env\n");
-        return 1;
-    }
-    
-    printf("about to init\n");
-    
-    if (spdk_vmd_init()) {
-        fprintf(stderr, "Failed to initialize VMD."
-            " Some NVMe devices can be unavailable.\n");
-        return 1;
-    }
-    
-    printf("about to probe\n");
-    
-    /*
-     * Start the SPDK NVMe enumeration process.  probe_cb will be called
-     *  for each NVMe controller found, giving our application a choice on
-     *  whether to attach to each controller.  attach_cb will then be
-     *  called for each controller after the SPDK NVMe driver has completed
-     *  initializing the controller we chose to attach.
-     */
-    int rc = spdk_nvme_probe(NULL, state, probe_cb, attach_cb, NULL);
-    if (rc != 0) {
-        fprintf(stderr, "spdk_nvme_probe() failed\n");
-        // cleanup();
-        return 2;
-    }
-    
-    printf("about to tailq empty\n");
-
-    if (TAILQ_EMPTY(&state -> g_controllers)) {
-        fprintf(stderr, "no NVMe controllers found\n");
-        // cleanup();
+int initialize(struct db_state *state, struct db_device *device) {
+    state -> device = device;
+    state -> queue = state -> device -> ops -> alloc_queue(state -> device);
+    if (state -> queue == NULL) {
         return 2;
     }
-    
-    printf("about to allocate qpairs\n");
-    struct ns_entry            *ns_entry = TAILQ_FIRST(&state -> g_namespaces);
-    ns_entry->qpair = spdk_nvme_ctrlr_alloc_io_qpair(ns_entry->ctrlr, NULL, 0);
-    if (ns_entry->qpair == NULL) {
-        printf("ERROR: spdk_nvme_ctrlr_alloc_io_qpair() failed\n");
-        return 2;
-    }
-    state -> main_namespace = ns_entry;
-    state -> sector_size = spdk_nvme_ns_get_sector_size(state -> main_namespace -> ns);
-    state -> num_sectors = spdk_nvme_ns_get_num_sectors(state -> main_namespace -> ns);
-    state -> max_transfer_size = spdk_nvme_ns_get_max_io_xfer_size(state -> main_namespace -> ns);
-
-    printf("Initialization complete.\n");
+    state -> sector_size = state -> device -> sector_size;
+    state -> num_sectors = state -> device -> num_sectors;
+    state -> max_transfer_size = state -> device -> max_transfer_size;
     return 0;
 }
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include "nvme_key.h"
 
-int initialize(struct db_state *state);
+struct db_device *open_device(const struct db_options *opts);
+
+// Sets state up to use device, with a queue of its own. The caller still owns device.
+int initialize(struct db_state *state, struct db_device *device);
 
 #endif /* nvme_key_init_h */
@@ -0,0 +1,325 @@
+//
+//  nvme_log_scan.c
+//
+//
+
+#include "nvme_log_scan.h"
+#include "nvme_write_key_async.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOC_SET_EMPTY (~0ULL)
+#define LOC_SET_INITIAL_SLOTS 64
+
+static unsigned long long loc_slot(unsigned long long loc, unsigned long long mask) {
+    return (loc * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+}
+
+static void loc_set_init(struct loc_set *set, unsigned long long slots) {
+    set -> slots = malloc(slots * sizeof(unsigned long long));
+    memset(set -> slots, 0xff, slots * sizeof(unsigned long long)); // all LOC_SET_EMPTY
+    set -> mask = slots - 1;
+    set -> count = 0;
+}
+
+static void loc_set_add(struct loc_set *set, unsigned long long loc) {
+    if (2 * (set -> count + 1) > set -> mask + 1) { // keep it at most half full
+        struct loc_set bigger;
+        loc_set_init(&bigger, 2 * (set -> mask + 1));
+        for (unsigned long long i = 0; i <= set -> mask; i++) {
+            if (set -> slots[i] != LOC_SET_EMPTY) {
+                loc_set_add(&bigger, set -> slots[i]);
+            }
+        }
+        free(set -> slots);
+        *set = bigger;
+    }
+    unsigned long long i = loc_slot(loc, set -> mask);
+    while (set -> slots[i] != LOC_SET_EMPTY) {
+        if (set -> slots[i] == loc) {
+            return;
+        }
+        i = (i + 1) & set -> mask;
+    }
+    set -> slots[i] = loc;
+    set -> count++;
+}
+
+static bool loc_set_has(struct loc_set *set, unsigned long long loc) {
+    for (unsigned long long i = loc_slot(loc, set -> mask); set -> slots[i] != LOC_SET_EMPTY; i = (i + 1) & set -> mask) {
+        if (set -> slots[i] == loc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void log_scan_record_died(struct db_state *db, unsigned long long loc) {
+    unsigned long long region = region_of(db, loc);
+    unsigned long long offset = loc - region * db -> region_sectors * db -> sector_size;
+    for (struct log_scan_shard *shard = db -> log_scans; shard; shard = shard -> next_active) {
+        if (offset < shard -> extents[region] && db -> regions[region].epoch == shard -> epochs[region]) {
+            loc_set_add(&shard -> died, loc);
+        }
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Picks the regions to read: every one in use, up to where its writes have been applied, which is where the log
+// heads are, or further back for flushes that haven't been applied yet (see start_checkpoint).
+static void log_scan_plan(struct log_scan_shard *shard) {
+    struct db_state *db = shard -> db;
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        struct region *region = &db -> regions[i];
+        shard -> extents[i] = region -> state == REGION_FREE ? 0 : region -> sectors_written * db -> sector_size;
+        shard -> epochs[i] = region -> epoch;
+    }
+    for (int i = 0; i < NUM_HEADS; i++) {
+        struct log_head *head = &db -> heads[i];
+        if (head -> region >= 0) {
+            unsigned long long loc = head -> current_sector_ssd * db -> sector_size + head -> current_sector_bytes;
+            shard -> extents[head -> region] = loc - head -> region * region_bytes;
+        }
+    }
+    unapplied_flush_starts(db, shard -> extents);
+    for (unsigned long long i = 0; i < db -> num_regions; i++) {
+        if (shard -> extents[i]) {
+            db -> regions[i].scanners++; // till its read's issued, and pins it instead
+            shard -> regions_left++;
+        }
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads planned regions till LOG_SCAN_REGIONS_IN_FLIGHT are being read or parsed, or there are none left.
+static void log_scan_issue(struct log_scan_shard *shard) {
+    struct db_state *db = shard -> db;
+    while (shard -> in_flight < LOG_SCAN_REGIONS_IN_FLIGHT && shard -> next_region < db -> num_regions) {
+        unsigned long long region = shard -> next_region++;
+        if (shard -> extents[region] == 0) {
+            continue;
+        }
+        db -> regions[region].scanners--;
+        shard -> in_flight++;
+        issue_log_scan_read(db, shard, region, shard -> extents[region]);
+    }
+}
+
+static void log_scan_free(struct log_scan *scan) {
+    for (unsigned int i = 0; i < scan -> handle -> num_shards; i++) {
+        free(scan -> shards[i].extents);
+        free(scan -> shards[i].epochs);
+        free(scan -> shards[i].died.slots);
+    }
+    free(scan);
+}
+
+// One more region's parsed, or scan_all_async is done planning. The last one runs the last callback.
+static void log_scan_release(struct log_scan *scan) {
+    if (atomic_fetch_sub(&scan -> regions_left, 1) != 1) {
+        return;
+    }
+    enum read_err err = scan -> failed ? READ_IO_ERROR : READ_SUCCESSFUL;
+    scan -> callback(scan -> cb_arg, err, 0, NULL, NULL, 1);
+    log_scan_free(scan);
+}
+
+// The records found so far, delivered a batch at a time.
+struct record_batch {
+    struct log_scan *scan;
+    struct db_state *db;
+    unsigned int count;
+    db_data keys[LOG_SCAN_BATCH_RECORDS];
+    db_data values[LOG_SCAN_BATCH_RECORDS];
+    void *inflated[LOG_SCAN_BATCH_RECORDS]; // values that were compressed, decompressed, or NULL
+};
+
+static void batch_deliver(struct record_batch *batch) {
+    struct log_scan *scan = batch -> scan;
+    scan -> callback(scan -> cb_arg, READ_SUCCESSFUL, batch -> count, batch -> keys, batch -> values, 0);
+    for (unsigned int i = 0; i < batch -> count; i++) {
+        free(batch -> inflated[i]);
+    }
+    batch -> count = 0;
+}
+
+// flags are the record's, and say if value's compressed.
+// Adds the record at record, if it's intact.
+static void batch_add(struct record_batch *batch, const char *record) {
+    struct log_scan *scan = batch -> scan;
+    struct ssd_header header;
+    memcpy(&header, record, sizeof(header));
+    if (!record_intact(record)) {
+        printf("Record failed its checksum, scan skipping it\n");
+        atomic_fetch_add_explicit(&batch -> db -> checksum_errors, 1, memory_order_relaxed);
+        scan -> failed = true;
+        return;
+    }
+    db_data key = {.length=header.key_length, .data=(char *)record + sizeof(header)};
+    db_data value = {.length=header.data_length, .data=key.data + key.length};
+    char flags = header.flags;
+    void *inflated = NULL;
+    if (flags & DATA_FLAGS_COMPRESSED) {
+        unsigned long long length = decompressed_length(value.data, value.length);
+        inflated = length ? malloc(length) : NULL;
+        if (inflated == NULL || !decompress_value(&batch -> db -> compressor, flags, value.data, value.length, inflated)) {
+            printf("Couldn't decompress a value, scan skipping it\n");
+            free(inflated);
+            scan -> failed = true;
+            return;
+        }
+        value = (db_data){.length=length, .data=inflated};
+    }
+    if (scan -> filter && !scan -> filter(scan -> cb_arg, key, value)) {
+        free(inflated);
+        return;
+    }
+    batch -> keys[batch -> count] = key;
+    batch -> values[batch -> count] = value;
+    batch -> inflated[batch -> count] = inflated;
+    if (++batch -> count == LOG_SCAN_BATCH_RECORDS) {
+        batch_deliver(batch);
+    }
+}
+
+void deliver_log_scan_read(struct db_state *db, struct read_cb_state *read_cb) {
+    struct log_scan_shard *shard = read_cb -> log_scan;
+    struct log_scan *scan = shard -> scan;
+    unsigned long long region_start = read_cb -> region * db -> region_sectors * db -> sector_size;
+    unsigned long long end = read_cb -> data_length;
+    char *buf = read_cb -> data;
+
+    struct record_batch *batch = malloc(sizeof(struct record_batch));
+    batch -> scan = scan;
+    batch -> db = db;
+    batch -> count = 0;
+    // Records the key's moved off since the scan started, if that's what happened, rather than before.
+    unsigned long long *moved = NULL;
+    unsigned long long num_moved = 0, moved_capacity = 0;
+
+    unsigned long long pos = end;
+    if (read_cb -> status != 0) {
+        scan -> failed = true;
+    } else {
+        pos = 0;
+    }
+    // Laid out the way gc_read_cb expects, see there.
+    while (pos < end) {
+        unsigned long long sector_left = db -> sector_size - pos % db -> sector_size;
+        struct ssd_header header;
+        if (sector_left < sizeof(header)) {
+            pos += sector_left;
+            continue;
+        }
+        memcpy(&header, buf + pos, sizeof(header));
+        if (header.key_length == 0 && header.flags == DATA_FLAG_PADDING) {
+            pos += sizeof(header) + header.data_length;
+            continue;
+        }
+        if (header.key_length == 0) {
+            pos += sector_left;
+            continue;
+        }
+        unsigned long long size = sizeof(header) + header.key_length + header.data_length;
+        if (pos + size > end) {
+            printf("Corrupt record header at %llu in region %llu, scan skipping the rest of it\n", pos, read_cb -> region);
+            scan -> failed = true;
+            break;
+        }
+        if (header.flags & DATA_FLAG_DELETED) {
+            pos += size;
+            continue;
+        }
+
+        db_data key = {.length=header.key_length, .data=buf + pos + sizeof(header)};
+        struct ram_stored_key found;
+        unsigned int epoch = 0;
+        if (find_key(db, key, &found, &epoch) && !(found.flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED))) {
+            if (found.data_loc == (long long) (region_start + pos) && epoch == read_cb -> epoch) {
+                batch_add(batch, buf + pos);
+            } else {
+                if (num_moved == moved_capacity) {
+                    moved_capacity = moved_capacity ? 2 * moved_capacity : 64;
+                    moved = realloc(moved, moved_capacity * sizeof(unsigned long long));
+                }
+                moved[num_moved++] = pos;
+            }
+        }
+        pos += size;
+    }
+
+    // The ones that died since go too, and then the region's done with.
+    acq_lock(db); // ACQUIRE LOCK
+    unsigned long long kept = 0;
+    for (unsigned long long i = 0; i < num_moved; i++) {
+        if (loc_set_has(&shard -> died, region_start + moved[i])) {
+            moved[kept++] = moved[i];
+        }
+    }
+    shard -> extents[read_cb -> region] = 0;
+    shard -> in_flight--;
+    if (--shard -> regions_left == 0) {
+        struct log_scan_shard **link = &db -> log_scans;
+        while (*link != shard) {
+            link = &(*link) -> next_active;
+        }
+        *link = shard -> next_active;
+    } else {
+        log_scan_issue(shard);
+    }
+    release_lock(db); // RELEASE LOCK
+
+    for (unsigned long long i = 0; i < kept; i++) {
+        batch_add(batch, buf + moved[i]);
+    }
+    if (batch -> count) {
+        batch_deliver(batch);
+    }
+    free(batch);
+    free(moved);
+    read_buffer_release(read_cb);
+    db -> callbacks_pending--;
+    log_scan_release(scan);
+}
+
+// PUBLIC API
+
+void scan_all_async(void *opaque, record_filter_cb filter, records_scan_cb callback, void *cb_arg) {
+    struct db_state *handle = opaque;
+    struct log_scan *scan = malloc(sizeof(struct log_scan) + handle -> num_shards * sizeof(struct log_scan_shard));
+    scan -> handle = handle;
+    scan -> filter = filter;
+    scan -> callback = callback;
+    scan -> cb_arg = cb_arg;
+    scan -> regions_left = 1; // so it can't finish while shards are still being planned
+    scan -> failed = false;
+
+    for (unsigned int i = 0; i < handle -> num_shards; i++) {
+        struct db_state *db = handle -> shards[i];
+        struct log_scan_shard *shard = &scan -> shards[i];
+        shard -> scan = scan;
+        shard -> db = db;
+        shard -> extents = malloc(db -> num_regions * sizeof(unsigned long long));
+        shard -> epochs = malloc(db -> num_regions * sizeof(unsigned int));
+        shard -> next_region = 0;
+        shard -> regions_left = 0;
+        shard -> in_flight = 0;
+        loc_set_init(&shard -> died, LOC_SET_INITIAL_SLOTS);
+
+        unsigned long long pushed = write_ring_pushed(&db -> write_ring);
+        acq_lock(db); // ACQUIRE LOCK
+        apply_pushed_writes(db, pushed); // like a read, so writes made before this are in the index
+        log_scan_plan(shard);
+        if (shard -> regions_left) {
+            shard -> next_active = db -> log_scans;
+            db -> log_scans = shard;
+            atomic_fetch_add(&scan -> regions_left, shard -> regions_left); // before any of them can be parsed
+            log_scan_issue(shard);
+        }
+        release_lock(db); // RELEASE LOCK
+    }
+    log_scan_release(scan);
+}
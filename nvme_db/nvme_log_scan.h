@@ -0,0 +1,70 @@
+//
+//  nvme_log_scan.h
+//
+//
+//  scan_all_async: every key and value, straight off the log, rather than a lookup and a random read per key.
+//
+//  When it starts, each shard makes a plan: every region in use, and how far into it writes had been applied
+//  (like a checkpoint's replay_from, see nvme_checkpoint.c). Each planned region is read with one big read (split
+//  up at max_transfer_size), LOG_SCAN_REGIONS_IN_FLIGHT at a time per shard, and its records are parsed on the
+//  poller without the lock. Planned regions aren't compacted, or reused, until they've been read.
+//
+//  A record is delivered if it was the key's current one when the scan started. Anything written or relocated
+//  after that lands outside the plan (past where a region was planned up to, or in a region opened since), so
+//  a key is never found twice. Deciding that for a record:
+//    - if the key points at it now (looked up without the lock, like a read), it was the key's then too.
+//    - if not, it still was if it's died since. Every shard records the planned records that die (record_died)
+//      while it's being scanned, and a record the key's moved off is checked against those, under the lock.
+//  So every key that was on the device when the scan started comes exactly once, with the value it had then,
+//  unless it's been deleted by the time its region is parsed.
+//
+
+#ifndef nvme_log_scan_h
+#define nvme_log_scan_h
+
+#include "nvme_read_key_async.h"
+
+#define LOG_SCAN_REGIONS_IN_FLIGHT 4 // per shard
+#define LOG_SCAN_BATCH_RECORDS 256 // most records per callback
+
+// Locs of records, open addressing, linear probing.
+struct loc_set {
+    unsigned long long *slots; // ~0ULL for an empty one
+    unsigned long long mask; // slots - 1, a power of two
+    unsigned long long count;
+};
+
+// The part of a scan reading one shard. Everything but the parse is only touched with the shard's lock held.
+struct log_scan_shard {
+    struct log_scan *scan;
+    struct db_state *db;
+    // By region: bytes of it the scan reads, or 0 if it doesn't (or has already parsed it), and its epoch when
+    // the scan started.
+    unsigned long long *extents;
+    unsigned int *epochs;
+    unsigned long long next_region; // where to look for the next one to read
+    unsigned long long regions_left; // planned but not yet parsed
+    unsigned int in_flight;
+    struct loc_set died; // planned records that were live when the scan started, and have since died
+    struct log_scan_shard *next_active; // in db -> log_scans
+};
+
+struct log_scan {
+    struct db_state *handle;
+    record_filter_cb filter;
+    records_scan_cb callback;
+    void *cb_arg;
+    _Atomic unsigned long long regions_left; // over every shard, plus one for scan_all_async while it's planning
+    _Atomic bool failed; // a region couldn't be read
+    struct log_scan_shard shards[]; // num_shards of them
+};
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// The record at loc has just died (overwritten, deleted or relocated). Scans still reading the shard remember it
+// if they planned to read it, since it was live when they started.
+void log_scan_record_died(struct db_state *db, unsigned long long loc);
+
+// Parses a region a scan has read, and runs the callbacks for its records. Without the lock.
+void deliver_log_scan_read(struct db_state *db, struct read_cb_state *read_cb);
+
+#endif /* nvme_log_scan_h */
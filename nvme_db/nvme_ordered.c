@@ -0,0 +1,256 @@
+//
+//  nvme_ordered.c
+//
+//
+
+#define _GNU_SOURCE // qsort_r
+#include "nvme_ordered.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct ordered_node *node_alloc(struct ordered_index *tree, bool leaf) {
+    unsigned long long size = sizeof(struct ordered_node) + (leaf ? 0 : (ORDERED_NODE_KEYS + 1) * sizeof(struct ordered_node *));
+    struct ordered_node *node = malloc(size);
+    if (node == NULL) {
+        abort(); // same as the hash index, nothing sensible to do
+    }
+    node -> num_keys = 0;
+    node -> leaf = leaf;
+    node -> next = NULL;
+    tree -> bytes += size;
+    return node;
+}
+
+static void node_free(struct ordered_node *node) {
+    if (!node -> leaf) {
+        for (unsigned int i = 0; i <= node -> num_keys; i++) {
+            node_free(node -> children[i]);
+        }
+    }
+    free(node);
+}
+
+int ordered_compare(const void *a, unsigned int a_length, const void *b, unsigned int b_length) {
+    int cmp = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return a_length < b_length ? -1 : a_length > b_length;
+}
+
+// key against the key with idx key_idx
+static int compare_to(struct ordered_index *tree, const void *key, unsigned int length, unsigned int key_idx) {
+    unsigned int other_length;
+    const void *other = tree -> key_of(tree -> ctx, key_idx, &other_length);
+    return ordered_compare(key, length, other, other_length);
+}
+
+// First i with keys[i] > key, or >= key if inclusive.
+static unsigned int node_search(struct ordered_index *tree, struct ordered_node *node, const void *key, unsigned int length, bool inclusive) {
+    unsigned int lo = 0, hi = node -> num_keys;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        int cmp = compare_to(tree, key, length, node -> keys[mid]);
+        if (cmp > 0 || (cmp == 0 && !inclusive)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void ordered_init(struct ordered_index *tree, ordered_key_cb key_of, void *ctx) {
+    memset(tree, 0, sizeof(struct ordered_index));
+    tree -> key_of = key_of;
+    tree -> ctx = ctx;
+}
+
+void ordered_free(struct ordered_index *tree) {
+    if (tree -> root) {
+        node_free(tree -> root);
+    }
+    tree -> root = NULL;
+    tree -> enabled = false;
+}
+
+static int compare_idxs(const void *a, const void *b, void *arg) {
+    struct ordered_index *tree = arg;
+    unsigned int length;
+    const void *key = tree -> key_of(tree -> ctx, *(const unsigned int *)a, &length);
+    return compare_to(tree, key, length, *(const unsigned int *)b);
+}
+
+void ordered_build(struct ordered_index *tree, unsigned int *idxs, unsigned long long num_keys) {
+    ordered_free(tree);
+    tree -> bytes = 0;
+    tree -> enabled = true;
+    tree -> num_keys = num_keys;
+    tree -> height = 1;
+
+    qsort_r(idxs, num_keys, sizeof(unsigned int), compare_idxs, tree);
+
+    // Full leaves, then full levels of inner nodes over them till there's one. firsts[i] is the first key under nodes[i].
+    unsigned long long count = (num_keys + ORDERED_NODE_KEYS - 1) / ORDERED_NODE_KEYS;
+    count = count ? count : 1;
+    struct ordered_node **nodes = malloc(count * sizeof(struct ordered_node *));
+    unsigned int *firsts = malloc(count * sizeof(unsigned int));
+    for (unsigned long long n = 0; n < count; n++) {
+        nodes[n] = node_alloc(tree, true);
+        unsigned long long start = n * ORDERED_NODE_KEYS;
+        unsigned long long end = start + ORDERED_NODE_KEYS < num_keys ? start + ORDERED_NODE_KEYS : num_keys;
+        nodes[n] -> num_keys = end - start;
+        memcpy(nodes[n] -> keys, idxs + start, (end - start) * sizeof(unsigned int));
+        firsts[n] = end > start ? idxs[start] : 0; // only the one empty leaf of an empty tree has none
+        if (n) {
+            nodes[n - 1] -> next = nodes[n];
+        }
+    }
+
+    while (count > 1) {
+        unsigned long long parents = (count + ORDERED_NODE_KEYS) / (ORDERED_NODE_KEYS + 1);
+        for (unsigned long long p = 0; p < parents; p++) {
+            struct ordered_node *parent = node_alloc(tree, false);
+            unsigned long long start = p * (ORDERED_NODE_KEYS + 1);
+            unsigned long long end = start + ORDERED_NODE_KEYS + 1 < count ? start + ORDERED_NODE_KEYS + 1 : count;
+            for (unsigned long long c = start; c < end; c++) {
+                parent -> children[c - start] = nodes[c];
+                if (c > start) {
+                    parent -> keys[c - start - 1] = firsts[c];
+                }
+            }
+            parent -> num_keys = end - start - 1;
+            firsts[p] = firsts[start]; // p <= start, so this never overwrites one still to be read
+            nodes[p] = parent;
+        }
+        count = parents;
+        tree -> height++;
+    }
+    tree -> root = nodes[0];
+    free(firsts);
+    free(nodes);
+}
+
+// Puts key_idx (and, in an inner node, the child to its right) at pos in node, which is full, and splits it.
+// Returns the new right half, with *separator the key to put between the halves in the parent. Usually half
+// goes each way, but a node that's only ever appended to (rightmost) is left full, so keys that are written
+// in order, like sequential ids, pack the tree full instead of half full.
+static struct ordered_node *node_split(struct ordered_index *tree, struct ordered_node *node, unsigned int pos, unsigned int key_idx,
+                                       struct ordered_node *right_child, bool rightmost, unsigned int *separator) {
+    unsigned int keys[ORDERED_NODE_KEYS + 1];
+    struct ordered_node *children[ORDERED_NODE_KEYS + 2];
+    memcpy(keys, node -> keys, pos * sizeof(unsigned int));
+    keys[pos] = key_idx;
+    memcpy(keys + pos + 1, node -> keys + pos, (ORDERED_NODE_KEYS - pos) * sizeof(unsigned int));
+    if (!node -> leaf) {
+        memcpy(children, node -> children, (pos + 1) * sizeof(struct ordered_node *));
+        children[pos + 1] = right_child;
+        memcpy(children + pos + 2, node -> children + pos + 1, (ORDERED_NODE_KEYS - pos) * sizeof(struct ordered_node *));
+    }
+
+    unsigned int split = rightmost && pos == ORDERED_NODE_KEYS ? ORDERED_NODE_KEYS : (ORDERED_NODE_KEYS + 1) / 2;
+    struct ordered_node *right = node_alloc(tree, node -> leaf);
+    if (node -> leaf) { // the right half starts with keys[split], which stays in the leaf
+        node -> num_keys = split;
+        memcpy(node -> keys, keys, split * sizeof(unsigned int));
+        right -> num_keys = ORDERED_NODE_KEYS + 1 - split;
+        memcpy(right -> keys, keys + split, right -> num_keys * sizeof(unsigned int));
+        right -> next = node -> next;
+        node -> next = right;
+    } else { // keys[split] moves up
+        node -> num_keys = split;
+        memcpy(node -> keys, keys, split * sizeof(unsigned int));
+        memcpy(node -> children, children, (split + 1) * sizeof(struct ordered_node *));
+        right -> num_keys = ORDERED_NODE_KEYS - split;
+        memcpy(right -> keys, keys + split + 1, right -> num_keys * sizeof(unsigned int));
+        memcpy(right -> children, children + split + 1, (right -> num_keys + 1) * sizeof(struct ordered_node *));
+    }
+    *separator = keys[split];
+    return right;
+}
+
+// Inserts into the subtree under node. If node split, returns its new right half, see node_split.
+static struct ordered_node *node_insert(struct ordered_index *tree, struct ordered_node *node, const void *key, unsigned int length,
+                                        unsigned int key_idx, bool rightmost, unsigned int *separator) {
+    unsigned int pos = node_search(tree, node, key, length, false);
+    struct ordered_node *right_child = NULL;
+    if (!node -> leaf) {
+        right_child = node_insert(tree, node -> children[pos], key, length, key_idx, rightmost && pos == node -> num_keys, &key_idx);
+        if (right_child == NULL) {
+            return NULL;
+        }
+    }
+
+    if (node -> num_keys == ORDERED_NODE_KEYS) {
+        return node_split(tree, node, pos, key_idx, right_child, rightmost, separator);
+    }
+    memmove(node -> keys + pos + 1, node -> keys + pos, (node -> num_keys - pos) * sizeof(unsigned int));
+    node -> keys[pos] = key_idx;
+    if (!node -> leaf) {
+        memmove(node -> children + pos + 2, node -> children + pos + 1, (node -> num_keys - pos) * sizeof(struct ordered_node *));
+        node -> children[pos + 1] = right_child;
+    }
+    node -> num_keys++;
+    return NULL;
+}
+
+void ordered_insert(struct ordered_index *tree, unsigned int key_idx) {
+    if (!tree -> enabled) {
+        return;
+    }
+    unsigned int length;
+    const void *key = tree -> key_of(tree -> ctx, key_idx, &length);
+    unsigned int separator;
+    struct ordered_node *right = node_insert(tree, tree -> root, key, length, key_idx, true, &separator);
+    if (right) { // the root split, so the tree grows a level
+        struct ordered_node *root = node_alloc(tree, false);
+        root -> num_keys = 1;
+        root -> keys[0] = separator;
+        root -> children[0] = tree -> root;
+        root -> children[1] = right;
+        tree -> root = root;
+        tree -> height++;
+    }
+    tree -> num_keys++;
+}
+
+void ordered_remove(struct ordered_index *tree, unsigned int key_idx) {
+    if (!tree -> enabled) {
+        return;
+    }
+    unsigned int length;
+    const void *key = tree -> key_of(tree -> ctx, key_idx, &length);
+    struct ordered_node *node = tree -> root;
+    while (!node -> leaf) {
+        node = node -> children[node_search(tree, node, key, length, false)];
+    }
+    unsigned int pos = node_search(tree, node, key, length, true);
+    if (pos == node -> num_keys || node -> keys[pos] != key_idx) {
+        return;
+    }
+    memmove(node -> keys + pos, node -> keys + pos + 1, (node -> num_keys - pos - 1) * sizeof(unsigned int));
+    node -> num_keys--;
+    tree -> num_keys--;
+}
+
+void ordered_seek(struct ordered_index *tree, const void *key, unsigned int length, bool exclusive, struct ordered_cursor *cursor) {
+    struct ordered_node *node = tree -> root;
+    while (!node -> leaf) {
+        node = node -> children[node_search(tree, node, key, length, false)];
+    }
+    cursor -> leaf = node;
+    cursor -> pos = node_search(tree, node, key, length, !exclusive);
+}
+
+bool ordered_next(struct ordered_cursor *cursor, unsigned int *key_idx) {
+    while (cursor -> leaf && cursor -> pos >= cursor -> leaf -> num_keys) {
+        cursor -> leaf = cursor -> leaf -> next;
+        cursor -> pos = 0;
+    }
+    if (cursor -> leaf == NULL) {
+        return false;
+    }
+    *key_idx = cursor -> leaf -> keys[cursor -> pos++];
+    return true;
+}
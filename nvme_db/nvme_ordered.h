@@ -0,0 +1,73 @@
+//
+//  nvme_ordered.h
+//
+//
+//  Optional B+tree of every key in the shard in key order (db_options.ordered_index), alongside the hash index
+//  point lookups use, for scan_async (see nvme_scan.h). Keys are compared as bytes, shorter first on a tie.
+//
+//  The tree only holds key idxs, 4 bytes each, and gets each key's bytes from the db when it needs them (the
+//  key_of callback), so it costs about 6 bytes a key. A deleted key stays in, and scans skip it like reads do,
+//  until its tombstone is dropped (see drop_tombstone in nvme_compact.c). Removing a key only ever takes it out
+//  of its leaf: nodes aren't merged, and a removed key can still be an inner node's separator, which is fine
+//  since key_of keeps giving its bytes.
+//
+//  Unlike the hash index it's only ever used with the lock held, so there's nothing optimistic about it.
+//
+
+#ifndef nvme_ordered_h
+#define nvme_ordered_h
+
+#include <stdbool.h>
+
+#define ORDERED_NODE_KEYS 64
+
+struct ordered_node {
+    unsigned int num_keys;
+    bool leaf;
+    struct ordered_node *next; // leaves: the next leaf to the right, or NULL
+    unsigned int keys[ORDERED_NODE_KEYS]; // key idxs. In an inner node keys[i] is the first key under children[i + 1].
+    struct ordered_node *children[]; // inner nodes only, num_keys + 1 of them
+};
+
+typedef const void *(*ordered_key_cb)(void *ctx, unsigned int key_idx, unsigned int *length); // the key's bytes
+
+struct ordered_index {
+    bool enabled;
+    struct ordered_node *root;
+    unsigned int height; // 1 when the root is a leaf
+    unsigned long long num_keys;
+    unsigned long long bytes; // of nodes
+    ordered_key_cb key_of;
+    void *ctx;
+};
+
+// Where a scan is: keys[pos] of leaf, or nothing left if leaf is NULL.
+struct ordered_cursor {
+    struct ordered_node *leaf;
+    unsigned int pos;
+};
+
+// Leaves it disabled, and then ordered_insert does nothing.
+void ordered_init(struct ordered_index *tree, ordered_key_cb key_of, void *ctx);
+void ordered_free(struct ordered_index *tree);
+
+// Builds the tree out of the num_keys key idxs in idxs, which all have to be distinct keys, and enables it. Sorts
+// them (in place) and packs the nodes full, which is a lot quicker than inserting them one at a time.
+void ordered_build(struct ordered_index *tree, unsigned int *idxs, unsigned long long num_keys);
+
+// The key must not be in the tree already.
+void ordered_insert(struct ordered_index *tree, unsigned int key_idx);
+
+// Does nothing if the key isn't in the tree.
+void ordered_remove(struct ordered_index *tree, unsigned int key_idx);
+
+// Points cursor at the first key >= key, or the first key > key if exclusive.
+void ordered_seek(struct ordered_index *tree, const void *key, unsigned int length, bool exclusive, struct ordered_cursor *cursor);
+
+// The key idx at cursor, moving it along. Returns false once there are no more.
+bool ordered_next(struct ordered_cursor *cursor, unsigned int *key_idx);
+
+// memcmp order, a prefix before anything longer
+int ordered_compare(const void *a, unsigned int a_length, const void *b, unsigned int b_length);
+
+#endif /* nvme_ordered_h */
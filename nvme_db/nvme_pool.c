@@ -0,0 +1,266 @@
+//
+//  nvme_pool.c
+//
+//
+
+#include "nvme_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_HEADER 16 // a slab's link to the next one, padded so objects stay 16-byte aligned
+
+struct slab_magazine {
+    void *objects[SLAB_MAGAZINE_SIZE];
+    int count;
+};
+
+static __thread struct slab_magazine magazines[SLAB_MAX_CACHES];
+static __thread bool magazines_registered; // for magazines_key's destructor
+
+static struct slab_cache *caches[SLAB_MAX_CACHES]; // by id - 1
+static _Atomic int num_caches;
+static pthread_key_t magazines_key;
+static pthread_once_t magazines_key_once = PTHREAD_ONCE_INIT;
+
+static inline void *next_of(void *object) {
+    return *(void **)object;
+}
+
+static inline void set_next(void *object, void *next) {
+    *(void **)object = next;
+}
+
+// MUST HAVE cache -> lock TO CALL THIS FUNCTION
+static void depot_grow(struct slab_cache *cache) {
+    size_t stride = (cache -> size + 15) / 16 * 16;
+    void *slab = malloc(SLAB_HEADER + SLAB_OBJECTS_PER_SLAB * stride);
+    if (slab == NULL) {
+        return;
+    }
+    set_next(slab, cache -> slabs);
+    cache -> slabs = slab;
+    cache -> num_slabs++;
+    for (int i = SLAB_OBJECTS_PER_SLAB; i-- > 0;) {
+        void *object = (char *)slab + SLAB_HEADER + i * stride;
+        set_next(object, cache -> depot);
+        cache -> depot = object;
+    }
+    cache -> depot_count += SLAB_OBJECTS_PER_SLAB;
+}
+
+// Moves objects between a magazine and the depot: count > 0 takes that many from the depot, < 0 gives them back.
+static void depot_exchange(struct slab_cache *cache, struct slab_magazine *magazine, int count) {
+    pthread_mutex_lock(&cache -> lock);
+    if (count > 0) {
+        while (cache -> depot_count < (unsigned long long)count && cache -> depot_count < SLAB_MAGAZINE_SIZE) {
+            unsigned long long before = cache -> depot_count;
+            depot_grow(cache);
+            if (cache -> depot_count == before) {
+                break; // out of memory. Hand out what there is.
+            }
+        }
+        while (count-- > 0 && cache -> depot) {
+            void *object = cache -> depot;
+            cache -> depot = next_of(object);
+            cache -> depot_count--;
+            cache -> checked_out++;
+            magazine -> objects[magazine -> count++] = object;
+        }
+        if (cache -> checked_out > cache -> high_water) {
+            cache -> high_water = cache -> checked_out;
+        }
+    } else {
+        while (count++ < 0 && magazine -> count) {
+            void *object = magazine -> objects[--magazine -> count];
+            set_next(object, cache -> depot);
+            cache -> depot = object;
+            cache -> depot_count++;
+            cache -> checked_out--;
+        }
+    }
+    pthread_mutex_unlock(&cache -> lock);
+}
+
+// A thread that's exiting hands everything it was keeping back to the depots, so nothing is stranded.
+static void magazines_release(void *unused) {
+    int n = atomic_load(&num_caches);
+    for (int i = 0; i < n && i < SLAB_MAX_CACHES; i++) {
+        if (caches[i] && magazines[i].count) {
+            depot_exchange(caches[i], &magazines[i], -magazines[i].count);
+        }
+    }
+}
+
+static void magazines_key_create(void) {
+    pthread_key_create(&magazines_key, magazines_release);
+}
+
+static int cache_id(struct slab_cache *cache) {
+    int id = atomic_load_explicit(&cache -> id, memory_order_acquire);
+    if (id) {
+        return id;
+    }
+    pthread_once(&magazines_key_once, magazines_key_create);
+    pthread_mutex_lock(&cache -> lock); // so two threads don't both register it
+    id = atomic_load(&cache -> id);
+    if (id == 0) {
+        id = atomic_fetch_add(&num_caches, 1) + 1;
+        if (id > SLAB_MAX_CACHES) {
+            fprintf(stderr, "more than %d slab caches, make SLAB_MAX_CACHES bigger\n", SLAB_MAX_CACHES);
+            abort();
+        }
+        caches[id - 1] = cache;
+        atomic_store_explicit(&cache -> id, id, memory_order_release);
+    }
+    pthread_mutex_unlock(&cache -> lock);
+    return id;
+}
+
+static struct slab_magazine *magazine_of(struct slab_cache *cache) {
+    struct slab_magazine *magazine = &magazines[cache_id(cache) - 1];
+    if (!magazines_registered) {
+        magazines_registered = true;
+        pthread_setspecific(magazines_key, magazines); // any non-NULL value gets the destructor called
+    }
+    return magazine;
+}
+
+void *slab_alloc(struct slab_cache *cache) {
+    struct slab_magazine *magazine = magazine_of(cache);
+    if (magazine -> count == 0) {
+        depot_exchange(cache, magazine, SLAB_MAGAZINE_SIZE / 2);
+        if (magazine -> count == 0) {
+            return NULL;
+        }
+    }
+    return magazine -> objects[--magazine -> count];
+}
+
+void slab_free(struct slab_cache *cache, void *object) {
+    struct slab_magazine *magazine = magazine_of(cache);
+    if (magazine -> count == SLAB_MAGAZINE_SIZE) {
+        depot_exchange(cache, magazine, -SLAB_MAGAZINE_SIZE / 2);
+    }
+    magazine -> objects[magazine -> count++] = object;
+}
+
+void slab_cache_stats(struct slab_cache *cache, struct slab_stats *stats) {
+    pthread_mutex_lock(&cache -> lock);
+    stats -> high_water = cache -> high_water;
+    stats -> bytes = cache -> num_slabs * (SLAB_HEADER + SLAB_OBJECTS_PER_SLAB * ((cache -> size + 15) / 16 * 16));
+    pthread_mutex_unlock(&cache -> lock);
+}
+
+// Which class a buffer of size goes in, or -1 if it's too big for any.
+static int dma_class_of(struct dma_pool *pool, unsigned long long size) {
+    unsigned long long class_size = pool -> min_size;
+    for (int i = 0; i < pool -> num_classes; i++, class_size <<= 1) {
+        if (size <= class_size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void dma_pool_init(struct dma_pool *pool, struct db_device *device) {
+    pool -> device = device;
+    pool -> min_size = device -> sector_size;
+    pool -> num_classes = 0;
+    for (unsigned long long size = pool -> min_size; pool -> num_classes < DMA_POOL_CLASSES && size <= DMA_POOL_MAX_BYTES; size <<= 1) {
+        struct dma_pool_class *class = &pool -> classes[pool -> num_classes++];
+        pthread_mutex_init(&class -> lock, NULL);
+        class -> free = NULL;
+        class -> num_free = 0;
+        class -> max_free = DMA_POOL_CACHED_BYTES / size;
+        class -> max_free = class -> max_free < 2 ? 2 : class -> max_free;
+    }
+    pool -> hits = 0;
+    pool -> misses = 0;
+    pool -> bytes_out = 0;
+    pool -> high_water_bytes = 0;
+
+    // Most reads and small flushes are a sector or two, so have those ready before the first one.
+    for (int i = 0; i < 2 && i < pool -> num_classes; i++) {
+        struct dma_pool_class *class = &pool -> classes[i];
+        unsigned long long size = pool -> min_size << i;
+        for (unsigned long long n = 0; n < DMA_POOL_PREFILL_BYTES / size && class -> num_free < class -> max_free; n++) {
+            void *buf = device_dma_malloc(device, size);
+            if (buf == NULL) {
+                break;
+            }
+            set_next(buf, class -> free);
+            class -> free = buf;
+            class -> num_free++;
+        }
+    }
+}
+
+void dma_pool_free(struct dma_pool *pool) {
+    for (int i = 0; i < pool -> num_classes; i++) {
+        struct dma_pool_class *class = &pool -> classes[i];
+        while (class -> free) {
+            void *buf = class -> free;
+            class -> free = next_of(buf);
+            device_dma_free(pool -> device, buf);
+        }
+        class -> num_free = 0;
+        pthread_mutex_destroy(&class -> lock);
+    }
+}
+
+void *dma_pool_get(struct dma_pool *pool, unsigned long long size) {
+    int idx = dma_class_of(pool, size);
+    if (idx < 0) {
+        atomic_fetch_add_explicit(&pool -> misses, 1, memory_order_relaxed);
+        return device_dma_malloc(pool -> device, size);
+    }
+    unsigned long long class_size = pool -> min_size << idx;
+    long long out = atomic_fetch_add_explicit(&pool -> bytes_out, class_size, memory_order_relaxed) + class_size;
+    long long high_water = atomic_load_explicit(&pool -> high_water_bytes, memory_order_relaxed);
+    while (out > high_water && !atomic_compare_exchange_weak(&pool -> high_water_bytes, &high_water, out)) {
+    }
+
+    struct dma_pool_class *class = &pool -> classes[idx];
+    pthread_mutex_lock(&class -> lock);
+    void *buf = class -> free;
+    if (buf) {
+        class -> free = next_of(buf);
+        class -> num_free--;
+    }
+    pthread_mutex_unlock(&class -> lock);
+
+    if (buf) {
+        atomic_fetch_add_explicit(&pool -> hits, 1, memory_order_relaxed);
+        return buf;
+    }
+    atomic_fetch_add_explicit(&pool -> misses, 1, memory_order_relaxed);
+    buf = device_dma_malloc(pool -> device, class_size);
+    if (buf == NULL) {
+        atomic_fetch_sub_explicit(&pool -> bytes_out, class_size, memory_order_relaxed);
+    }
+    return buf;
+}
+
+void dma_pool_put(struct dma_pool *pool, void *buf, unsigned long long size) {
+    int idx = dma_class_of(pool, size);
+    if (idx < 0) {
+        device_dma_free(pool -> device, buf);
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool -> bytes_out, pool -> min_size << idx, memory_order_relaxed);
+
+    struct dma_pool_class *class = &pool -> classes[idx];
+    pthread_mutex_lock(&class -> lock);
+    if (class -> num_free < class -> max_free) {
+        set_next(buf, class -> free);
+        class -> free = buf;
+        class -> num_free++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&class -> lock);
+    if (buf) { // enough of these already
+        device_dma_free(pool -> device, buf);
+    }
+}
@@ -0,0 +1,94 @@
+//
+//  nvme_pool.h
+//
+//
+//  Recycled memory for the hot paths, so once the db has warmed up a read, write or flush doesn't call malloc or
+//  the device's DMA allocator (spdk_zmalloc's hugepage heap, for SPDK) at all.
+//
+//  slab_cache: fixed-size objects, for the state structs every I/O carries around. Each thread keeps a magazine of
+//  free objects per cache and allocates from and frees to it without any locking. Only when a magazine runs empty
+//  or full does it swap half a magazine's worth with the cache's shared depot, which takes a mutex. Objects freed
+//  on another thread than the one that allocated them (reads are issued by the caller and finished by the poller)
+//  just flow through the depot. The depot gets new objects a slab at a time and never gives them back.
+//
+//  dma_pool: DMA buffers in power-of-two size classes, from the sector size up to DMA_POOL_MAX_BYTES. One per shard,
+//  with a mutex per class. Buffers bigger than that come straight from the device. Each class keeps at most
+//  DMA_POOL_CACHED_BYTES of free buffers, and the smallest classes are filled up front.
+//
+
+#ifndef nvme_pool_h
+#define nvme_pool_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "nvme_device.h"
+
+#define SLAB_MAX_CACHES 16
+#define SLAB_MAGAZINE_SIZE 64 // free objects each thread keeps per cache
+#define SLAB_OBJECTS_PER_SLAB 64
+
+struct slab_cache {
+    const char *name;
+    size_t size;
+    _Atomic int id; // which of each thread's magazines is ours. 0 until first used.
+
+    pthread_mutex_t lock; // for everything below
+    void *depot; // free objects, linked through their first word
+    unsigned long long depot_count;
+    void *slabs; // every slab, linked the same way, so they stay reachable
+    unsigned long long num_slabs;
+    // Objects out of the depot: in use, or sitting in some thread's magazine. Only changes when magazines swap
+    // with the depot, so it's cheap to keep, and is within a magazine per thread of what's really in use.
+    long long checked_out;
+    long long high_water;
+};
+
+#define SLAB_CACHE_INIT(cache_name, object_size) { \
+    .name = cache_name, .size = object_size, .id = 0, .lock = PTHREAD_MUTEX_INITIALIZER, \
+    .depot = NULL, .depot_count = 0, .slabs = NULL, .num_slabs = 0, .checked_out = 0, .high_water = 0 }
+
+// Not zeroed.
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *object);
+
+struct slab_stats {
+    unsigned long long high_water; // most objects out at once
+    unsigned long long bytes; // in slabs
+};
+void slab_cache_stats(struct slab_cache *cache, struct slab_stats *stats);
+
+#define DMA_POOL_CLASSES 11 // sector_size << 0 ... sector_size << 10, i.e. 4KB to 4MB with 4KB sectors
+#define DMA_POOL_MAX_BYTES (4ULL<<20) // never a class bigger than this, whatever the sector size
+#define DMA_POOL_CACHED_BYTES (16ULL<<20) // free buffers kept per class, at least 2
+#define DMA_POOL_PREFILL_BYTES (128*1024) // allocated up front for each of the two smallest classes, per shard
+
+struct dma_pool_class {
+    pthread_mutex_t lock;
+    void *free; // linked through their first word
+    unsigned long long num_free;
+    unsigned long long max_free;
+};
+
+struct dma_pool {
+    struct db_device *device;
+    unsigned long long min_size; // of class 0
+    int num_classes;
+    struct dma_pool_class classes[DMA_POOL_CLASSES];
+
+    _Atomic unsigned long long hits; // handed out from the pool
+    _Atomic unsigned long long misses; // had to be allocated from the device
+    _Atomic long long bytes_out; // by class size, of buffers handed out and not yet put back
+    _Atomic long long high_water_bytes;
+};
+
+void dma_pool_init(struct dma_pool *pool, struct db_device *device);
+// Gives every free buffer back to the device.
+void dma_pool_free(struct dma_pool *pool);
+
+// Buffers aren't zeroed, unlike device_dma_malloc's. size has to be passed back to dma_pool_put.
+void *dma_pool_get(struct dma_pool *pool, unsigned long long size);
+void dma_pool_put(struct dma_pool *pool, void *buf, unsigned long long size);
+
+#endif /* nvme_pool_h */
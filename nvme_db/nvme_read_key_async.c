@@ -6,96 +6,634 @@
 //
 
 #include "nvme_read_key_async.h"
-#include "spdk/nvme.h"
-#include "spdk/vmd.h"
-#include "spdk/nvme_zns.h"
-#include "spdk/env.h"
+#include "nvme_log_scan.h"
 
-struct read_cb_state {
-    struct db_state *db;
-    void *data;
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-    unsigned long long key_header_offset; // offset from beginning of buf to ssd_header
-    unsigned long long data_length;
+struct slab_cache read_state_cache = SLAB_CACHE_INIT("read_cb_state", sizeof(struct read_cb_state));
 
-    key_read_cb callback;
-    void *cb_arg;
-};
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Puts the stream's next chunk on completed_reads, if it's been read and the one before has been delivered.
+static void stream_queue_next(struct read_stream *stream) {
+    struct read_cb_state *next = stream -> done[stream -> delivered % READ_STREAM_WINDOW];
+    if (stream -> delivering || next == NULL) {
+        return;
+    }
+    stream -> delivering = true;
+    stream -> db -> callbacks_pending++;
+    TAILQ_INSERT_TAIL(&stream -> db -> completed_reads, next, link);
+}
 
 static void
-read_complete(struct read_cb_state *arg, const struct spdk_nvme_cpl *completion)
+read_complete(void *cb_arg, int status)
 {
+    struct read_cb_state *arg = cb_arg;
+    if (status != 0) {
+        arg -> status = status;
+    }
+    if (--arg -> commands_pending) {
+        return; // the rest of it's still being read
+    }
+    status = arg -> status;
     arg -> db -> reads_in_flight--; // don't need to lock here because this key doesn't need a lock
 #ifdef DEBUG
     printf("read has completed! data_length is %d\n", arg -> data_length);
 #endif
 
-    /* See if an error occurred. If so, display information
-     * about it, and set completion value so that I/O
-     * caller is aware that an error occurred.
-     */
-    if (spdk_nvme_cpl_is_error(completion)) {
-        // acq_lock(arg -> db);
-        spdk_nvme_qpair_print_completion(arg->db->main_namespace->qpair, (struct spdk_nvme_cpl *)completion);
-        // release_lock(arg -> db);
-        fprintf(stderr, "I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
+    // The device has already printed the details of the error.
+    if (status != 0) {
         fprintf(stderr, "Read I/O failed, aborting run\n");
-        arg -> callback(arg -> cb_arg, READ_IO_ERROR, (db_data){.length=0, .data=NULL});
-        goto end;
     }
 
-    arg -> callback(arg -> cb_arg, READ_SUCCESSFUL, (db_data){.length=arg -> data_length, .data=arg -> data + arg -> key_header_offset});
+    if (arg -> stream) { // which keeps the region pinned itself, and delivers its chunks in order
+        arg -> stream -> done[arg -> chunk % READ_STREAM_WINDOW] = arg;
+        stream_queue_next(arg -> stream);
+        return;
+    }
+    arg -> db -> regions[arg -> region].readers--; // poll_db holds the lock for us
+
+    // The data is in our own buffer now, so the callback doesn't need the lock. poll_db runs it once it's let go.
+    arg -> db -> callbacks_pending++;
+    TAILQ_INSERT_TAIL(&arg -> db -> completed_reads, arg, link);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads num_sectors from first_sector into read_cb -> data, in commands of at most max_io_bytes, all at once.
+// read_complete runs once, when they're all done.
+static void read_sectors(struct db_state *db, struct read_cb_state *read_cb, unsigned long long first_sector, unsigned long long num_sectors) {
+    unsigned long long command_sectors = max_io_bytes(db) / db -> sector_size;
+    command_sectors = command_sectors < num_sectors ? command_sectors : num_sectors;
+    read_cb -> status = 0;
+    read_cb -> commands_pending = (num_sectors + command_sectors - 1) / command_sectors;
+    if (read_cb -> log_scan) { // not a value read, so not part of read_amplification
+        db -> scan_bytes_read += num_sectors * db -> sector_size;
+    } else {
+        db -> read_commands += read_cb -> commands_pending;
+        db -> device_bytes_read += num_sectors * db -> sector_size;
+    }
+    for (unsigned long long done = 0; done < num_sectors; done += command_sectors) {
+        unsigned long long sectors = num_sectors - done < command_sectors ? num_sectors - done : command_sectors;
+        device_read(db -> queue, read_cb -> data + done * db -> sector_size, first_sector + done, sectors, read_complete, read_cb);
+    }
+}
+
+// Whether a read got the record it was after, intact, at record. Counted if not.
+static bool record_ok(struct db_state *db, const void *record, unsigned short key_length, unsigned int data_length, unsigned int key_hash, unsigned int epoch) {
+    if (record_is(record, key_length, data_length, key_hash, epoch) && (!db -> verify_checksums || record_intact(record))) {
+        return true;
+    }
+    atomic_fetch_add_explicit(&db -> checksum_errors, 1, memory_order_relaxed);
+    return false;
+}
+
+// For compact_index, once record_ok: whether the record's key is key, and not just one with the same hash. Then
+// the key that was asked for isn't there. Counted if not. Anything goes if key is NULL, as the index checked.
+static bool key_ok(struct db_state *db, const void *record, const void *key, unsigned short key_length) {
+    if (key == NULL || record_has_key(record, key, key_length)) {
+        return true;
+    }
+    atomic_fetch_add_explicit(&db -> key_mismatches, 1, memory_order_relaxed);
+    return false;
+}
+
+void multi_read_release(struct multi_read *multi) {
+    if (atomic_fetch_sub(&multi -> pending, 1) != 1) {
+        return;
+    }
+    if (multi -> batch_callback) {
+        multi -> batch_callback(multi -> batch_arg, multi -> num_keys, multi -> errors, multi -> values);
+        for (unsigned int i = 0; i < multi -> num_held; i++) {
+            read_buffer_release(multi -> held[i]);
+        }
+    }
+    free(multi);
+}
+
+// A pool buffer with the value stored compressed at stored decompressed into it. NULL if it doesn't decompress.
+static struct read_cb_state *inflate_value(struct db_state *db, const void *stored, unsigned long long stored_length, char flags) {
+    unsigned long long length = decompressed_length(stored, stored_length);
+    if (length == 0) {
+        return NULL;
+    }
+    struct read_cb_state *inflated = slab_alloc(&read_state_cache);
+    inflated -> db = db;
+    inflated -> buffer = READ_BUFFER_POOL;
+    inflated -> data_size = length;
+    inflated -> data = dma_pool_get(&db -> dma_pool, length);
+    inflated -> value_offset = 0;
+    inflated -> data_length = length;
+    if (!decompress_value(&db -> compressor, flags, stored, stored_length, inflated -> data)) {
+        read_buffer_release(inflated);
+        return NULL;
+    }
+    return inflated;
+}
+
+// Swaps the compressed value a read of one key got for the value, decompressed into target.buf if it has one,
+// otherwise a pool buffer of the same kind. READ_BUFFER_TOO_SMALL leaves data_length the value's length.
+static enum read_err inflate_read(struct db_state *db, struct read_cb_state *arg) {
+    void *stored = arg -> data + arg -> value_offset;
+    unsigned long long length = decompressed_length(stored, arg -> data_length);
+    if (length == 0) {
+        return READ_IO_ERROR;
+    }
+    if (arg -> target.buf && arg -> target.buf_length < length) {
+        arg -> data_length = length;
+        return READ_BUFFER_TOO_SMALL;
+    }
+    void *value = arg -> target.buf ? arg -> target.buf : dma_pool_get(&db -> dma_pool, length);
+    if (!decompress_value(&db -> compressor, arg -> value_flags, stored, arg -> data_length, value)) {
+        if (value != arg -> target.buf) {
+            dma_pool_put(&db -> dma_pool, value, length);
+        }
+        return READ_IO_ERROR;
+    }
+    dma_pool_put(&db -> dma_pool, arg -> data, arg -> data_size); // compressed reads never go straight into target.buf
+    if (arg -> target.buf) {
+        arg -> buffer = READ_BUFFER_CALLER;
+    }
+    arg -> data = value;
+    arg -> data_size = length;
+    arg -> value_offset = 0;
+    arg -> data_length = length;
+    return READ_SUCCESSFUL;
+}
+
+static void deliver_multi_read(struct db_state *db, struct read_cb_state *arg) {
+    struct multi_read *multi = arg -> multi;
+    enum read_err read_err = arg -> status != 0 ? READ_IO_ERROR : READ_SUCCESSFUL;
+    for (unsigned int i = arg -> first; i < arg -> first + arg -> count; i++) {
+        struct multi_read_entry *entry = &multi -> entries[i];
+        enum read_err err = read_err;
+        db_data value = {.length=0, .data=NULL};
+        struct read_cb_state *inflated = NULL;
+        unsigned long long key_length = entry -> value_loc - entry -> data_loc - sizeof(struct ssd_header);
+        const void *record = arg -> data + (entry -> offset - (entry -> value_loc - entry -> data_loc));
+        if (err == READ_SUCCESSFUL && !record_ok(db, record, key_length, entry -> data_length, entry -> key_hash, arg -> epoch)) {
+            err = READ_CHECKSUM_ERROR;
+        }
+        if (err == READ_SUCCESSFUL && !key_ok(db, record, entry -> key_copy, key_length)) {
+            err = KEY_NOT_FOUND;
+        }
+        if (err == READ_SUCCESSFUL) {
+            value = (db_data){.length=entry -> data_length, .data=arg -> data + entry -> offset};
+        }
+        if (err == READ_SUCCESSFUL && entry -> flags) {
+            inflated = inflate_value(db, value.data, value.length, entry -> flags);
+            err = inflated ? READ_SUCCESSFUL : READ_IO_ERROR;
+            value = inflated ? (db_data){.length=inflated -> data_length, .data=inflated -> data} : (db_data){.length=0, .data=NULL};
+        }
+        if (err == READ_SUCCESSFUL) {
+            value_cache_insert(&db -> value_cache, entry -> data_loc, arg -> epoch, value.data, value.length);
+        }
+        if (multi -> callback) {
+            multi -> callback(multi -> cb_args ? multi -> cb_args[entry -> key] : NULL, err, value);
+        }
+        if (multi -> batch_callback) {
+            multi -> errors[entry -> key] = err;
+            multi -> values[entry -> key] = value;
+        }
+        if (inflated && multi -> batch_callback) {
+            multi -> held[atomic_fetch_add(&multi -> num_held, 1)] = inflated;
+        } else if (inflated) {
+            read_buffer_release(inflated);
+        }
+    }
+    if (multi -> batch_callback) { // values point into the buffer
+        multi -> held[atomic_fetch_add(&multi -> num_held, 1)] = arg;
+    } else {
+        read_buffer_release(arg);
+    }
+    db -> callbacks_pending--;
+    multi_read_release(multi);
+}
+
+void deliver_cached_read(struct db_state *db, struct cache_entry *cached, const struct read_target *target) {
+    db_data value = {.length=cached -> length, .data=cached -> data};
+    if (target -> lease_callback) { // the entry's the lease's buffer, and stays pinned till it's released
+        struct read_cb_state *lease = slab_alloc(&read_state_cache);
+        lease -> db = db;
+        lease -> buffer = READ_BUFFER_CACHE;
+        lease -> data = cached;
+        target -> lease_callback(target -> cb_arg, READ_SUCCESSFUL, value, lease);
+        return;
+    }
+    enum read_err err = READ_SUCCESSFUL;
+    if (target -> buf && target -> buf_length < value.length) {
+        err = READ_BUFFER_TOO_SMALL;
+        value.data = NULL;
+    } else if (target -> buf) {
+        memcpy(target -> buf, value.data, value.length);
+        value.data = target -> buf;
+    }
+    target -> callback(target -> cb_arg, err, value);
+    value_cache_put(&db -> value_cache, cached);
+}
+
+struct read_cb_state *copy_pending_write(struct db_state *db, struct write_cb_state *write_callback, const struct read_target *target) {
+    struct read_cb_state *read_cb = slab_alloc(&read_state_cache);
+    read_cb -> db = db;
+    read_cb -> target = *target;
+    read_cb -> multi = NULL;
+    read_cb -> stream = NULL;
+    read_cb -> log_scan = NULL;
+    read_cb -> value_offset = 0;
+    read_cb -> data_length = write_callback -> raw_value.length;
+    read_cb -> value_flags = 0;
+    if (target -> buf) {
+        read_cb -> buffer = READ_BUFFER_CALLER;
+        read_cb -> data = target -> buf;
+    } else {
+        read_cb -> buffer = target -> lease_callback ? READ_BUFFER_LEASED : READ_BUFFER_POOL;
+        read_cb -> data_size = write_callback -> raw_value.length;
+        read_cb -> data = dma_pool_get(&db -> dma_pool, read_cb -> data_size);
+    }
+    if (write_callback -> raw_value.length) {
+        // What's being flushed is compressed, if that's how it's stored, but the caller's still got the value.
+        void *value = write_callback -> raw_value.data;
+        if (write_callback -> flushed_value && !(write_callback -> flags & DATA_FLAGS_COMPRESSED)) {
+            value = write_callback -> flushed_value;
+        }
+        memcpy(read_cb -> data, value, write_callback -> raw_value.length);
+    }
+    db -> values_read++;
+    db -> pending_write_reads++;
+    return read_cb;
+}
+
+void deliver_copied_read(struct read_cb_state *read_cb) {
+    db_data value = {.length=read_cb -> data_length, .data=read_cb -> data};
+    if (read_cb -> target.lease_callback) {
+        read_cb -> target.lease_callback(read_cb -> target.cb_arg, READ_SUCCESSFUL, value, read_cb);
+        return;
+    }
+    read_cb -> target.callback(read_cb -> target.cb_arg, READ_SUCCESSFUL, value);
+    read_buffer_release(read_cb);
+}
+
+void read_buffer_release(struct read_cb_state *read_cb) {
+    if (read_cb -> buffer == READ_BUFFER_CACHE) {
+        value_cache_put(&read_cb -> db -> value_cache, read_cb -> data);
+    } else if (read_cb -> buffer != READ_BUFFER_CALLER) {
+        dma_pool_put(&read_cb -> db -> dma_pool, read_cb -> data, read_cb -> data_size);
+    }
+    slab_free(&read_state_cache, read_cb);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads chunks until there are READ_STREAM_WINDOW not yet delivered, or there are no more.
+static void stream_issue(struct read_stream *stream) {
+    struct db_state *db = stream -> db;
+    while (!stream -> failed && stream -> issued < stream -> num_chunks && stream -> issued - stream -> delivered < READ_STREAM_WINDOW) {
+        unsigned int chunk = stream -> issued++;
+        unsigned long long first = chunk * stream -> chunk_sectors;
+        unsigned long long sectors = stream -> num_sectors - first < stream -> chunk_sectors ? stream -> num_sectors - first : stream -> chunk_sectors;
+        struct read_cb_state *read_cb = slab_alloc(&read_state_cache);
+        read_cb -> db = db;
+        read_cb -> buffer = READ_BUFFER_POOL;
+        read_cb -> multi = NULL;
+        read_cb -> stream = stream;
+        read_cb -> log_scan = NULL;
+        read_cb -> chunk = chunk;
+        read_cb -> data_size = sectors * db -> sector_size;
+        read_cb -> data = dma_pool_get(&db -> dma_pool, read_cb -> data_size);
+        db -> reads_in_flight++;
+        read_sectors(db, read_cb, stream -> first_sector + first, sectors);
+    }
+}
+
+void issue_stream_read(struct db_state *db, struct ram_stored_key key, db_data read_key, key_read_chunk_cb callback, void *cb_arg) {
+    struct read_stream *stream = malloc(sizeof(struct read_stream));
+    stream -> db = db;
+    stream -> callback = callback;
+    stream -> cb_arg = cb_arg;
+    stream -> region = region_of(db, key.data_loc);
+    db -> regions[stream -> region].readers++; // until the last chunk's been delivered
+    stream -> epoch = db -> regions[stream -> region].epoch;
+    stream -> first_sector = key.data_loc / db -> sector_size;
+    stream -> record_offset = key.data_loc % db -> sector_size;
+    stream -> value_offset = stream -> record_offset + sizeof(struct ssd_header) + key.key_length;
+    stream -> length = key.data_length;
+    stream -> value_flags = key.flags & DATA_FLAGS_COMPRESSED;
+    stream -> key_length = key.key_length;
+    stream -> key_hash = key.key_hash;
+    stream -> key = NULL;
+    if (db -> compact_index) {
+        stream -> key = malloc(read_key.length);
+        memcpy(stream -> key, read_key.data, read_key.length);
+    }
+    stream -> num_sectors = (stream -> value_offset + stream -> length + db -> sector_size - 1) / db -> sector_size;
+    stream -> chunk_sectors = max_io_bytes(db) / db -> sector_size;
+    if (stream -> chunk_sectors <= stream -> value_offset / db -> sector_size) { // the first chunk has all the key
+        stream -> chunk_sectors = stream -> value_offset / db -> sector_size + 1;
+    }
+    if (stream -> value_flags || stream -> chunk_sectors > stream -> num_sectors) { // it can only be decompressed whole
+        stream -> chunk_sectors = stream -> num_sectors;
+    }
+    stream -> num_chunks = (stream -> num_sectors + stream -> chunk_sectors - 1) / stream -> chunk_sectors;
+    stream -> issued = 0;
+    stream -> delivered = 0;
+    stream -> delivering = false;
+    stream -> failed = false;
+    memset(stream -> done, 0, sizeof(stream -> done));
+    db -> values_read++;
+    db -> value_bytes_read += key.data_length;
+    stream_issue(stream);
+}
+
+// Checks a chunk of a stream as it's delivered, see read_stream.header. Without the lock.
+static enum read_err stream_chunk_check(struct db_state *db, struct read_stream *stream, struct read_cb_state *read_cb, unsigned long long chunk_start) {
+    const char *data = read_cb -> data;
+    if (read_cb -> chunk == 0) {
+        if (!record_is(data + stream -> record_offset, stream -> key_length, stream -> length, stream -> key_hash, stream -> epoch)) {
+            atomic_fetch_add_explicit(&db -> checksum_errors, 1, memory_order_relaxed);
+            return READ_CHECKSUM_ERROR;
+        }
+        if (!key_ok(db, data + stream -> record_offset, stream -> key, stream -> key_length)) {
+            return KEY_NOT_FOUND;
+        }
+        memcpy(&stream -> header, data + stream -> record_offset, sizeof(stream -> header));
+        stream -> crc = crc32c(0, data + stream -> record_offset, offsetof(struct ssd_header, seq));
+    }
+    if (!db -> verify_checksums) {
+        return READ_SUCCESSFUL;
+    }
+    // The key and value in this chunk.
+    unsigned long long key_start = stream -> record_offset + sizeof(struct ssd_header);
+    unsigned long long value_end = stream -> value_offset + stream -> length;
+    unsigned long long from = chunk_start > key_start ? chunk_start : key_start;
+    unsigned long long to = chunk_start + read_cb -> data_size < value_end ? chunk_start + read_cb -> data_size : value_end;
+    if (to > from) {
+        stream -> crc = crc32c(stream -> crc, data + (from - chunk_start), to - from);
+    }
+    if (read_cb -> chunk == stream -> num_chunks - 1 && record_crc_end(stream -> crc, stream -> header.seq) != stream -> header.crc) {
+        atomic_fetch_add_explicit(&db -> checksum_errors, 1, memory_order_relaxed);
+        return READ_CHECKSUM_ERROR;
+    }
+    return READ_SUCCESSFUL;
+}
+
+// Runs the callback for one chunk of a stream, then reads further ahead. Without the lock.
+static void deliver_stream_chunk(struct db_state *db, struct read_cb_state *read_cb) {
+    struct read_stream *stream = read_cb -> stream;
+    unsigned long long chunk_start = read_cb -> chunk * stream -> chunk_sectors * db -> sector_size; // from first_sector
+    unsigned long long value_end = stream -> value_offset + stream -> length;
+    unsigned long long begin = chunk_start > stream -> value_offset ? chunk_start : stream -> value_offset;
+    unsigned long long end = chunk_start + read_cb -> data_size < value_end ? chunk_start + read_cb -> data_size : value_end;
+    enum read_err err = read_cb -> status == 0 ? READ_SUCCESSFUL : READ_IO_ERROR;
+    if (!stream -> failed) { // only ever changed by whoever's delivering, and only one chunk's delivered at a time
+        if (err == READ_SUCCESSFUL) {
+            err = stream_chunk_check(db, stream, read_cb, chunk_start);
+        }
+        struct read_cb_state *inflated = NULL;
+        if (err == READ_SUCCESSFUL && stream -> value_flags) { // the one chunk
+            inflated = inflate_value(db, read_cb -> data + stream -> value_offset, stream -> length, stream -> value_flags);
+            err = inflated ? READ_SUCCESSFUL : READ_IO_ERROR;
+        }
+        if (err == KEY_NOT_FOUND) { // another key's record, which can only be the first chunk
+            stream -> callback(stream -> cb_arg, err, 0, (db_data){.data=NULL, .length=0}, 0);
+        } else if (err != READ_SUCCESSFUL) {
+            stream -> callback(stream -> cb_arg, err, begin - stream -> value_offset, (db_data){.data=NULL, .length=0}, stream -> length);
+        } else if (inflated) {
+            db_data value = {.data=inflated -> data, .length=inflated -> data_length};
+            stream -> callback(stream -> cb_arg, READ_SUCCESSFUL, 0, value, value.length);
+            read_buffer_release(inflated);
+        } else {
+            db_data chunk = {.data=read_cb -> data + (begin - chunk_start), .length=end - begin};
+            stream -> callback(stream -> cb_arg, READ_SUCCESSFUL, begin - stream -> value_offset, chunk, stream -> length);
+        }
+    }
+
+    acq_lock(db); // ACQUIRE LOCK
+    stream -> failed = stream -> failed || err != READ_SUCCESSFUL;
+    stream -> done[read_cb -> chunk % READ_STREAM_WINDOW] = NULL;
+    stream -> delivered++;
+    stream -> delivering = false;
+    bool finished = stream -> delivered == stream -> issued && (stream -> failed || stream -> issued == stream -> num_chunks);
+    if (finished) {
+        db -> regions[stream -> region].readers--;
+    } else {
+        stream_issue(stream);
+        stream_queue_next(stream);
+    }
+    release_lock(db); // RELEASE LOCK
 
-end:
-    spdk_free(arg -> data);
-    free(arg);
-    return;
+    read_buffer_release(read_cb);
+    db -> callbacks_pending--;
+    if (finished) {
+        free(stream -> key);
+        free(stream);
+    }
 }
 
-void issue_nvme_read(struct db_state *db, struct ram_stored_key key, key_read_cb callback, void *cb_arg) {
+void deliver_reads(struct db_state *db, struct read_cb_head *completed) {
+    struct read_cb_state *arg;
+    while ((arg = TAILQ_FIRST(completed)) != NULL) {
+        TAILQ_REMOVE(completed, arg, link);
+        if (arg -> multi) {
+            deliver_multi_read(db, arg);
+            continue;
+        }
+        if (arg -> stream) {
+            deliver_stream_chunk(db, arg);
+            continue;
+        }
+        if (arg -> log_scan) {
+            deliver_log_scan_read(db, arg);
+            continue;
+        }
+        enum read_err err = arg -> status == 0 ? READ_SUCCESSFUL : READ_IO_ERROR;
+        if (err == READ_SUCCESSFUL && !record_ok(db, arg -> data + arg -> record_offset, arg -> key_length, arg -> data_length, arg -> key_hash, arg -> epoch)) {
+            err = READ_CHECKSUM_ERROR;
+        }
+        if (err == READ_SUCCESSFUL && !key_ok(db, arg -> data + arg -> record_offset, arg -> key, arg -> key_length)) {
+            err = KEY_NOT_FOUND;
+        }
+        free(arg -> key); // a lease outlives this
+        arg -> key = NULL;
+        if (err == READ_SUCCESSFUL && arg -> value_flags) {
+            err = inflate_read(db, arg);
+        }
+        db_data value = {.length=0, .data=NULL};
+        if (err == READ_BUFFER_TOO_SMALL) {
+            value.length = arg -> data_length;
+        }
+        if (err == READ_SUCCESSFUL) {
+            value = (db_data){.length=arg -> data_length, .data=arg -> data + arg -> value_offset};
+            value_cache_insert(&db -> value_cache, arg -> data_loc, arg -> epoch, value.data, value.length); // before the callback can touch it
+            if (arg -> buffer == READ_BUFFER_CALLER_COPY) {
+                memcpy(arg -> target.buf, value.data, value.length);
+                value.data = arg -> target.buf;
+            }
+        }
+        if (arg -> target.lease_callback) {
+            bool leased = err == READ_SUCCESSFUL;
+            arg -> target.lease_callback(arg -> target.cb_arg, err, value, leased ? arg : NULL);
+            if (!leased) {
+                read_buffer_release(arg);
+            }
+        } else {
+            arg -> target.callback(arg -> target.cb_arg, err, value);
+            read_buffer_release(arg);
+        }
+        db -> callbacks_pending--;
+    }
+}
+
+void issue_nvme_read(struct db_state *db, struct ram_stored_key key, db_data read_key, const struct read_target *target) {
     unsigned long long data_beginning = key.data_loc + sizeof(struct ssd_header) + key.key_length;
 #ifdef DEBUG
     printf("data_beginning is %llu, data_loc is %llu\n", data_beginning, key.data_loc);
 #endif
-    unsigned long long key_sector = data_beginning/db -> sector_size;
+    // From the header, not just the value, so the record can be checked.
+    unsigned long long key_sector = key.data_loc/db -> sector_size;
     unsigned long long bytes_within_sector = data_beginning - (key_sector * db -> sector_size);
     unsigned long long bytes_to_read = key.data_length;
     unsigned long long sectors_to_read = ceil(((double) bytes_to_read + bytes_within_sector) / ((double) db -> sector_size));
-    struct read_cb_state *read_cb = calloc(sizeof(struct read_cb_state), 1);
+    struct read_cb_state *read_cb = slab_alloc(&read_state_cache);
     read_cb -> db = db;
-    read_cb -> callback = callback;
-    read_cb -> cb_arg = cb_arg;
+    read_cb -> target = *target;
+    read_cb -> multi = NULL;
+    read_cb -> stream = NULL;
+    read_cb -> log_scan = NULL;
     read_cb -> data_length = key.data_length;
-    read_cb -> key_header_offset = bytes_within_sector;
-    read_cb -> data = spdk_zmalloc(db -> sector_size * sectors_to_read, db -> sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+    read_cb -> value_flags = key.flags & DATA_FLAGS_COMPRESSED;
+    read_cb -> region = region_of(db, key.data_loc);
+    db -> regions[read_cb -> region].readers++;
+    read_cb -> data_loc = key.data_loc;
+    read_cb -> epoch = db -> regions[read_cb -> region].epoch;
+    read_cb -> record_offset = key.data_loc - key_sector * db -> sector_size;
+    read_cb -> value_offset = bytes_within_sector;
+    read_cb -> key_length = key.key_length;
+    read_cb -> key_hash = key.key_hash;
+    read_cb -> key = NULL;
+    if (db -> compact_index) { // the caller's key is only ours till we return
+        read_cb -> key = malloc(read_key.length);
+        memcpy(read_cb -> key, read_key.data, read_key.length);
+    }
+    read_cb -> data_size = db -> sector_size * sectors_to_read;
+    if (target -> buf && target -> buf_length >= read_cb -> data_size && !read_cb -> value_flags) {
+        read_cb -> buffer = READ_BUFFER_CALLER;
+        read_cb -> data = target -> buf;
+    } else {
+        read_cb -> buffer = target -> buf ? READ_BUFFER_CALLER_COPY : target -> lease_callback ? READ_BUFFER_LEASED : READ_BUFFER_POOL;
+        read_cb -> data = dma_pool_get(&db -> dma_pool, read_cb -> data_size);
+    }
+    db -> values_read++;
+    db -> value_bytes_read += key.data_length;
 
     unsigned long long end_sector_bytes = (data_beginning + key.data_length)%db -> sector_size;
 #ifdef DEBUG
     printf("reading %lld bytes from sector %lld byte %lld to sector %lld byte %lld for key %.16s\n",
-    bytes_to_read, key_sector, bytes_within_sector, key_sector + sectors_to_read - 1, end_sector_bytes, &db -> key_vla[key.key_offset]);
+    bytes_to_read, key_sector, bytes_within_sector, key_sector + sectors_to_read - 1, end_sector_bytes, key_bytes(db, &key));
 #endif
-    spdk_nvme_ns_cmd_read(
-        db -> main_namespace -> ns,
-        db -> main_namespace -> qpair,
-        read_cb -> data,
-        key_sector,
-        sectors_to_read,
-        read_complete, // callback
-        read_cb, // callback arg
-        0
-    );
-    return 0;
+    read_sectors(db, read_cb, key_sector, sectors_to_read);
+}
+
+void issue_log_scan_read(struct db_state *db, struct log_scan_shard *shard, unsigned long long region, unsigned long long bytes) {
+    unsigned long long num_sectors = (bytes + db -> sector_size - 1) / db -> sector_size;
+    struct read_cb_state *read_cb = slab_alloc(&read_state_cache);
+    read_cb -> db = db;
+    read_cb -> buffer = READ_BUFFER_POOL;
+    read_cb -> multi = NULL;
+    read_cb -> stream = NULL;
+    read_cb -> log_scan = shard;
+    read_cb -> value_flags = 0;
+    read_cb -> region = region;
+    db -> regions[region].readers++;
+    read_cb -> epoch = db -> regions[region].epoch;
+    read_cb -> data_length = bytes;
+    read_cb -> data_size = num_sectors * db -> sector_size;
+    read_cb -> data = dma_pool_get(&db -> dma_pool, read_cb -> data_size);
+    db -> reads_in_flight++;
+    read_sectors(db, read_cb, region * db -> region_sectors, num_sectors);
+}
+
+static int compare_data_loc(const void *a, const void *b) {
+    const struct multi_read_entry *x = a, *y = b;
+    return x -> data_loc < y -> data_loc ? -1 : x -> data_loc > y -> data_loc;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// One device read for entries[first] to [first + count - 1], which are sorted and end by byte end.
+static void issue_read_run(struct db_state *db, struct multi_read *multi, unsigned int first, unsigned int count, unsigned long long end) {
+    unsigned long long first_sector = multi -> entries[first].data_loc / db -> sector_size;
+    unsigned long long num_sectors = (end + db -> sector_size - 1) / db -> sector_size - first_sector;
+    for (unsigned int i = first; i < first + count; i++) {
+        multi -> entries[i].offset = multi -> entries[i].value_loc - first_sector * db -> sector_size;
+        db -> value_bytes_read += multi -> entries[i].data_length;
+    }
+
+    struct read_cb_state *read_cb = slab_alloc(&read_state_cache);
+    read_cb -> db = db;
+    read_cb -> buffer = READ_BUFFER_POOL;
+    read_cb -> multi = multi;
+    read_cb -> stream = NULL;
+    read_cb -> log_scan = NULL;
+    read_cb -> first = first;
+    read_cb -> count = count;
+    read_cb -> region = region_of(db, multi -> entries[first].data_loc);
+    db -> regions[read_cb -> region].readers++;
+    read_cb -> epoch = db -> regions[read_cb -> region].epoch;
+    read_cb -> data_size = num_sectors * db -> sector_size;
+    read_cb -> data = dma_pool_get(&db -> dma_pool, read_cb -> data_size);
+    db -> reads_in_flight++;
+    db -> values_read += count;
+    atomic_fetch_add(&multi -> pending, 1); // before it can complete and be delivered on another thread
+#ifdef DEBUG
+    printf("reading %u values in %llu sectors from sector %llu\n", count, num_sectors, first_sector);
+#endif
+    read_sectors(db, read_cb, first_sector, num_sectors);
+}
+
+unsigned int issue_multi_read(struct db_state *db, struct multi_read *multi, unsigned int first, unsigned int count) {
+    struct multi_read_entry *entries = multi -> entries;
+    qsort(entries + first, count, sizeof(struct multi_read_entry), compare_data_loc);
+
+    unsigned long long max_bytes = max_io_bytes(db);
+    unsigned int reads = 0;
+    unsigned int start = first;
+    while (start < first + count) {
+        unsigned long long run_begin = entries[start].data_loc / db -> sector_size * db -> sector_size;
+        unsigned long long run_end = entries[start].value_loc + entries[start].data_length;
+        unsigned long long region = region_of(db, entries[start].data_loc);
+        unsigned int end = start + 1;
+        // Take the next value along while it's close enough. Two keys can have the same value, or overlap.
+        for (; end < first + count; end++) {
+            struct multi_read_entry *next = &entries[end];
+            unsigned long long next_end = next -> value_loc + next -> data_length;
+            next_end = next_end > run_end ? next_end : run_end;
+            unsigned long long bytes = (next_end + db -> sector_size - 1) / db -> sector_size * db -> sector_size - run_begin;
+            if (next -> data_loc > run_end + db -> read_merge_gap || region_of(db, next -> data_loc) != region || bytes > max_bytes) {
+                break;
+            }
+            run_end = next_end;
+        }
+        issue_read_run(db, multi, start, end - start, run_end);
+        reads++;
+        start = end;
+    }
+    return reads;
 }
 
 struct dump_cb {
+    struct db_state *db;
     int fd;
     void *buf;
     int len;
 };
 
-static void sector_read_cb(struct dump_cb *state, const struct spdk_nvme_cpl *completion) {
+static void sector_read_cb(void *cb_arg, int status) {
+    struct dump_cb *state = cb_arg;
     write(state -> fd, state -> buf, state -> len);
-    spdk_free(state -> buf);
+    close(state -> fd);
+    device_dma_free(state -> db -> device, state -> buf);
     free(state);
     printf("Completed dump successfully\n");
 }
@@ -108,18 +646,17 @@ void dump_sectors_to_file(void *opaque, int start_lba, int num_lbas) {
     int fd = open(filename, O_CREAT | O_WRONLY, 0x777);
     free(filename);
     struct dump_cb *dump_state = malloc(sizeof(struct dump_cb));
+    dump_state -> db = db;
     dump_state -> fd = fd;
-    dump_state -> buf = spdk_zmalloc(num_lbas * db -> sector_size, db -> sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
+    dump_state -> buf = device_dma_malloc(db -> device, num_lbas * db -> sector_size);
     dump_state -> len = db -> sector_size * num_lbas;
 
-    spdk_nvme_ns_cmd_read(
-        db -> main_namespace -> ns,
-        db -> main_namespace -> qpair,
+    device_read(
+        db -> queue,
         dump_state -> buf,
         start_lba,
         num_lbas,
         sector_read_cb, // callback
-        dump_state, // callback arg
-        0
+        dump_state // callback arg
     );
 }
@@ -11,8 +11,168 @@
 #include <stdio.h>
 #include "nvme_key.h"
 
-void issue_nvme_read(struct db_state *db, struct ram_stored_key key, key_read_cb callback, void *cb_arg);
+// Who a read of one key is for, and where its value goes.
+struct read_target {
+    key_read_cb callback;
+    key_read_lease_cb lease_callback; // instead of callback, for read_value_leased_async
+    void *cb_arg;
+    void *buf; // read_value_into_async's, or NULL
+    unsigned long long buf_length;
+};
 
-// TODO: batch read_keys if we think it could improve performance.
+enum read_buffer {
+    READ_BUFFER_POOL, // from db -> dma_pool, and back there once the callback returns
+    READ_BUFFER_LEASED, // from db -> dma_pool, and back there when the app calls db_release_read
+    READ_BUFFER_CALLER, // target.buf, read straight into
+    READ_BUFFER_CALLER_COPY, // from db -> dma_pool, because target.buf can't fit the sectors, and copied into it
+    READ_BUFFER_CACHE, // a leased value that was in db -> value_cache. data is the cache_entry.
+};
+
+struct read_cb_state {
+    struct db_state *db;
+    void *data; // see buffer
+    unsigned long long data_size;
+    enum read_buffer buffer;
+    unsigned long long region; // pinned so the compactor doesn't reuse it under us
+    unsigned long long data_loc; // of the record, and its region's epoch, for db -> value_cache
+    unsigned int epoch;
+
+    // Reads from the device start at the record, so it can be checked (see record_is and record_intact) before
+    // the value's handed over. key_length and key_hash are the ram_stored_key's, to check it against.
+    unsigned long long record_offset; // from the beginning of data to the ssd_header
+    unsigned long long value_offset; // ...and to the value
+    unsigned long long data_length;
+    unsigned short key_length;
+    unsigned int key_hash;
+    void *key; // compact_index: a malloc'd copy of the key being read, to check the record's against. NULL otherwise.
+    char value_flags; // the record's DATA_FLAGS_COMPRESSED, if the value has to be decompressed once it's read
+
+    struct read_target target;
+
+    // Part of a read_values_async: this read is multi -> entries[first] to [first + count - 1], and target,
+    // the offsets, data_length and the key aren't used. NULL for a read of one key.
+    struct multi_read *multi;
+    unsigned int first;
+    unsigned int count;
+
+    // Part of a read_value_stream_async: this is chunk number chunk of stream. NULL otherwise.
+    struct read_stream *stream;
+    unsigned int chunk;
+
+    // Part of a scan_all_async: this read is the first data_length bytes of region, for that shard of the scan.
+    // NULL otherwise.
+    struct log_scan_shard *log_scan;
+
+    unsigned int commands_pending; // reads bigger than max_io_bytes go to the device as several commands
+    int status; // of the device read, once it's done
+    TAILQ_ENTRY(read_cb_state) link; // in db -> completed_reads
+};
+
+#define READ_MERGE_GAP_DEFAULT (16*1024)
+
+struct multi_read_entry {
+    unsigned int key; // index in the caller's keys
+    unsigned int data_length;
+    unsigned long long data_loc; // of the record
+    unsigned long long value_loc; // where the value itself starts on the device
+    unsigned long long offset; // of the value in its read's buffer
+    unsigned int key_hash; // the ram_stored_key's, to check the record with
+    const void *key_copy; // compact_index: the key, after the multi_read's other arrays. NULL otherwise.
+    char flags; // the record's DATA_FLAGS_COMPRESSED
+};
+
+// One read_values_async call. Keys are looked up a shard at a time, and each shard's are sorted by where they
+// are on the device so neighbours can be read together. Freed when the last of its reads has been delivered.
+struct multi_read {
+    _Atomic unsigned int pending; // reads not yet delivered, plus one for read_values_async while it's issuing them
+    unsigned int num_keys;
+    key_read_cb callback;
+    void **cb_args;
+    keys_read_cb batch_callback;
+    void *batch_arg;
+    // Only with a batch_callback, which gets every value at once, so the reads' buffers are held until it's run,
+    // and so are the buffers compressed values are decompressed into: room for two per key.
+    enum read_err *errors;
+    db_data *values;
+    _Atomic unsigned int num_held;
+    struct read_cb_state **held;
+    struct multi_read_entry entries[]; // num_keys of them
+};
+
+#define READ_STREAM_WINDOW 4 // chunks of a read_value_stream_async read ahead of the one being delivered
+
+// One read_value_stream_async. The value is read max_io_bytes at a time, and delivered a chunk at a time, in
+// order: a chunk only goes on completed_reads once the one before it has been delivered, so its callbacks never
+// overlap even with several threads polling. The region stays pinned until the last chunk's been delivered.
+struct read_stream {
+    struct db_state *db;
+    key_read_chunk_cb callback;
+    void *cb_arg;
+    unsigned long long region;
+    unsigned int epoch; // of the region, when the stream started
+    unsigned long long first_sector; // of the record
+    unsigned long long num_sectors;
+    unsigned long long record_offset; // from the start of first_sector to the record's header...
+    unsigned long long value_offset; // ...and to the value
+    unsigned long long length; // of the value, as it's stored
+    char value_flags; // compressed values are read in one chunk, and that's decompressed
+    unsigned long long chunk_sectors;
+    unsigned int num_chunks;
+    unsigned int issued;
+    unsigned int delivered;
+    bool delivering; // a chunk's on completed_reads, or in its callback
+    bool failed; // a chunk couldn't be read, and the callback's been told. The rest are only cleaned up.
+    // Checked as it's delivered: the first chunk has the header and key, which are checked against these (see
+    // record_is) and kept, and the crc is added to chunk by chunk, and checked with the last.
+    unsigned short key_length;
+    unsigned int key_hash;
+    void *key; // like read_cb_state.key
+    struct ssd_header header;
+    unsigned int crc;
+    struct read_cb_state *done[READ_STREAM_WINDOW]; // read but not yet delivered, by chunk % READ_STREAM_WINDOW
+};
+
+extern struct slab_cache read_state_cache; // every read_cb_state comes from here
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads the value of read_key, whose ram_stored_key is key. target -> buf, if set, has to be at least
+// key.data_length long, unless the value's compressed.
+void issue_nvme_read(struct db_state *db, struct ram_stored_key key, db_data read_key, const struct read_target *target);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Starts a read_value_stream_async of read_key, whose ram_stored_key, key, has a value on the device.
+void issue_stream_read(struct db_state *db, struct ram_stored_key key, db_data read_key, key_read_chunk_cb callback, void *cb_arg);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads the first bytes of region for a scan_all_async, see nvme_log_scan.h.
+void issue_log_scan_read(struct db_state *db, struct log_scan_shard *shard, unsigned long long region, unsigned long long bytes);
+
+// A read of one key that hit in db -> value_cache. Runs the callback, and lets go of cached unless it's leased.
+void deliver_cached_read(struct db_state *db, struct cache_entry *cached, const struct read_target *target);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// A read of a key with a write that hasn't been applied yet gets that write's value, copied out of wherever it
+// is now (the caller's memory while it's queued, its flush's buffer after that, or the caller's memory all along
+// if it's being stored compressed) into target -> buf or a pool buffer, with no device read. target -> buf, if
+// set, has to be at least value.length long. The write can't be a delete.
+struct read_cb_state *copy_pending_write(struct db_state *db, struct write_cb_state *write_callback, const struct read_target *target);
+
+// Runs the callback of a read made by copy_pending_write. Without the lock.
+void deliver_copied_read(struct read_cb_state *read_cb);
+
+// Hands a read's buffer back, after the callback or, for a lease, when the app's done with it. Any thread.
+void read_buffer_release(struct read_cb_state *read_cb);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Reads the records of multi -> entries[first] to [first + count - 1], which have everything but offset set and
+// are all in this shard. Sorts them, and reads any that are within db -> read_merge_gap bytes of each other (and
+// in the same region) with one device read, up to max_transfer_size. Returns how many reads it issued.
+unsigned int issue_multi_read(struct db_state *db, struct multi_read *multi, unsigned int first, unsigned int count);
+
+// Drops one of multi -> pending. The last one runs the batch callback and frees it all.
+void multi_read_release(struct multi_read *multi);
+
+// Runs the callbacks of reads taken off db -> completed_reads. Without the lock.
+void deliver_reads(struct db_state *db, struct read_cb_head *completed);
 
 #endif /* nvme_read_key_async_h */
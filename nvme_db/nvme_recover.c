@@ -0,0 +1,584 @@
+//
+//  nvme_recover.c
+//
+//
+
+#include "nvme_recover.h"
+#include "nvme_key.h"
+#include "nvme_hash.h"
+#include "nvme_checkpoint.h"
+#include "nvme_workers.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RECOVERY_REGIONS_IN_FLIGHT 32 // regions being read or parsed at once
+#define RECOVERY_QUEUE_DEPTH 128 // reads outstanding at once
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_PROBING, // reading the first sector, to skip regions that were never written
+    SLOT_READING,
+    SLOT_PARSING,
+};
+
+struct recovered_record {
+    unsigned long long hash;
+    unsigned long long offset; // within the region
+};
+
+struct recovery_slot {
+    struct recovery *recovery;
+    enum slot_state state;
+    long long region;
+    void *buf; // the whole region
+    unsigned long long next_sector; // within the region, next sector to read
+    unsigned long long start; // where in the region to start parsing records. Past 0 if a checkpoint has the rest.
+    int reads_outstanding;
+
+    // Filled in by parse_region on a worker thread.
+    struct recovered_record *records;
+    unsigned long long num_records;
+    unsigned long long records_capacity;
+    unsigned long long end; // bytes of the region that hold valid records
+    unsigned int epoch; // of the region's first record
+    _Atomic bool parsed;
+};
+
+struct recovery {
+    struct db_state *db;
+    struct worker_pool *workers;
+    struct recovery_slot slots[RECOVERY_REGIONS_IN_FLIGHT];
+    int reads_outstanding;
+    int busy_slots;
+    bool io_error;
+
+    struct ssd_header *firsts; // what every region's first sector starts with, see find_runs
+
+    // The region table of the checkpoint that was loaded, or NULL if the whole device has to be scanned.
+    struct checkpoint_region *checkpoint;
+    unsigned int checkpoint_epoch; // regions opened since have at least this epoch
+
+    // Per key, which record db -> keys currently points at, to decide which record is newest.
+    unsigned long long *seqs;
+    unsigned int *epochs;
+    unsigned long long seqs_capacity;
+
+    unsigned long long max_seq;
+    unsigned int max_epoch;
+    unsigned long long num_records;
+    unsigned long long bytes_read;
+};
+
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long record_size(struct ssd_header *header) {
+    return sizeof(struct ssd_header) + header -> key_length + (unsigned long long) header -> data_length;
+}
+
+// Whether header could be a record's, in a region opened with epoch. Not whether the record fits.
+static bool header_plausible(struct ssd_header *header, unsigned int epoch) {
+    return header -> key_length != 0 && header -> seq != 0 && header -> epoch == epoch && epoch != 0 &&
+        (header -> flags & ~(DATA_FLAGS_COMPRESSED | DATA_FLAG_DELETED)) == 0 &&
+        !((header -> flags & DATA_FLAG_DELETED) && header -> data_length);
+}
+
+static bool record_valid(struct db_state *db, struct ssd_header *header, unsigned long long pos, unsigned int epoch) {
+    return header_plausible(header, epoch) && pos + record_size(header) <= db -> region_sectors * db -> sector_size;
+}
+
+// Runs on a worker thread, so it mustn't touch anything but the slot.
+static void parse_region(void *arg) {
+    struct recovery_slot *slot = arg;
+    struct db_state *db = slot -> recovery -> db;
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+
+    struct ssd_header header;
+
+    // Same layout rules as the compactor: headers never straddle a sector, and a flush pads out its last sector
+    // with zeroes. A zeroed sector start means nothing was written from there on. Every record in this use of
+    // the region has the same epoch as the first, fillers included.
+    unsigned long long pos = slot -> start;
+    slot -> end = slot -> start;
+    slot -> num_records = 0;
+    while (pos < region_bytes) {
+        unsigned long long sector_left = db -> sector_size - pos % db -> sector_size;
+        if (sector_left < sizeof(header)) {
+            pos += sector_left;
+            continue;
+        }
+        memcpy(&header, slot -> buf + pos, sizeof(header));
+        if (header.key_length == 0 && header.flags == DATA_FLAG_PADDING) {
+            if (header.epoch != slot -> epoch || pos + sizeof(header) + header.data_length > region_bytes) {
+                break;
+            }
+            pos += sizeof(header) + header.data_length;
+            continue;
+        }
+        if (header.key_length == 0) {
+            if (sector_left == db -> sector_size) {
+                break;
+            }
+            pos += sector_left;
+            continue;
+        }
+        if (!record_valid(db, &header, pos, slot -> epoch)) { // torn, or left over from the region's last use
+            break;
+        }
+        // The header made it, but not all of the rest, or it's gone bad since. Either way there's nothing to
+        // recover from it, but its header says where the next one is, if there's one after it.
+        if (!record_intact(slot -> buf + pos)) {
+            printf("Record at %llu in region %lld failed its checksum, skipping it\n", pos, slot -> region);
+            pos += sizeof(header) + header.key_length + header.data_length;
+            slot -> end = pos;
+            continue;
+        }
+
+        if (slot -> num_records == slot -> records_capacity) {
+            slot -> records_capacity = slot -> records_capacity ? slot -> records_capacity * 2 : 1024;
+            slot -> records = realloc(slot -> records, slot -> records_capacity * sizeof(struct recovered_record));
+        }
+        slot -> records[slot -> num_records++] = (struct recovered_record){
+            .hash = hash_bytes(slot -> buf + pos + sizeof(header), header.key_length),
+            .offset = pos,
+        };
+        pos += sizeof(header) + header.key_length + header.data_length;
+        slot -> end = pos;
+    }
+    atomic_store(&slot -> parsed, true);
+}
+
+// Decides, from the region's first record, what has to be read of it. A region the checkpoint knows about
+// (same epoch) only needs what was written after the checkpoint, if anything; one opened since needs all of
+// it. Anything else is left over from before the region was last freed.
+static bool needs_scan(struct recovery *recovery, struct recovery_slot *slot, unsigned int epoch) {
+    struct db_state *db = recovery -> db;
+    slot -> start = 0;
+    if (recovery -> checkpoint == NULL) {
+        return true;
+    }
+
+    struct checkpoint_region *known = &recovery -> checkpoint[slot -> region];
+    if (known -> state != REGION_FREE && known -> epoch == epoch) {
+        struct region *region = &db -> regions[slot -> region];
+        region -> state = REGION_SEALED;
+        region -> epoch = epoch;
+        region -> sealed_at = epoch;
+        region -> record_bytes = known -> record_bytes;
+        region -> sectors_written = known -> sectors_written;
+        slot -> start = known -> replay_from;
+        return slot -> start < db -> region_sectors * db -> sector_size;
+    }
+    return epoch >= recovery -> checkpoint_epoch;
+}
+
+static void region_read_cb(void *cb_arg, int status) {
+    struct recovery_slot *slot = cb_arg;
+    struct recovery *recovery = slot -> recovery;
+    struct db_state *db = recovery -> db;
+    slot -> reads_outstanding--;
+    recovery -> reads_outstanding--;
+
+    // The device has already printed the details of the error.
+    if (status != 0) {
+        recovery -> io_error = true;
+    }
+
+    if (slot -> state == SLOT_PROBING) {
+        struct ssd_header header;
+        memcpy(&header, slot -> buf, sizeof(header));
+        if (status != 0 || !record_valid(db, &header, 0, header.epoch) || !needs_scan(recovery, slot, header.epoch)) {
+            slot -> state = SLOT_IDLE;
+            recovery -> busy_slots--;
+            return;
+        }
+        slot -> state = SLOT_READING;
+        slot -> epoch = header.epoch;
+        slot -> next_sector = slot -> start / db -> sector_size;
+        slot -> next_sector = slot -> next_sector ? slot -> next_sector : 1; // already have sector 0
+    }
+    if (slot -> reads_outstanding == 0 && slot -> next_sector == db -> region_sectors) {
+        slot -> state = SLOT_PARSING;
+        atomic_store(&slot -> parsed, false);
+        workers_submit(recovery -> workers, parse_region, slot);
+    }
+}
+
+static void issue_region_read(struct recovery *recovery, struct recovery_slot *slot, unsigned long long num_sectors) {
+    struct db_state *db = recovery -> db;
+    slot -> reads_outstanding++;
+    recovery -> reads_outstanding++;
+    recovery -> bytes_read += num_sectors * db -> sector_size;
+    unsigned long long first = slot -> next_sector;
+    slot -> next_sector += num_sectors;
+    device_read(
+        db -> queue,
+        slot -> buf + first * db -> sector_size,
+        slot -> region * db -> region_sectors + first,
+        num_sectors,
+        region_read_cb,
+        slot
+    );
+}
+
+static bool newer(unsigned long long seq, unsigned int epoch, unsigned long long than_seq, unsigned int than_epoch) {
+    // Relocated copies share a seq with the original, and the later copy is the one the db was using.
+    return seq > than_seq || (seq == than_seq && epoch > than_epoch);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION (or, here, be the only thread with the db)
+// Points key at the record at loc, with header, in a region opened with epoch, if it's the newest one seen yet.
+// Whichever of the two loses is counted as one of the key's older records. A record the checkpoint already
+// counted can be counted again, which only keeps the key's tombstone (if it gets one) around for good. Returns
+// the key's idx.
+static long long merge_record(struct recovery *recovery, unsigned long long loc, struct ssd_header *header, db_data key, unsigned long long hash, unsigned int epoch) {
+    struct db_state *db = recovery -> db;
+    long long key_idx = search_for_key(db, key, hash, true);
+    if (key_idx < 0) {
+        key_idx = append_key(db, key, hash);
+        if (key_idx >= recovery -> seqs_capacity) {
+            recovery -> seqs_capacity = db -> keys.capacity;
+            recovery -> seqs = realloc(recovery -> seqs, recovery -> seqs_capacity * sizeof(unsigned long long));
+            recovery -> epochs = realloc(recovery -> epochs, recovery -> seqs_capacity * sizeof(unsigned int));
+        }
+        recovery -> seqs[key_idx] = 0;
+        recovery -> epochs[key_idx] = 0;
+    }
+
+    struct ram_stored_key *ram_key = key_at(db, key_idx);
+    if (newer(header -> seq, epoch, recovery -> seqs[key_idx], recovery -> epochs[key_idx])) {
+        if (!(ram_key -> flags & DATA_FLAG_INCOMPLETE) && ram_key -> data_loc != (long long) loc) {
+            older_record_added(ram_key);
+        }
+        ram_key -> data_loc = loc;
+        ram_key -> data_length = header -> data_length;
+        ram_key -> flags = header -> flags;
+        recovery -> seqs[key_idx] = header -> seq;
+        recovery -> epochs[key_idx] = epoch;
+    } else {
+        older_record_added(ram_key);
+    }
+    if (header -> seq > recovery -> max_seq) {
+        recovery -> max_seq = header -> seq;
+    }
+    return key_idx;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION (or, here, be the only thread with the db)
+static void merge_region(struct recovery *recovery, struct recovery_slot *slot) {
+    struct db_state *db = recovery -> db;
+    struct region *region = &db -> regions[slot -> region];
+    unsigned long long region_start = slot -> region * db -> region_sectors * db -> sector_size;
+
+    for (unsigned long long i = 0; i < slot -> num_records; i++) {
+        struct recovered_record *record = &slot -> records[i];
+        struct ssd_header header;
+        memcpy(&header, slot -> buf + record -> offset, sizeof(header));
+        db_data key = {.length=header.key_length, .data=slot -> buf + record -> offset + sizeof(header)};
+        region -> record_bytes += record_size(&header);
+        merge_record(recovery, region_start + record -> offset, &header, key, record -> hash, slot -> epoch);
+    }
+    recovery -> num_records += slot -> num_records;
+
+    // A region is only scanned if its first record is valid, so it's in use. If it was only the tail of one
+    // the checkpoint knows about, sectors_written is cut back to what's really there.
+    region -> state = REGION_SEALED;
+    region -> epoch = slot -> epoch;
+    region -> sealed_at = slot -> epoch;
+    region -> sectors_written = (slot -> end + db -> sector_size - 1) / db -> sector_size;
+    if (slot -> epoch > recovery -> max_epoch) {
+        recovery -> max_epoch = slot -> epoch;
+    }
+}
+
+// Device reads recover_db waits for before it carries on.
+struct sync_reads {
+    int outstanding;
+    bool error;
+};
+
+static void sync_read_cb(void *cb_arg, int status) {
+    struct sync_reads *reads = cb_arg;
+    reads -> outstanding--;
+    if (status != 0) {
+        reads -> error = true;
+    }
+}
+
+static void wait_for_reads(struct recovery *recovery, struct sync_reads *reads) {
+    while (reads -> outstanding) {
+        device_process_completions(recovery -> db -> queue, 0);
+    }
+    if (reads -> error) {
+        recovery -> io_error = true;
+    }
+}
+
+// Reads the first sector of every region into recovery -> firsts, RECOVERY_QUEUE_DEPTH at a time.
+static void read_first_headers(struct recovery *recovery) {
+    struct db_state *db = recovery -> db;
+    void *buf = device_dma_malloc(db -> device, RECOVERY_QUEUE_DEPTH * db -> sector_size);
+    recovery -> firsts = calloc(db -> num_regions, sizeof(struct ssd_header));
+    for (unsigned long long first = 0; first < db -> num_regions && !recovery -> io_error; first += RECOVERY_QUEUE_DEPTH) {
+        unsigned long long count = db -> num_regions - first < RECOVERY_QUEUE_DEPTH ? db -> num_regions - first : RECOVERY_QUEUE_DEPTH;
+        struct sync_reads reads = {.outstanding=count, .error=false};
+        for (unsigned long long i = 0; i < count; i++) {
+            device_read(db -> queue, buf + i * db -> sector_size, (first + i) * db -> region_sectors, 1, sync_read_cb, &reads);
+        }
+        wait_for_reads(recovery, &reads);
+        for (unsigned long long i = 0; i < count; i++) {
+            memcpy(&recovery -> firsts[first + i], buf + i * db -> sector_size, sizeof(struct ssd_header));
+        }
+        recovery -> bytes_read += count * db -> sector_size;
+    }
+    device_dma_free(db -> device, buf);
+}
+
+// Whether the run of span regions starting at region, which the checkpoint knows about, was all written when it
+// was taken, and none of the other regions look to have been opened again since.
+static bool run_known(struct recovery *recovery, unsigned long long region, unsigned long long span) {
+    struct db_state *db = recovery -> db;
+    struct ssd_header *header = &recovery -> firsts[region];
+    if (recovery -> checkpoint[region].replay_from < db -> region_sectors * db -> sector_size) {
+        return false;
+    }
+    for (unsigned long long i = 1; i < span; i++) {
+        struct ssd_header *first = &recovery -> firsts[region + i];
+        if (record_valid(db, first, 0, first -> epoch) && first -> epoch > header -> epoch) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the record the run starting at region starts with, a region's worth at a time into the first slot's
+// buffer, copies its key into key, and checks its crc.
+static bool run_intact(struct recovery *recovery, unsigned long long region, struct ssd_header *header, char *key) {
+    struct db_state *db = recovery -> db;
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    unsigned long long chunk_sectors = db -> max_transfer_size / db -> sector_size;
+    chunk_sectors = chunk_sectors ? chunk_sectors : 1;
+    unsigned long long size = record_size(header);
+    unsigned long long key_end = sizeof(struct ssd_header) + header -> key_length;
+    void *buf = recovery -> slots[0].buf;
+
+    // Same as record_intact's, but the record's never all in memory at once.
+    unsigned int crc = crc32c(0, header, offsetof(struct ssd_header, seq));
+    for (unsigned long long offset = 0; offset < size; offset += region_bytes) {
+        unsigned long long length = size - offset < region_bytes ? size - offset : region_bytes;
+        unsigned long long sectors = (length + db -> sector_size - 1) / db -> sector_size;
+        struct sync_reads reads = {.outstanding=0, .error=false};
+        for (unsigned long long done = 0; done < sectors; done += chunk_sectors) {
+            unsigned long long num_sectors = sectors - done < chunk_sectors ? sectors - done : chunk_sectors;
+            reads.outstanding++;
+            device_read(db -> queue, buf + done * db -> sector_size, region * db -> region_sectors + offset / db -> sector_size + done,
+                num_sectors, sync_read_cb, &reads);
+        }
+        wait_for_reads(recovery, &reads);
+        recovery -> bytes_read += sectors * db -> sector_size;
+        if (recovery -> io_error) {
+            return false;
+        }
+        unsigned long long from = offset > sizeof(struct ssd_header) ? offset : sizeof(struct ssd_header);
+        if (from < offset + length) {
+            crc = crc32c(crc, buf + (from - offset), offset + length - from);
+        }
+        if (from < key_end) {
+            unsigned long long to = key_end < offset + length ? key_end : offset + length;
+            memcpy(key + (from - sizeof(struct ssd_header)), buf + (from - offset), to - from);
+        }
+    }
+    return record_crc_end(crc, header -> seq) == header -> crc;
+}
+
+// A record bigger than a region has a run of regions to itself (see open_run), and only the first of them says
+// so: the rest are the middle of its value, which could look like anything, a region full of records included.
+// So every run is found first, from the first header of every region, and its regions are kept out of the scan.
+// A run counts if the checkpoint has it all written and none of its regions has been opened since, or failing
+// that if its record's crc checks out. If not it's torn, or left over from before it was freed, and its regions
+// are scanned like any other (its first one comes up empty).
+static void find_runs(struct recovery *recovery) {
+    struct db_state *db = recovery -> db;
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    for (unsigned long long r = 0; r < db -> num_regions && !recovery -> io_error; r++) {
+        struct ssd_header *header = &recovery -> firsts[r];
+        unsigned long long size = record_size(header);
+        unsigned long long span = (size + region_bytes - 1) / region_bytes;
+        if (!header_plausible(header, header -> epoch) || span < 2 || r + span > db -> num_regions) {
+            continue;
+        }
+        struct checkpoint_region *checkpointed = recovery -> checkpoint ? &recovery -> checkpoint[r] : NULL;
+        bool in_checkpoint = checkpointed && checkpointed -> state != REGION_FREE && checkpointed -> epoch == header -> epoch;
+        if (checkpointed && !in_checkpoint && header -> epoch < recovery -> checkpoint_epoch) {
+            continue; // freed before the checkpoint, see needs_scan
+        }
+        bool known = in_checkpoint && run_known(recovery, r, span);
+        char *key = malloc(header -> key_length);
+        if (!known && !run_intact(recovery, r, header, key)) {
+            if (!recovery -> io_error) {
+                printf("Record at the start of region %llu failed its checksum, skipping it\n", r);
+            }
+            free(key);
+            continue;
+        }
+
+        struct region *region = &db -> regions[r];
+        region -> state = REGION_SEALED;
+        region -> epoch = header -> epoch;
+        region -> sealed_at = header -> epoch;
+        if (known) { // and its key is in the checkpoint too, but which one isn't, so it's never told the run's gone
+            region -> record_bytes = checkpointed -> record_bytes;
+            region -> sectors_written = checkpointed -> sectors_written;
+            region -> run_key = -1;
+        } else {
+            region -> record_bytes = size;
+            region -> sectors_written = (size + db -> sector_size - 1) / db -> sector_size;
+            db_data key_data = {.length=header -> key_length, .data=key};
+            region -> run_key = merge_record(recovery, r * region_bytes, header, key_data, hash_bytes(key, header -> key_length), header -> epoch);
+            recovery -> num_records++;
+        }
+        for (unsigned long long i = 1; i < span; i++) {
+            db -> regions[r + i].state = REGION_SPANNED;
+        }
+        if (header -> epoch > recovery -> max_epoch) {
+            recovery -> max_epoch = header -> epoch;
+        }
+        free(key);
+        r += span - 1;
+    }
+}
+
+// Whether the region is still the one the checkpoint knew: not freed, or opened again, since.
+static bool region_kept(struct recovery *recovery, unsigned long long r) {
+    struct region *region = &recovery -> db -> regions[r];
+    return region -> state != REGION_FREE && region -> epoch < recovery -> checkpoint_epoch;
+}
+
+// Space accounting and the free list, now that every key points at its newest record.
+static void finish_recovery(struct recovery *recovery) {
+    struct db_state *db = recovery -> db;
+
+    unsigned long long record_bytes = 0;
+    db -> num_free_regions = 0;
+    for (unsigned long long i = db -> num_regions; i-- > 0;) { // pushed in reverse, so region 0 gets used first
+        record_bytes += db -> regions[i].record_bytes;
+        if (db -> regions[i].state == REGION_FREE) {
+            db -> free_regions[db -> num_free_regions++] = i;
+        }
+    }
+
+    db -> live_bytes = 0;
+    for (long long i = 0; i < db -> num_key_entries; i++) {
+        struct ram_stored_key *key = key_at(db, i);
+        key -> flags &= ~DATA_FLAG_WRITE_PENDING; // checkpointed while a write was queued. Nothing is now.
+        if (recovery -> checkpoint && recovery -> seqs[i] == 0 && (key -> flags & DATA_FLAG_DELETED) &&
+            !(key -> flags & DATA_FLAG_INCOMPLETE) && !region_kept(recovery, region_of(db, key -> data_loc))) {
+            // A tombstone from the checkpoint that was made dead space since (see tombstone_check), and then its
+            // region freed. Nothing replayed points the key elsewhere, since the tombstone wasn't moved, just left.
+            key -> flags |= DATA_FLAG_INCOMPLETE;
+            key -> data_loc = -1;
+        }
+        if (key -> flags & DATA_FLAG_INCOMPLETE) { // from a checkpoint, and its first write never made it
+            tombstone_check(db, i); // or a tombstone with no record left, which can go if there's nothing older either
+            continue;
+        }
+        unsigned long long size = sizeof(struct ssd_header) + key -> key_length + key -> data_length;
+        db -> regions[region_of(db, key -> data_loc)].live_bytes += size;
+        db -> live_bytes += size;
+    }
+    db -> dead_bytes = record_bytes - db -> live_bytes;
+
+    // A checkpoint's next_seq and next_epoch may be past anything that made it to the device.
+    if (recovery -> max_seq + 1 > db -> next_seq) {
+        db -> next_seq = recovery -> max_seq + 1;
+    }
+    if (recovery -> max_epoch + 1 > db -> next_epoch) {
+        db -> next_epoch = recovery -> max_epoch + 1;
+    }
+    db -> seal_clock = db -> next_epoch - 1;
+}
+
+int recover_db(struct db_state *db) {
+    unsigned long long start = get_time_ns();
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    unsigned long long chunk_sectors = db -> max_transfer_size / db -> sector_size;
+    if (chunk_sectors == 0) {
+        chunk_sectors = 1;
+    }
+
+    struct recovery *recovery = calloc(1, sizeof(struct recovery));
+    recovery -> db = db;
+    recovery -> workers = workers_start(0);
+
+    recovery -> checkpoint = checkpoint_load(db, recovery -> workers);
+    if (recovery -> checkpoint) {
+        // Keys from the checkpoint lose to any record replayed for them, since those were all written after it.
+        recovery -> checkpoint_epoch = db -> next_epoch;
+        recovery -> seqs_capacity = db -> keys.capacity;
+        recovery -> seqs = calloc(recovery -> seqs_capacity, sizeof(unsigned long long));
+        recovery -> epochs = calloc(recovery -> seqs_capacity, sizeof(unsigned int));
+    }
+    for (int i = 0; i < RECOVERY_REGIONS_IN_FLIGHT; i++) {
+        recovery -> slots[i].recovery = recovery;
+        recovery -> slots[i].buf = device_dma_malloc(db -> device, region_bytes);
+    }
+    read_first_headers(recovery);
+    find_runs(recovery);
+
+    unsigned long long next_region = 0;
+    while (next_region < db -> num_regions || recovery -> busy_slots) {
+        for (int i = 0; i < RECOVERY_REGIONS_IN_FLIGHT; i++) {
+            struct recovery_slot *slot = &recovery -> slots[i];
+            while (next_region < db -> num_regions && db -> regions[next_region].state != REGION_FREE) {
+                next_region++; // part of a run, see find_runs
+            }
+            if (slot -> state == SLOT_PARSING && atomic_load(&slot -> parsed)) {
+                merge_region(recovery, slot);
+                slot -> state = SLOT_IDLE;
+                recovery -> busy_slots--;
+            }
+            if (slot -> state == SLOT_IDLE && next_region < db -> num_regions && recovery -> reads_outstanding < RECOVERY_QUEUE_DEPTH) {
+                slot -> state = SLOT_PROBING;
+                slot -> region = next_region++;
+                slot -> next_sector = 0;
+                recovery -> busy_slots++;
+                issue_region_read(recovery, slot, 1);
+            }
+            while (slot -> state == SLOT_READING && slot -> next_sector < db -> region_sectors && recovery -> reads_outstanding < RECOVERY_QUEUE_DEPTH) {
+                unsigned long long num_sectors = db -> region_sectors - slot -> next_sector;
+                issue_region_read(recovery, slot, num_sectors < chunk_sectors ? num_sectors : chunk_sectors);
+            }
+        }
+        device_process_completions(db -> queue, 0);
+    }
+    workers_stop(recovery -> workers);
+
+    int rc = 0;
+    if (recovery -> io_error) {
+        printf("Got I/O errors while recovering, not starting\n");
+        rc = -1;
+    } else {
+        finish_recovery(recovery);
+        double seconds = (get_time_ns() - start) / 1e9;
+        printf("Recovered %lld keys from %llu records in %llu regions. Read %.3g GB in %.3g s (%.3g GB/s)\n",
+            db -> num_key_entries, recovery -> num_records, db -> num_regions - db -> num_free_regions,
+            recovery -> bytes_read / 1e9, seconds, recovery -> bytes_read / 1e9 / seconds);
+    }
+
+    for (int i = 0; i < RECOVERY_REGIONS_IN_FLIGHT; i++) {
+        device_dma_free(db -> device, recovery -> slots[i].buf);
+        free(recovery -> slots[i].records);
+    }
+    free(recovery -> firsts);
+    free(recovery -> checkpoint);
+    free(recovery -> seqs);
+    free(recovery -> epochs);
+    free(recovery);
+    return rc;
+}
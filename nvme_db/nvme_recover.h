@@ -0,0 +1,28 @@
+//
+//  nvme_recover.h
+//
+//
+//  Rebuilding the in-RAM index on startup by scanning every region of the device.
+//
+//  Each region is read with a few large sequential reads (many regions at once, so the device sees a deep
+//  queue), then parsed on a worker thread, which checks and hashes every record. The polling thread only
+//  has to merge the parsed records into the index, where the record with the highest seq for a key wins.
+//  A region's records stop at the first header that is zeroed, torn, or from an older epoch (i.e. left
+//  over from before the region was last reused), so an unfinished flush at crash time is simply dropped.
+//
+//  Before that, the first sector of every region is read to find the runs of regions that records bigger than a
+//  region have to themselves, which aren't parsed like the rest. See find_runs.
+//
+//  If there's a checkpoint (see nvme_checkpoint.h) the keys come from it, and only regions opened since it, or
+//  still being written to when it was taken, get parsed.
+//
+
+#ifndef nvme_recover_h
+#define nvme_recover_h
+
+struct db_state;
+
+// Called from create_db, before any I/O has been issued. Returns 0 on success.
+int recover_db(struct db_state *db);
+
+#endif /* nvme_recover_h */
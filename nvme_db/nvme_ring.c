@@ -0,0 +1,78 @@
+//
+//  nvme_ring.c
+//
+//
+
+#include "db_interface.h"
+#include "nvme_ring.h"
+
+#include <stdlib.h>
+
+int write_ring_init(struct write_ring *ring, unsigned long long slots) {
+    ring -> cells = malloc(slots * sizeof(struct write_ring_cell));
+    if (ring -> cells == NULL) {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < slots; i++) {
+        atomic_init(&ring -> cells[i].seq, i);
+    }
+    ring -> mask = slots - 1;
+    atomic_init(&ring -> tail, 0);
+    ring -> head = 0;
+    atomic_init(&ring -> applied, 0);
+    return 0;
+}
+
+void write_ring_free(struct write_ring *ring) {
+    free(ring -> cells);
+    ring -> cells = NULL;
+}
+
+bool write_ring_push(struct write_ring *ring, const struct write_request *request) {
+    unsigned long long pos = atomic_load_explicit(&ring -> tail, memory_order_relaxed);
+    struct write_ring_cell *cell;
+    while (true) {
+        cell = &ring -> cells[pos & ring -> mask];
+        unsigned long long seq = atomic_load_explicit(&cell -> seq, memory_order_acquire);
+        long long diff = (long long) (seq - pos);
+        if (diff == 0) { // free for this position, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&ring -> tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            } // else pos is now the new tail
+        } else if (diff < 0) { // still holds the request from a lap ago, so we're full
+            return false;
+        } else { // someone else claimed it first
+            pos = atomic_load_explicit(&ring -> tail, memory_order_relaxed);
+        }
+    }
+    cell -> request = *request;
+    atomic_store_explicit(&cell -> seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool write_ring_pop(struct write_ring *ring, struct write_request *request) {
+    struct write_ring_cell *cell = &ring -> cells[ring -> head & ring -> mask];
+    if (atomic_load_explicit(&cell -> seq, memory_order_acquire) != ring -> head + 1) {
+        return false;
+    }
+    *request = cell -> request;
+    atomic_store_explicit(&cell -> seq, ring -> head + ring -> mask + 1, memory_order_release); // free for the next lap
+    ring -> head++;
+    return true;
+}
+
+bool write_ring_empty(struct write_ring *ring) {
+    return atomic_load(&ring -> tail) == ring -> head;
+}
+
+void write_ring_mark_applied(struct write_ring *ring) {
+    atomic_store_explicit(&ring -> applied, ring -> head, memory_order_release);
+}
+
+unsigned long long write_ring_pushed(struct write_ring *ring) {
+    return atomic_load_explicit(&ring -> tail, memory_order_acquire);
+}
+
+unsigned long long write_ring_applied(struct write_ring *ring) {
+    return atomic_load_explicit(&ring -> applied, memory_order_acquire);
+}
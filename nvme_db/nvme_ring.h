@@ -0,0 +1,73 @@
+//
+//  nvme_ring.h
+//
+//
+//  Bounded lock-free ring that application threads hand writes and deletes to. Each shard has one, and
+//  poll_db drains it in batches under the shard's lock, so producers never take the lock or touch the index,
+//  the write queue or the device. Only the poller does, and it gets a whole batch for each time it takes the lock.
+//
+//  Multi-producer, single-consumer, after Dmitry Vyukov's bounded MPMC queue: every cell has a sequence
+//  number saying whose turn it is, producers claim cells by bumping tail with a cmpxchg and publish by
+//  bumping the cell's sequence, and the consumer (whoever holds the lock) takes them in order from head.
+//  Writes from one thread to one key always land in the same shard's ring in order, so they're applied in order.
+//
+//  Reads have to see writes pushed before them, so the consumer also publishes how far it's applied (not just
+//  taken): a read that finds applied behind the tail it saw takes the lock and drains the ring itself.
+//
+
+#ifndef nvme_ring_h
+#define nvme_ring_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+// db_interface.h has to be included first, for db_data and key_write_cb.
+
+#define WRITE_RING_SLOTS 4096 // per shard. Power of 2.
+
+// Everything write_value_async and delete_value_async know about a write.
+struct write_request {
+    db_data key;
+    db_data value; // as it's to be stored, which is compressed if flags say so
+    db_data raw_value; // as the caller gave it
+    unsigned long long hash; // of the key, already computed to pick the shard
+    char flags; // 0, DATA_FLAG_DELETED, or how value's compressed
+    unsigned int crc; // of the record so far, see record_crc_begin
+    bool dma; // value came from db_dma_alloc
+    value_fill_cb fill; // write_value_stream_async's, which has no value.data. NULL otherwise.
+    key_write_cb callback;
+    void *cb_arg;
+};
+
+struct write_ring_cell {
+    _Atomic unsigned long long seq; // == position when free for it, position + 1 once a request is in it
+    struct write_request request;
+};
+
+struct write_ring {
+    struct write_ring_cell *cells;
+    unsigned long long mask;
+    _Atomic unsigned long long tail __attribute__((aligned(64))); // next position a producer claims
+    unsigned long long head __attribute__((aligned(64))); // next position to take. Only touched under the lock.
+    _Atomic unsigned long long applied; // head, as of the last time everything taken had been applied. Read without the lock.
+};
+
+int write_ring_init(struct write_ring *ring, unsigned long long slots);
+void write_ring_free(struct write_ring *ring);
+
+// Returns false if the ring is full. Safe from any thread.
+bool write_ring_push(struct write_ring *ring, const struct write_request *request);
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+// Returns false if there's nothing (completely pushed) to take.
+bool write_ring_pop(struct write_ring *ring, struct write_request *request);
+// Whether nothing has even started being pushed.
+bool write_ring_empty(struct write_ring *ring);
+// Once what's been taken has been applied.
+void write_ring_mark_applied(struct write_ring *ring);
+
+// Safe from any thread. Everything pushed so far is before write_ring_pushed(), and has been applied once
+// write_ring_applied() is at least that.
+unsigned long long write_ring_pushed(struct write_ring *ring);
+unsigned long long write_ring_applied(struct write_ring *ring);
+
+#endif /* nvme_ring_h */
@@ -0,0 +1,308 @@
+//
+//  nvme_scan.c
+//
+//
+
+#include "nvme_scan.h"
+#include "nvme_shard.h"
+#include "nvme_write_key_async.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SCAN_MAX_KEY_LENGTH (1 << 16) // key_length is an unsigned short
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Whether a read of the key would find a value, see read_values_async.
+static bool key_visible(struct db_state *db, unsigned int key_idx) {
+    struct ram_stored_key *key = key_at(db, key_idx);
+    if (key -> flags & DATA_FLAG_WRITE_PENDING) {
+        struct pending_write *pending = pending_write_find(db, key_idx);
+        if (pending) {
+            return !(pending -> latest -> flags & DATA_FLAG_DELETED);
+        }
+    }
+    return !(key -> flags & (DATA_FLAG_INCOMPLETE | DATA_FLAG_DELETED));
+}
+
+static void *grow_bytes(char *bytes, unsigned long long *capacity, unsigned long long needed) {
+    if (needed <= *capacity) {
+        return bytes;
+    }
+    while (*capacity < needed) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+    }
+    return realloc(bytes, *capacity);
+}
+
+// MUST HAVE SCAN LOCK TO CALL THIS FUNCTION
+// Takes the shard's next keys in the range out of its ordered index, after the last ones it took.
+static void shard_refill(struct scan *scan, unsigned int i) {
+    struct scan_shard *shard = &scan -> shards[i];
+    struct db_state *db = scan -> handle -> shards[i];
+
+    const void *from = scan -> start;
+    unsigned int from_length = scan -> start_length;
+    bool exclusive = false;
+    if (shard -> num_keys) {
+        struct scan_key *last = &shard -> keys[shard -> num_keys - 1];
+        memcpy(scan -> resume, shard -> bytes + last -> offset, last -> length);
+        from = scan -> resume;
+        from_length = last -> length;
+        exclusive = true;
+    }
+    shard -> num_keys = 0;
+    shard -> next = 0;
+    unsigned long long used = 0;
+
+    unsigned long long pushed = write_ring_pushed(&db -> write_ring);
+    acq_lock(db); // ACQUIRE LOCK
+    apply_pushed_writes(db, pushed); // like a read, so the scan sees writes made before it
+    struct ordered_cursor cursor;
+    ordered_seek(&db -> ordered, from, from_length, exclusive, &cursor);
+    unsigned int key_idx;
+    while (shard -> num_keys < SCAN_BATCH_KEYS) {
+        if (!ordered_next(&cursor, &key_idx)) {
+            shard -> exhausted = true;
+            break;
+        }
+        struct ram_stored_key *key = key_at(db, key_idx);
+        char *bytes = key_bytes(db, key);
+        if (scan -> end && ordered_compare(bytes, key -> key_length, scan -> end, scan -> end_length) >= 0) {
+            shard -> exhausted = true;
+            break;
+        }
+        if (!key_visible(db, key_idx)) {
+            continue;
+        }
+        shard -> bytes = grow_bytes(shard -> bytes, &shard -> bytes_capacity, used + key -> key_length);
+        memcpy(shard -> bytes + used, bytes, key -> key_length);
+        shard -> keys[shard -> num_keys++] = (struct scan_key){.offset=used, .length=key -> key_length};
+        used += key -> key_length;
+    }
+    release_lock(db); // RELEASE LOCK
+}
+
+// MUST HAVE SCAN LOCK TO CALL THIS FUNCTION
+// The next batch of keys, merged from every shard's.
+static struct scan_batch *take_batch(struct scan *scan) {
+    struct scan_batch *batch = malloc(sizeof(struct scan_batch) +
+        SCAN_BATCH_KEYS * (3 * sizeof(db_data) + sizeof(enum read_err) + sizeof(struct scan_key)));
+    batch -> scan = scan;
+    batch -> number = scan -> next_number++;
+    batch -> last = false;
+    batch -> ready = false;
+    batch -> num_keys = 0;
+    batch -> keys = (db_data *)(batch + 1);
+    batch -> found_keys = batch -> keys + SCAN_BATCH_KEYS;
+    batch -> values = batch -> found_keys + SCAN_BATCH_KEYS;
+    batch -> errors = (enum read_err *)(batch -> values + SCAN_BATCH_KEYS);
+    struct scan_key *taken = (struct scan_key *)(batch -> errors + SCAN_BATCH_KEYS);
+    batch -> key_bytes = NULL;
+    batch -> value_bytes = NULL;
+    batch -> num_found = 0;
+    unsigned long long used = 0, capacity = 0;
+
+    while (batch -> num_keys < SCAN_BATCH_KEYS && scan -> left) {
+        struct scan_shard *best = NULL;
+        for (unsigned int i = 0; i < scan -> handle -> num_shards; i++) {
+            struct scan_shard *shard = &scan -> shards[i];
+            if (shard -> next == shard -> num_keys && !shard -> exhausted) {
+                shard_refill(scan, i);
+            }
+            if (shard -> next == shard -> num_keys) {
+                continue;
+            }
+            if (best == NULL) {
+                best = shard;
+                continue;
+            }
+            struct scan_key *a = &shard -> keys[shard -> next], *b = &best -> keys[best -> next];
+            if (ordered_compare(shard -> bytes + a -> offset, a -> length, best -> bytes + b -> offset, b -> length) < 0) {
+                best = shard;
+            }
+        }
+        if (best == NULL) { // every shard's out of keys
+            scan -> left = 0;
+            break;
+        }
+        struct scan_key *key = &best -> keys[best -> next++];
+        batch -> key_bytes = grow_bytes(batch -> key_bytes, &capacity, used + key -> length);
+        memcpy(batch -> key_bytes + used, best -> bytes + key -> offset, key -> length);
+        taken[batch -> num_keys++] = (struct scan_key){.offset=used, .length=key -> length};
+        used += key -> length;
+        if (scan -> left != ~0ULL) {
+            scan -> left--;
+        }
+    }
+    for (unsigned int k = 0; k < batch -> num_keys; k++) { // key_bytes has stopped moving
+        batch -> keys[k] = (db_data){.length=taken[k].length, .data=batch -> key_bytes + taken[k].offset};
+    }
+    if (scan -> left == 0) {
+        batch -> last = true;
+        scan -> taken_all = true;
+    }
+    return batch;
+}
+
+static void scan_free(struct scan *scan) {
+    for (unsigned int i = 0; i < scan -> handle -> num_shards; i++) {
+        free(scan -> shards[i].bytes);
+    }
+    free(scan -> shards);
+    free(scan -> resume);
+    free(scan -> start);
+    free(scan -> end);
+    pthread_mutex_destroy(&scan -> lock);
+    free(scan);
+}
+
+static void scan_release(struct scan *scan) {
+    pthread_mutex_lock(&scan -> lock);
+    bool done = --scan -> active == 0 && scan -> finished;
+    pthread_mutex_unlock(&scan -> lock);
+    if (done) {
+        scan_free(scan);
+    }
+}
+
+// MUST HAVE SCAN LOCK TO CALL THIS FUNCTION, and be the one delivering
+// Runs the batch's callback, without the lock, and frees it.
+static void deliver_batch(struct scan *scan, struct scan_batch *batch) {
+    pthread_mutex_unlock(&scan -> lock);
+    scan -> callback(scan -> cb_arg, batch -> num_found, batch -> found_keys, batch -> errors, batch -> values, batch -> last);
+    pthread_mutex_lock(&scan -> lock);
+    scan -> window[batch -> number % SCAN_BATCHES_IN_FLIGHT] = NULL;
+    scan -> next_delivery++;
+    scan -> finished = batch -> last;
+    free(batch -> key_bytes);
+    free(batch -> value_bytes);
+    free(batch);
+}
+
+static void scan_batch_done(struct scan_batch *batch, const enum read_err *errors, const db_data *values);
+static void scan_read_cb(void *cb_arg, unsigned int num_keys, const enum read_err *errors, const db_data *values);
+
+// Takes batches and starts reading them, till there are SCAN_BATCHES_IN_FLIGHT waiting to be delivered. Only
+// one thread does at a time. Reads that complete right away call scan_batch_done from in here, which leaves the
+// refilling to this loop, so a scan that's all in the value cache doesn't recurse a batch deeper every batch.
+static void scan_fill(struct scan *scan) {
+    pthread_mutex_lock(&scan -> lock);
+    if (scan -> filling) {
+        pthread_mutex_unlock(&scan -> lock);
+        return;
+    }
+    scan -> filling = true;
+    while (!scan -> taken_all && scan -> next_number - scan -> next_delivery < SCAN_BATCHES_IN_FLIGHT) {
+        struct scan_batch *batch = take_batch(scan);
+        scan -> window[batch -> number % SCAN_BATCHES_IN_FLIGHT] = batch;
+        scan -> active++;
+        pthread_mutex_unlock(&scan -> lock);
+        if (batch -> num_keys) {
+            read_values_async(scan -> handle, batch -> keys, batch -> num_keys, NULL, NULL, scan_read_cb, batch);
+        } else { // nothing left in the range: an empty last batch
+            scan_batch_done(batch, NULL, NULL);
+        }
+        pthread_mutex_lock(&scan -> lock);
+    }
+    scan -> filling = false; // with the lock held since the window was last looked at, so no refill's missed
+    pthread_mutex_unlock(&scan -> lock);
+}
+
+// The batch's values are in. Delivers it if it's next, and whatever was waiting behind it. Otherwise copies the
+// values (they're only good till this returns) and leaves it for whoever delivers the batch before it.
+static void scan_batch_done(struct scan_batch *batch, const enum read_err *errors, const db_data *values) {
+    struct scan *scan = batch -> scan;
+    for (unsigned int k = 0; k < batch -> num_keys; k++) {
+        if (errors[k] == KEY_NOT_FOUND) { // deleted since it was taken
+            continue;
+        }
+        batch -> found_keys[batch -> num_found] = batch -> keys[k];
+        batch -> errors[batch -> num_found] = errors[k];
+        batch -> values[batch -> num_found] = values[k];
+        batch -> num_found++;
+    }
+
+    pthread_mutex_lock(&scan -> lock);
+    if (!scan -> delivering && batch -> number == scan -> next_delivery) {
+        scan -> delivering = true;
+        deliver_batch(scan, batch);
+        struct scan_batch *next;
+        while ((next = scan -> window[scan -> next_delivery % SCAN_BATCHES_IN_FLIGHT]) && next -> ready) {
+            deliver_batch(scan, next);
+        }
+        scan -> delivering = false;
+    } else {
+        unsigned long long bytes = 0;
+        for (unsigned int k = 0; k < batch -> num_found; k++) {
+            bytes += batch -> values[k].length;
+        }
+        batch -> value_bytes = malloc(bytes + 1);
+        bytes = 0;
+        for (unsigned int k = 0; k < batch -> num_found; k++) {
+            memcpy(batch -> value_bytes + bytes, batch -> values[k].data, batch -> values[k].length);
+            batch -> values[k].data = batch -> value_bytes + bytes;
+            bytes += batch -> values[k].length;
+        }
+        batch -> ready = true;
+    }
+    pthread_mutex_unlock(&scan -> lock);
+
+    scan_fill(scan);
+    scan_release(scan);
+}
+
+static void scan_read_cb(void *cb_arg, unsigned int num_keys, const enum read_err *errors, const db_data *values) {
+    scan_batch_done(cb_arg, errors, values);
+}
+
+// PUBLIC API
+
+int scan_async(void *opaque, db_data start, db_data end, unsigned long long limit, keys_scan_cb callback, void *cb_arg) {
+    struct db_state *handle = opaque;
+    if (!handle -> shards[0] -> ordered.enabled) {
+        return -1;
+    }
+
+    struct scan *scan = calloc(1, sizeof(struct scan));
+    pthread_mutex_init(&scan -> lock, NULL);
+    scan -> handle = handle;
+    scan -> callback = callback;
+    scan -> cb_arg = cb_arg;
+    scan -> start = malloc(start.length + 1);
+    if (start.length) {
+        memcpy(scan -> start, start.data, start.length);
+    }
+    scan -> start_length = start.length;
+    if (end.data) {
+        scan -> end = malloc(end.length + 1);
+        memcpy(scan -> end, end.data, end.length);
+        scan -> end_length = end.length;
+    }
+    scan -> left = limit ? limit : ~0ULL;
+    scan -> shards = calloc(handle -> num_shards, sizeof(struct scan_shard));
+    scan -> resume = malloc(SCAN_MAX_KEY_LENGTH);
+    scan -> active = 1; // till we're done with it here
+
+    scan_fill(scan);
+    scan_release(scan);
+    return 0;
+}
+
+int scan_prefix_async(void *opaque, db_data prefix, unsigned long long limit, keys_scan_cb callback, void *cb_arg) {
+    // Every key starting with prefix is >= it, and < it with trailing 0xff bytes dropped and the last one left
+    // incremented. If it's nothing but 0xff bytes there's no such key, and the scan goes to the end.
+    if (prefix.length >= SCAN_MAX_KEY_LENGTH) { // longer than any key can be, and than end
+        return -1;
+    }
+    unsigned char end[SCAN_MAX_KEY_LENGTH];
+    int end_length = prefix.length;
+    memcpy(end, prefix.data, prefix.length);
+    while (end_length > 0 && end[end_length - 1] == 0xff) {
+        end_length--;
+    }
+    if (end_length > 0) {
+        end[end_length - 1]++;
+    }
+    return scan_async(opaque, prefix, (db_data){.length=end_length, .data=end_length ? end : NULL}, limit, callback, cb_arg);
+}
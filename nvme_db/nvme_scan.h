@@ -0,0 +1,85 @@
+//
+//  nvme_scan.h
+//
+//
+//  scan_async: keys in order, from every shard's ordered index (see nvme_ordered.h), with their values.
+//
+//  Keys are hashed to shards, so each shard only has some of them, in order. A scan keeps a cursor into every
+//  shard, and a buffer of the next SCAN_BATCH_KEYS keys each of them has in the range, which it merges into
+//  batches of up to SCAN_BATCH_KEYS keys. Each batch's values are read with read_values_async, so values near
+//  each other on the device are fetched with one read, and up to SCAN_BATCHES_IN_FLIGHT batches are being read
+//  at once. Batches are delivered in order: one that comes in ahead of those before it has its values copied,
+//  and waits.
+//
+//  A scan isn't a snapshot. It sees every write made before it started. Of the ones made while it's going, a
+//  key written in a part of the range no shard's buffered yet is seen, and the rest may or may not be.
+//
+
+#ifndef nvme_scan_h
+#define nvme_scan_h
+
+#include "nvme_key.h"
+
+#define SCAN_BATCH_KEYS 64
+#define SCAN_BATCHES_IN_FLIGHT 4
+
+// A key copied out of the db, in a buffer of the scan's.
+struct scan_key {
+    unsigned int offset; // in the buffer's bytes
+    unsigned int length;
+};
+
+// The next keys a shard has, already taken out of its ordered index.
+struct scan_shard {
+    struct scan_key keys[SCAN_BATCH_KEYS];
+    unsigned int num_keys;
+    unsigned int next; // keys[next] is the shard's smallest key the scan hasn't taken yet
+    char *bytes; // of the keys
+    unsigned long long bytes_capacity;
+    bool exhausted; // no more keys in the range after these
+};
+
+struct scan_batch {
+    struct scan *scan;
+    unsigned long long number; // in the order batches are delivered
+    bool last;
+    bool ready; // values are in, and copied, waiting for the batches before it to be delivered
+
+    unsigned int num_keys;
+    db_data *keys; // into key_bytes
+    char *key_bytes;
+
+    // Once they're in. Only keys that were found: a key that's been deleted since it was taken is left out.
+    unsigned int num_found;
+    db_data *found_keys;
+    enum read_err *errors;
+    db_data *values;
+    char *value_bytes; // copies of them, if the batch has to wait
+};
+
+struct scan {
+    pthread_mutex_t lock; // for everything here. Taken before any shard's lock, never after.
+    struct db_state *handle;
+    keys_scan_cb callback;
+    void *cb_arg;
+
+    char *start;
+    unsigned int start_length;
+    char *end; // NULL if the scan goes on to the last key
+    unsigned int end_length;
+    unsigned long long left; // keys it can still take. ~0ULL if there's no limit.
+
+    struct scan_shard *shards;
+    char *resume; // scratch for the key a shard's buffer carries on after
+
+    struct scan_batch *window[SCAN_BATCHES_IN_FLIGHT]; // by number % SCAN_BATCHES_IN_FLIGHT
+    unsigned long long next_number; // of the next batch to take keys for
+    unsigned long long next_delivery; // number of the batch whose callback is next
+    bool taken_all; // the last batch has been taken
+    bool filling; // some thread is in scan_fill, taking batches and starting their reads
+    bool delivering; // some thread is running callbacks, so the rest leave their batches to it
+    bool finished; // the last batch has been delivered
+    unsigned int active; // scan_async, and batches taken but not yet done with. The scan's freed when this gets to 0 and it's finished.
+};
+
+#endif /* nvme_scan_h */
@@ -0,0 +1,46 @@
+//
+//  nvme_shard.c
+//
+//
+
+#include "nvme_shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+static void *poller_main(void *arg) {
+    struct db_state *db = arg;
+    while (!atomic_load_explicit(&db -> stop_poller, memory_order_relaxed)) {
+        // Give the core up when there's nothing to do, in case there are more threads than cores.
+        if (poll_shard(db) == 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+int pollers_start(struct db_state *db) {
+    for (unsigned int i = 0; i < db -> num_shards; i++) {
+        struct db_state *shard = db -> shards[i];
+        atomic_store(&shard -> stop_poller, false);
+        if (pthread_create(&shard -> poller, NULL, poller_main, shard) != 0) {
+            printf("Couldn't start poller thread for shard %u\n", i);
+            db -> num_pollers = i;
+            pollers_stop(db);
+            return -1;
+        }
+    }
+    db -> num_pollers = db -> num_shards;
+    return 0;
+}
+
+void pollers_stop(struct db_state *db) {
+    for (unsigned int i = 0; i < db -> num_pollers; i++) {
+        atomic_store(&db -> shards[i] -> stop_poller, true);
+    }
+    for (unsigned int i = 0; i < db -> num_pollers; i++) {
+        pthread_join(db -> shards[i] -> poller, NULL);
+    }
+    db -> num_pollers = 0;
+}
@@ -0,0 +1,35 @@
+//
+//  nvme_shard.h
+//
+//
+//  Sharded mode. Keys hash to one of num_shards shards, and every shard is a whole db_state of its own: its own
+//  lock, index, write queue, log heads and regions, on its own slice of the device with its own I/O queue. So
+//  threads working on different shards never touch the same cache lines or submission queue. With
+//  poller_threads set every shard also gets a thread that does nothing but poll it.
+//
+//  The handle create_db returns is shards[0], which routes every call to the right shard. A device has to be
+//  opened with the same number of shards every time, since that decides where each shard's slice is.
+//
+
+#ifndef nvme_shard_h
+#define nvme_shard_h
+
+#include "nvme_key.h"
+
+#define MAX_SHARDS 256
+
+// The index uses bits 25 and up of the hash (see nvme_index.c), so the shard comes from the bits below,
+// otherwise every shard's keys would crowd into the same part of its table.
+static inline unsigned int shard_index(struct db_state *db, unsigned long long hash) {
+    return ((hash & 0xffffff) * db -> num_shards) >> 24;
+}
+
+static inline struct db_state *shard_for_hash(struct db_state *db, unsigned long long hash) {
+    return db -> shards[shard_index(db, hash)];
+}
+
+// Each returns 0 on success. Only called on the handle.
+int pollers_start(struct db_state *db);
+void pollers_stop(struct db_state *db);
+
+#endif /* nvme_shard_h */
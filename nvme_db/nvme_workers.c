@@ -0,0 +1,123 @@
+//
+//  nvme_workers.c
+//
+//
+
+#include "nvme_workers.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "spdk/queue.h"
+
+#define MAX_WORKERS 64
+
+struct work_item {
+    work_fn fn;
+    void *arg;
+    TAILQ_ENTRY(work_item) link;
+};
+
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t work_done; // unfinished went to 0
+    TAILQ_HEAD(work_head, work_item) work;
+    unsigned long long unfinished; // submitted, and not done running yet
+    bool stopping;
+
+    unsigned int num_threads;
+    pthread_t threads[MAX_WORKERS];
+};
+
+static void *worker_main(void *opaque) {
+    struct worker_pool *pool = opaque;
+    pthread_mutex_lock(&pool -> lock);
+    while (true) {
+        struct work_item *item = TAILQ_FIRST(&pool -> work);
+        if (item == NULL) {
+            if (pool -> stopping) {
+                break;
+            }
+            pthread_cond_wait(&pool -> work_available, &pool -> lock);
+            continue;
+        }
+        TAILQ_REMOVE(&pool -> work, item, link);
+        pthread_mutex_unlock(&pool -> lock);
+
+        item -> fn(item -> arg);
+        free(item);
+
+        pthread_mutex_lock(&pool -> lock);
+        if (--pool -> unfinished == 0) {
+            pthread_cond_broadcast(&pool -> work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool -> lock);
+    return NULL;
+}
+
+struct worker_pool *workers_start(unsigned int num_threads) {
+    if (num_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+    if (num_threads > MAX_WORKERS) {
+        num_threads = MAX_WORKERS;
+    }
+
+    struct worker_pool *pool = calloc(1, sizeof(struct worker_pool));
+    pthread_mutex_init(&pool -> lock, NULL);
+    pthread_cond_init(&pool -> work_available, NULL);
+    pthread_cond_init(&pool -> work_done, NULL);
+    TAILQ_INIT(&pool -> work);
+    for (unsigned int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool -> threads[i], NULL, worker_main, pool) != 0) {
+            break;
+        }
+        pool -> num_threads++;
+    }
+    return pool;
+}
+
+unsigned int workers_count(struct worker_pool *pool) {
+    return pool -> num_threads;
+}
+
+void workers_submit(struct worker_pool *pool, work_fn fn, void *arg) {
+    if (pool -> num_threads == 0) { // couldn't start any threads, so do it here.
+        fn(arg);
+        return;
+    }
+    struct work_item *item = malloc(sizeof(struct work_item));
+    item -> fn = fn;
+    item -> arg = arg;
+    pthread_mutex_lock(&pool -> lock);
+    TAILQ_INSERT_TAIL(&pool -> work, item, link);
+    pool -> unfinished++;
+    pthread_cond_signal(&pool -> work_available);
+    pthread_mutex_unlock(&pool -> lock);
+}
+
+void workers_wait(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool -> lock);
+    while (pool -> unfinished) {
+        pthread_cond_wait(&pool -> work_done, &pool -> lock);
+    }
+    pthread_mutex_unlock(&pool -> lock);
+}
+
+void workers_stop(struct worker_pool *pool) {
+    pthread_mutex_lock(&pool -> lock);
+    pool -> stopping = true;
+    pthread_cond_broadcast(&pool -> work_available);
+    pthread_mutex_unlock(&pool -> lock);
+    for (unsigned int i = 0; i < pool -> num_threads; i++) {
+        pthread_join(pool -> threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool -> lock);
+    pthread_cond_destroy(&pool -> work_available);
+    pthread_cond_destroy(&pool -> work_done);
+    free(pool);
+}
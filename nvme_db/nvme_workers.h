@@ -0,0 +1,28 @@
+//
+//  nvme_workers.h
+//
+//
+//  A small pool of threads for CPU-heavy work that shouldn't run on the polling thread. Work items run in
+//  no particular order, and never touch the device queue (which only the polling thread may use), so they
+//  hand their results back through their argument.
+//
+
+#ifndef nvme_workers_h
+#define nvme_workers_h
+
+typedef void (*work_fn)(void *arg);
+
+struct worker_pool;
+
+// num_threads 0 means one per online CPU.
+struct worker_pool *workers_start(unsigned int num_threads);
+void workers_submit(struct worker_pool *pool, work_fn fn, void *arg);
+unsigned int workers_count(struct worker_pool *pool); // 0 if no threads could be started: submit runs work inline
+
+// Blocks until everything submitted so far has finished running.
+void workers_wait(struct worker_pool *pool);
+
+// Runs everything already submitted, then joins the threads and frees the pool.
+void workers_stop(struct worker_pool *pool);
+
+#endif /* nvme_workers_h */
@@ -6,176 +6,949 @@
 //
 
 #include "nvme_write_key_async.h"
-#include "spdk/nvme.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLUSH_MAX_SEGMENTS 256 // per device write. Values past that many segments are copied like any other.
+#define FLUSH_IN_PLACE_MIN 2048 // values shorter than this are cheaper to copy than to give a segment of their own
+#define PENDING_WRITES_MIN_SLOTS 1024
+#define PLACEMENT_MAX_PADDING 8 // a value is only moved up to start a sector if the padding is under 1/8th of it
+#define FLUSH_CHUNK_WINDOW 4 // device writes a record too big for one is written with at once, see flush_large_record
+
+struct flush_writes_state;
+
+// A buffer one device write of a big record at a time is built in.
+struct flush_chunk {
+    struct flush_writes_state *flush;
+    void *buf; // max_io_bytes, from db -> dma_pool. NULL till it's needed.
+    int slot; // which of chunks and iov it is
+};
 
 struct flush_writes_state {
     TAILQ_HEAD(flush_writes_head, write_cb_state) write_callback_queue;
     struct db_state *db;
-    void *buf; // buffer used to write data to SSD, must be freed on flush.
-    struct ns_entry *ns_entry;
+    void *buf; // everything that was copied rather than written in place, from db -> dma_pool. Put back on flush.
+    unsigned long long buf_size;
+    struct db_iovec iov[FLUSH_MAX_SEGMENTS + 1]; // what the device is writing: pieces of buf, and values written from where they are.
+    int iovcnt;
+    long long region; // region being written to
+    unsigned long long start; // where in the region its records start
+    unsigned long long submitted_at; // commit_now_us(), to measure the device's latency
+
+    bool done; // the device has completed this write, but an earlier flush may not have completed yet.
+    enum write_err error;
+    TAILQ_ENTRY(flush_writes_state) link; // in db -> flushes_in_order
+
+    // Only for flush_large_record, which writes one record in num_chunks device writes of chunk_sectors.
+    unsigned long long lba; // of the first
+    unsigned long long num_sectors;
+    unsigned long long chunk_sectors;
+    unsigned int num_chunks;
+    unsigned int chunks_issued;
+    unsigned int chunks_done;
+    int chunk_status; // first error of any of them
+    unsigned long long record_offset; // of the header, from the start of the first chunk
+    struct ssd_header header;
+    long long filler_offset; // of a filler record before the header, or -1, see record_padding
+    struct ssd_header filler;
+    // A streamed value's crc isn't known till the last chunk's been built, by when the header's been written. So
+    // the sector with the header is kept, and written again with the crc once every chunk has been. NULL otherwise.
+    void *header_sector;
+    struct flush_chunk chunks[FLUSH_CHUNK_WINDOW];
 };
 
-static void flush_writes_cb(void *arg, const struct spdk_nvme_cpl *completion) {
-    struct flush_writes_state *callback_state = arg;
-    struct db_state *db = callback_state -> db;
-    // Lock is acquired by the caller of spdk_nvme_qpair_process_completions.
+struct slab_cache flush_state_cache = SLAB_CACHE_INIT("flush_writes_state", sizeof(struct flush_writes_state));
 
-    enum write_err error = WRITE_SUCCESSFUL;
+static int pending_writes_alloc(struct pending_writes *pending, unsigned long long slots) {
+    pending -> slots = malloc(slots * sizeof(struct pending_write));
+    if (pending -> slots == NULL) {
+        return -1;
+    }
+    for (unsigned long long i = 0; i < slots; i++) {
+        pending -> slots[i].key_index = -1;
+    }
+    pending -> mask = slots - 1;
+    pending -> count = 0;
+    return 0;
+}
 
-    /* See if an error occurred. If so, display information
-     * about it, and set completion value so that I/O
-     * caller is aware that an error occurred.
-     */
-    if (spdk_nvme_cpl_is_error(completion)) {
-        // TODO: fix this. go through each write callback and return an error.
-        spdk_nvme_qpair_print_completion(callback_state->ns_entry->qpair, (struct spdk_nvme_cpl *)completion);
-        fprintf(stderr, "I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
-        error = WRITE_IO_ERROR;
+int pending_writes_init(struct pending_writes *pending) {
+    return pending_writes_alloc(pending, PENDING_WRITES_MIN_SLOTS);
+}
+
+void pending_writes_free(struct pending_writes *pending) {
+    free(pending -> slots);
+    pending -> slots = NULL;
+}
+
+static unsigned long long pending_slot_of(struct pending_writes *pending, long long key_index) {
+    return ((unsigned long long)key_index * 0x9E3779B97F4A7C15ULL >> 32) & pending -> mask;
+}
+
+// The slot key_index is in, or the empty one it would go in.
+static struct pending_write *pending_slot(struct pending_writes *pending, long long key_index) {
+    unsigned long long i = pending_slot_of(pending, key_index);
+    while (pending -> slots[i].key_index >= 0 && pending -> slots[i].key_index != key_index) {
+        i = (i + 1) & pending -> mask;
     }
+    return &pending -> slots[i];
+}
 
-#ifdef DEBUG
-    printf("Got write callback\n");
-#endif
+// Kept at most half full. If there's no memory to grow it carries on fuller, it just gets slower.
+static void pending_writes_grow(struct pending_writes *pending) {
+    struct pending_writes grown;
+    if (pending_writes_alloc(&grown, (pending -> mask + 1) * 2) != 0) {
+        return;
+    }
+    for (unsigned long long i = 0; i <= pending -> mask; i++) {
+        if (pending -> slots[i].key_index >= 0) {
+            *pending_slot(&grown, pending -> slots[i].key_index) = pending -> slots[i];
+            grown.count++;
+        }
+    }
+    free(pending -> slots);
+    *pending = grown;
+}
 
-    struct write_cb_state *prev_callback = NULL;
+void pending_write_add(struct db_state *db, struct write_cb_state *write_callback) {
+    struct pending_writes *pending = &db -> pending_writes;
+    if ((pending -> count + 1) * 2 > pending -> mask + 1) {
+        pending_writes_grow(pending);
+    }
+    struct pending_write *slot = pending_slot(pending, write_callback -> key_index);
+    if (slot -> key_index < 0) {
+        *slot = (struct pending_write){.key_index=write_callback -> key_index, .count=0};
+        pending -> count++;
+    }
+    slot -> count++;
+    slot -> latest = write_callback;
+}
+
+struct pending_write *pending_write_find(struct db_state *db, long long key_index) {
+    struct pending_write *slot = pending_slot(&db -> pending_writes, key_index);
+    return slot -> key_index < 0 ? NULL : slot;
+}
+
+// Writes to a key complete in the order they were enqueued (flushes are applied in order, and a failed flush
+// fails everything queued after it too), so the latest is always the last to go.
+static void pending_write_remove(struct db_state *db, struct write_cb_state *write_callback) {
+    struct pending_writes *pending = &db -> pending_writes;
+    struct pending_write *slot = pending_write_find(db, write_callback -> key_index);
+    if (slot == NULL || --slot -> count) {
+        return;
+    }
+    // Backward shift: move up anything later in the run that's allowed to be where the hole is.
+    unsigned long long hole = slot - pending -> slots;
+    for (unsigned long long i = (hole + 1) & pending -> mask; pending -> slots[i].key_index >= 0; i = (i + 1) & pending -> mask) {
+        unsigned long long home = pending_slot_of(pending, pending -> slots[i].key_index);
+        if (((i - home) & pending -> mask) >= ((i - hole) & pending -> mask)) {
+            pending -> slots[hole] = pending -> slots[i];
+            hole = i;
+        }
+    }
+    pending -> slots[hole].key_index = -1;
+    pending -> count--;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Relocations are the compactor's own business and are finished off right away. User callbacks are left for
+// poll_db to run after it drops the lock, see deliver_writes.
+void complete_write(struct db_state *db, struct write_cb_state *write_callback, enum write_err error) {
+    if (write_callback -> relocated_from >= 0) {
+        write_callback -> callback(write_callback -> cb_arg, error);
+        slab_free(&write_state_cache, write_callback);
+        return;
+    }
+    if (write_callback -> key_index >= 0 && write_callback -> fill == NULL) {
+        pending_write_remove(db, write_callback);
+    }
+    if (write_callback -> fill) {
+        db -> streams_in_flight--;
+    }
+    write_callback -> error = error;
+    db -> callbacks_pending++;
+    TAILQ_INSERT_TAIL(&db -> completed_writes, write_callback, link);
+}
+
+void deliver_writes(struct db_state *db, struct write_cb_head *completed) {
     struct write_cb_state *write_callback;
-    TAILQ_FOREACH(write_callback, &callback_state -> write_callback_queue, link) {
-        free(prev_callback);
-        prev_callback = write_callback;
-        if (error != WRITE_SUCCESSFUL) {
+    while ((write_callback = TAILQ_FIRST(completed)) != NULL) {
+        TAILQ_REMOVE(completed, write_callback, link);
+        write_callback -> callback(write_callback -> cb_arg, write_callback -> error);
+        if (write_callback -> flags & DATA_FLAGS_COMPRESSED) {
+            free(write_callback -> value.data); // compress_value's copy
+        }
+        slab_free(&write_state_cache, write_callback);
+        db -> callbacks_pending--;
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Streamed writes are looked for in the queues, but only while there are any.
+bool write_on_its_way(struct db_state *db, long long key_index) {
+    if (pending_write_find(db, key_index)) {
+        return true;
+    }
+    if (db -> streams_in_flight == 0) {
+        return false;
+    }
+    struct write_cb_state *write_callback;
+    TAILQ_FOREACH(write_callback, &db -> write_callback_queue, link) {
+        if (write_callback -> key_index == key_index) {
+            return true;
+        }
+    }
+    struct flush_writes_state *flush;
+    TAILQ_FOREACH(flush, &db -> flushes_in_order, link) {
+        TAILQ_FOREACH(write_callback, &flush -> write_callback_queue, link) {
+            if (write_callback -> key_index == key_index && write_callback -> relocated_from < 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Point every key written by this flush at its new location and complete the writes.
+static void apply_flush(struct db_state *db, struct flush_writes_state *callback_state) {
+    struct write_cb_state *write_callback;
+    index_write_begin(db);
+    while ((write_callback = TAILQ_FIRST(&callback_state -> write_callback_queue)) != NULL) {
+        TAILQ_REMOVE(&callback_state -> write_callback_queue, write_callback, link);
+        unsigned long long size = callback_ssd_size(write_callback);
+        struct ram_stored_key *key = key_at(db, write_callback -> key_index);
+        // Whichever of the key's records isn't the one it points at afterwards is counted as an older record.
+        if (callback_state -> error != WRITE_SUCCESSFUL) {
             printf("Not setting incomplete false due to IO error\n");
             // TODO: what to do here when we get an IO error? remove the key is the only thing.
+            // For overwrites the old value is still there, so at least the key keeps working.
+            older_record_added(key); // some of it may have made it, so it's counted, to be safe
+        } else if (write_callback -> relocated_from >= 0) {
+            record_written(db, write_callback -> ssd_loc, size);
+            if (key -> data_loc == write_callback -> relocated_from) {
+                record_died(db, write_callback -> relocated_from, size);
+                key -> data_loc = write_callback -> ssd_loc;
+            } else { // the key was overwritten or deleted while this was in flight
+                record_died(db, write_callback -> ssd_loc, size);
+            }
+            older_record_added(key);
         } else {
-            db -> keys[write_callback -> key_index].flags &= (255-DATA_FLAG_INCOMPLETE); // set incomplete flag to false
+            if (!(key -> flags & DATA_FLAG_INCOMPLETE)) { // overwrite, the old record is now garbage.
+                record_died(db, key -> data_loc, sizeof(struct ssd_header) + key -> key_length + key -> data_length);
+                older_record_added(key);
+            }
+            record_written(db, write_callback -> ssd_loc, size);
+            // Reads already issued against the old location copied the old ram_stored_key, and its region
+            // isn't reused until they're done, so they still read the old value intact.
+            key -> data_loc = write_callback -> ssd_loc;
+            key -> data_length = write_callback -> value.length;
+            key -> flags = write_callback -> flags; // clears DATA_FLAG_INCOMPLETE
+            // Streamed writes aren't in pending_writes, so for those any entry is a newer write still to come.
+            struct pending_write *pending = pending_write_find(db, write_callback -> key_index);
+            if (pending && pending -> count > (write_callback -> fill ? 0 : 1)) {
+                key -> flags |= DATA_FLAG_WRITE_PENDING;
+            }
 #ifdef DEBUG
-            printf("Setting complete for key %.16s\n", (char *)db -> key_vla+db -> keys[write_callback -> key_index].key_offset);
+            printf("Setting complete for key %.16s\n", key_bytes(db, key));
 #endif
         }
-        write_callback -> callback(write_callback -> cb_arg, error);
+        complete_write(db, write_callback, callback_state -> error);
     }
-    free(prev_callback);
+    index_write_end(db);
 
     db -> writes_in_flight--;
+    db -> regions[callback_state -> region].writers--;
 
-    TAILQ_INIT(&callback_state -> write_callback_queue); // believe this frees it? unclear...
-
-    release_lock(db);
-    spdk_free(callback_state -> buf);
-    free(callback_state);
+    if (callback_state -> buf) {
+        dma_pool_put(&db -> dma_pool, callback_state -> buf, callback_state -> buf_size);
+    }
+    slab_free(&flush_state_cache, callback_state);
 }
 
-// MUST HAVE LOCK TO CALL THIS FUNCTION
-void flush_writes(struct db_state *db) {
-    unsigned long long write_bytes_queued = calc_write_bytes_queued(db);
-    // TODO: fail with error if there's not enough space on the SSD.
+static void flush_writes_cb(void *arg, int status) {
+    struct flush_writes_state *callback_state = arg;
+    struct db_state *db = callback_state -> db;
+    // Lock is acquired by the caller of device_process_completions.
+
+    // The device has already printed the details of the error.
+    if (status != 0) {
+        // TODO: fix this. go through each write callback and return an error.
+        callback_state -> error = WRITE_IO_ERROR;
+    }
+    callback_state -> done = true;
+    commit_flush_done(db, callback_state -> submitted_at);
+    for (int i = 0; i < NUM_HEADS; i++) {
+        if (db -> heads[i].tail_writer == callback_state) {
+            db -> heads[i].tail_writer = NULL; // the next flush can write that sector again
+        }
+    }
+
 #ifdef DEBUG
-    printf("write bytes queued: %d. current_sector_bytes is %d\n", write_bytes_queued, db -> current_sector_bytes);
+    printf("Got write callback\n");
 #endif
-    double bytes_to_write = db -> current_sector_bytes + write_bytes_queued;
-    unsigned long long current_sector = db -> current_sector_ssd; // sector we're going to write to
-    db -> current_sector_ssd += (db -> current_sector_bytes + write_bytes_queued)/db -> sector_size;
+
+    // Apply every completed flush up to the first one still outstanding.
+    struct flush_writes_state *oldest;
+    while ((oldest = TAILQ_FIRST(&db -> flushes_in_order)) != NULL && oldest -> done) {
+        TAILQ_REMOVE(&db -> flushes_in_order, oldest, link);
+        apply_flush(db, oldest);
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+static void fail_writes(struct db_state *db, struct write_cb_head *queue, enum write_err error) {
+    struct write_cb_state *write_callback;
+    while ((write_callback = TAILQ_FIRST(queue)) != NULL) {
+        TAILQ_REMOVE(queue, write_callback, link);
+        if (queue == &db -> write_callback_queue) {
+            commit_dequeued(db, callback_ssd_size(write_callback));
+        }
+        complete_write(db, write_callback, error);
+    }
+}
+
+// Returns how many bytes of padding go before a record at loc. Records are packed back to back, small ones many
+// to a sector, except that:
+// - headers never straddle a sector boundary, so the compactor can always tell a header from the zeroes padding
+//   out the end of a flush. Zeroes mean skip to the next sector.
+// - a record that would read a sector more than it has to is moved up so it starts a sector, if the padding is
+//   small next to it, with a filler record (DATA_FLAG_PADDING) in front of it to skip over. Reads start at the
+//   header, to check the crc, so it's the whole record that counts. Except for a DMA value the device could
+//   write from where it is if it started a sector (see layout_record): then it's the value that's moved up, and
+//   its header goes at the end of the sector before.
+// *filler is where the filler goes, in the padding, or -1 if there isn't one.
+static unsigned long long record_padding(struct db_state *db, unsigned long long loc, struct write_cb_state *write_callback, long long *filler) {
+    unsigned long long sector_size = db -> sector_size;
+    unsigned long long sector_left = sector_size - loc % sector_size;
+    if (sector_left < sizeof(struct ssd_header)) {
+        unsigned long long padding = sector_left + record_padding(db, loc + sector_left, write_callback, filler);
+        *filler += *filler >= 0 ? sector_left : 0;
+        return padding;
+    }
+    *filler = -1;
+    bool value_first = write_callback -> value_dma && write_callback -> relocated_from < 0 && db -> device -> sgl_alignment > 1;
+    unsigned long long from = value_first ? sizeof(struct ssd_header) + write_callback -> key.length : 0; // into the record
+    unsigned long long length = value_first ? write_callback -> value.length : callback_ssd_size(write_callback);
+    // Recovery knows a region by its first record, so that's never a filler.
+    if (from >= sector_size || loc % (db -> region_sectors * sector_size) == 0) {
+        return 0;
+    }
+    unsigned long long packed_sectors = ((loc + from) % sector_size + length + sector_size - 1) / sector_size;
+    if (packed_sectors == (length + sector_size - 1) / sector_size) {
+        return 0;
+    }
+    unsigned long long padding = sector_size - (loc + from) % sector_size;
+    padding += padding < sizeof(struct ssd_header) ? sector_size : 0; // the filler needs room for its header
+    if (padding * PLACEMENT_MAX_PADDING > length) {
+        return 0;
+    }
+    *filler = 0;
+    return padding;
+}
+
+// The record's ssd_header.crc, once a streamed value's been copied. A relocated record keeps the one it had.
+static unsigned int header_crc(struct write_cb_state *write_callback) {
+    return write_callback -> relocated_from >= 0 ? write_callback -> crc : record_crc_end(write_callback -> crc, write_callback -> seq);
+}
+
+// The record that pads out the bytes from at to a record at record_at, see record_padding.
+static struct ssd_header filler_header(struct db_state *db, long long region, unsigned long long at, unsigned long long record_at) {
+    return (struct ssd_header){
+        .key_length = 0,
+        .data_length = record_at - at - sizeof(struct ssd_header),
+        .flags = DATA_FLAG_PADDING,
+        .seq = 0,
+        .epoch = db -> regions[region].epoch,
+        .crc = 0
+    };
+}
+
+// Where the records of a flush go in the device write, and which values the device can take from where they are
+// rather than from a copy. Worked out once to decide how many records to take and how big a buffer they need, and
+// again, the same way, as they're laid out.
+struct flush_layout {
+    unsigned long long start; // of the device write, which starts at the head's current sector
+    unsigned long long offset; // into it
+    unsigned long long in_place; // bytes of values written from where they are
+    int segments; // iov entries for those, plus the bits of buffer in between
+};
+
+struct record_layout {
+    long long filler; // offset of the filler record in front of it, or -1, see record_padding
+    unsigned long long offset; // of its header
+    unsigned long long skip; // the value's first skip bytes are copied...
+    unsigned long long in_place; // ...then this many are written from where they are, and the rest is copied.
+};
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// A DMA value can be written in place if the device's alignment rules allow a segment that starts where it
+// would start in the write anyway. The unaligned ends are copied, same as headers and keys.
+static struct record_layout layout_record(struct db_state *db, struct flush_layout *layout, struct write_cb_state *write_callback) {
+    struct record_layout record = {0};
+    unsigned long long padding = record_padding(db, layout -> start + layout -> offset, write_callback, &record.filler);
+    record.filler += record.filler >= 0 ? layout -> offset : 0;
+    layout -> offset += padding;
+    record.offset = layout -> offset;
+
+    unsigned long long alignment = db -> device -> sgl_alignment;
+    if (write_callback -> value_dma && alignment && layout -> segments + 2 <= FLUSH_MAX_SEGMENTS) {
+        unsigned long long value_offset = record.offset + sizeof(struct ssd_header) + write_callback -> key.length;
+        unsigned long long skip = (alignment - (unsigned long long)write_callback -> value.data % alignment) % alignment;
+        if ((value_offset + skip) % alignment == 0 && write_callback -> value.length >= skip + FLUSH_IN_PLACE_MIN) {
+            record.skip = skip;
+            record.in_place = (write_callback -> value.length - skip) / alignment * alignment;
+            layout -> in_place += record.in_place;
+            layout -> segments += 2;
+        }
+    }
+    layout -> offset += callback_ssd_size(write_callback);
+    return record;
+}
+
+// Appends to the part of buf the device is going to write. Returns where to copy len bytes to.
+static void *flush_copy(struct flush_writes_state *flush, unsigned long long *buf_used, unsigned long long len) {
+    void *dst = flush -> buf + *buf_used;
+    *buf_used += len;
+    return dst;
+}
+
+// Ends the piece of buf written so far with a segment, then adds one for data written from where it is. The
+// next piece of buf has to start aligned too.
+static void flush_in_place(struct flush_writes_state *flush, unsigned long long *buf_used, unsigned long long *segment_start, void *data, unsigned long long len) {
+    unsigned long long alignment = flush -> db -> device -> sgl_alignment;
+    if (*buf_used > *segment_start) {
+        flush -> iov[flush -> iovcnt++] = (struct db_iovec){.base=flush -> buf + *segment_start, .length=*buf_used - *segment_start};
+    }
+    flush -> iov[flush -> iovcnt++] = (struct db_iovec){.base=data, .length=len};
+    *buf_used = (*buf_used + alignment - 1) / alignment * alignment;
+    *segment_start = *buf_used;
+}
+
+// Copies len bytes of a record's value, starting offset bytes in, to dst. A streamed value's only here now, so
+// it's added to the crc as it goes: it's always copied once, in order.
+static void copy_value(struct write_cb_state *write_callback, unsigned long long offset, void *dst, unsigned long long len) {
+    if (write_callback -> fill) {
+        write_callback -> fill(write_callback -> cb_arg, offset, dst, len);
+        write_callback -> crc = crc32c(write_callback -> crc, dst, len);
+    } else {
+        memcpy(dst, write_callback -> value.data + offset, len);
+    }
+}
+
+// Copies len bytes of what the device is writing, starting offset bytes in, to dst.
+static void iov_gather(struct db_iovec *iov, int iovcnt, unsigned long long offset, void *dst, unsigned long long len) {
+    for (int i = 0; i < iovcnt && len; i++) {
+        if (offset >= iov[i].length) {
+            offset -= iov[i].length;
+            continue;
+        }
+        unsigned long long n = iov[i].length - offset < len ? iov[i].length - offset : len;
+        memcpy(dst, iov[i].base + offset, n);
+        dst += n;
+        len -= n;
+        offset = 0;
+    }
+}
+
+// Copies len bytes of a big record's write, starting offset bytes in, to dst: padding (with a filler record in it,
+// maybe), header, key, value, then the zeroes out to the end of its last sector.
+static void large_record_copy(struct flush_writes_state *flush, unsigned long long offset, void *dst, unsigned long long len) {
+    struct write_cb_state *record = TAILQ_FIRST(&flush -> write_callback_queue);
+    unsigned long long key_at = flush -> record_offset + sizeof(struct ssd_header);
+    unsigned long long value_at = key_at + record -> key.length;
+    unsigned long long end = value_at + record -> value.length;
+    unsigned long long filler_at = flush -> filler_offset >= 0 ? flush -> filler_offset : flush -> record_offset;
+    unsigned long long filler_end = flush -> filler_offset >= 0 ? filler_at + sizeof(struct ssd_header) : flush -> record_offset;
+    while (len) {
+        unsigned long long n = len;
+        if (offset < filler_at) {
+            n = filler_at - offset < n ? filler_at - offset : n;
+            memset(dst, 0, n);
+        } else if (offset < filler_end) {
+            n = filler_end - offset < n ? filler_end - offset : n;
+            memcpy(dst, (char *)&flush -> filler + (offset - filler_at), n);
+        } else if (offset < flush -> record_offset) {
+            n = flush -> record_offset - offset < n ? flush -> record_offset - offset : n;
+            memset(dst, 0, n);
+        } else if (offset < key_at) {
+            n = key_at - offset < n ? key_at - offset : n;
+            memcpy(dst, (char *)&flush -> header + (offset - flush -> record_offset), n);
+        } else if (offset < value_at) {
+            n = value_at - offset < n ? value_at - offset : n;
+            memcpy(dst, record -> key.data + (offset - key_at), n);
+        } else if (offset < end) {
+            n = end - offset < n ? end - offset : n;
+            copy_value(record, offset - value_at, dst, n);
+        } else {
+            memset(dst, 0, n);
+        }
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+static void flush_chunk_cb(void *arg, int status);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Builds the next chunk of a big record and writes it. Chunks that are all DMA value the device can take from
+// where it is aren't copied.
+static void issue_flush_chunk(struct flush_writes_state *flush, struct flush_chunk *chunk) {
+    struct db_state *db = flush -> db;
+    struct write_cb_state *record = TAILQ_FIRST(&flush -> write_callback_queue);
+    unsigned long long first = flush -> chunks_issued++ * flush -> chunk_sectors;
+    unsigned long long sectors = flush -> num_sectors - first < flush -> chunk_sectors ? flush -> num_sectors - first : flush -> chunk_sectors;
+    unsigned long long offset = first * db -> sector_size;
+    unsigned long long len = sectors * db -> sector_size;
+    unsigned long long value_at = flush -> record_offset + sizeof(struct ssd_header) + record -> key.length;
+    unsigned long long alignment = db -> device -> sgl_alignment;
+    if (record -> value_dma && alignment && offset >= value_at && offset + len <= value_at + record -> value.length
+        && (unsigned long long)(record -> value.data + (offset - value_at)) % alignment == 0) {
+        flush -> iov[chunk -> slot] = (struct db_iovec){.base=record -> value.data + (offset - value_at), .length=len};
+        db -> in_place_bytes_written += len;
+        device_writev(db -> queue, &flush -> iov[chunk -> slot], 1, flush -> lba + first, sectors, flush_chunk_cb, chunk);
+        return;
+    }
+    if (chunk -> buf == NULL) {
+        chunk -> buf = dma_pool_get(&db -> dma_pool, max_io_bytes(db));
+    }
+    large_record_copy(flush, offset, chunk -> buf, len);
+    unsigned long long header_sector = flush -> record_offset / db -> sector_size * db -> sector_size;
+    if (record -> fill && header_sector >= offset && header_sector < offset + len) {
+        flush -> header_sector = dma_pool_get(&db -> dma_pool, db -> sector_size);
+        memcpy(flush -> header_sector, chunk -> buf + (header_sector - offset), db -> sector_size);
+    }
+    device_write(db -> queue, chunk -> buf, flush -> lba + first, sectors, flush_chunk_cb, chunk);
+}
+
+static void flush_header_cb(void *arg, int status) {
+    struct flush_writes_state *flush = arg;
+    // Lock is acquired by the caller of device_process_completions.
+    if (flush -> header_sector) {
+        dma_pool_put(&flush -> db -> dma_pool, flush -> header_sector, flush -> db -> sector_size);
+        flush -> header_sector = NULL;
+    }
+    flush_writes_cb(flush, status);
+}
+
+static void flush_chunk_cb(void *arg, int status) {
+    struct flush_chunk *chunk = arg;
+    struct flush_writes_state *flush = chunk -> flush;
+    // Lock is acquired by the caller of device_process_completions.
+    flush -> chunks_done++;
+    if (status != 0 && flush -> chunk_status == 0) {
+        flush -> chunk_status = status;
+    }
+    if (flush -> chunk_status == 0 && flush -> chunks_issued < flush -> num_chunks) {
+        issue_flush_chunk(flush, chunk);
+        return;
+    }
+    if (flush -> chunks_done < flush -> chunks_issued) {
+        return;
+    }
+    struct db_state *db = flush -> db;
+    for (int i = 0; i < FLUSH_CHUNK_WINDOW; i++) {
+        if (flush -> chunks[i].buf) {
+            dma_pool_put(&db -> dma_pool, flush -> chunks[i].buf, max_io_bytes(db));
+        }
+    }
+    if (flush -> header_sector && flush -> chunk_status == 0) {
+        struct write_cb_state *record = TAILQ_FIRST(&flush -> write_callback_queue);
+        flush -> header.crc = header_crc(record);
+        memcpy(flush -> header_sector + flush -> record_offset % db -> sector_size, &flush -> header, sizeof(flush -> header));
+        db -> device_bytes_written += db -> sector_size;
+        device_write(db -> queue, flush -> header_sector, flush -> lba + flush -> record_offset / db -> sector_size, 1, flush_header_cb, flush);
+        return;
+    }
+    flush_header_cb(flush, flush -> chunk_status);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Writes the first record in the queue, which is too big for one device command, on its own: max_io_bytes at a
+// time, FLUSH_CHUNK_WINDOW commands in flight, each chunk copied into its buffer as the one before it in that
+// buffer completes. So the record never needs a second copy of itself in DMA memory, and the device queue never
+// has one huge command everything else waits behind. It's applied once the last chunk is written, like any flush.
+// head is where it goes: heads[head_idx], or a run of its own (see flush_spanning_record). Either way it starts on
+// a fresh sector, so the one with the header, which a streamed record writes twice, has nothing else in it.
+static void flush_large_record(struct db_state *db, int head_idx, struct log_head *head, struct write_cb_head *queue) {
+    struct write_cb_state *write_callback = TAILQ_FIRST(queue);
+    unsigned long long size = callback_ssd_size(write_callback);
+    unsigned long long current_sector = head -> current_sector_ssd;
+    unsigned long long write_start = current_sector * db -> sector_size;
+    long long filler;
+    unsigned long long record_offset = record_padding(db, write_start, write_callback, &filler);
+    unsigned long long sectors_to_write = (record_offset + size + db -> sector_size - 1) / db -> sector_size;
+    if (head_idx == HEAD_USER) {
+        commit_flushing(db, size, write_callback -> clock_time_enqueued);
+    }
+
+    struct flush_writes_state *flush = slab_alloc(&flush_state_cache);
+    flush -> db = db;
+    flush -> region = head -> region;
+    flush -> start = write_start - head -> region * db -> region_sectors * db -> sector_size;
+    flush -> done = false;
+    flush -> error = WRITE_SUCCESSFUL;
+    flush -> buf = NULL;
+    flush -> buf_size = 0;
+    flush -> iovcnt = 0;
+    TAILQ_INIT(&flush -> write_callback_queue);
+    flush -> lba = current_sector;
+    flush -> num_sectors = sectors_to_write;
+    flush -> chunk_sectors = max_io_bytes(db) / db -> sector_size;
+    flush -> num_chunks = (sectors_to_write + flush -> chunk_sectors - 1) / flush -> chunk_sectors;
+    flush -> chunks_issued = 0;
+    flush -> chunks_done = 0;
+    flush -> chunk_status = 0;
+    flush -> record_offset = record_offset;
+    flush -> filler_offset = filler;
+    if (filler >= 0) {
+        flush -> filler = filler_header(db, head -> region, flush -> filler_offset, record_offset);
+        db -> records_aligned++;
+    }
+    flush -> header = (struct ssd_header){
+        .key_length = write_callback -> key.length,
+        .data_length = write_callback -> value.length,
+        .flags = write_callback -> flags,
+        .seq = write_callback -> seq,
+        .epoch = db -> regions[head -> region].epoch,
+        .crc = write_callback -> fill ? 0 : header_crc(write_callback) // see header_sector
+    };
+    flush -> header_sector = NULL;
+
+    write_callback -> ssd_loc = write_start + record_offset;
+    // Not copied anywhere as a whole, so reads of the key are served from the caller's value till it's applied.
+    write_callback -> flushed_value = write_callback -> value.data;
+    if (head_idx == HEAD_GC) {
+        db -> relocated_bytes_written += size;
+    } else {
+        db -> user_bytes_written += size;
+    }
+    TAILQ_REMOVE(queue, write_callback, link);
+    if (head_idx == HEAD_USER) {
+        commit_dequeued(db, size);
+    }
+    TAILQ_INSERT_TAIL(&flush -> write_callback_queue, write_callback, link);
+
+    // The rest of the record's last sector is padding, so the next flush starts on a fresh sector.
+    head -> current_sector_ssd = current_sector + sectors_to_write;
+    head -> current_sector_bytes = 0;
+    db -> regions[head -> region].sectors_written = head -> current_sector_ssd - head -> region * db -> region_sectors;
+    db -> regions[head -> region].writers++;
+    db -> device_bytes_written += sectors_to_write * db -> sector_size;
+
+    db -> writes_in_flight++;
+    flush -> submitted_at = commit_now_us();
+    TAILQ_INSERT_TAIL(&db -> flushes_in_order, flush, link);
+
+    for (int i = 0; i < FLUSH_CHUNK_WINDOW; i++) {
+        flush -> chunks[i] = (struct flush_chunk){.flush=flush, .buf=NULL, .slot=i};
+    }
+    for (int i = 0; i < FLUSH_CHUNK_WINDOW && flush -> chunks_issued < flush -> num_chunks; i++) {
+        issue_flush_chunk(flush, &flush -> chunks[i]);
+    }
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Writes the first record in the queue, which is bigger than a region, to a run of free regions in a row (see
+// open_run), from the start of the first of them. The head's own region is left as it was. Returns false if it
+// has to wait for the compactor to free up enough regions.
+static bool flush_spanning_record(struct db_state *db, int head_idx, struct write_cb_head *queue) {
+    struct write_cb_state *write_callback = TAILQ_FIRST(queue);
+    unsigned long long region_bytes = db -> region_sectors * db -> sector_size;
+    unsigned long long count = (callback_ssd_size(write_callback) + region_bytes - 1) / region_bytes;
+    bool short_of_space;
+    long long first = open_run(db, count, &short_of_space);
+    if (first < 0 && short_of_space && compaction_possible(db)) {
+        db -> compaction.writes_blocked = true; // try again once the compactor has freed some regions
+        return false;
+    }
+    if (first < 0) {
+        printf("No run of %llu free regions for a %llu byte record, failing it\n", count, callback_ssd_size(write_callback));
+        TAILQ_REMOVE(queue, write_callback, link);
+        if (head_idx == HEAD_USER) {
+            commit_dequeued(db, callback_ssd_size(write_callback));
+        }
+        complete_write(db, write_callback, NOT_ENOUGH_SPACE_ERROR);
+        return true;
+    }
+    if (head_idx == HEAD_USER) {
+        db -> compaction.writes_blocked = false;
+    }
+    db -> regions[first].run_key = write_callback -> key_index; // see free_region
+    struct log_head run = {.region=first, .current_sector_ssd=first * db -> region_sectors, .current_sector_data=NULL, .current_sector_bytes=0, .tail_writer=NULL};
+    flush_large_record(db, head_idx, &run, queue);
+    return true;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// If the record was next at the head, would it be too big to share a device command (see flush_large_record)?
+static bool written_alone(struct db_state *db, struct log_head *head, struct write_cb_state *write_callback) {
+    struct flush_layout layout = {.start=head -> current_sector_ssd * db -> sector_size, .offset=head -> current_sector_bytes};
+    layout_record(db, &layout, write_callback);
+    return layout.offset > max_io_bytes(db);
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Writes out as much of the queue as fits in the head's region, opening a new region first if not even the
+// first record fits. Returns false if nothing could be written.
+static bool flush_region_writes(struct db_state *db, int head_idx, struct write_cb_head *queue) {
+    struct log_head *head = &db -> heads[head_idx];
+    if (callback_ssd_size(TAILQ_FIRST(queue)) > db -> region_sectors * db -> sector_size) {
+        return flush_spanning_record(db, head_idx, queue);
+    }
+    // A flush starts by writing the head's part-written sector again with the new records after what's there (see
+    // db_options.fresh_sector_flushes for why that's safe), unless the write that put it there is still in flight,
+    // since the device could finish the two in either order, or the first record is one flush_large_record writes,
+    // or the db was told not to. Then the rest of that sector is left as padding.
+    if (head -> current_sector_bytes && (head -> tail_writer || db -> fresh_sector_flushes || written_alone(db, head, TAILQ_FIRST(queue)))) {
+        head -> current_sector_ssd++;
+        head -> current_sector_bytes = 0;
+        db -> tail_sectors_skipped++;
+    } else if (head -> current_sector_bytes) {
+        db -> tail_sector_rewrites++;
+    }
+    unsigned long long first_size = callback_ssd_size(TAILQ_FIRST(queue));
+    unsigned long long region_end = (head -> region + 1) * db -> region_sectors * db -> sector_size;
+    unsigned long long head_loc = head -> current_sector_ssd * db -> sector_size + head -> current_sector_bytes;
+    long long filler;
+    if (head -> region < 0 || head_loc + record_padding(db, head_loc, TAILQ_FIRST(queue), &filler) + first_size > region_end) {
+        if (!open_region(db, head_idx)) {
+            if (head_idx == HEAD_GC) {
+                printf("Compactor is out of space to relocate to\n");
+            } else if (compaction_possible(db)) {
+                db -> compaction.writes_blocked = true; // try again once the compactor has freed a region
+            } else {
+                printf("Out of space, failing writes\n");
+                fail_writes(db, queue, NOT_ENOUGH_SPACE_ERROR);
+            }
+            return false;
+        }
+        region_end = (head -> region + 1) * db -> region_sectors * db -> sector_size;
+        head_loc = head -> current_sector_ssd * db -> sector_size;
+    }
+    if (head_idx == HEAD_USER) {
+        db -> compaction.writes_blocked = false;
+    }
+    unsigned long long current_sector = head -> current_sector_ssd; // sector we're going to write to
+    unsigned long long write_start = current_sector * db -> sector_size;
+
+    // Take as many records as fit before the end of the region, and in one device command. A record that's too
+    // big for one on its own is written by itself, a command at a time.
+    struct flush_layout layout = {.start=write_start, .offset=head -> current_sector_bytes};
+    struct write_cb_state *write_callback;
+    TAILQ_FOREACH(write_callback, queue, link) {
+        struct flush_layout next = layout;
+        layout_record(db, &next, write_callback);
+        if (next.offset > max_io_bytes(db) && write_callback == TAILQ_FIRST(queue)) {
+            flush_large_record(db, head_idx, head, queue);
+            return true;
+        }
+        if (write_start + next.offset > region_end || next.offset > max_io_bytes(db)) {
+            break;
+        }
+        layout = next;
+    }
+    struct write_cb_state *stop_at = write_callback; // first record that didn't fit, or NULL
+    unsigned long long write_bytes_queued = layout.offset - head -> current_sector_bytes;
+    if (head_idx == HEAD_USER) {
+        commit_flushing(db, write_bytes_queued, TAILQ_FIRST(queue) -> clock_time_enqueued);
+    }
+
 #ifdef DEBUG
-    printf("current_sector_bytes is %lld, write_bytes_queued %lld, increasing current sector by %d to %d\n",
-    db -> current_sector_bytes, write_bytes_queued, (db -> current_sector_bytes + write_bytes_queued)/db -> sector_size, db -> current_sector_ssd);
+    printf("write bytes queued: %d. current_sector_bytes is %d\n", write_bytes_queued, head -> current_sector_bytes);
 #endif
-    unsigned long long sectors_to_write = ceil(bytes_to_write/((double)db -> sector_size)); // e.g. We have 10000 bytes enqueued with a sector length of 4096, so write 3 sectors with 1 partially written
+    unsigned long long sectors_to_write = (layout.offset + db -> sector_size - 1) / db -> sector_size; // e.g. We have 10000 bytes enqueued with a sector length of 4096, so write 3 sectors with 1 partially written
     sectors_to_write = sectors_to_write == 0 ? 1 : sectors_to_write; // at min 1
     unsigned long long write_size = sectors_to_write * db -> sector_size;
 
-    struct flush_writes_state *flush_writes_cb_state = malloc(sizeof(struct flush_writes_state));
+    // Everything but the values written in place gets copied into buf, and every one of those can cost up to
+    // sgl_alignment of padding after it in buf (not in the write) so the next piece starts aligned.
+    unsigned long long buf_size = write_size - layout.in_place + layout.segments / 2 * db -> device -> sgl_alignment;
+    buf_size = (buf_size + db -> sector_size - 1) / db -> sector_size * db -> sector_size;
+
+    struct flush_writes_state *flush_writes_cb_state = slab_alloc(&flush_state_cache);
     flush_writes_cb_state -> db = db;
+    flush_writes_cb_state -> region = head -> region;
+    flush_writes_cb_state -> start = head_loc - head -> region * db -> region_sectors * db -> sector_size;
+    flush_writes_cb_state -> done = false;
+    flush_writes_cb_state -> error = WRITE_SUCCESSFUL;
     // transfer the callback queue to the callback, it will be written to when that's completed.
-    flush_writes_cb_state -> buf = spdk_zmalloc(write_size, db -> sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
-    flush_writes_cb_state -> ns_entry = db -> main_namespace;
+    flush_writes_cb_state -> buf = dma_pool_get(&db -> dma_pool, buf_size);
+    flush_writes_cb_state -> buf_size = buf_size;
+    flush_writes_cb_state -> iovcnt = 0;
     TAILQ_INIT(&flush_writes_cb_state -> write_callback_queue);
 
-    unsigned long long buf_bytes_written = db -> current_sector_bytes;
-    if (db -> current_sector_bytes) {
-        memcpy(flush_writes_cb_state -> buf, db -> current_sector_data, db -> current_sector_bytes);
+    unsigned long long buf_used = 0; // of buf
+    unsigned long long segment_start = 0; // in buf, of the piece that hasn't been given a segment yet
+    if (head -> current_sector_bytes) {
+        memcpy(flush_copy(flush_writes_cb_state, &buf_used, head -> current_sector_bytes), head -> current_sector_data, head -> current_sector_bytes);
 #ifdef DEBUG
-        printf("Copying first %lld bytes into flush writes cb state: %.64s\n", db -> current_sector_bytes, db -> current_sector_data);
+        printf("Copying first %lld bytes into flush writes cb state: %.64s\n", head -> current_sector_bytes, head -> current_sector_data);
 #endif
     }
-    while (!TAILQ_EMPTY(&db -> write_callback_queue)) {
-        struct write_cb_state *write_callback = TAILQ_FIRST(&db -> write_callback_queue);
+    layout = (struct flush_layout){.start=write_start, .offset=head -> current_sector_bytes};
+    while (TAILQ_FIRST(queue) != stop_at) {
+        write_callback = TAILQ_FIRST(queue);
 
-        db -> keys[write_callback -> key_index].data_loc = buf_bytes_written + current_sector * db -> sector_size;
+        unsigned long long padding_from = layout.offset;
+        struct record_layout record = layout_record(db, &layout, write_callback);
+        void *padding = flush_copy(flush_writes_cb_state, &buf_used, record.offset - padding_from);
+        memset(padding, 0, record.offset - padding_from);
+        if (record.filler >= 0) {
+            struct ssd_header filler = filler_header(db, head -> region, record.filler, record.offset);
+            memcpy(padding + (record.filler - padding_from), &filler, sizeof(filler));
+            db -> records_aligned++;
+        }
+
+        // The key itself is only repointed once the write has completed, see apply_flush.
+        write_callback -> ssd_loc = write_start + record.offset;
 #ifdef DEBUG
-        printf("Flushing key %.16s to %lld\n", (char *)db -> key_vla+db -> keys[write_callback -> key_index].key_offset, db -> keys[write_callback -> key_index].data_loc);
+        printf("Flushing key %.16s to %lld\n", (char *)write_callback -> key.data, write_callback -> ssd_loc);
 #endif
 
-        // Write header
+        // Header, filled in once the value's copied, which finishes a streamed value's crc
+        void *header_at = flush_copy(flush_writes_cb_state, &buf_used, sizeof(struct ssd_header));
+
+        // Write key
+        memcpy(flush_copy(flush_writes_cb_state, &buf_used, write_callback -> key.length), write_callback -> key.data, write_callback -> key.length);
+
+        // Write data, from where it is if we can.
+        void *value = write_callback -> value.data;
+        unsigned long long value_copied = write_callback -> value.length;
+        // Reads of the key are served from here until the write's applied. DMA values are the db's till then anyway.
+        write_callback -> flushed_value = write_callback -> value_dma ? value : flush_writes_cb_state -> buf + buf_used;
+        if (record.in_place) {
+            memcpy(flush_copy(flush_writes_cb_state, &buf_used, record.skip), value, record.skip);
+            flush_in_place(flush_writes_cb_state, &buf_used, &segment_start, value + record.skip, record.in_place);
+            value += record.skip + record.in_place;
+            value_copied -= record.skip + record.in_place;
+        }
+        copy_value(write_callback, write_callback -> value.length - value_copied, flush_copy(flush_writes_cb_state, &buf_used, value_copied), value_copied);
+
         struct ssd_header header = (struct ssd_header){
             .key_length = write_callback -> key.length,
             .data_length = write_callback -> value.length,
-            .flags = 0
+            .flags = write_callback -> flags,
+            .seq = write_callback -> seq,
+            .epoch = db -> regions[head -> region].epoch,
+            .crc = header_crc(write_callback)
         };
-        memcpy(flush_writes_cb_state -> buf + buf_bytes_written, &header, sizeof(header));
-        buf_bytes_written += sizeof(header);
+        memcpy(header_at, &header, sizeof(header));
 
-        // Write key
-        memcpy(flush_writes_cb_state -> buf + buf_bytes_written, write_callback -> key.data, write_callback -> key.length);
-        buf_bytes_written += write_callback -> key.length;
-
-        // Write data
-        memcpy(flush_writes_cb_state -> buf + buf_bytes_written, write_callback -> value.data, write_callback -> value.length);
-        buf_bytes_written += write_callback -> value.length;
+        if (head_idx == HEAD_GC) {
+            db -> relocated_bytes_written += callback_ssd_size(write_callback);
+        } else {
+            db -> user_bytes_written += callback_ssd_size(write_callback);
+        }
+        db -> in_place_bytes_written += record.in_place;
 
 #ifdef DEBUG
         unsigned long long bytes_written = sizeof(header) + write_callback -> key.length + write_callback -> value.length;
-        unsigned long long original_sector = db -> keys[write_callback -> key_index].data_loc / db -> sector_size;
-        unsigned long long original_sector_bytes = db -> keys[write_callback -> key_index].data_loc % db -> sector_size;
-        unsigned long long end_sector = (db -> keys[write_callback -> key_index].data_loc + bytes_written)/db -> sector_size;
-        unsigned long long end_sector_bytes = (db -> keys[write_callback -> key_index].data_loc + bytes_written)%db -> sector_size;
+        unsigned long long original_sector = write_callback -> ssd_loc / db -> sector_size;
+        unsigned long long original_sector_bytes = write_callback -> ssd_loc % db -> sector_size;
+        unsigned long long end_sector = (write_callback -> ssd_loc + bytes_written)/db -> sector_size;
+        unsigned long long end_sector_bytes = (write_callback -> ssd_loc + bytes_written)%db -> sector_size;
         printf("Wrote %lld bytes from sector %lld byte %lld to sector %lld byte %lld for key %.16s\n",
         bytes_written, original_sector, original_sector_bytes, end_sector, end_sector_bytes, (char *)write_callback -> key.data);
 #endif
 
-        TAILQ_REMOVE(&db -> write_callback_queue, write_callback, link);
+        TAILQ_REMOVE(queue, write_callback, link);
+        if (head_idx == HEAD_USER) {
+            commit_dequeued(db, callback_ssd_size(write_callback));
+        }
         TAILQ_INSERT_TAIL(&flush_writes_cb_state -> write_callback_queue, write_callback, link);
     }
 
-    if (buf_bytes_written < write_size) { // We're writing to 9.5 sectors, so fill out the last .5 with 0s and store the first .5
+    // We're writing to 9.5 sectors, so the last .5 is zeroes.
+    memset(flush_copy(flush_writes_cb_state, &buf_used, write_size - layout.offset), 0, write_size - layout.offset);
+    struct db_iovec *iov = flush_writes_cb_state -> iov;
+    iov[flush_writes_cb_state -> iovcnt++] = (struct db_iovec){.base=flush_writes_cb_state -> buf + segment_start, .length=buf_used - segment_start};
+
+    if (layout.offset < write_size) { // and store the first .5 for the next flush to start with
         // if write_size is 10000 bytes and we end up writing 9400 bytes, we want to 0 out the last 600 and store the first 400.
-#ifdef DEBUG
-        printf("setting %d bytes from %lld to 'a'\n", write_size - buf_bytes_written, buf_bytes_written + (current_sector*db -> sector_size));
-#endif
-        db -> current_sector_bytes = db -> sector_size - (write_size - buf_bytes_written);
-        memset(flush_writes_cb_state -> buf + buf_bytes_written, 0, write_size-buf_bytes_written);
-        memcpy(db -> current_sector_data, flush_writes_cb_state -> buf + (write_size - db -> sector_size), db -> current_sector_bytes);
+        head -> current_sector_bytes = db -> sector_size - (write_size - layout.offset);
+        iov_gather(iov, flush_writes_cb_state -> iovcnt, write_size - db -> sector_size, head -> current_sector_data, head -> current_sector_bytes);
+        head -> current_sector_ssd = current_sector + sectors_to_write - 1; // written again by the next flush
+        head -> tail_writer = flush_writes_cb_state;
     } else {
-        db -> current_sector_bytes = 0;
-        memset(db -> current_sector_data, 'b', db -> sector_size);
+        head -> current_sector_bytes = 0;
+        memset(head -> current_sector_data, 'b', db -> sector_size);
+        head -> current_sector_ssd = current_sector + sectors_to_write;
+        head -> tail_writer = NULL;
     }
 
-    db -> current_sector_ssd += 1;
-    db -> current_sector_bytes = 0;
+    db -> regions[head -> region].sectors_written = current_sector + sectors_to_write - head -> region * db -> region_sectors;
+    db -> regions[head -> region].writers++;
+    db -> device_bytes_written += write_size;
 
     db -> writes_in_flight++;
+    flush_writes_cb_state -> submitted_at = commit_now_us();
+    TAILQ_INSERT_TAIL(&db -> flushes_in_order, flush_writes_cb_state, link);
 
 #ifdef DEBUG
-    printf("Wrote %lld bytes. Set current_sector_bytes to %lld\n", buf_bytes_written, db -> current_sector_bytes);
+    printf("Wrote %lld bytes. Set current_sector_bytes to %lld\n", layout.offset, head -> current_sector_bytes);
 #endif
 
 #ifdef DEBUG
     printf("Writing %d sectors of data to sector %d\n", sectors_to_write, current_sector);
 #endif
-    spdk_nvme_ns_cmd_write(
-        db -> main_namespace -> ns,
-        db -> main_namespace -> qpair,
-        flush_writes_cb_state -> buf,
-        current_sector, // LBA start
-        sectors_to_write, // number of LBAs
-        flush_writes_cb,
-        flush_writes_cb_state,
-        0 // flags. Worth considering implementing at some point: streams directive for big writes.
-    );
-    return;
+    if (flush_writes_cb_state -> iovcnt == 1) { // nothing was written in place, it's all in buf
+        device_write(
+            db -> queue,
+            flush_writes_cb_state -> buf,
+            current_sector, // LBA start
+            sectors_to_write, // number of LBAs
+            flush_writes_cb,
+            flush_writes_cb_state
+        );
+    } else {
+        device_writev(
+            db -> queue,
+            iov,
+            flush_writes_cb_state -> iovcnt,
+            current_sector,
+            sectors_to_write,
+            flush_writes_cb,
+            flush_writes_cb_state
+        );
+    }
+    return true;
+}
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Writes out everything queued for the head (user writes or relocations), one device write per region.
+void flush_writes(struct db_state *db, int head_idx) {
+    struct write_cb_head *queue = head_idx == HEAD_GC ? &db -> gc_write_queue : &db -> write_callback_queue;
+    while (!TAILQ_EMPTY(queue)) {
+        if (!flush_region_writes(db, head_idx, queue)) {
+            break;
+        }
+    }
 }
 
-static void write_zeroes_cb(void *arg, const struct spdk_nvme_cpl *completion) {
-    spdk_free(arg);
-    if (spdk_nvme_cpl_is_error(completion)) {
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+void unapplied_flush_starts(struct db_state *db, unsigned long long *region_starts) {
+    struct flush_writes_state *flush;
+    TAILQ_FOREACH(flush, &db -> flushes_in_order, link) {
+        if (flush -> start < region_starts[flush -> region]) {
+            region_starts[flush -> region] = flush -> start;
+        }
+    }
+}
+
+struct write_zeroes_state {
+    struct db_state *db;
+    void *buf;
+};
+
+static void write_zeroes_cb(void *arg, int status) {
+    struct write_zeroes_state *state = arg;
+    device_dma_free(state -> db -> device, state -> buf);
+    free(state);
+    if (status != 0) {
         printf("got error while writing zeroes!\n");
     } else {
         printf("successfully wrote zeroes\n");
@@ -186,27 +959,26 @@ static void write_zeroes_cb(void *arg, const struct spdk_nvme_cpl *completion) {
 void write_zeroes(struct db_state *db, int start_block, int num_blocks) {
     // In theory we could use e.g. write_uncorrectable, or write_zeroes, but the SSD i've been testing on doesn't support those,
     // so instead just actually write zeroes. This is useful for testing.
-    void *buf = spdk_zmalloc(db -> sector_size * num_blocks, db -> sector_size, NULL, SPDK_ENV_SOCKET_ID_ANY, SPDK_MALLOC_DMA);
-    memset(buf, 'c', db -> sector_size * num_blocks);
-    spdk_nvme_ns_cmd_write(
-        db -> main_namespace -> ns,
-        db -> main_namespace -> qpair,
-        buf,
+    struct write_zeroes_state *state = malloc(sizeof(struct write_zeroes_state));
+    state -> db = db;
+    state -> buf = device_dma_malloc(db -> device, db -> sector_size * num_blocks);
+    memset(state -> buf, 'c', db -> sector_size * num_blocks);
+    device_write(
+        db -> queue,
+        state -> buf,
         start_block,
         num_blocks,
         write_zeroes_cb,
-        buf,
-        0
+        state
     );
 }
 
-static void flush_cb(void *arg,  const struct spdk_nvme_cpl *completion) {
+static void flush_cb(void *arg, int status) {
     struct db_state *db = arg;
     db -> flushes_in_flight--;
-    if (spdk_nvme_cpl_is_error(completion)) {
+    if (status != 0) {
         // TODO: fix this. go through each write callback and return an error.
-        // spdk_nvme_qpair_print_completion(callback_state->ns_entry->qpair, (struct spdk_nvme_cpl *)completion);
-        fprintf(stderr, "flush failed: I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
+        fprintf(stderr, "flush failed: I/O error status: %d\n", status);
         printf("completed flush with error\n");
     } else {
 #ifdef DEBUG
@@ -218,18 +990,27 @@ static void flush_cb(void *arg,  const struct spdk_nvme_cpl *completion) {
 void flush_commands(void *opaque) {
     struct db_state *db = opaque;
     db -> flushes_in_flight++;
-    spdk_nvme_ns_cmd_flush(
-        db -> main_namespace -> ns,
-        db -> main_namespace -> qpair,
+    device_flush(
+        db -> queue,
         flush_cb,
         db
     );
 }
 
 void wait_for_zero_writes(void *opaque) {
-    struct db_state *db = opaque;
-    while (db -> writes_in_flight) {
-        usleep(1000);
-        poll_db(db);
+    struct db_state *handle = opaque;
+    for (unsigned int i = 0; i < handle -> num_shards; i++) {
+        struct db_state *db = handle -> shards[i];
+        while (true) {
+            acq_lock(db);
+            bool idle = db -> writes_in_flight == 0 && TAILQ_EMPTY(&db -> write_callback_queue) && db -> callbacks_pending == 0 &&
+                write_ring_empty(&db -> write_ring) && db -> compaction.erases_in_flight == 0;
+            release_lock(db);
+            if (idle) {
+                break;
+            }
+            usleep(1000);
+            poll_db(handle); // does nothing if there are poller threads
+        }
     }
 }
@@ -13,7 +13,34 @@
 
 typedef void (*nvme_write_cb)(void *, enum write_err);
 
-void flush_writes(struct db_state *db);
+extern struct slab_cache flush_state_cache;
+
+// head_idx is HEAD_USER or HEAD_GC, see nvme_compact.h.
+void flush_writes(struct db_state *db, int head_idx);
+
+// Lowers region_starts[region] to where the first record not yet applied to db -> keys starts, for every region
+// a flush is still in flight to. Records in a region are applied in the order they're laid out, so everything
+// from there on is unapplied. Used to decide what a checkpoint has to replay.
+void unapplied_flush_starts(struct db_state *db, unsigned long long *region_starts);
+
+int pending_writes_init(struct pending_writes *pending);
+void pending_writes_free(struct pending_writes *pending);
+
+// MUST HAVE LOCK TO CALL THESE FUNCTIONS
+// Adds a user write to db -> pending_writes, as the key's latest. complete_write takes it off again.
+void pending_write_add(struct db_state *db, struct write_cb_state *write_callback);
+// The key's entry, or NULL if it has no writes pending.
+struct pending_write *pending_write_find(struct db_state *db, long long key_index);
+// Whether a user write or delete of the key is on its way: pending, or a streamed write (which isn't in
+// pending_writes) that hasn't completed.
+bool write_on_its_way(struct db_state *db, long long key_index);
+
+// MUST HAVE LOCK TO CALL THIS FUNCTION
+// Finishes a write: relocations right away, user writes by putting them on db -> completed_writes.
+void complete_write(struct db_state *db, struct write_cb_state *write_callback, enum write_err error);
+
+// Runs the callbacks of writes taken off db -> completed_writes. Without the lock.
+void deliver_writes(struct db_state *db, struct write_cb_head *completed);
 
 void write_zeroes(struct db_state *db, int start_block, int num_blocks);
 